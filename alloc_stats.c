@@ -0,0 +1,76 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "alloc_stats.h"
+
+#ifdef ENABLE_ALLOC_STATS
+
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+/* glibc's own allocator, still reachable once malloc() is replaced */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread uint64_t heap_allocs = 0;
+
+void *malloc(size_t size)
+{
+    heap_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    heap_allocs++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    heap_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+static const char *op_names[ALLOC_OPS] = {
+        [ALLOC_OP_GETATTR]     = "getattr",
+        [ALLOC_OP_GETXATTR]    = "getxattr",
+        [ALLOC_OP_SETXATTR]    = "setxattr",
+        [ALLOC_OP_LISTXATTR]   = "listxattr",
+        [ALLOC_OP_REMOVEXATTR] = "removexattr",
+};
+
+static uint64_t op_calls[ALLOC_OPS];
+static uint64_t op_allocs[ALLOC_OPS];
+
+uint64_t alloc_stats_begin(void)
+{
+    return heap_allocs;
+}
+
+void alloc_stats_end(enum alloc_op op, uint64_t begin)
+{
+    __atomic_add_fetch(&op_calls[op], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&op_allocs[op], heap_allocs - begin, __ATOMIC_RELAXED);
+}
+
+void alloc_stats_report(void)
+{
+    fprintf(stderr, "%-12s %12s %12s %10s\n", "operation", "calls", "heap allocs", "per call");
+    for (int op = 0; op < ALLOC_OPS; op++) {
+        uint64_t calls = __atomic_load_n(&op_calls[op], __ATOMIC_RELAXED);
+        uint64_t allocs = __atomic_load_n(&op_allocs[op], __ATOMIC_RELAXED);
+        fprintf(stderr, "%-12s %12" PRIu64 " %12" PRIu64 " %10.2f\n", op_names[op], calls, allocs,
+                calls > 0 ? (double) allocs / calls : 0);
+    }
+}
+
+#endif
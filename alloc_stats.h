@@ -0,0 +1,44 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_ALLOC_STATS_H
+#define FUSE_XATTRS_ALLOC_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Heap allocations made while serving each kind of operation, to check
+ * that hot paths stay off malloc(). Only built with -DENABLE_ALLOC_STATS=1:
+ * it replaces malloc(), calloc() and realloc() to count calls per thread,
+ * which doesn't mix with sanitizers. Counts are printed on unmount.
+ */
+enum alloc_op {
+    ALLOC_OP_GETATTR,
+    ALLOC_OP_GETXATTR,
+    ALLOC_OP_SETXATTR,
+    ALLOC_OP_LISTXATTR,
+    ALLOC_OP_REMOVEXATTR,
+    ALLOC_OPS
+};
+
+#ifdef ENABLE_ALLOC_STATS
+
+uint64_t alloc_stats_begin(void);
+void alloc_stats_end(enum alloc_op op, uint64_t begin);
+void alloc_stats_report(void);
+
+#else
+
+static inline uint64_t alloc_stats_begin(void) { return 0; }
+static inline void alloc_stats_end(enum alloc_op op, uint64_t begin) { (void) op; (void) begin; }
+static inline void alloc_stats_report(void) { }
+
+#endif
+
+#endif //FUSE_XATTRS_ALLOC_STATS_H
@@ -0,0 +1,688 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "binary_storage.h"
+#include "blob_store.h"
+#include "dir_store.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include "xattrs_config.h"
+#include "fuse_xattrs_config.h"
+
+#define ARCHIVE_FLUSH_SIZE (1024 * 1024) // bytes buffered per dump worker
+#define ARCHIVE_MAX_QUEUED 256           // restore jobs waiting for a worker
+
+struct archive_stats {
+    uint64_t files;
+    uint64_t attrs;
+    uint64_t bytes;
+    uint64_t skipped;
+    uint64_t errors;
+};
+
+static void __stats_add(struct archive_stats *dst, const struct archive_stats *src)
+{
+    dst->files += src->files;
+    dst->attrs += src->attrs;
+    dst->bytes += src->bytes;
+    dst->skipped += src->skipped;
+    dst->errors += src->errors;
+}
+
+static void __report(const char *what, const struct archive_stats *stats, const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+    double mib = (double) stats->bytes / (1024 * 1024);
+
+    fprintf(stderr, "%s: %" PRIu64 " files, %" PRIu64 " attributes, %.1f MiB in %.2fs (%.1f MiB/s, %.0f files/s)\n",
+            what, stats->files, stats->attrs, mib, seconds,
+            seconds > 0 ? mib / seconds : 0, seconds > 0 ? (double) stats->files / seconds : 0);
+
+    if (stats->skipped > 0)
+        fprintf(stderr, "%s: %" PRIu64 " files skipped (missing from the source directory)\n", what, stats->skipped);
+    if (stats->errors > 0)
+        fprintf(stderr, "%s: %" PRIu64 " errors\n", what, stats->errors);
+}
+
+struct buffer {
+    char *data;
+    size_t size;
+    size_t alloc;
+};
+
+static int __buffer_append(struct buffer *buffer, const void *src, size_t size)
+{
+    if (buffer->size + size > buffer->alloc) {
+        size_t alloc = buffer->alloc > 0 ? buffer->alloc : 4096;
+        while (alloc < buffer->size + size)
+            alloc *= 2;
+
+        char *data = realloc(buffer->data, alloc);
+        if (data == NULL)
+            return -ENOMEM;
+        buffer->data = data;
+        buffer->alloc = alloc;
+    }
+
+    memcpy(buffer->data + buffer->size, src, size);
+    buffer->size += size;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// dump
+
+struct dump {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char **pending; // mount relative directories left to walk
+    size_t pending_size;
+    size_t pending_alloc;
+    unsigned int busy;
+    int error;
+
+    pthread_mutex_t out_lock;
+    FILE *out;
+};
+
+struct dump_worker {
+    struct dump *dump;
+    pthread_t thread;
+    struct buffer buffer;
+    uint32_t count;
+    int failed;
+    struct archive_stats stats;
+};
+
+static int __dump_push(struct dump *dump, char *path)
+{
+    pthread_mutex_lock(&dump->lock);
+    if (dump->pending_size == dump->pending_alloc) {
+        size_t alloc = dump->pending_alloc > 0 ? dump->pending_alloc * 2 : 64;
+        char **pending = realloc(dump->pending, alloc * sizeof(char *));
+        if (pending == NULL) {
+            pthread_mutex_unlock(&dump->lock);
+            return -ENOMEM;
+        }
+        dump->pending = pending;
+        dump->pending_alloc = alloc;
+    }
+    dump->pending[dump->pending_size++] = path;
+    pthread_cond_signal(&dump->cond);
+    pthread_mutex_unlock(&dump->lock);
+    return 0;
+}
+
+/* @return the next directory to walk, or NULL once the walk is over. */
+static char *__dump_pop(struct dump *dump)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&dump->lock);
+    while (dump->pending_size == 0 && dump->busy > 0 && dump->error == 0)
+        pthread_cond_wait(&dump->cond, &dump->lock);
+
+    if (dump->pending_size > 0 && dump->error == 0) {
+        // LIFO keeps the walk depth first and the pending list short
+        path = dump->pending[--dump->pending_size];
+        dump->busy++;
+    } else {
+        pthread_cond_broadcast(&dump->cond);
+    }
+    pthread_mutex_unlock(&dump->lock);
+
+    return path;
+}
+
+static void __dump_done(struct dump *dump)
+{
+    pthread_mutex_lock(&dump->lock);
+    dump->busy--;
+    if (dump->busy == 0 && dump->pending_size == 0)
+        pthread_cond_broadcast(&dump->cond);
+    pthread_mutex_unlock(&dump->lock);
+}
+
+static void __dump_fail(struct dump *dump, int error)
+{
+    pthread_mutex_lock(&dump->lock);
+    if (dump->error == 0)
+        dump->error = error;
+    pthread_cond_broadcast(&dump->cond);
+    pthread_mutex_unlock(&dump->lock);
+}
+
+static void __dump_flush(struct dump_worker *worker)
+{
+    if (worker->buffer.size == 0)
+        return;
+
+    struct dump *dump = worker->dump;
+    pthread_mutex_lock(&dump->out_lock);
+    size_t written = fwrite(worker->buffer.data, 1, worker->buffer.size, dump->out);
+    pthread_mutex_unlock(&dump->out_lock);
+
+    if (written != worker->buffer.size) {
+        fprintf(stderr, "cannot write archive: %s\n", strerror(errno));
+        __dump_fail(dump, -EIO);
+    }
+    worker->stats.bytes += worker->buffer.size;
+    worker->buffer.size = 0;
+}
+
+static void __dump_attr(const char *name, const char *value, size_t size, void *data)
+{
+    struct dump_worker *worker = data;
+    const uint16_t name_size = (uint16_t) (strlen(name) + 1);
+    const uint32_t value_size = (uint32_t) size;
+
+    if (__buffer_append(&worker->buffer, &name_size, sizeof(name_size)) != 0 ||
+        __buffer_append(&worker->buffer, name, name_size) != 0 ||
+        __buffer_append(&worker->buffer, &value_size, sizeof(value_size)) != 0 ||
+        __buffer_append(&worker->buffer, value, size) != 0) {
+        worker->failed = 1;
+        return;
+    }
+    worker->count++;
+}
+
+/* @param path - mount relative path of a file with a sidecar. */
+static void __dump_file(struct dump_worker *worker, const char *path)
+{
+    const size_t start = worker->buffer.size;
+    const uint32_t path_size = (uint32_t) strlen(path);
+    const uint32_t count = 0;
+
+    worker->count = 0;
+    worker->failed = 0;
+    if (__buffer_append(&worker->buffer, &path_size, sizeof(path_size)) != 0 ||
+        __buffer_append(&worker->buffer, path, path_size) != 0 ||
+        __buffer_append(&worker->buffer, &count, sizeof(count)) != 0) {
+        worker->failed = 1;
+    }
+
+    int res = 0;
+    if (!worker->failed) {
+        char *abs_path = prepend_source_directory(path);
+        res = binary_storage_foreach(abs_path, __dump_attr, worker);
+        free(abs_path);
+    }
+
+    if (worker->failed)
+        res = -ENOMEM;
+    if (res != 0) {
+        fprintf(stderr, "cannot read the attributes of %s: %s\n", path, strerror(-res));
+        worker->stats.errors++;
+    }
+    if (res != 0 || worker->count == 0) {
+        worker->buffer.size = start;
+        return;
+    }
+
+    memcpy(worker->buffer.data + start + sizeof(path_size) + path_size, &worker->count, sizeof(worker->count));
+    worker->stats.files++;
+    worker->stats.attrs += worker->count;
+
+    if (worker->buffer.size >= ARCHIVE_FLUSH_SIZE)
+        __dump_flush(worker);
+}
+
+static char *__join(const char *dir, const char *name)
+{
+    // the root is "/", everything else has no trailing slash
+    const size_t dir_len = strcmp(dir, "/") == 0 ? 0 : strlen(dir);
+    const size_t name_len = strlen(name);
+    char *path = malloc(dir_len + 1 + name_len + 1);
+    if (path == NULL)
+        return NULL;
+
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+static void __dump_store_entry(const char *path, void *data)
+{
+    __dump_file(data, path + xattrs_config.source_dir_size);
+}
+
+/* @param path - mount relative path of a directory with a store. */
+static void __dump_store(struct dump_worker *worker, const char *path)
+{
+    char *store = __join(path, DIR_STORE_NAME);
+    char *abs_store = store != NULL ? prepend_source_directory(store) : NULL;
+    int res = abs_store != NULL ? dir_store_foreach_entry(abs_store, __dump_store_entry, worker) : -ENOMEM;
+    if (res != 0) {
+        fprintf(stderr, "cannot read the directory store of %s: %s\n", path, strerror(-res));
+        worker->stats.errors++;
+    }
+    free(abs_store);
+    free(store);
+}
+
+/* @param path - mount relative path of the directory. */
+static void __dump_dir(struct dump_worker *worker, const char *path)
+{
+    const int is_root = strcmp(path, "/") == 0;
+    char *abs_path = prepend_source_directory(path);
+    DIR *dir = opendir(abs_path);
+    if (dir == NULL) {
+        fprintf(stderr, "cannot open directory %s: %s\n", abs_path, strerror(errno));
+        worker->stats.errors++;
+        free(abs_path);
+        return;
+    }
+    free(abs_path);
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        if (dir_store_enabled()) {
+            if (strcmp(de->d_name, DIR_STORE_NAME) == 0)
+                __dump_store(worker, path);
+            if (filename_is_sidecar(de->d_name))
+                continue;
+        } else if (dir_store_is_store_name(de->d_name)) {
+            continue;
+        }
+
+        // values are dumped inline: the blobs themselves aren't attributes
+        if (is_root && strcmp(de->d_name, BLOB_STORE_NAME) == 0)
+            continue;
+
+        // the sidecar of the root lives inside it
+        if (is_root && strcmp(de->d_name, BINARY_SIDECAR_EXT) == 0) {
+            __dump_file(worker, "/");
+            continue;
+        }
+
+        char *child = __join(path, de->d_name);
+        if (child == NULL) {
+            __dump_fail(worker->dump, -ENOMEM);
+            break;
+        }
+
+        if (filename_is_sidecar(de->d_name)) {
+            child[strlen(child) - BINARY_SIDECAR_EXT_SIZE] = '\0';
+            __dump_file(worker, child);
+            free(child);
+            continue;
+        }
+
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        if (!is_dir) {
+            free(child);
+        } else if (__dump_push(worker->dump, child) != 0) {
+            free(child);
+            __dump_fail(worker->dump, -ENOMEM);
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+static void *__dump_worker(void *arg)
+{
+    struct dump_worker *worker = arg;
+
+    char *path;
+    while ((path = __dump_pop(worker->dump)) != NULL) {
+        __dump_dir(worker, path);
+        free(path);
+        __dump_done(worker->dump);
+    }
+    __dump_flush(worker);
+
+    return NULL;
+}
+
+int archive_dump(FILE *out, unsigned int threads)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (threads == 0)
+        threads = 1;
+
+    const uint32_t version = ARCHIVE_VERSION;
+    if (fwrite(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC), 1, out) != 1 ||
+        fwrite(&version, sizeof(version), 1, out) != 1) {
+        return -EIO;
+    }
+
+    struct dump dump = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .cond = PTHREAD_COND_INITIALIZER,
+            .out_lock = PTHREAD_MUTEX_INITIALIZER,
+            .out = out,
+    };
+    struct dump_worker *workers = calloc(threads, sizeof(struct dump_worker));
+    char *root = strdup("/");
+    if (workers == NULL || root == NULL || __dump_push(&dump, root) != 0) {
+        free(workers);
+        free(root);
+        return -ENOMEM;
+    }
+
+    unsigned int started;
+    for (started = 0; started < threads; started++) {
+        workers[started].dump = &dump;
+        if (pthread_create(&workers[started].thread, NULL, __dump_worker, &workers[started]) != 0)
+            break;
+    }
+    if (started == 0) {
+        free(dump.pending[0]);
+        free(dump.pending);
+        free(workers);
+        return -EAGAIN;
+    }
+
+    struct archive_stats stats = { 0 };
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        __stats_add(&stats, &workers[i].stats);
+        free(workers[i].buffer.data);
+    }
+    free(workers);
+
+    // left over after a fatal error
+    for (size_t i = 0; i < dump.pending_size; i++)
+        free(dump.pending[i]);
+    free(dump.pending);
+
+    const uint32_t end = 0;
+    if (fwrite(&end, sizeof(end), 1, out) != 1 || fflush(out) != 0) {
+        if (dump.error == 0)
+            dump.error = -EIO;
+    }
+
+    __report("dump", &stats, &start);
+
+    if (dump.error != 0)
+        return dump.error;
+    return stats.errors > 0 ? -EIO : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// restore
+
+struct restore {
+    pthread_mutex_t lock;
+    struct archive_stats stats;
+};
+
+struct restore_job {
+    struct restore *restore;
+    char *path; // absolute
+    char *data; // the attributes as stored in the archive
+    size_t count;
+    struct binary_storage_attr attrs[];
+};
+
+static void __restore_job_free(struct restore_job *job)
+{
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+static void __restore_job(void *arg)
+{
+    struct restore_job *job = arg;
+    struct archive_stats stats = { 0 };
+
+    struct stat st;
+    if (lstat(job->path, &st) != 0) {
+        stats.skipped++;
+    } else {
+        int res = binary_storage_write_keys(job->path, job->attrs, job->count);
+        if (res != 0) {
+            fprintf(stderr, "cannot restore the attributes of %s: %s\n", job->path, strerror(-res));
+            stats.errors++;
+        } else {
+            stats.files++;
+            stats.attrs += job->count;
+        }
+    }
+
+    pthread_mutex_lock(&job->restore->lock);
+    __stats_add(&job->restore->stats, &stats);
+    pthread_mutex_unlock(&job->restore->lock);
+
+    __restore_job_free(job);
+}
+
+/* @return 0, -EILSEQ on a truncated archive or -EIO. */
+static int __read_exact(FILE *in, void *dst, size_t size, uint64_t *bytes)
+{
+    if (size > 0 && fread(dst, size, 1, in) != 1)
+        return ferror(in) ? -EIO : -EILSEQ;
+
+    *bytes += size;
+    return 0;
+}
+
+static int __read_into(FILE *in, struct buffer *buffer, size_t size, uint64_t *bytes)
+{
+    if (buffer->size + size > buffer->alloc) {
+        size_t alloc = buffer->alloc > 0 ? buffer->alloc : 4096;
+        while (alloc < buffer->size + size)
+            alloc *= 2;
+
+        char *data = realloc(buffer->data, alloc);
+        if (data == NULL)
+            return -ENOMEM;
+        buffer->data = data;
+        buffer->alloc = alloc;
+    }
+
+    int res = __read_exact(in, buffer->data + buffer->size, size, bytes);
+    if (res == 0)
+        buffer->size += size;
+    return res;
+}
+
+static int __valid_path(const char *path, size_t size)
+{
+    if (size == 0 || path[0] != '/' || memchr(path, '\0', size) != NULL)
+        return 0;
+
+    // no way out of the source directory
+    for (size_t i = 0; i + 2 < size; i++) {
+        if (path[i] == '/' && path[i + 1] == '.' && path[i + 2] == '.' &&
+            (i + 3 == size || path[i + 3] == '/'))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Read the next file of the archive.
+ * @return 1 and the job, 0 at the end of the archive or -errno.
+ */
+static int __read_job(FILE *in, struct restore *restore, struct restore_job **_job, uint64_t *bytes)
+{
+    uint32_t path_size;
+    int res = __read_exact(in, &path_size, sizeof(path_size), bytes);
+    if (res != 0)
+        return res;
+    if (path_size == 0)
+        return 0;
+    if (path_size >= PATH_MAX)
+        return -EILSEQ;
+
+    char *path = malloc(path_size + 1);
+    if (path == NULL)
+        return -ENOMEM;
+    res = __read_exact(in, path, path_size, bytes);
+    if (res != 0 || !__valid_path(path, path_size)) {
+        free(path);
+        return res != 0 ? res : -EILSEQ;
+    }
+    path[path_size] = '\0';
+
+    uint32_t count;
+    res = __read_exact(in, &count, sizeof(count), bytes);
+    if (res != 0) {
+        free(path);
+        return res;
+    }
+
+    struct buffer buffer = { NULL, 0, 0 };
+    for (uint32_t i = 0; i < count && res == 0; i++) {
+        uint16_t name_size;
+        uint32_t value_size;
+
+        res = __read_into(in, &buffer, sizeof(name_size), bytes);
+        if (res != 0)
+            break;
+        memcpy(&name_size, buffer.data + buffer.size - sizeof(name_size), sizeof(name_size));
+        if (name_size < 2 || name_size > XATTR_NAME_MAX + 1) {
+            res = -EILSEQ;
+            break;
+        }
+        res = __read_into(in, &buffer, name_size, bytes);
+        if (res != 0)
+            break;
+        if (buffer.data[buffer.size - 1] != '\0') {
+            res = -EILSEQ;
+            break;
+        }
+
+        res = __read_into(in, &buffer, sizeof(value_size), bytes);
+        if (res != 0)
+            break;
+        memcpy(&value_size, buffer.data + buffer.size - sizeof(value_size), sizeof(value_size));
+        if (value_size > XATTR_SIZE_MAX || buffer.size + value_size > MAX_METADATA_SIZE) {
+            res = -EILSEQ;
+            break;
+        }
+        res = __read_into(in, &buffer, value_size, bytes);
+    }
+
+    struct restore_job *job = NULL;
+    if (res == 0) {
+        job = malloc(sizeof(struct restore_job) + count * sizeof(struct binary_storage_attr));
+        if (job == NULL)
+            res = -ENOMEM;
+    }
+    if (res != 0) {
+        free(buffer.data);
+        free(path);
+        return res;
+    }
+
+    job->restore = restore;
+    job->path = prepend_source_directory(path);
+    job->data = buffer.data;
+    job->count = count;
+    free(path);
+
+    // the records were validated while reading them
+    size_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t name_size;
+        uint32_t value_size;
+
+        memcpy(&name_size, job->data + offset, sizeof(name_size));
+        offset += sizeof(name_size);
+        job->attrs[i].name = job->data + offset;
+        offset += name_size;
+        memcpy(&value_size, job->data + offset, sizeof(value_size));
+        offset += sizeof(value_size);
+        job->attrs[i].value = job->data + offset;
+        job->attrs[i].size = value_size;
+        offset += value_size;
+    }
+
+    *_job = job;
+    return 1;
+}
+
+int archive_restore(FILE *in, unsigned int threads)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char magic[sizeof(ARCHIVE_MAGIC)];
+    uint32_t version;
+    uint64_t bytes = 0;
+    if (__read_exact(in, magic, sizeof(magic), &bytes) != 0 ||
+        memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0 ||
+        __read_exact(in, &version, sizeof(version), &bytes) != 0 ||
+        version != ARCHIVE_VERSION) {
+        fprintf(stderr, "not a fuse_xattrs archive\n");
+        return -EILSEQ;
+    }
+
+    struct restore restore = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    struct thread_pool *pool = thread_pool_new(threads > 0 ? threads : 1, ARCHIVE_MAX_QUEUED);
+    if (pool == NULL)
+        return -ENOMEM;
+
+    int res;
+    struct restore_job *job;
+    while ((res = __read_job(in, &restore, &job, &bytes)) == 1) {
+        res = thread_pool_submit(pool, __restore_job, job, 1);
+        if (res != 0) {
+            __restore_job_free(job);
+            break;
+        }
+    }
+    if (res == -EILSEQ)
+        fprintf(stderr, "corrupted or truncated archive\n");
+
+    thread_pool_free(pool);
+
+    // restored sidecars are only durable once the filesystem is synced
+    int fd = open(xattrs_config.source_dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || syncfs(fd) != 0) {
+        fprintf(stderr, "cannot sync %s: %s\n", xattrs_config.source_dir, strerror(errno));
+        if (res == 0)
+            res = -EIO;
+    }
+    if (fd != -1)
+        close(fd);
+
+    restore.stats.bytes = bytes;
+    __report("restore", &restore.stats, &start);
+
+    if (res != 0)
+        return res;
+    return restore.stats.errors > 0 ? -EIO : 0;
+}
@@ -0,0 +1,44 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_ARCHIVE_H
+#define FUSE_XATTRS_ARCHIVE_H
+
+#include <stdio.h>
+
+/*
+ * Single file archive with every attribute of a source directory.
+ *
+ *   header:  "FXATTRS" '\0', u32 version
+ *   file:    u32 path_size, path (mount relative, no '\0'), u32 count,
+ *            count * (u16 name_size (with '\0'), name, u32 value_size, value)
+ *   end:     u32 path_size = 0
+ *
+ * Integers are stored in host byte order, like the sidecars themselves.
+ * The attributes of a file are always stored together, the order of the
+ * files is unspecified.
+ */
+#define ARCHIVE_MAGIC "FXATTRS"
+#define ARCHIVE_VERSION 1
+
+/**
+ * Walk xattrs_config.source_dir with threads workers and write the
+ * attributes of every file to out. Each sidecar is read once.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int archive_dump(FILE *out, unsigned int threads);
+
+/**
+ * Apply the archive read from in to xattrs_config.source_dir, rewriting
+ * each sidecar once. Files missing from the source directory are skipped.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int archive_restore(FILE *in, unsigned int threads);
+
+#endif //FUSE_XATTRS_ARCHIVE_H
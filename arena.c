@@ -0,0 +1,127 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_RETAIN_SIZE (1024 * 1024) // per thread, kept between requests
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/*
+ * Chunks after current are empty. A NULL current means nothing is
+ * allocated, not even from head.
+ */
+static __thread struct arena_chunk *head = NULL;
+static __thread struct arena_chunk *current = NULL;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static void __free_chunks(void *value)
+{
+    struct arena_chunk *chunk = value;
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static void __create_key(void)
+{
+    // frees the chunks of threads that exit (libfuse stops idle workers)
+    pthread_key_create(&key, __free_chunks);
+}
+
+static void __set_head(struct arena_chunk *chunk)
+{
+    head = chunk;
+    pthread_once(&key_once, __create_key);
+    pthread_setspecific(key, head);
+}
+
+struct arena_mark arena_mark(void)
+{
+    struct arena_mark mark = { current, current != NULL ? current->used : 0 };
+    return mark;
+}
+
+/* Give back what a big request left behind, once nothing is allocated. */
+static void __trim(void)
+{
+    struct arena_chunk *first = head;
+    size_t kept = 0;
+    struct arena_chunk **link = &first;
+    while (*link != NULL) {
+        struct arena_chunk *chunk = *link;
+        if (kept + chunk->size > ARENA_RETAIN_SIZE) {
+            *link = chunk->next;
+            free(chunk);
+        } else {
+            kept += chunk->size;
+            link = &chunk->next;
+        }
+    }
+    if (first != head)
+        __set_head(first);
+}
+
+void arena_rewind(struct arena_mark mark)
+{
+    current = mark.chunk;
+    if (current != NULL)
+        current->used = mark.used;
+    else if (head != NULL && (head->next != NULL || head->size > ARENA_CHUNK_SIZE))
+        __trim();
+}
+
+void *arena_alloc(size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+    struct arena_chunk *last = NULL;
+    struct arena_chunk *chunk = current;
+    if (chunk == NULL && (chunk = head) != NULL)
+        chunk->used = 0;
+
+    while (chunk != NULL && chunk->size - chunk->used < size) {
+        last = chunk;
+        if ((chunk = chunk->next) != NULL)
+            chunk->used = 0;
+    }
+
+    if (chunk == NULL) {
+        const size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = NULL;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        if (last != NULL)
+            last->next = chunk;
+        else
+            __set_head(chunk);
+    }
+
+    current = chunk;
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
@@ -0,0 +1,40 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_ARENA_H
+#define FUSE_XATTRS_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Per thread bump allocator for memory that only lives while a request is
+ * being served: paths, sidecar buffers, parsed records...
+ *
+ *     struct arena_mark mark = arena_mark();
+ *     char *path = arena_alloc(size);
+ *     ...
+ *     arena_rewind(mark); // frees everything allocated since arena_mark()
+ *
+ * Marks nest, so helpers can rewind their own allocations while called
+ * from an operation that rewinds later. Chunks are kept for the next
+ * request, so once a thread warmed up, serving a request doesn't touch
+ * the heap. Never free() arena memory, nor keep it after the rewind.
+ */
+struct arena_mark {
+    void *chunk;
+    size_t used;
+};
+
+struct arena_mark arena_mark(void);
+void arena_rewind(struct arena_mark mark);
+
+/* @return 16 bytes aligned memory, or NULL when out of memory. */
+void *arena_alloc(size_t size);
+
+#endif //FUSE_XATTRS_ARENA_H
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+
+
+# fuse_xattrs - Add xattrs support using sidecar files
+#
+# Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+#
+# This program can be distributed under the terms of the GNU GPL.
+# See the file COPYING.
+
+# getxattr throughput through the mount versus libfuse_xattrs_client.
+#
+# Mounts source_dir on mountpoint, sets a few attributes on a tree of
+# files, then reads them back from several threads: with getxattr(2) on
+# the mount, then with the client library reading source_dir directly.
+# Both sides go through ctypes calls of similar cost, so the difference
+# is the kernel round trip:
+#
+#   ./client_lookup.py ../build/fuse_xattrs ../build/libfuse_xattrs_client.so src mnt
+
+import argparse
+import ctypes
+import os
+import shutil
+import subprocess
+import threading
+import time
+
+
+def mount(binary, source_dir, mountpoint, options):
+    subprocess.check_call([binary, source_dir, mountpoint, "-o", ",".join(["multithread"] + options)])
+    for _ in range(100):
+        if os.path.ismount(mountpoint):
+            return
+        time.sleep(0.05)
+    raise RuntimeError("%s didn't mount" % mountpoint)
+
+
+def populate(mountpoint, dirs, files, attrs, value_size):
+    paths = []
+    for d in range(dirs):
+        directory = os.path.join(mountpoint, "client_lookup", "d%d" % d)
+        os.makedirs(directory, exist_ok=True)
+        for f in range(files):
+            name = os.path.join(directory, "f%d" % f)
+            open(name, "w").close()
+            for a in range(attrs):
+                os.setxattr(name, "user.attr%d" % a, os.urandom(value_size))
+            paths.append("/" + os.path.relpath(name, mountpoint))
+    return paths
+
+
+def run(paths, names, threads, seconds, getxattr):
+    counts = [0] * threads
+    deadline = time.perf_counter() + seconds
+
+    def worker(index):
+        value = ctypes.create_string_buffer(65536)
+        count = 0
+        while time.perf_counter() < deadline:
+            for path in paths[index::threads]:
+                for name in names:
+                    if getxattr(path, name, value, len(value)) < 0:
+                        raise RuntimeError("getxattr failed on %s" % path)
+                    count += 1
+        counts[index] = count
+
+    workers = [threading.Thread(target=worker, args=(i,)) for i in range(threads)]
+    start = time.perf_counter()
+    for worker_thread in workers:
+        worker_thread.start()
+    for worker_thread in workers:
+        worker_thread.join()
+    return sum(counts) / (time.perf_counter() - start)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="getxattr throughput, mount versus client library")
+    parser.add_argument("binary", help="fuse_xattrs executable")
+    parser.add_argument("library", help="libfuse_xattrs_client.so")
+    parser.add_argument("source_dir")
+    parser.add_argument("mountpoint")
+    parser.add_argument("-d", "--dirs", type=int, default=10)
+    parser.add_argument("-f", "--files", type=int, default=200, help="files per directory")
+    parser.add_argument("-a", "--attrs", type=int, default=4, help="attributes per file")
+    parser.add_argument("-s", "--value-size", type=int, default=64)
+    parser.add_argument("-j", "--threads", type=int, default=4)
+    parser.add_argument("-t", "--seconds", type=float, default=5)
+    parser.add_argument("-o", "--options", default="", help="extra mount options, e.g. cache")
+    args = parser.parse_args()
+
+    libc = ctypes.CDLL(None, use_errno=True)
+    client = ctypes.CDLL(os.path.abspath(args.library))
+    if client.fuse_xattrs_client_open(os.fsencode(args.source_dir), 0) != 0:
+        raise RuntimeError("cannot open %s" % args.source_dir)
+
+    options = [option for option in args.options.split(",") if option]
+    mount(args.binary, args.source_dir, args.mountpoint, options)
+    try:
+        relative = populate(args.mountpoint, args.dirs, args.files, args.attrs, args.value_size)
+        names = [os.fsencode("user.attr%d" % a) for a in range(args.attrs)]
+        mounted = [os.fsencode(args.mountpoint + path) for path in relative]
+        direct = [os.fsencode(path) for path in relative]
+
+        rate = run(mounted, names, args.threads, args.seconds, libc.getxattr)
+        print("mount:   %d files x %d attributes, %d threads: %.0f getxattr/s" % (
+            len(relative), args.attrs, args.threads, rate))
+        rate = run(direct, names, args.threads, args.seconds, client.fuse_xattrs_client_get)
+        print("library: %d files x %d attributes, %d threads: %.0f getxattr/s" % (
+            len(relative), args.attrs, args.threads, rate))
+    finally:
+        shutil.rmtree(os.path.join(args.mountpoint, "client_lookup"))
+        subprocess.check_call(["fusermount3", "-u", args.mountpoint])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+
+
+# fuse_xattrs - Add xattrs support using sidecar files
+#
+# Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+#
+# This program can be distributed under the terms of the GNU GPL.
+# See the file COPYING.
+
+# Throughput per set of negotiated FUSE capabilities.
+#
+# Mounts source_dir on mountpoint once per configuration and runs the
+# same workloads on each: small appends, sequential write and read of a
+# large file, readdir plus stat of a tree, and open/fstat/close churn:
+#
+#   ./fuse_caps.py ../build/fuse_xattrs src mnt
+#   ./fuse_caps.py ../build/fuse_xattrs src mnt --config baseline writeback_cache
+
+import argparse
+import os
+import shutil
+import subprocess
+import time
+
+CONFIGS = {
+    "baseline": [],
+    "writeback_cache": ["writeback_cache"],
+    "no_open": ["no_open"],
+    "readdirplus=no": ["readdirplus=no"],
+    "readdirplus=yes": ["readdirplus=yes"],
+    "max_write=128k": ["max_write=131072"],
+    "max_background=64": ["max_background=64", "congestion_threshold=48"],
+    "no_parallel_dirops": ["no_parallel_dirops"],
+    "passthrough": ["passthrough"],
+    "all": ["writeback_cache", "no_open", "readdirplus=yes"],
+}
+
+
+def populate(source_dir, dirs, files):
+    root = os.path.join(source_dir, "fuse_caps")
+    for d in range(dirs):
+        directory = os.path.join(root, "d%d" % d)
+        os.makedirs(directory, exist_ok=True)
+        for f in range(files):
+            with open(os.path.join(directory, "f%d" % f), "w") as fp:
+                fp.write("x" * 100)
+
+
+def mount(binary, source_dir, mountpoint, options):
+    options = ["multithread"] + options
+    subprocess.check_call([binary, source_dir, mountpoint, "-o", ",".join(options)])
+    for _ in range(100):
+        if os.path.ismount(mountpoint):
+            return
+        time.sleep(0.05)
+    raise RuntimeError("%s didn't mount" % mountpoint)
+
+
+def timed(function):
+    start = time.perf_counter()
+    count = function()
+    return count / (time.perf_counter() - start)
+
+
+def small_writes(root, count):
+    def run():
+        with open(os.path.join(root, "small"), "wb", buffering=0) as fp:
+            for _ in range(count):
+                fp.write(b"x" * 64)
+        os.unlink(os.path.join(root, "small"))
+        return count
+    return timed(run)
+
+
+def sequential(root, megabytes):
+    chunk = b"x" * (1 << 20)
+    path = os.path.join(root, "large")
+
+    def write():
+        with open(path, "wb", buffering=0) as fp:
+            for _ in range(megabytes):
+                fp.write(chunk)
+            os.fsync(fp.fileno())
+        return megabytes
+
+    def read():
+        with open(path, "rb", buffering=0) as fp:
+            while fp.read(1 << 20):
+                pass
+        return megabytes
+
+    write_rate = timed(write)
+    read_rate = timed(read)
+    os.unlink(path)
+    return write_rate, read_rate
+
+
+def readdir_stat(root):
+    def run():
+        count = 0
+        for directory in os.scandir(root):
+            if not directory.is_dir():
+                continue
+            for entry in os.scandir(directory.path):
+                entry.stat(follow_symlinks=False)
+                count += 1
+        return count
+    return timed(run)
+
+
+def open_churn(root, rounds):
+    paths = []
+    for directory in os.scandir(root):
+        if directory.is_dir():
+            paths += [entry.path for entry in os.scandir(directory.path)]
+
+    def run():
+        for _ in range(rounds):
+            for path in paths:
+                fd = os.open(path, os.O_RDONLY)
+                os.fstat(fd)
+                os.close(fd)
+        return rounds * len(paths)
+    return timed(run)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="throughput per negotiated FUSE capability")
+    parser.add_argument("binary", help="fuse_xattrs executable")
+    parser.add_argument("source_dir")
+    parser.add_argument("mountpoint")
+    parser.add_argument("--config", nargs="+", choices=sorted(CONFIGS), default=list(CONFIGS))
+    parser.add_argument("-d", "--dirs", type=int, default=10)
+    parser.add_argument("-f", "--files", type=int, default=500, help="files per directory")
+    parser.add_argument("-w", "--writes", type=int, default=20000, help="small writes")
+    parser.add_argument("-s", "--size", type=int, default=256, help="MiB written and read")
+    parser.add_argument("-r", "--rounds", type=int, default=3, help="open/fstat/close rounds")
+    args = parser.parse_args()
+
+    populate(args.source_dir, args.dirs, args.files)
+    root = os.path.join(args.mountpoint, "fuse_caps")
+
+    try:
+        print("%-20s %12s %12s %12s %14s %12s" % (
+            "config", "writes/s", "write MiB/s", "read MiB/s", "readdir+stat/s", "opens/s"))
+        for name in args.config:
+            mount(args.binary, args.source_dir, args.mountpoint, CONFIGS[name])
+            try:
+                writes = small_writes(root, args.writes)
+                write_rate, read_rate = sequential(root, args.size)
+                listing = readdir_stat(root)
+                opens = open_churn(root, args.rounds)
+            finally:
+                subprocess.check_call(["fusermount3", "-u", args.mountpoint])
+            print("%-20s %12.0f %12.0f %12.0f %14.0f %12.0f" % (
+                name, writes, write_rate, read_rate, listing, opens))
+    finally:
+        shutil.rmtree(os.path.join(args.source_dir, "fuse_caps"))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,235 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/*
+ * Lookups in a sidecar held in memory, per number of attributes and per
+ * record_scan kernel, plus the record by record parse lookups used to
+ * do. Half of the lookups are for names that aren't there:
+ *
+ *   cmake -DENABLE_BENCHMARKS=1 .. && make record_scan_bench
+ *   ./record_scan_bench [-l] [-v value_size] [count...]
+ *
+ * -l uses long names sharing a prefix, "user.org.example.checksum.N",
+ * instead of short ones, "user.aN". Before timing a kernel, its results
+ * are checked against the parse, on the sidecar and on truncated copies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../arena.h"
+#include "../record_scan.h"
+
+#define LOOKUPS (1 << 20)
+
+struct sidecar {
+    char *buffer;
+    size_t size;
+    char **names;           // count present names, then count missing ones
+    size_t count;
+};
+
+static void __name(char *name, size_t size, int long_names, size_t index)
+{
+    if (long_names)
+        snprintf(name, size, "user.org.example.checksum.%zu", index);
+    else
+        snprintf(name, size, "user.a%zu", index);
+}
+
+static void __build(struct sidecar *sidecar, size_t count, int long_names, size_t value_size)
+{
+    sidecar->count = count;
+    sidecar->names = calloc(count * 2, sizeof(char *));
+    sidecar->buffer = malloc(count * (sizeof(uint16_t) + 64 + sizeof(size_t) + value_size));
+    sidecar->size = 0;
+    if (sidecar->names == NULL || sidecar->buffer == NULL) {
+        perror("record_scan_bench");
+        exit(1);
+    }
+
+    char name[64];
+    for (size_t i = 0; i < count * 2; i++) {
+        __name(name, sizeof(name), long_names, i);
+        sidecar->names[i] = strdup(name);
+        if (i >= count)
+            continue;
+
+        const uint16_t name_size = (uint16_t) (strlen(name) + 1);
+        char *p = sidecar->buffer + sidecar->size;
+        memcpy(p, &name_size, sizeof(uint16_t));
+        memcpy(p + sizeof(uint16_t), name, name_size);
+        memcpy(p + sizeof(uint16_t) + name_size, &value_size, sizeof(size_t));
+        memset(p + sizeof(uint16_t) + name_size + sizeof(size_t), 'v', value_size);
+        sidecar->size += sizeof(uint16_t) + name_size + sizeof(size_t) + value_size;
+    }
+}
+
+/*
+ * What lookups did before record_scan: parse every record into a header
+ * allocated from the request arena, with the same checks.
+ */
+struct copied_attr {
+    uint16_t name_size;
+    size_t value_size;
+    const char *name;
+    const char *value;
+};
+
+static ssize_t __find_copying(const char *buffer, size_t size, const char *name, size_t name_size)
+{
+    struct arena_mark mark = arena_mark();
+    ssize_t res = -ENOENT;
+    size_t offset = 0;
+    while (offset < size) {
+        struct copied_attr *attr = arena_alloc(sizeof(struct copied_attr));
+        const size_t start = offset;
+
+        res = -EILSEQ;
+        if (attr == NULL || offset + sizeof(uint16_t) > size)
+            break;
+        memcpy(&attr->name_size, buffer + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        if (offset + attr->name_size > size)
+            break;
+        attr->name = buffer + offset;
+        offset += attr->name_size;
+        if (offset + sizeof(size_t) > size)
+            break;
+        memcpy(&attr->value_size, buffer + offset, sizeof(size_t));
+        offset += sizeof(size_t);
+        if (offset + attr->value_size > size)
+            break;
+        attr->value = buffer + offset;
+        offset += attr->value_size;
+
+        res = -ENOENT;
+        if (attr->name_size == name_size && memcmp(attr->name, name, name_size) == 0) {
+            res = (ssize_t) start;
+            break;
+        }
+    }
+    arena_rewind(mark);
+    return res;
+}
+
+static void __check_size(const struct sidecar *sidecar, size_t size)
+{
+    // a sample of the names of large sidecars, present and missing ones
+    const size_t stride = sidecar->count > 128 ? sidecar->count / 128 : 1;
+    for (size_t i = 0; i < sidecar->count * 2; i += stride) {
+        const char *name = sidecar->names[i];
+        const size_t name_size = strlen(name) + 1;
+        const ssize_t expected = __find_copying(sidecar->buffer, size, name, name_size);
+        const ssize_t res = record_scan_find(sidecar->buffer, size, name, name_size);
+        if (res != expected) {
+            fprintf(stderr, "record_scan_bench: %s, %s in %zu of %zu bytes: %zd instead of %zd\n",
+                    record_scan_kernel_name(), name, size, sidecar->size, res, expected);
+            exit(1);
+        }
+    }
+}
+
+/* The kernel in use finds what the parse finds, in the sidecar and truncated. */
+static void __check(const struct sidecar *sidecar)
+{
+    // every size of small sidecars, a few of the larger ones
+    const size_t step = sidecar->size > 4096 ? sidecar->size / 8 : 1;
+    for (size_t size = 0; size < sidecar->size; size += step)
+        __check_size(sidecar, size);
+    __check_size(sidecar, sidecar->size);
+}
+
+static double __now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* @return ns per lookup */
+static double __run(const struct sidecar *sidecar, int copying, size_t lookups)
+{
+    unsigned int seed = 1;
+    size_t found = 0;
+    const double start = __now();
+    for (size_t i = 0; i < lookups; i++) {
+        const char *name = sidecar->names[rand_r(&seed) % (sidecar->count * 2)];
+        const size_t name_size = strlen(name) + 1;
+        ssize_t res = copying ? __find_copying(sidecar->buffer, sidecar->size, name, name_size)
+                              : record_scan_find(sidecar->buffer, sidecar->size, name, name_size);
+        found += res >= 0;
+    }
+    const double elapsed = __now() - start;
+
+    if (found == 0 || found == lookups) {
+        fprintf(stderr, "record_scan_bench: unexpected number of matches %zu\n", found);
+        exit(1);
+    }
+    return elapsed * 1e9 / lookups;
+}
+
+int main(int argc, char *argv[])
+{
+    int long_names = 0;
+    size_t value_size = 32;
+    int opt;
+    while ((opt = getopt(argc, argv, "lv:")) != -1) {
+        switch (opt) {
+            case 'l':
+                long_names = 1;
+                break;
+            case 'v':
+                value_size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-l] [-v value_size] [count...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    static const size_t default_counts[] = {1, 10, 100, 1000, 10000};
+    const size_t count_count = optind < argc ? (size_t) (argc - optind) : sizeof(default_counts) / sizeof(size_t);
+
+    printf("%8s %12s %12s %12s %12s\n", "attrs", "copy ns", "scalar ns", "sse2 ns", "avx2 ns");
+    for (size_t c = 0; c < count_count; c++) {
+        const size_t count = optind < argc ? strtoul(argv[optind + c], NULL, 10) : default_counts[c];
+        if (count == 0)
+            continue;
+
+        struct sidecar sidecar;
+        __build(&sidecar, count, long_names, value_size);
+        // about the same number of records visited for every count
+        const size_t lookups = LOOKUPS / count > 1000 ? LOOKUPS / count : 1000;
+
+        printf("%8zu %12.1f", count, __run(&sidecar, 1, lookups));
+        static const enum record_scan_kernel kernels[] = {RECORD_SCAN_SCALAR, RECORD_SCAN_SSE2, RECORD_SCAN_AVX2};
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (record_scan_use(kernels[k]) != 0) {
+                printf(" %12s", "-");
+                continue;
+            }
+            __check(&sidecar);
+            printf(" %12.1f", __run(&sidecar, 0, lookups));
+        }
+        printf("\n");
+
+        for (size_t i = 0; i < count * 2; i++)
+            free(sidecar.names[i]);
+        free(sidecar.names);
+        free(sidecar.buffer);
+    }
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+
+
+# fuse_xattrs - Add xattrs support using sidecar files
+#
+# Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+#
+# This program can be distributed under the terms of the GNU GPL.
+# See the file COPYING.
+
+# Small-write throughput on a mounted filesystem.
+#
+# Every write(2) to a FUSE file makes the kernel probe security.capability
+# unless killpriv is delegated to the daemon. Compare:
+#
+#   fuse_xattrs src mnt                          && ./small_writes.py mnt
+#   fuse_xattrs -o no_security_xattrs src mnt    && ./small_writes.py mnt
+
+import argparse
+import os
+import time
+
+
+def run(directory, count, size):
+    path = os.path.join(directory, "bench_small_writes.tmp")
+    payload = b"x" * size
+    fd = os.open(path, os.O_CREAT | os.O_WRONLY | os.O_TRUNC, 0o644)
+    try:
+        start = time.perf_counter()
+        for _ in range(count):
+            os.write(fd, payload)
+        elapsed = time.perf_counter() - start
+    finally:
+        os.close(fd)
+        os.remove(path)
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="small write(2) throughput")
+    parser.add_argument("directory", help="directory inside the mount")
+    parser.add_argument("-n", "--count", type=int, default=100000)
+    parser.add_argument("-s", "--size", type=int, default=64, help="bytes per write")
+    parser.add_argument("-r", "--rounds", type=int, default=3)
+    args = parser.parse_args()
+
+    best = min(run(args.directory, args.count, args.size) for _ in range(args.rounds))
+    print("writes: %d x %d bytes, best of %d: %.3fs, %.0f writes/s, %.2f MiB/s" % (
+        args.count, args.size, args.rounds, best, args.count / best,
+        args.count * args.size / best / (1024 * 1024)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+
+
+# fuse_xattrs - Add xattrs support using sidecar files
+#
+# Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+#
+# This program can be distributed under the terms of the GNU GPL.
+# See the file COPYING.
+
+# stat(2) throughput for several stat_cache_ttl values.
+#
+# Mounts source_dir on mountpoint once per TTL (0: no stat cache) and
+# stats a tree of files, plus some paths that don't exist, from several
+# threads. The kernel timeouts are 0 unless --kernel-cache is given, so
+# every stat reaches the daemon and the numbers measure its cache alone:
+#
+#   ./stat_storm.py ../build/fuse_xattrs src mnt --ttl 0 1 5 60
+
+import argparse
+import os
+import shutil
+import subprocess
+import threading
+import time
+
+
+def populate(source_dir, dirs, files):
+    paths = []
+    for d in range(dirs):
+        directory = os.path.join(source_dir, "stat_storm", "d%d" % d)
+        os.makedirs(directory, exist_ok=True)
+        for f in range(files):
+            name = os.path.join(directory, "f%d" % f)
+            open(name, "w").close()
+            paths.append(os.path.relpath(name, source_dir))
+    return paths
+
+
+def mount(binary, source_dir, mountpoint, ttl, kernel_cache):
+    options = ["multithread"]
+    if ttl > 0:
+        options += ["stat_cache", "stat_cache_ttl=%d" % ttl]
+    if not kernel_cache:
+        options += ["attr_timeout=0", "entry_timeout=0", "negative_timeout=0"]
+    subprocess.check_call([binary, source_dir, mountpoint, "-o", ",".join(options)])
+    for _ in range(100):
+        if os.path.ismount(mountpoint):
+            return
+        time.sleep(0.05)
+    raise RuntimeError("%s didn't mount" % mountpoint)
+
+
+def storm(paths, threads, seconds):
+    counts = [0] * threads
+    deadline = time.perf_counter() + seconds
+
+    def worker(index):
+        count = 0
+        while time.perf_counter() < deadline:
+            for path in paths[index::threads]:
+                try:
+                    os.lstat(path)
+                except FileNotFoundError:
+                    pass
+                count += 1
+        counts[index] = count
+
+    workers = [threading.Thread(target=worker, args=(i,)) for i in range(threads)]
+    start = time.perf_counter()
+    for worker_thread in workers:
+        worker_thread.start()
+    for worker_thread in workers:
+        worker_thread.join()
+    return sum(counts) / (time.perf_counter() - start)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="stat(2) throughput per stat_cache_ttl")
+    parser.add_argument("binary", help="fuse_xattrs executable")
+    parser.add_argument("source_dir")
+    parser.add_argument("mountpoint")
+    parser.add_argument("--ttl", type=int, nargs="+", default=[0, 1, 5, 60])
+    parser.add_argument("-d", "--dirs", type=int, default=20)
+    parser.add_argument("-f", "--files", type=int, default=500, help="files per directory")
+    parser.add_argument("-m", "--missing", type=float, default=0.2, help="fraction of paths that don't exist")
+    parser.add_argument("-j", "--threads", type=int, default=4)
+    parser.add_argument("-t", "--seconds", type=float, default=5)
+    parser.add_argument("--kernel-cache", action="store_true",
+                        help="let the kernel timeouts follow stat_cache_ttl")
+    args = parser.parse_args()
+
+    relative = populate(args.source_dir, args.dirs, args.files)
+    relative += ["stat_storm/missing%d" % i for i in range(int(len(relative) * args.missing))]
+    paths = [os.path.join(args.mountpoint, path) for path in relative]
+
+    try:
+        for ttl in args.ttl:
+            mount(args.binary, args.source_dir, args.mountpoint, ttl, args.kernel_cache)
+            try:
+                rate = storm(paths, args.threads, args.seconds)
+            finally:
+                subprocess.check_call(["fusermount3", "-u", args.mountpoint])
+            print("stat_cache_ttl=%-4s %d paths, %d threads: %.0f stats/s" % (
+                ttl if ttl > 0 else "off", len(paths), args.threads, rate))
+    finally:
+        shutil.rmtree(os.path.join(args.source_dir, "stat_storm"))
+
+
+if __name__ == "__main__":
+    main()
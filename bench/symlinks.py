@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+
+
+# fuse_xattrs - Add xattrs support using sidecar files
+#
+# Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+#
+# This program can be distributed under the terms of the GNU GPL.
+# See the file COPYING.
+
+# Data throughput of a regular mount against -o symlinks.
+#
+# Mounts source_dir on mountpoint once per mode and runs the same
+# workloads on each: sequential write and read of a large file, and
+# open/read/close of many small files. With -o symlinks the data goes to
+# the source filesystem directly, only the lookups reach the daemon:
+#
+#   ./symlinks.py ../build/fuse_xattrs src mnt
+#   ./symlinks.py ../build/fuse_xattrs src mnt -s 1024 --drop-caches
+
+import argparse
+import os
+import shutil
+import subprocess
+import time
+
+MODES = {
+    "regular": [],
+    "symlinks": ["symlinks"],
+}
+
+
+def populate(source_dir, dirs, files, size):
+    root = os.path.join(source_dir, "symlinks")
+    for d in range(dirs):
+        directory = os.path.join(root, "d%d" % d)
+        os.makedirs(directory, exist_ok=True)
+        for f in range(files):
+            with open(os.path.join(directory, "f%d" % f), "wb") as fp:
+                fp.write(b"x" * size)
+
+
+def mount(binary, source_dir, mountpoint, options):
+    options = ["multithread"] + options
+    subprocess.check_call([binary, source_dir, mountpoint, "-o", ",".join(options)])
+    for _ in range(100):
+        if os.path.ismount(mountpoint):
+            return
+        time.sleep(0.05)
+    raise RuntimeError("%s didn't mount" % mountpoint)
+
+
+def drop_caches():
+    subprocess.check_call(["sync"])
+    with open("/proc/sys/vm/drop_caches", "w") as drop:
+        drop.write("3\n")
+
+
+def timed(function):
+    start = time.perf_counter()
+    count = function()
+    return count / (time.perf_counter() - start)
+
+
+def sequential(root, megabytes, drop):
+    chunk = b"x" * (1 << 20)
+    path = os.path.join(root, "large")
+
+    # created from the source side: through the mount it would be a
+    # regular file while open, its data going through the daemon
+    def write():
+        with open(path, "r+b", buffering=0) as fp:
+            for _ in range(megabytes):
+                fp.write(chunk)
+            os.fsync(fp.fileno())
+        return megabytes
+
+    def read():
+        with open(path, "rb", buffering=0) as fp:
+            while fp.read(1 << 20):
+                pass
+        return megabytes
+
+    write_rate = timed(write)
+    if drop:
+        drop_caches()
+    read_rate = timed(read)
+    return write_rate, read_rate
+
+
+def small_files(root, rounds, drop):
+    paths = []
+    for directory in os.scandir(root):
+        if directory.is_dir():
+            paths += [entry.path for entry in os.scandir(directory.path)]
+
+    def run():
+        for _ in range(rounds):
+            for path in paths:
+                with open(path, "rb", buffering=0) as fp:
+                    fp.read()
+        return rounds * len(paths)
+
+    if drop:
+        drop_caches()
+    return timed(run)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="data throughput, regular mount against -o symlinks")
+    parser.add_argument("binary", help="fuse_xattrs executable")
+    parser.add_argument("source_dir")
+    parser.add_argument("mountpoint")
+    parser.add_argument("--mode", nargs="+", choices=sorted(MODES), default=list(MODES))
+    parser.add_argument("-d", "--dirs", type=int, default=10)
+    parser.add_argument("-f", "--files", type=int, default=500, help="small files per directory")
+    parser.add_argument("-b", "--bytes", type=int, default=16384, help="size of the small files")
+    parser.add_argument("-s", "--size", type=int, default=256, help="MiB written and read")
+    parser.add_argument("-r", "--rounds", type=int, default=3, help="passes over the small files")
+    parser.add_argument("--drop-caches", action="store_true", help="drop the page cache before reading (root)")
+    args = parser.parse_args()
+
+    populate(args.source_dir, args.dirs, args.files, args.bytes)
+    open(os.path.join(args.source_dir, "symlinks", "large"), "w").close()
+    root = os.path.join(args.mountpoint, "symlinks")
+
+    try:
+        print("%-10s %12s %12s %14s %14s" % ("mode", "write MiB/s", "read MiB/s", "small files/s", "small MiB/s"))
+        for name in args.mode:
+            mount(args.binary, args.source_dir, args.mountpoint, MODES[name])
+            try:
+                write_rate, read_rate = sequential(root, args.size, args.drop_caches)
+                files = small_files(root, args.rounds, args.drop_caches)
+            finally:
+                subprocess.check_call(["fusermount3", "-u", args.mountpoint])
+            print("%-10s %12.0f %12.0f %14.0f %14.1f" % (
+                name, write_rate, read_rate, files, files * args.bytes / (1 << 20)))
+    finally:
+        shutil.rmtree(os.path.join(args.source_dir, "symlinks"))
+
+
+if __name__ == "__main__":
+    main()
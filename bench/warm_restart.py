@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+
+
+# fuse_xattrs - Add xattrs support using sidecar files
+#
+# Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+#
+# This program can be distributed under the terms of the GNU GPL.
+# See the file COPYING.
+
+# getxattr latency right after a restart, with and without a cache snapshot.
+#
+# Populates a tree of files with attributes, mounts with -o cache, reads
+# every attribute once and unmounts (saving the snapshot), then mounts
+# again and times the first getxattr of each file. --drop-caches empties
+# the page cache before the timed pass (needs root), which is what a
+# node reboot does:
+#
+#   ./warm_restart.py ../build/fuse_xattrs src mnt --drop-caches
+
+import argparse
+import os
+import shutil
+import subprocess
+import time
+
+
+def populate(source_dir, dirs, files, attrs):
+    paths = []
+    for d in range(dirs):
+        directory = os.path.join(source_dir, "warm_restart", "d%d" % d)
+        os.makedirs(directory, exist_ok=True)
+        for f in range(files):
+            name = os.path.join(directory, "f%d" % f)
+            open(name, "w").close()
+            for a in range(attrs):
+                os.setxattr(name, "user.attr%d" % a, b"value %d" % a)
+            paths.append(os.path.relpath(name, source_dir))
+    return paths
+
+
+def mount(binary, source_dir, mountpoint, snapshot):
+    options = ["cache", "cache_ttl=3600", "attr_timeout=0", "entry_timeout=0"]
+    if snapshot:
+        options.append("cache_snapshot=" + snapshot)
+    subprocess.check_call([binary, source_dir, mountpoint, "-o", ",".join(options)])
+    for _ in range(100):
+        if os.path.ismount(mountpoint):
+            return
+        time.sleep(0.05)
+    raise RuntimeError("%s didn't mount" % mountpoint)
+
+
+def unmount(mountpoint, snapshot):
+    subprocess.check_call(["fusermount3", "-u", mountpoint])
+    # the snapshot is written once the daemon got the unmount
+    for _ in range(200):
+        if subprocess.call(["pgrep", "-f", "cache_snapshot=%s" % snapshot],
+                           stdout=subprocess.DEVNULL) != 0:
+            return
+        time.sleep(0.05)
+
+
+def first_pass(paths):
+    latencies = []
+    for path in paths:
+        start = time.perf_counter()
+        os.getxattr(path, "user.attr0")
+        latencies.append(time.perf_counter() - start)
+    latencies.sort()
+    return latencies
+
+
+def percentile(latencies, p):
+    return latencies[min(len(latencies) - 1, int(len(latencies) * p))] * 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser(description="getxattr latency after a restart")
+    parser.add_argument("binary", help="fuse_xattrs executable")
+    parser.add_argument("source_dir")
+    parser.add_argument("mountpoint")
+    parser.add_argument("-d", "--dirs", type=int, default=20)
+    parser.add_argument("-f", "--files", type=int, default=500, help="files per directory")
+    parser.add_argument("-a", "--attrs", type=int, default=4, help="attributes per file")
+    parser.add_argument("--drop-caches", action="store_true", help="drop the page cache before timing (root)")
+    args = parser.parse_args()
+
+    snapshot = os.path.abspath("warm_restart.snapshot")
+    try:
+        # through the mount, so that the sidecars exist
+        mount(args.binary, args.source_dir, args.mountpoint, None)
+        try:
+            relative = populate(args.mountpoint, args.dirs, args.files, args.attrs)
+        finally:
+            unmount(args.mountpoint, None)
+        paths = [os.path.join(args.mountpoint, path) for path in relative]
+
+        for name, use_snapshot in [("cold", False), ("snapshot", True)]:
+            if use_snapshot:
+                mount(args.binary, args.source_dir, args.mountpoint, snapshot)
+                first_pass(paths)
+                unmount(args.mountpoint, snapshot)
+
+            if args.drop_caches:
+                subprocess.check_call(["sync"])
+                with open("/proc/sys/vm/drop_caches", "w") as drop:
+                    drop.write("3\n")
+
+            mount(args.binary, args.source_dir, args.mountpoint, snapshot if use_snapshot else None)
+            try:
+                start = time.perf_counter()
+                latencies = first_pass(paths)
+                elapsed = time.perf_counter() - start
+            finally:
+                unmount(args.mountpoint, snapshot if use_snapshot else None)
+            print("%-8s %d files: %.0f getxattr/s, p50 %.0f us, p99 %.0f us, max %.0f us" % (
+                name, len(paths), len(paths) / elapsed, percentile(latencies, 0.5),
+                percentile(latencies, 0.99), latencies[-1] * 1e6))
+    finally:
+        shutil.rmtree(os.path.join(args.source_dir, "warm_restart"), ignore_errors=True)
+        if os.path.exists(snapshot):
+            os.remove(snapshot)
+
+
+if __name__ == "__main__":
+    main()
@@ -7,14 +7,33 @@
   See the file COPYING.
 */
 
+/* For F_OFD_SETLKW */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
 
 #include "binary_storage.h"
 #include "utils.h"
+#include "arena.h"
+#include "hash_table.h"
+#include "sync.h"
+#include "own_changes.h"
+#include "sidecar_cache.h"
+#include "open_sidecars.h"
+#include "query_index.h"
+#include "dir_store.h"
+#include "blob_store.h"
+#include "record_scan.h"
+#include "xattrs_config.h"
 #include "fuse_xattrs_config.h"
 
 
@@ -27,102 +46,460 @@
     #define ERR_NO_ATTR ENOATTR
 #endif
 
+/*
+ * Serialize operations on the same sidecar when running multi-threaded.
+ * Locks are striped by path, so unrelated files rarely contend.
+ */
+#define SIDECAR_LOCK_STRIPES 64
+
+static pthread_mutex_t sidecar_locks[SIDECAR_LOCK_STRIPES] = {
+        [0 ... SIDECAR_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static pthread_mutex_t *__sidecar_lock(const char *path)
+{
+    return &sidecar_locks[hash_string(path) & (SIDECAR_LOCK_STRIPES - 1)];
+}
+
+/* value_size without the blob reference flag: bytes actually stored */
+#define __stored_size(size) ((size) & ~BLOB_REF_FLAG)
+
+/* A record of a loaded sidecar: name and value point into its buffer. */
 struct on_memory_attr {
     u_int16_t name_size;
     size_t value_size;
 
-    char *name;
-    char *value;
+    const char *name;
+    const char *value;
 };
 
 void __print_on_memory_attr(struct on_memory_attr *attr)
 {
-#ifdef DEBUG
-    char *sanitized_value = sanitize_value(attr->value, attr->value_size);
-    debug_print("--------------\n");
-    debug_print("name size: %hu\n", attr->name_size);
-    debug_print("name: '%s'\n", attr->name);
-    debug_print("value size: %zu\n", attr->value_size);
-    debug_print("sanitized_value: '%s'\n", sanitized_value);
-    debug_print("--------------\n");
-    free(sanitized_value);
+    if (DEBUG) {
+        struct arena_mark mark = arena_mark();
+        char *sanitized_value = arena_sanitize_value(attr->value, __stored_size(attr->value_size));
+        debug_print("--------------\n");
+        debug_print("name size: %hu\n", attr->name_size);
+        debug_print("name: '%s'\n", attr->name);
+        debug_print("value size: %zu\n", attr->value_size);
+        debug_print("sanitized_value: '%s'\n", sanitized_value);
+        debug_print("--------------\n");
+        arena_rewind(mark);
+    }
+}
+
+static int __pread_all(int fd, char *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buffer + done, size - done, (off_t) done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 ? -EIO : -errno;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+static int __pwrite_all(int fd, const char *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, buffer + done, size - done, (off_t) done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -errno;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * Sidecars are rewritten in place. The stripe locks only cover this
+ * process: across processes (other mounts of the same source, the tool,
+ * fuse_xattrs_client) sidecars are locked with open file description
+ * locks, which unlike POSIX ones aren't dropped when another fd of the
+ * file is closed, and also work over NFS. Reads hold a shared lock while
+ * loading the sidecar, rewrites an exclusive one from reading it until
+ * it is written (see __rewrite_begin()), so concurrent updates aren't
+ * lost. Advisory and best effort, a filesystem without locks just runs
+ * unlocked. -o single_writer skips them.
+ *
+ * Time spent waiting for them is counted in lock_waits: the first bucket
+ * counts locks taken without waiting, the next ones waits of less than
+ * 10us, 100us, ... 1s, and the last one longer waits.
+ */
+#define LOCK_WAIT_BUCKETS 8
+
+static uint64_t lock_waits[LOCK_WAIT_BUCKETS];
+
+static void __count_lock_wait(uint64_t ns)
+{
+    size_t bucket = 0;
+    for (uint64_t limit = 1000; ns > 0 && bucket < LOCK_WAIT_BUCKETS - 1; limit *= 10) {
+        bucket++;
+        if (ns < limit * 10)
+            break;
+    }
+    __atomic_add_fetch(&lock_waits[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t __now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* @param type - F_RDLCK, F_WRLCK or F_UNLCK */
+static void __lock_sidecar(int fd, short type)
+{
+    if (xattrs_config.single_writer)
+        return;
+
+#ifdef F_OFD_SETLKW
+    struct flock lock = { .l_type = type, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+    if (fcntl(fd, F_OFD_SETLK, &lock) == 0) {
+        if (type != F_UNLCK)
+            __count_lock_wait(0);
+        return;
+    }
+    if (errno != EAGAIN && errno != EACCES && errno != EINTR)
+        return;
+
+    const uint64_t begin = __now();
+    while (fcntl(fd, F_OFD_SETLKW, &lock) != 0 && errno == EINTR)
+        ;
+    __count_lock_wait(__now() - begin);
+#else
+    const int operation = type == F_RDLCK ? LOCK_SH : type == F_WRLCK ? LOCK_EX : LOCK_UN;
+    if (flock(fd, operation | (type != F_UNLCK ? LOCK_NB : 0)) == 0) {
+        if (type != F_UNLCK)
+            __count_lock_wait(0);
+        return;
+    }
+
+    const uint64_t begin = __now();
+    while (flock(fd, operation) != 0 && errno == EINTR)
+        ;
+    __count_lock_wait(__now() - begin);
 #endif
 }
 
-void __free_on_memory_attr(struct on_memory_attr *attr)
+void binary_storage_lock_file(int fd, short type)
+{
+    __lock_sidecar(fd, type);
+}
+
+void binary_storage_lock_stats(FILE *out)
 {
-    if(attr->name != NULL)
-        free(attr->name);
+    static const char *names[LOCK_WAIT_BUCKETS] = {
+            "0", "10us", "100us", "1ms", "10ms", "100ms", "1s", "inf"
+    };
+    for (size_t i = 0; i < LOCK_WAIT_BUCKETS; i++)
+        fprintf(out, "lock_wait_%s=%llu\n", names[i],
+                (unsigned long long) __atomic_load_n(&lock_waits[i], __ATOMIC_RELAXED));
+}
 
-    if(attr->value != NULL)
-        free(attr->value);
+static void __sidecar_state(const struct stat *st, struct sidecar_state *state)
+{
+    state->ino = (uint64_t) st->st_ino;
+    state->size = (int64_t) st->st_size;
+    state->mtime_sec = (int64_t) st->st_mtim.tv_sec;
+    state->mtime_nsec = (int64_t) st->st_mtim.tv_nsec;
+    state->ctime_sec = (int64_t) st->st_ctim.tv_sec;
+    state->ctime_nsec = (int64_t) st->st_ctim.tv_nsec;
+}
 
-    free(attr);
+static void __sidecar_state_absent(struct sidecar_state *state)
+{
+    memset(state, 0, sizeof(struct sidecar_state));
+    state->size = -1;
 }
 
-char *__read_file(const char *path, int *buffer_size)
+/**
+ * @param shared - the contents may outlive the request (they get cached),
+ *                 otherwise they are allocated from the request arena.
+ * @param state - set to the state of the sidecar read
+ */
+struct sidecar_data *__read_file(const char *path, int *buffer_size, int shared, struct sidecar_state *state)
 {
-    FILE *file = fopen(path, "r");
-    char *buffer = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct sidecar_data *data = NULL;
 
-    if (file == NULL) {
+    if (fd == -1) {
         debug_print("file not found: %s\n", path);
+        __sidecar_state_absent(state);
         *buffer_size = -ENOENT;
         return NULL;
     }
 
     debug_print("file found, reading it: %s\n", path);
+    __lock_sidecar(fd, F_RDLCK);
 
-    fseek(file, 0, SEEK_END);
-    *buffer_size = (int)ftell(file);
-
-    if (*buffer_size == -1) {
-        error_print("error: path: %s, size: %d, errno=%d\n", path, *buffer_size, errno);
-        *buffer_size = errno;
-        fclose(file);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        error_print("error: path: %s, errno=%d\n", path, errno);
+        *buffer_size = -errno;
+        close(fd);
         return NULL;
     }
+    __sidecar_state(&st, state);
 
-    if (*buffer_size > MAX_METADATA_SIZE) {
-        error_print("metadata file too big. path: %s, size: %d\n", path, *buffer_size);
+    if (st.st_size > MAX_METADATA_SIZE) {
+        error_print("metadata file too big. path: %s, size: %lld\n", path, (long long) st.st_size);
         *buffer_size = -ENOSPC;
-        fclose(file);
+        close(fd);
         return NULL;
     }
 
-    if (*buffer_size == 0) {
+    if (st.st_size == 0) {
         debug_print("empty file.\n");
         *buffer_size = -ENOENT;
-        fclose(file);
+        close(fd);
         return NULL;
     }
-    assert(*buffer_size > 0);
-    size_t _buffer_size = (size_t) *buffer_size;
+    *buffer_size = (int) st.st_size;
+    size_t _buffer_size = (size_t) st.st_size;
 
-    fseek(file, 0, SEEK_SET);
-    buffer = malloc(_buffer_size);
-    if (buffer == NULL) {
+    data = shared ? sidecar_data_new(_buffer_size) : sidecar_data_new_arena(_buffer_size);
+    if (data == NULL) {
         *buffer_size = -ENOMEM;
         error_print("cannot allocate memory.\n");
-        fclose(file);
+        close(fd);
+        return NULL;
+    }
+
+    int res = __pread_all(fd, data->buffer, _buffer_size);
+    close(fd);
+    if (res != 0) {
+        error_print("cannot read %s errno=%d\n", path, -res);
+        sidecar_data_release(data);
+        *buffer_size = res;
+        return NULL;
+    }
+
+    return data;
+}
+
+static int __same_file_state(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/*
+ * Same contract as __read_file_sidecar() for a file with open handles:
+ * the sidecar stays open and its contents are reused until fstat() says
+ * somebody else rewrote it.
+ */
+static struct sidecar_data *__read_open_sidecar(struct open_sidecar *open_sidecar, const char *path, int *buffer_size)
+{
+    if (open_sidecar->fd == -1) {
+        char *sidecar_path = arena_get_sidecar_path(path);
+        if (sidecar_path == NULL) {
+            *buffer_size = -ENOMEM;
+            return NULL;
+        }
+        int writable = 1;
+        int fd = open(sidecar_path, O_RDWR | O_CLOEXEC);
+        if (fd == -1 && (errno == EACCES || errno == EROFS)) {
+            writable = 0;
+            fd = open(sidecar_path, O_RDONLY | O_CLOEXEC);
+        }
+
+        if (fd == -1) {
+            *buffer_size = -errno;
+            return NULL;
+        }
+        open_sidecars_keep_fd(open_sidecar, fd, writable);
+    }
+
+    __lock_sidecar(open_sidecar->fd, F_RDLCK);
+    struct stat st;
+    if (fstat(open_sidecar->fd, &st) != 0) {
+        *buffer_size = -errno;
+        open_sidecars_forget(open_sidecar);
+        return NULL;
+    }
+
+    if (open_sidecar->data != NULL && !__same_file_state(&st, &open_sidecar->st)) {
+        debug_print("sidecar changed behind our back: %s\n", path);
+        sidecar_data_release(open_sidecar->data);
+        open_sidecar->data = NULL;
+    }
+
+    int res = 0;
+    if (open_sidecar->data == NULL) {
+        struct sidecar_data *data = NULL;
+        if (st.st_size > MAX_METADATA_SIZE) {
+            error_print("metadata file too big. path: %s, size: %lld\n", path, (long long) st.st_size);
+            res = -ENOSPC;
+        } else if ((data = sidecar_data_new((size_t) st.st_size)) == NULL) {
+            res = -ENOMEM;
+        } else if ((res = __pread_all(open_sidecar->fd, data->buffer, data->size)) != 0) {
+            sidecar_data_release(data);
+        } else {
+            open_sidecar->data = data;
+            open_sidecar->st = st;
+        }
+    }
+    __lock_sidecar(open_sidecar->fd, F_UNLCK);
+
+    if (res != 0) {
+        *buffer_size = res;
         return NULL;
     }
 
-    memset(buffer, '\0', _buffer_size);
-    fread(buffer, 1, _buffer_size, file);
-    fclose(file);
+    if (open_sidecar->data->size == 0) {
+        *buffer_size = -ENOENT;
+        return NULL;
+    }
+    *buffer_size = (int) open_sidecar->data->size;
+    return sidecar_data_ref(open_sidecar->data);
+}
 
-    return buffer;
+/*
+ * Replace the sidecar of an open file through its resident fd and keep
+ * the new contents.
+ * @param created - set if the sidecar had to be created.
+ */
+static int __write_open_sidecar(struct open_sidecar *open_sidecar, const char *sidecar_path,
+                                const char *buffer, size_t size, int *created)
+{
+    if (open_sidecar->fd == -1 || !open_sidecar->writable) {
+        open_sidecars_forget(open_sidecar);
+        int fd = open(sidecar_path, O_RDWR | O_CLOEXEC);
+        if (fd == -1 && errno == ENOENT) {
+            fd = open(sidecar_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            *created = fd != -1;
+        }
+        if (fd == -1) {
+            int res = -errno;
+            error_print("cannot open sidecar %s errno=%d\n", sidecar_path, errno);
+            return res;
+        }
+        open_sidecars_keep_fd(open_sidecar, fd, 1);
+    }
+
+    __lock_sidecar(open_sidecar->fd, F_WRLCK);
+    int res = __pwrite_all(open_sidecar->fd, buffer, size);
+    if (res == 0 && ftruncate(open_sidecar->fd, (off_t) size) != 0)
+        res = -errno;
+    if (res == 0 && fstat(open_sidecar->fd, &open_sidecar->st) != 0)
+        res = -errno;
+    __lock_sidecar(open_sidecar->fd, F_UNLCK);
+
+    sidecar_data_release(open_sidecar->data);
+    open_sidecar->data = res == 0 ? sidecar_data_new(size) : NULL;
+    if (open_sidecar->data != NULL)
+        memcpy(open_sidecar->data->buffer, buffer, size);
+
+    if (res != 0) {
+        error_print("cannot write sidecar %s errno=%d\n", sidecar_path, -res);
+        open_sidecars_forget(open_sidecar);
+    }
+    return res;
 }
 
-char *__read_file_sidecar(const char *path, int *buffer_size)
+/*
+ * An entry loaded from the cache snapshot is good as long as its sidecar
+ * is still in the state it was saved in: a stat instead of a read.
+ */
+static struct sidecar_data *__read_unverified(const char *path, const char *sidecar_path)
 {
-    char *sidecar_path = get_sidecar_path(path);
+    struct sidecar_state saved;
+    struct sidecar_data *data = sidecar_cache_lookup_unverified(path, &saved);
+    if (data == NULL)
+        return NULL;
+
+    struct sidecar_state current;
+    struct stat st;
+    int valid = 1;
+    if (stat(sidecar_path, &st) == 0)
+        __sidecar_state(&st, &current);
+    else if (errno == ENOENT)
+        __sidecar_state_absent(&current);
+    else
+        valid = 0;
+
+    valid = valid && current.ino == saved.ino && current.size == saved.size &&
+            current.mtime_sec == saved.mtime_sec && current.mtime_nsec == saved.mtime_nsec &&
+            current.ctime_sec == saved.ctime_sec && current.ctime_nsec == saved.ctime_nsec;
+    sidecar_cache_verified(path, valid);
+    if (!valid) {
+        debug_print("snapshot entry out of date: path=%s\n", path);
+        sidecar_data_release(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * Load the sidecar of path, going through the sidecar cache when enabled.
+ * Must be called with the sidecar lock of path held.
+ * @return contents to release with sidecar_data_release(), or NULL and
+ *         -errno in buffer_size (-ENOENT when there are no attributes).
+ */
+struct sidecar_data *__read_file_sidecar(const char *path, int *buffer_size)
+{
+    if (dir_store_enabled())
+        return dir_store_load(path, buffer_size);
+
+    struct open_sidecar *open_sidecar = open_sidecars_get(path);
+    if (open_sidecar != NULL && open_sidecar->fd != -1)
+        return __read_open_sidecar(open_sidecar, path, buffer_size);
+
+    struct sidecar_data *data = sidecar_cache_lookup(path);
+    if (data != NULL) {
+        debug_print("cache hit: path=%s size=%zu\n", path, data->size);
+        if (data->size == 0) {
+            sidecar_data_release(data);
+            *buffer_size = -ENOENT;
+            return NULL;
+        }
+        *buffer_size = (int) data->size;
+        return data;
+    }
+
+    const uint64_t epoch = sidecar_cache_epoch(path);
+    if (open_sidecar != NULL && open_sidecars_fd_available()) {
+        data = __read_open_sidecar(open_sidecar, path, buffer_size);
+        // no sidecar yet: not opened again until the cache forgets it
+        if (data == NULL && *buffer_size == -ENOENT && open_sidecar->fd == -1)
+            sidecar_cache_insert(path, NULL, epoch);
+        return data;
+    }
+
+    char *sidecar_path = arena_get_sidecar_path(path);
+    if (sidecar_path == NULL) {
+        *buffer_size = -ENOMEM;
+        return NULL;
+    }
     debug_print("path=%s sidecar_path=%s\n", path, sidecar_path);
 
-    char *buffer = __read_file(sidecar_path, buffer_size);
-    free (sidecar_path);
-    return buffer;
+    data = __read_unverified(path, sidecar_path);
+    if (data != NULL) {
+        debug_print("snapshot hit: path=%s size=%zu\n", path, data->size);
+        if (data->size == 0) {
+            sidecar_data_release(data);
+            *buffer_size = -ENOENT;
+            return NULL;
+        }
+        *buffer_size = (int) data->size;
+        return data;
+    }
+
+    struct sidecar_state state;
+    data = __read_file(sidecar_path, buffer_size, sidecar_cache_enabled(), &state);
+
+    if (data != NULL || *buffer_size == -ENOENT)
+        sidecar_cache_insert_state(path, data, epoch, &state);
+
+    return data;
 }
 
 int __cmp_name(const char *name, size_t name_length, struct on_memory_attr *attr)
@@ -142,7 +519,9 @@ int __cmp_name(const char *name, size_t name_length, struct on_memory_attr *attr
 struct on_memory_attr *__read_on_memory_attr(size_t *offset, char *buffer, size_t buffer_size)
 {
     debug_print("offset=%zu\n", *offset);
-    struct on_memory_attr *attr = malloc(sizeof(struct on_memory_attr));
+    struct on_memory_attr *attr = arena_alloc(sizeof(struct on_memory_attr));
+    if (attr == NULL)
+        return NULL;
     attr->name = NULL;
     attr->value = NULL;
 
@@ -151,7 +530,6 @@ struct on_memory_attr *__read_on_memory_attr(size_t *offset, char *buffer, size_
     size_t data_size = sizeof(u_int16_t);
     if (*offset + data_size > buffer_size) {
         error_print("Error, sizes doesn't match.\n");
-        __free_on_memory_attr(attr);
         return NULL;
     }
     memcpy(&attr->name_size, buffer + *offset, data_size);
@@ -163,11 +541,9 @@ struct on_memory_attr *__read_on_memory_attr(size_t *offset, char *buffer, size_
     data_size = attr->name_size;
     if (*offset + data_size > buffer_size) {
         error_print("Error, sizes doesn't match.\n");
-        __free_on_memory_attr(attr);
         return NULL;
     }
-    attr->name = malloc(data_size);
-    memcpy(attr->name, buffer + *offset, data_size);
+    attr->name = buffer + *offset;
     *offset += data_size;
 
     ////////////////////////////////
@@ -175,7 +551,6 @@ struct on_memory_attr *__read_on_memory_attr(size_t *offset, char *buffer, size_
     data_size = sizeof(size_t);
     if (*offset + data_size > buffer_size) {
         error_print("Error, sizes doesn't match.\n");
-        __free_on_memory_attr(attr);
         return NULL;
     }
     memcpy(&attr->value_size, buffer + *offset, data_size);
@@ -184,46 +559,287 @@ struct on_memory_attr *__read_on_memory_attr(size_t *offset, char *buffer, size_
 
     ////////////////////////////////
     // Read value data
-    data_size = attr->value_size;
+    data_size = __stored_size(attr->value_size);
     if (*offset + data_size > buffer_size) {
         error_print("Error, sizes doesn't match. data_size=%zu buffer_size=%zu\n",
             data_size, buffer_size);
 
-        __free_on_memory_attr(attr);
         return NULL;
     }
-    attr->value = malloc(data_size);
-    memcpy(attr->value, buffer + *offset, data_size);
+    attr->value = buffer + *offset;
     *offset += data_size;
 
     return attr;
 }
 
-int __write_to_file(FILE *file, const char *name, const char *value, const size_t value_size)
+/*
+ * A rewritten sidecar, built in the request arena and then written to the
+ * sidecar file, through its fd when the file is open, or to the directory
+ * store.
+ */
+struct sidecar_output {
+    char *buffer;
+    size_t size;
+    size_t capacity;
+    struct open_sidecar *open_sidecar;
+    int fd;                     // sidecar locked since it was read, -1: none
+    struct dir_store_update *update;    // or its directory store
+};
+
+static void __rewrite_end(struct sidecar_output *out)
+{
+    if (out->fd != -1) {
+        close(out->fd);
+        out->fd = -1;
+    }
+    if (out->update != NULL) {
+        dir_store_update_end(out->update, NULL, 0, 0);
+        out->update = NULL;
+    }
+}
+
+/**
+ * Start a read-modify-write of the sidecar of path: lock it exclusively
+ * and read it, bypassing the caches as other processes may have changed
+ * it. With a directory store, the whole store is locked instead (see
+ * dir_store_update_begin()). The lock is held until __output_close() or
+ * __rewrite_end(). Same contract as __read_file_sidecar() otherwise.
+ * @param create - create the sidecar if there is none, to lock it.
+ */
+static struct sidecar_data *__rewrite_begin(struct sidecar_output *out, const char *path, int create,
+                                            int *buffer_size)
+{
+    out->fd = -1;
+    out->update = NULL;
+    if (dir_store_enabled()) {
+        struct sidecar_data *data;
+        out->update = dir_store_update_begin(path, &data, buffer_size);
+        return data;
+    }
+    if (xattrs_config.single_writer)
+        return __read_file_sidecar(path, buffer_size);
+
+    char *sidecar_path = arena_get_sidecar_path(path);
+    if (sidecar_path == NULL) {
+        *buffer_size = -ENOMEM;
+        return NULL;
+    }
+
+    struct stat st;
+    for (;;) {
+        int fd = open(sidecar_path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0666);
+        if (fd == -1) {
+            *buffer_size = -errno;
+            if (errno != ENOENT)
+                error_print("cannot open sidecar %s errno=%d\n", sidecar_path, errno);
+            return NULL;
+        }
+
+        __lock_sidecar(fd, F_WRLCK);
+        if (fstat(fd, &st) != 0) {
+            *buffer_size = -errno;
+            close(fd);
+            return NULL;
+        }
+        out->fd = fd;
+        // compacted while we waited: lock the sidecar that replaces it
+        if (st.st_nlink > 0)
+            break;
+        __rewrite_end(out);
+    }
+
+    if (st.st_size > MAX_METADATA_SIZE) {
+        error_print("metadata file too big. path: %s, size: %lld\n", path, (long long) st.st_size);
+        *buffer_size = -ENOSPC;
+        return NULL;
+    }
+    if (st.st_size == 0) {
+        *buffer_size = -ENOENT;
+        return NULL;
+    }
+
+    // an open file's contents are still good if nobody rewrote the sidecar
+    struct open_sidecar *open_sidecar = open_sidecars_get(path);
+    if (open_sidecar != NULL && open_sidecar->data != NULL && __same_file_state(&st, &open_sidecar->st)) {
+        *buffer_size = (int) open_sidecar->data->size;
+        return sidecar_data_ref(open_sidecar->data);
+    }
+
+    struct sidecar_data *data = sidecar_data_new_arena((size_t) st.st_size);
+    if (data == NULL) {
+        *buffer_size = -ENOMEM;
+        return NULL;
+    }
+    int res = __pread_all(out->fd, data->buffer, data->size);
+    if (res != 0) {
+        sidecar_data_release(data);
+        *buffer_size = res;
+        return NULL;
+    }
+    *buffer_size = (int) data->size;
+    return data;
+}
+
+/*
+ * Write the rewritten sidecar through the fd locked by __rewrite_begin().
+ * An open file keeps that fd and the new contents.
+ */
+static int __write_locked_sidecar(struct sidecar_output *out, const char *sidecar_path)
+{
+    int res = __pwrite_all(out->fd, out->buffer, out->size);
+    if (res == 0 && ftruncate(out->fd, (off_t) out->size) != 0)
+        res = -errno;
+    if (res != 0) {
+        error_print("cannot write sidecar %s errno=%d\n", sidecar_path, -res);
+        if (out->open_sidecar != NULL)
+            open_sidecars_forget(out->open_sidecar);
+        return res;
+    }
+
+    struct open_sidecar *open_sidecar = out->open_sidecar;
+    if (open_sidecar != NULL) {
+        struct stat st;
+        struct sidecar_data *data = fstat(out->fd, &st) == 0 ? sidecar_data_new(out->size) : NULL;
+        open_sidecars_forget(open_sidecar);
+        if (data != NULL && !open_sidecars_fd_available()) {
+            sidecar_data_release(data);
+            data = NULL;
+        }
+        if (data != NULL) {
+            memcpy(data->buffer, out->buffer, out->size);
+            __lock_sidecar(out->fd, F_UNLCK);
+            open_sidecars_keep_fd(open_sidecar, out->fd, 1);
+            open_sidecar->st = st;
+            open_sidecar->data = data;
+            out->fd = -1;
+        }
+    }
+    return 0;
+}
+
+/* @param capacity - expected size, the buffer grows past it if needed. */
+static int __output_open(struct sidecar_output *out, const char *path, size_t capacity)
+{
+    out->size = 0;
+    out->capacity = capacity > 0 ? capacity : 1;
+    out->open_sidecar = dir_store_enabled() ? NULL : open_sidecars_get(path);
+    out->buffer = arena_alloc(out->capacity);
+
+    if (out->buffer == NULL) {
+        error_print("cannot allocate the sidecar of %s\n", path);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static int __output_write(struct sidecar_output *out, const void *data, size_t size)
+{
+    if (out->size + size > out->capacity) {
+        size_t capacity = out->capacity * 2 > out->size + size ? out->capacity * 2 : out->size + size;
+        char *buffer = arena_alloc(capacity);
+        if (buffer == NULL)
+            return -1;
+        memcpy(buffer, out->buffer, out->size);
+        out->buffer = buffer;
+        out->capacity = capacity;
+    }
+
+    memcpy(out->buffer + out->size, data, size);
+    out->size += size;
+    return 0;
+}
+
+static int __write_sidecar_file(const char *sidecar_path, const char *buffer, size_t size)
+{
+    // truncated once locked, not by open()
+    int fd = open(sidecar_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        int res = -errno;
+        error_print("cannot open sidecar %s errno=%d\n", sidecar_path, errno);
+        return res;
+    }
+
+    __lock_sidecar(fd, F_WRLCK);
+    int res = __pwrite_all(fd, buffer, size);
+    if (res == 0 && ftruncate(fd, (off_t) size) != 0)
+        res = -errno;
+    if (close(fd) != 0 && res == 0)
+        res = -errno;
+    if (res != 0)
+        error_print("cannot write sidecar %s errno=%d\n", sidecar_path, -res);
+    return res;
+}
+
+/**
+ * Finish writing the sidecar of path.
+ * @param created - path had no sidecar before.
+ */
+static int __output_close(struct sidecar_output *out, const char *path, int created)
+{
+    int res;
+
+    if (out->update != NULL) {
+        res = dir_store_update_end(out->update, out->buffer, out->size, 1);
+        out->update = NULL;
+    } else if (dir_store_enabled()) {
+        res = dir_store_put(path, out->buffer, out->size);
+    } else {
+        char *sidecar_path = arena_get_sidecar_path(path);
+        if (sidecar_path == NULL)
+            res = -ENOMEM;
+        else if (out->fd != -1)
+            res = __write_locked_sidecar(out, sidecar_path);
+        else if (out->open_sidecar != NULL && (out->open_sidecar->fd != -1 || open_sidecars_fd_available()))
+            res = __write_open_sidecar(out->open_sidecar, sidecar_path, out->buffer, out->size, &created);
+        else
+            res = __write_sidecar_file(sidecar_path, out->buffer, out->size);
+
+        if (sidecar_path != NULL) {
+            own_changes_record(sidecar_path);
+            sync_mark_dirty(sidecar_path);
+            if (created)
+                sync_mark_parent_dirty(sidecar_path);
+        }
+    }
+
+    __rewrite_end(out);
+    sidecar_cache_invalidate(path);
+    return res;
+}
+
+/* Bytes a record takes in a sidecar. */
+static size_t __record_size(const char *name, size_t value_size)
+{
+    return sizeof(u_int16_t) + strlen(name) + 1 + sizeof(size_t) + __stored_size(value_size);
+}
+
+int __write_to_file(struct sidecar_output *out, const char *name, const char *value, const size_t value_size)
 {
     const u_int16_t name_size = (int) strlen(name) + 1;
+    const size_t data_size = __stored_size(value_size);
 
-#ifdef DEBUG
-    char *sanitized_value = sanitize_value(value, value_size);
-    debug_print("name='%s' name_size=%zu sanitized_value='%s' value_size=%zu\n", name, name_size, sanitized_value, value_size);
-    free(sanitized_value);
-#endif
+    if (DEBUG) {
+        struct arena_mark mark = arena_mark();
+        char *sanitized_value = arena_sanitize_value(value, data_size);
+        debug_print("name='%s' name_size=%zu sanitized_value='%s' value_size=%zu\n", name, name_size, sanitized_value, value_size);
+        arena_rewind(mark);
+    }
 
     // write name
-    if (fwrite(&name_size, sizeof(u_int16_t), 1, file) != 1) {
+    if (__output_write(out, &name_size, sizeof(u_int16_t)) != 0) {
         return -1;
     }
-    if (fwrite(name, name_size, 1, file) != 1) {
+    if (__output_write(out, name, name_size) != 0) {
         return -1;
     }
 
     // write value
-    if (fwrite(&value_size, sizeof(size_t), 1, file) != 1) {
+    if (__output_write(out, &value_size, sizeof(size_t)) != 0) {
         return -1;
     }
     // write value content only if we have something to write.
-    if (value_size > 0) {
-        if (fwrite(value, value_size, 1, file) != 1) {
+    if (data_size > 0) {
+        if (__output_write(out, value, data_size) != 0) {
             return -1;
         }
     }
@@ -231,6 +847,76 @@ int __write_to_file(FILE *file, const char *name, const char *value, const size_
     return 0;
 }
 
+/* Write a new value, as a reference to the blob store when it is worth it. */
+static int __write_value(struct sidecar_output *out, const char *name, const char *value, size_t size)
+{
+    char ref[BLOB_REF_SIZE];
+    if (blob_store_wants(size) && blob_store_put(value, size, ref) == 0)
+        return __write_to_file(out, name, ref, BLOB_REF_SIZE | BLOB_REF_FLAG);
+
+    return __write_to_file(out, name, value, size);
+}
+
+/*
+ * Generation counter of a sidecar (-o generation), in a record of its
+ * own. Its name is outside the user namespace: no attribute clashes with
+ * it, and it is neither listed nor iterated.
+ */
+#define GENERATION_RECORD "fuse_xattrs.generation"
+
+static int __is_generation(const struct on_memory_attr *attr)
+{
+    return attr->name_size == sizeof(GENERATION_RECORD) &&
+           memcmp(attr->name, GENERATION_RECORD, sizeof(GENERATION_RECORD)) == 0;
+}
+
+static uint64_t __generation_value(const struct on_memory_attr *attr)
+{
+    uint64_t generation = 0;
+    if (attr->value_size == sizeof(uint64_t))
+        memcpy(&generation, attr->value, sizeof(uint64_t));
+    return generation;
+}
+
+/*
+ * Generation of a sidecar written before counters were kept: derived from
+ * its contents (FNV-1a), never 0, so that it differs both from a file
+ * without attributes and from the same sidecar once another writer
+ * changed it.
+ */
+static uint64_t __legacy_generation(const char *buffer, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char) buffer[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * Append the generation record to a rewritten sidecar, once a counter is
+ * kept for it. It starts from the clock, so that a sidecar dropped and
+ * created again doesn't repeat values.
+ * @param old - generation of the sidecar read, 0: none
+ * @param changed - the rewrite changed an attribute: bump it
+ */
+static int __write_generation(struct sidecar_output *out, uint64_t old, int changed)
+{
+    // a sidecar without attributes is dropped, not kept for its counter
+    if (out->size == 0 || (old == 0 && !xattrs_config.generation))
+        return 0;
+
+    uint64_t generation = old;
+    if (changed) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        const uint64_t now = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+        generation = now > old ? now : old + 1;
+    }
+    return __write_to_file(out, GENERATION_RECORD, (const char *) &generation, sizeof(uint64_t));
+}
+
 /**
  *
  * @param path - path to file.
@@ -240,38 +926,49 @@ int __write_to_file(FILE *file, const char *name, const char *value, const size_
  * @param flags - XATTR_CREATE and/or XATTR_REPLACE
  * @return On success, zero is returned.  On failure, -errno is returnted.
  */
-int binary_storage_write_key(const char *path, const char *name, const char *value, size_t size, int flags)
+static int __binary_storage_write_key(const char *path, const char *name, const char *value, size_t size, int flags)
 {
-#ifdef DEBUG
-    char *sanitized_value = sanitize_value(value, size);
-    debug_print("path=%s name=%s sanitized_value=%s size=%zu flags=%d\n", path, name, sanitized_value, size, flags);
-    free(sanitized_value);
-#endif
+    if (DEBUG) {
+        struct arena_mark mark = arena_mark();
+        char *sanitized_value = arena_sanitize_value(value, size);
+        debug_print("path=%s name=%s sanitized_value=%s size=%zu flags=%d\n", path, name, sanitized_value, size, flags);
+        arena_rewind(mark);
+    }
 
     int buffer_size;
-    char *buffer = __read_file_sidecar(path, &buffer_size);
+    struct sidecar_output out;
+    struct sidecar_data *data = __rewrite_begin(&out, path, !(flags & XATTR_REPLACE), &buffer_size);
+    char *buffer = data != NULL ? data->buffer : NULL;
 
     if (buffer == NULL && buffer_size == -ENOENT && flags & XATTR_REPLACE) {
         error_print("No xattr. (flag XATTR_REPLACE)");
+        __rewrite_end(&out);
         return -ENODATA;
     }
 
     if (buffer == NULL && buffer_size != -ENOENT) {
+        __rewrite_end(&out);
         return buffer_size;
     }
 
     int status;
-    char *sidecar_path = get_sidecar_path(path);
-    FILE *file = fopen(sidecar_path, "w");
-    free(sidecar_path);
+    status = __output_open(&out, path, (data != NULL ? data->size : 0) + __record_size(name, size));
+    if (status != 0) {
+        sidecar_data_release(data);
+        __rewrite_end(&out);
+        return status;
+    }
 
     if (buffer == NULL) {
         debug_print("new file, writing directly...\n");
-        status = __write_to_file(file, name, value, size);
+        status = __write_value(&out, name, value, size);
         assert(status == 0);
-        fclose(file);
-        free(buffer);
-        return 0;
+        sidecar_data_release(data);
+        if (__write_generation(&out, 0, 1) != 0) {
+            __rewrite_end(&out);
+            return -EIO;
+        }
+        return __output_close(&out, path, 1);
     }
     assert(buffer_size >= 0);
     size_t _buffer_size = (size_t)buffer_size;
@@ -280,6 +977,7 @@ int binary_storage_write_key(const char *path, const char *name, const char *val
     size_t offset = 0;
     size_t name_len = strlen(name) + 1; // null byte
     int replaced = 0;
+    uint64_t generation = 0;
     while(offset < _buffer_size)
     {
         debug_print("replaced=%d offset=%zu buffer_size=%zu\n", replaced, offset, _buffer_size);
@@ -288,23 +986,24 @@ int binary_storage_write_key(const char *path, const char *name, const char *val
         // FIXME: handle attr == NULL
         assert(attr != NULL);
 
-        if (memcmp(attr->name, name, name_len) == 0) {
+        if (__is_generation(attr)) {
+            generation = __generation_value(attr);
+        } else if (__cmp_name(name, name_len, attr) == 1) {
             assert(replaced == 0);
             if (flags & XATTR_CREATE) {
                 error_print("Key already exists. (flag XATTR_CREATE)");
-                status = __write_to_file(file, attr->name, attr->value, attr->value_size);
+                status = __write_to_file(&out, attr->name, attr->value, attr->value_size);
                 assert(status == 0);
                 res = -EEXIST;
             } else {
-                status = __write_to_file(file, name, value, size);
+                status = __write_value(&out, name, value, size);
                 assert(status == 0);
                 replaced = 1;
             }
         } else {
-            status = __write_to_file(file, attr->name, attr->value, attr->value_size);
+            status = __write_to_file(&out, attr->name, attr->value, attr->value_size);
             assert(status == 0);
         }
-        __free_on_memory_attr(attr);
     }
 
     if (replaced == 0 && res == 0) {
@@ -312,20 +1011,89 @@ int binary_storage_write_key(const char *path, const char *name, const char *val
             error_print("Key doesn't exists. (flag XATTR_REPLACE)");
             res = -ENODATA;
         } else {
-            status = __write_to_file(file, name, value, size);
+            status = __write_value(&out, name, value, size);
             assert(status == 0);
         }
     }
 
-    fclose(file);
-    free(buffer);
-    return res;
+    sidecar_data_release(data);
+    if (__write_generation(&out, generation, res == 0) != 0) {
+        __rewrite_end(&out);
+        return -EIO;
+    }
+    status = __output_close(&out, path, 0);
+    return res != 0 ? res : status;
 }
 
-int binary_storage_read_key(const char *path, const char *name, char *value, size_t size)
+static int __binary_storage_write_keys(const char *path, const struct binary_storage_attr *attrs, size_t count)
 {
+    debug_print("path=%s count=%zu\n", path, count);
+
     int buffer_size;
-    char *buffer = __read_file_sidecar(path, &buffer_size);
+    struct sidecar_output out;
+    struct sidecar_data *data = __rewrite_begin(&out, path, 1, &buffer_size);
+    if (data == NULL && buffer_size != -ENOENT) {
+        __rewrite_end(&out);
+        return buffer_size;
+    }
+
+    size_t capacity = data != NULL ? data->size : 0;
+    for (size_t i = 0; i < count; i++)
+        capacity += __record_size(attrs[i].name, attrs[i].size);
+
+    int status = __output_open(&out, path, capacity);
+    if (status != 0) {
+        sidecar_data_release(data);
+        __rewrite_end(&out);
+        return status;
+    }
+
+    int res = 0;
+    size_t offset = 0;
+    uint64_t generation = 0;
+    while (data != NULL && offset < data->size && res == 0)
+    {
+        struct on_memory_attr *attr = __read_on_memory_attr(&offset, data->buffer, data->size);
+        if (attr == NULL) {
+            res = -EILSEQ;
+            break;
+        }
+        if (__is_generation(attr)) {
+            generation = __generation_value(attr);
+            continue;
+        }
+
+        // keep the attribute unless it gets replaced
+        size_t i;
+        for (i = 0; i < count; i++) {
+            if (attr->name_size == strlen(attrs[i].name) + 1 &&
+                memcmp(attr->name, attrs[i].name, attr->name_size) == 0)
+                break;
+        }
+        if (i == count && __write_to_file(&out, attr->name, attr->value, attr->value_size) != 0)
+            res = -EIO;
+    }
+
+    for (size_t i = 0; i < count && res == 0; i++) {
+        if (__write_value(&out, attrs[i].name, attrs[i].value, attrs[i].size) != 0)
+            res = -EIO;
+    }
+    if (res == 0 && __write_generation(&out, generation, 1) != 0)
+        res = -EIO;
+
+    // a sidecar that doesn't parse is left alone
+    status = res == 0 ? __output_close(&out, path, data == NULL) : 0;
+    if (res != 0)
+        __rewrite_end(&out);
+    sidecar_data_release(data);
+    return res != 0 ? res : status;
+}
+
+static int __binary_storage_read_key(const char *path, const char *name, char *value, size_t size)
+{
+    int buffer_size;
+    struct sidecar_data *data = __read_file_sidecar(path, &buffer_size);
+    char *buffer = data != NULL ? data->buffer : NULL;
     
     if (buffer == NULL) {
         if (buffer_size == -ENOENT) {
@@ -340,43 +1108,44 @@ int binary_storage_read_key(const char *path, const char *name, char *value, siz
         memset(value, '\0', size);
     }
 
-    size_t name_len = strlen(name) + 1; // null byte \0
-    size_t offset = 0;
-    while(offset < _buffer_size)
-    {
-        struct on_memory_attr *attr = __read_on_memory_attr(&offset, buffer, _buffer_size);
-        if (attr == NULL) {
-            free(buffer);
-            return -EILSEQ;
-        }
+    // only the matching record is parsed, see record_scan.h
+    ssize_t found = record_scan_find(buffer, _buffer_size, name, strlen(name) + 1);
+    if (found < 0) {
+        sidecar_data_release(data);
+        return found == -ENOENT ? -ERR_NO_ATTR : (int) found;
+    }
 
-        if (__cmp_name(name, name_len, attr) == 1) {
-            int value_size = (int)attr->value_size;
-            int res;
-            if (size == 0) {
-                res = value_size;
-            } else if (attr->value_size <= size) {
-                memcpy(value, attr->value, attr->value_size);
-                res = value_size;
-            } else {
-                error_print("error, attr->value_size=%zu > size=%zu\n", attr->value_size, size);
-                res = -ERANGE;
-            }
-            free(buffer);
-            __free_on_memory_attr(attr);
-            return res;
-        }
-        __free_on_memory_attr(attr);
+    size_t offset = (size_t) found;
+    struct on_memory_attr *attr = __read_on_memory_attr(&offset, buffer, _buffer_size);
+    if (attr == NULL) {
+        sidecar_data_release(data);
+        return -ENOMEM;
     }
-    free(buffer);
+    __print_on_memory_attr(attr);
 
-    return -ERR_NO_ATTR;
+    int value_size = (int)attr->value_size;
+    int res;
+    if (attr->value_size & BLOB_REF_FLAG) {
+        res = __stored_size(attr->value_size) == BLOB_REF_SIZE ? blob_store_get(attr->value, value, size)
+                                                               : -EILSEQ;
+    } else if (size == 0) {
+        res = value_size;
+    } else if (attr->value_size <= size) {
+        memcpy(value, attr->value, attr->value_size);
+        res = value_size;
+    } else {
+        error_print("error, attr->value_size=%zu > size=%zu\n", attr->value_size, size);
+        res = -ERANGE;
+    }
+    sidecar_data_release(data);
+    return res;
 }
 
-int binary_storage_list_keys(const char *path, char *list, size_t size)
+static int __binary_storage_list_keys(const char *path, char *list, size_t size)
 {
     int buffer_size;
-    char *buffer = __read_file_sidecar(path, &buffer_size);
+    struct sidecar_data *data = __read_file_sidecar(path, &buffer_size);
+    char *buffer = data != NULL ? data->buffer : NULL;
 
     if (buffer == NULL) {
         debug_print("buffer == NULL buffer_size=%d\n", buffer_size);
@@ -399,16 +1168,17 @@ int binary_storage_list_keys(const char *path, char *list, size_t size)
     {
         struct on_memory_attr *attr = __read_on_memory_attr(&offset, buffer, _buffer_size);
         if (attr == NULL) {
-            free(buffer);
+            sidecar_data_release(data);
             return -EILSEQ;
         }
+        if (__is_generation(attr))
+            continue;
 
         if (size > 0) {
             if (attr->name_size + res > size) {
                 error_print("Not enough memory allocated. allocated=%zu required=%ld\n",
                             size, attr->name_size + res);
-                __free_on_memory_attr(attr);
-                free(buffer);
+                sidecar_data_release(data);
                 return -ERANGE;
             } else {
                 memcpy(list + res, attr->name, attr->name_size);
@@ -417,9 +1187,8 @@ int binary_storage_list_keys(const char *path, char *list, size_t size)
         } else {
             res += attr->name_size;
         }
-        __free_on_memory_attr(attr);
     }
-    free(buffer);
+    sidecar_data_release(data);
 
     if (size == 0 && res > XATTR_LIST_MAX) {
         // FIXME: we should return the size or an error ?
@@ -429,26 +1198,33 @@ int binary_storage_list_keys(const char *path, char *list, size_t size)
     return (int)res;
 }
 
-int binary_storage_remove_key(const char *path, const char *name)
+static int __binary_storage_remove_key(const char *path, const char *name)
 {
     debug_print("path=%s name=%s\n", path, name);
     int buffer_size;
-    char *buffer = __read_file_sidecar(path, &buffer_size);
+    struct sidecar_output out;
+    struct sidecar_data *data = __rewrite_begin(&out, path, 0, &buffer_size);
+    char *buffer = data != NULL ? data->buffer : NULL;
 
     if (buffer == NULL) {
+        __rewrite_end(&out);
         return buffer_size;
     }
     assert(buffer_size > 0);
     size_t _buffer_size = (size_t) buffer_size;
 
-    char *sidecar_path = get_sidecar_path(path);
-    FILE *file = fopen(sidecar_path, "w");
-    free(sidecar_path);
+    int status = __output_open(&out, path, _buffer_size);
+    if (status != 0) {
+        sidecar_data_release(data);
+        __rewrite_end(&out);
+        return status;
+    }
 
     size_t offset = 0;
     size_t name_len = strlen(name) + 1; // null byte \0
 
     int removed = 0;
+    uint64_t generation = 0;
     while(offset < _buffer_size)
     {
         debug_print("removed=%d offset=%zu buffer_size=%zu\n", removed, offset, _buffer_size);
@@ -459,13 +1235,14 @@ int binary_storage_remove_key(const char *path, const char *name)
             break;
         }
 
-        if (memcmp(attr->name, name, name_len) == 0) {
+        if (__is_generation(attr)) {
+            generation = __generation_value(attr);
+        } else if (__cmp_name(name, name_len, attr) == 1) {
             removed++;
         } else {
-            int status = __write_to_file(file, attr->name, attr->value, attr->value_size);
+            status = __write_to_file(&out, attr->name, attr->value, attr->value_size);
             assert(status == 0);
         }
-        __free_on_memory_attr(attr);
     }
 
     int res = 0;
@@ -479,7 +1256,327 @@ int binary_storage_remove_key(const char *path, const char *name)
         res = -EILSEQ;
     }
 
-    fclose(file);
-    free(buffer);
+    sidecar_data_release(data);
+    if (__write_generation(&out, generation, res == 0) != 0) {
+        __rewrite_end(&out);
+        return -EIO;
+    }
+    status = __output_close(&out, path, 0);
+    return res != 0 ? res : status;
+}
+
+pthread_mutex_t *binary_storage_lock(const char *path)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    return lock;
+}
+
+void binary_storage_unlock(pthread_mutex_t *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+int binary_storage_write_key_locked(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    struct arena_mark mark = arena_mark();
+    int res = __binary_storage_write_key(path, name, value, size, flags);
+    if (res == 0)
+        query_index_set(path, name, value, size);
+    arena_rewind(mark);
     return res;
-}
\ No newline at end of file
+}
+
+int binary_storage_write_key(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    pthread_mutex_t *lock = binary_storage_lock(path);
+    int res = binary_storage_write_key_locked(path, name, value, size, flags);
+    binary_storage_unlock(lock);
+    return res;
+}
+
+int binary_storage_write_keys(const char *path, const struct binary_storage_attr *attrs, size_t count)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    struct arena_mark mark = arena_mark();
+    int res = __binary_storage_write_keys(path, attrs, count);
+    if (res == 0) {
+        for (size_t i = 0; i < count; i++)
+            query_index_set(path, attrs[i].name, attrs[i].value, attrs[i].size);
+    }
+    arena_rewind(mark);
+    pthread_mutex_unlock(lock);
+    return res;
+}
+
+int binary_storage_read_key_locked(const char *path, const char *name, char *value, size_t size)
+{
+    struct arena_mark mark = arena_mark();
+    int res = __binary_storage_read_key(path, name, value, size);
+    arena_rewind(mark);
+    return res;
+}
+
+int binary_storage_read_key(const char *path, const char *name, char *value, size_t size)
+{
+    pthread_mutex_t *lock = binary_storage_lock(path);
+    int res = binary_storage_read_key_locked(path, name, value, size);
+    binary_storage_unlock(lock);
+    return res;
+}
+
+int binary_storage_list_keys(const char *path, char *list, size_t size)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    struct arena_mark mark = arena_mark();
+    int res = __binary_storage_list_keys(path, list, size);
+    arena_rewind(mark);
+    pthread_mutex_unlock(lock);
+    return res;
+}
+
+int binary_storage_remove_key_locked(const char *path, const char *name)
+{
+    struct arena_mark mark = arena_mark();
+    int res = __binary_storage_remove_key(path, name);
+    if (res == 0)
+        query_index_remove(path, name);
+    arena_rewind(mark);
+    return res;
+}
+
+int binary_storage_remove_key(const char *path, const char *name)
+{
+    pthread_mutex_t *lock = binary_storage_lock(path);
+    int res = binary_storage_remove_key_locked(path, name);
+    binary_storage_unlock(lock);
+    return res;
+}
+
+void binary_storage_prefetch(const char *path)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    struct arena_mark mark = arena_mark();
+    int buffer_size;
+    sidecar_data_release(__read_file_sidecar(path, &buffer_size));
+    arena_rewind(mark);
+    pthread_mutex_unlock(lock);
+}
+
+static int __foreach(const char *path, binary_storage_attr_fn fn, binary_storage_ref_fn ref_fn, void *data)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    struct arena_mark mark = arena_mark();
+
+    int buffer_size;
+    struct sidecar_data *sidecar = __read_file_sidecar(path, &buffer_size);
+    if (sidecar == NULL) {
+        arena_rewind(mark);
+        pthread_mutex_unlock(lock);
+        return buffer_size == -ENOENT ? 0 : buffer_size;
+    }
+
+    int res = 0;
+    size_t offset = 0;
+    while (offset < sidecar->size) {
+        struct on_memory_attr *attr = __read_on_memory_attr(&offset, sidecar->buffer, sidecar->size);
+        if (attr == NULL) {
+            res = -EILSEQ;
+            break;
+        }
+        if (__is_generation(attr))
+            continue;
+        if (attr->value_size & BLOB_REF_FLAG) {
+            if (ref_fn != NULL && __stored_size(attr->value_size) == BLOB_REF_SIZE)
+                ref_fn(attr->value, data);
+            if (fn != NULL) {
+                struct arena_mark value_mark = arena_mark();
+                int size = blob_store_get(attr->value, NULL, 0);
+                char *value = size >= 0 ? arena_alloc(size > 0 ? (size_t) size : 1) : NULL;
+                if (value != NULL)
+                    size = blob_store_get(attr->value, value, (size_t) size);
+                if (value != NULL && size >= 0)
+                    fn(attr->name, value, (size_t) size, data);
+                else
+                    res = value != NULL ? size : -ENOMEM;
+                arena_rewind(value_mark);
+            }
+        } else if (fn != NULL) {
+            fn(attr->name, attr->value, attr->value_size, data);
+        }
+    }
+
+    sidecar_data_release(sidecar);
+    arena_rewind(mark);
+    pthread_mutex_unlock(lock);
+    return res;
+}
+
+int binary_storage_foreach(const char *path, binary_storage_attr_fn fn, void *data)
+{
+    return __foreach(path, fn, NULL, data);
+}
+
+int binary_storage_foreach_ref(const char *path, binary_storage_ref_fn fn, void *data)
+{
+    return __foreach(path, NULL, fn, data);
+}
+
+/* @return On success, zero is returned. On failure, -errno is returned. */
+static int __read_generation(const char *path, uint64_t *generation)
+{
+    int buffer_size;
+    struct sidecar_data *data = __read_file_sidecar(path, &buffer_size);
+    *generation = 0;
+    if (data == NULL)
+        return buffer_size == -ENOENT ? 0 : buffer_size;
+
+    int res = 0;
+    ssize_t found = record_scan_find(data->buffer, data->size, GENERATION_RECORD, sizeof(GENERATION_RECORD));
+    if (found == -ENOENT) {
+        // attributes set before generations were kept: counted from their next change
+        *generation = __legacy_generation(data->buffer, data->size);
+    } else if (found < 0) {
+        res = (int) found;
+    } else {
+        size_t offset = (size_t) found;
+        struct on_memory_attr *attr = __read_on_memory_attr(&offset, data->buffer, data->size);
+        if (attr != NULL)
+            *generation = __generation_value(attr);
+        else
+            res = -ENOMEM;
+    }
+    sidecar_data_release(data);
+    return res;
+}
+
+int binary_storage_generation(const char *path, uint64_t *generation)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    struct arena_mark mark = arena_mark();
+
+    int res = __read_generation(path, generation);
+
+    arena_rewind(mark);
+    pthread_mutex_unlock(lock);
+    return res;
+}
+
+void binary_storage_open(const char *path)
+{
+    if (dir_store_enabled())
+        return;
+
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    if (open_sidecars_hold(path) != 0)
+        error_print("cannot keep the sidecar of %s open\n", path);
+    pthread_mutex_unlock(lock);
+}
+
+void binary_storage_release(const char *path)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    open_sidecars_release(path);
+    pthread_mutex_unlock(lock);
+}
+
+void binary_storage_forget(const char *path)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    struct open_sidecar *open_sidecar = open_sidecars_get(path);
+    if (open_sidecar != NULL)
+        open_sidecars_forget(open_sidecar);
+    pthread_mutex_unlock(lock);
+}
+
+int binary_storage_compact(const char *path)
+{
+    pthread_mutex_t *lock = __sidecar_lock(path);
+    pthread_mutex_lock(lock);
+    struct arena_mark mark = arena_mark();
+
+    struct stat st;
+    const int orphan = lstat(path, &st) != 0 && errno == ENOENT;
+    int res = 0;
+
+    if (dir_store_enabled()) {
+        // stores drop the entries left empty themselves
+        if (orphan && (res = dir_store_remove(path)) == 0)
+            res = 1;
+    } else if (open_sidecars_get(path) == NULL) {
+        char *sidecar_path = arena_get_sidecar_path(path);
+        // write locks need a writable fd, a read-only sidecar makes do with a shared one
+        short lock = F_WRLCK;
+        int fd = sidecar_path != NULL ? open(sidecar_path, O_RDWR | O_CLOEXEC) : -1;
+        if (fd == -1 && sidecar_path != NULL && (errno == EACCES || errno == EROFS)) {
+            lock = F_RDLCK;
+            fd = open(sidecar_path, O_RDONLY | O_CLOEXEC);
+        }
+        if (sidecar_path == NULL) {
+            res = -ENOMEM;
+        } else if (fd == -1) {
+            res = errno == ENOENT ? 0 : -errno;
+        } else {
+            // checked again once other processes are done with it
+            __lock_sidecar(fd, lock);
+            if (fstat(fd, &st) != 0)
+                res = -errno;
+            else if (!orphan && st.st_size > 0)
+                res = 0;
+            else if (unlink(sidecar_path) != 0)
+                res = -errno;
+            else
+                res = 1;
+            close(fd);
+            if (res == 1) {
+                own_changes_record(sidecar_path);
+                sync_mark_parent_dirty(sidecar_path);
+            }
+        }
+    }
+
+    if (res == 1) {
+        sidecar_cache_invalidate(path);
+        query_index_remove_path(path);
+    }
+    arena_rewind(mark);
+    pthread_mutex_unlock(lock);
+    return res;
+}
+
+void binary_storage_rename(const char *from, const char *to, int is_directory)
+{
+    // a directory moves paths of every stripe: take them all, in order
+    if (is_directory) {
+        for (int i = 0; i < SIDECAR_LOCK_STRIPES; i++)
+            pthread_mutex_lock(&sidecar_locks[i]);
+        open_sidecars_rename(from, to, is_directory);
+        for (int i = SIDECAR_LOCK_STRIPES - 1; i >= 0; i--)
+            pthread_mutex_unlock(&sidecar_locks[i]);
+        return;
+    }
+
+    pthread_mutex_t *first = __sidecar_lock(from);
+    pthread_mutex_t *second = __sidecar_lock(to);
+    if (first > second) {
+        pthread_mutex_t *tmp = first;
+        first = second;
+        second = tmp;
+    }
+
+    pthread_mutex_lock(first);
+    if (second != first)
+        pthread_mutex_lock(second);
+    open_sidecars_rename(from, to, is_directory);
+    if (second != first)
+        pthread_mutex_unlock(second);
+    pthread_mutex_unlock(first);
+}
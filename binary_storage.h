@@ -7,6 +7,8 @@
   See the file COPYING.
 */
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #ifndef FUSE_XATTRS_BINARY_STORAGE_STRUCT_H
 #define FUSE_XATTRS_BINARY_STORAGE_STRUCT_H
@@ -16,4 +18,93 @@ int binary_storage_read_key(const char *path, const char *name, char *value, siz
 int binary_storage_list_keys(const char *path, char *list, size_t size);
 int binary_storage_remove_key(const char *path, const char *name);
 
+/*
+ * The sidecar lock of path, held across several calls by storages built on
+ * this one (see native_storage.c). The _locked variants expect it held, the
+ * ones above take it themselves and must not be called meanwhile.
+ */
+pthread_mutex_t *binary_storage_lock(const char *path);
+void binary_storage_unlock(pthread_mutex_t *lock);
+int binary_storage_write_key_locked(const char *path, const char *name, const char *value, size_t size, int flags);
+int binary_storage_read_key_locked(const char *path, const char *name, char *value, size_t size);
+int binary_storage_remove_key_locked(const char *path, const char *name);
+
+struct binary_storage_attr {
+    const char *name;
+    const char *value;
+    size_t size;
+};
+
+/**
+ * Set several attributes of path rewriting its sidecar once. Attributes
+ * not in attrs are kept, the ones in attrs are created or replaced.
+ * @return On success, zero is returned.  On failure, -errno is returned.
+ */
+int binary_storage_write_keys(const char *path, const struct binary_storage_attr *attrs, size_t count);
+
+typedef void (*binary_storage_attr_fn)(const char *name, const char *value, size_t size, void *data);
+
+/**
+ * Call fn for every attribute of path. The sidecar stays locked meanwhile.
+ * @return On success, zero is returned.  On failure, -errno is returned.
+ */
+int binary_storage_foreach(const char *path, binary_storage_attr_fn fn, void *data);
+
+typedef void (*binary_storage_ref_fn)(const char *ref, void *data);
+
+/**
+ * Call fn with every blob store reference in the sidecar of path.
+ * @return On success, zero is returned.  On failure, -errno is returned.
+ */
+int binary_storage_foreach_ref(const char *path, binary_storage_ref_fn fn, void *data);
+
+/*
+ * Virtual attribute holding the generation of a file with -o generation:
+ * a counter bumped by every change of its attributes, through the mount
+ * or by another process sharing the sidecars. Read-only, never listed.
+ */
+#define GENERATION_XATTR_NAME "user.fuse_xattrs.generation"
+
+/**
+ * Read the generation of path, 0 if it has no attributes. Attributes that
+ * didn't change since generations are kept read a hash of their sidecar.
+ * Never writes the sidecar.
+ * @return On success, zero is returned.  On failure, -errno is returned.
+ */
+int binary_storage_generation(const char *path, uint64_t *generation);
+
+/* Load the sidecar of path into the sidecar cache. */
+void binary_storage_prefetch(const char *path);
+
+/*
+ * Open handles of path: while there is one, its sidecar stays open and
+ * its contents resident (see open_sidecars.h).
+ */
+void binary_storage_open(const char *path);
+void binary_storage_release(const char *path);
+
+/* The sidecar of path was removed or replaced: close it. */
+void binary_storage_forget(const char *path);
+
+/*
+ * Take (F_RDLCK, F_WRLCK) or drop (F_UNLCK) the cross-process lock of a
+ * sidecar-like file open as fd, counted in the lock stats. Nothing with
+ * -o single_writer.
+ */
+void binary_storage_lock_file(int fd, short type);
+
+/* Print the histogram of waits for sidecar locks, one name=count per line. */
+void binary_storage_lock_stats(FILE *out);
+
+/**
+ * Drop the sidecar of path if it holds no attribute anymore, or if path
+ * itself is gone (removed behind the mount). Sidecars of open files are
+ * kept.
+ * @return 1 if dropped, 0 if kept. On failure, -errno is returned.
+ */
+int binary_storage_compact(const char *path);
+
+/* path was renamed: its open handles follow it. */
+void binary_storage_rename(const char *from, const char *to, int is_directory);
+
 #endif //FUSE_XATTRS_BINARY_STORAGE_STRUCT_H
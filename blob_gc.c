@@ -0,0 +1,125 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For FTW_ACTIONRETVAL */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <ftw.h>
+
+#include "blob_gc.h"
+#include "blob_store.h"
+#include "binary_storage.h"
+#include "dir_store.h"
+#include "hash_table.h"
+#include "utils.h"
+#include "xattrs_config.h"
+
+/* nftw() callbacks take no user data */
+static struct hash_table *live = NULL;
+static uint64_t sidecars = 0;
+static uint64_t refs = 0;
+static uint64_t errors = 0;
+
+static void __mark(const char *ref, void *data)
+{
+    (void) data;
+    char hex[BLOB_KEY_HEX_SIZE];
+    blob_store_key_hex(ref, hex);
+
+    refs++;
+    if (hash_table_get(live, hex) == NULL && hash_table_put(live, hex, live) != 0)
+        errors++;
+}
+
+static void __mark_path(const char *path, void *data)
+{
+    (void) data;
+    sidecars++;
+
+    int res = binary_storage_foreach_ref(path, __mark, NULL);
+    if (res != 0) {
+        fprintf(stderr, "cannot read the attributes of %s: %s\n", path, strerror(-res));
+        errors++;
+    }
+}
+
+static int __mark_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void) sb;
+    const char *name = fpath + ftwbuf->base;
+
+    if (typeflag == FTW_D && ftwbuf->level == 1 && strcmp(name, BLOB_STORE_NAME) == 0)
+        return FTW_SKIP_SUBTREE;
+    if (typeflag != FTW_F)
+        return FTW_CONTINUE;
+
+    if (dir_store_enabled()) {
+        if (strcmp(name, DIR_STORE_NAME) == 0) {
+            int res = dir_store_foreach_entry(fpath, __mark_path, NULL);
+            if (res != 0) {
+                fprintf(stderr, "cannot read the directory store %s: %s\n", fpath, strerror(-res));
+                errors++;
+            }
+        }
+        return FTW_CONTINUE;
+    }
+
+    // the sidecar of the root is named after the extension alone
+    const int is_root_sidecar = ftwbuf->level == 1 && strcmp(name, BINARY_SIDECAR_EXT) == 0;
+    if ((!is_root_sidecar && filename_is_sidecar(name) != 1) || dir_store_is_store_name(name))
+        return FTW_CONTINUE;
+
+    char *path = strndup(fpath, strlen(fpath) - BINARY_SIDECAR_EXT_SIZE);
+    if (path == NULL) {
+        errors++;
+        return FTW_STOP;
+    }
+    __mark_path(path, NULL);
+    free(path);
+
+    return FTW_CONTINUE;
+}
+
+int blob_gc(void)
+{
+    live = hash_table_new();
+    if (live == NULL)
+        return -ENOMEM;
+
+    if (nftw(xattrs_config.source_dir, __mark_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0) {
+        fprintf(stderr, "cannot walk %s: %s\n", xattrs_config.source_dir, strerror(errno));
+        errors++;
+    }
+
+    fprintf(stderr, "gc: %" PRIu64 " sidecars, %" PRIu64 " references to %zu blobs\n",
+            sidecars, refs, hash_table_size(live));
+
+    int res = 0;
+    if (errors > 0) {
+        // a reference we missed would be deleted
+        fprintf(stderr, "gc: %" PRIu64 " errors, not deleting anything\n", errors);
+        res = -EIO;
+    } else {
+        int64_t removed = blob_store_sweep(live);
+        if (removed < 0) {
+            res = (int) removed;
+        } else {
+            fprintf(stderr, "gc: %" PRId64 " unreferenced blobs deleted\n", removed);
+        }
+    }
+
+    hash_table_free(live, NULL);
+    live = NULL;
+    return res;
+}
@@ -0,0 +1,23 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_BLOB_GC_H
+#define FUSE_XATTRS_BLOB_GC_H
+
+/**
+ * Mark and sweep the blob store of xattrs_config.source_dir: collect the
+ * references of every sidecar, then delete the blobs nobody references.
+ * Nothing is deleted if any sidecar couldn't be read. Blobs have no
+ * reference count, this scan is the only way to know: run it on a source
+ * directory nobody is writing to.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int blob_gc(void);
+
+#endif //FUSE_XATTRS_BLOB_GC_H
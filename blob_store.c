@@ -0,0 +1,334 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "blob_store.h"
+#include "utils.h"
+
+#define BLOB_PATH_EXTRA (1 + 2 + 1 + BLOB_KEY_HEX_SIZE) // "/xx/<hex>\0"
+
+static pthread_once_t root_once = PTHREAD_ONCE_INIT;
+static char *root = NULL;
+static size_t root_size = 0;
+
+static int enabled = 0;
+static size_t min_size = 0;
+
+/*
+ * Keys of values stored inline once, by their first 8 bytes. A value
+ * only gets a blob when it shows up again: unique values, the common
+ * case, cost no blob file. Direct mapped, a slot taken by another value
+ * just delays its blob.
+ */
+#define BLOB_SEEN_SLOTS 16384
+static uint64_t seen[BLOB_SEEN_SLOTS];
+
+/*
+ * Resolved on first use, once source_dir is known. References are resolved
+ * even when new values aren't deduplicated.
+ */
+static void __init_root(void)
+{
+    root = prepend_source_directory("/" BLOB_STORE_NAME);
+    root_size = strlen(root);
+}
+
+int blob_store_init(size_t _min_size)
+{
+    min_size = _min_size > 0 ? _min_size : DEFAULT_DEDUP_MIN;
+    enabled = 1;
+    return 0;
+}
+
+int blob_store_enabled(void)
+{
+    return enabled;
+}
+
+int blob_store_wants(size_t size)
+{
+    // a reference must be worth it
+    return enabled && size >= min_size && size > BLOB_REF_SIZE;
+}
+
+static inline uint64_t __rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t __fmix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * Two multiply-rotate lanes over 8 byte words. Not cryptographic: a
+ * colliding blob is detected by comparing contents before reusing it.
+ */
+static void __hash(const char *data, size_t size, unsigned char key[BLOB_KEY_SIZE])
+{
+    uint64_t a = 0x9e3779b97f4a7c15ULL ^ size;
+    uint64_t b = 0xc2b2ae3d27d4eb4fULL + size;
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        a = __rotl(a ^ (word * 0x87c37b91114253d5ULL), 31) * 0x9e3779b97f4a7c15ULL;
+        b = __rotl(b ^ (word * 0x4cf5ad432745937fULL), 27) * 0xc2b2ae3d27d4eb4fULL;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    a ^= tail * 0x87c37b91114253d5ULL;
+    b ^= tail * 0x4cf5ad432745937fULL;
+
+    a = __fmix(a + b);
+    b = __fmix(b + a);
+    memcpy(key, &a, sizeof(a));
+    memcpy(key + sizeof(a), &b, sizeof(b));
+}
+
+void blob_store_key_hex(const char ref[BLOB_REF_SIZE], char hex[BLOB_KEY_HEX_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *key = (const unsigned char *) ref + sizeof(uint64_t);
+
+    for (size_t i = 0; i < BLOB_KEY_SIZE; i++) {
+        hex[i * 2] = digits[key[i] >> 4];
+        hex[i * 2 + 1] = digits[key[i] & 0xf];
+    }
+    hex[BLOB_KEY_HEX_SIZE - 1] = '\0';
+}
+
+static void __blob_path(const char ref[BLOB_REF_SIZE], char *path)
+{
+    char hex[BLOB_KEY_HEX_SIZE];
+    blob_store_key_hex(ref, hex);
+    sprintf(path, "%s/%.2s/%s", root, hex, hex);
+}
+
+static int __read_all(int fd, char *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buffer + done, size - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -errno;
+        if (n == 0)
+            return -EILSEQ; // shorter than its reference says
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+static int __write_all(int fd, const char *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, buffer + done, size - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -errno;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+/* @return 1 if path holds value, 0 if there is no blob, -EEXIST if it differs. */
+static int __same_content(const char *path, const char *value, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size != size) {
+        close(fd);
+        return -EEXIST;
+    }
+
+    char *content = malloc(size > 0 ? size : 1);
+    if (content == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    int res = __read_all(fd, content, size);
+    close(fd);
+    if (res == 0)
+        res = memcmp(content, value, size) == 0 ? 1 : -EEXIST;
+    free(content);
+
+    return res;
+}
+
+static int __create(const char *path, const char *value, size_t size)
+{
+    const char *slash = strrchr(path, '/');
+    const size_t dir_size = (size_t) (slash - path);
+    char dir[dir_size + 1];
+    memcpy(dir, path, dir_size);
+    dir[dir_size] = '\0';
+
+    char tmp_path[dir_size + sizeof("/.tmpXXXXXX")];
+    sprintf(tmp_path, "%s/.tmpXXXXXX", dir);
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1 && errno == ENOENT) {
+        mkdir(root, 0755);
+        mkdir(dir, 0755);
+        sprintf(tmp_path, "%s/.tmpXXXXXX", dir);
+        fd = mkstemp(tmp_path);
+    }
+    if (fd == -1) {
+        error_print("cannot create blob in %s errno=%d\n", dir, errno);
+        return -errno;
+    }
+
+    // blobs are immutable and shared: make them durable before any reference
+    int res = __write_all(fd, value, size);
+    if (res == 0 && (fchmod(fd, 0644) != 0 || fsync(fd) != 0))
+        res = -errno;
+    close(fd);
+
+    if (res == 0 && link(tmp_path, path) != 0) {
+        // somebody else stored it meanwhile
+        res = errno == EEXIST ? (__same_content(path, value, size) == 1 ? 0 : -EEXIST) : -errno;
+    }
+    unlink(tmp_path);
+
+    if (res == 0) {
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    return res;
+}
+
+/* @return 1 if the value of key was seen before, else remember it. */
+static int __seen_before(const char ref[BLOB_REF_SIZE])
+{
+    uint64_t key;
+    memcpy(&key, ref + sizeof(uint64_t), sizeof(key));
+    key |= 1; // 0 marks an empty slot
+
+    uint64_t *slot = &seen[key % BLOB_SEEN_SLOTS];
+    return __atomic_exchange_n(slot, key, __ATOMIC_RELAXED) == key;
+}
+
+int blob_store_put(const char *value, size_t size, char ref[BLOB_REF_SIZE])
+{
+    const uint64_t value_size = size;
+    memcpy(ref, &value_size, sizeof(value_size));
+    __hash(value, size, (unsigned char *) ref + sizeof(value_size));
+
+    pthread_once(&root_once, __init_root);
+
+    char path[root_size + BLOB_PATH_EXTRA];
+    __blob_path(ref, path);
+
+    int res = __same_content(path, value, size);
+    if (res == 1)
+        return 0;
+    if (res == -EEXIST)
+        debug_print("hash collision: %s\n", path);
+    if (res != 0)
+        return res;
+
+    if (!__seen_before(ref))
+        return -ENOENT;
+    return __create(path, value, size);
+}
+
+int blob_store_get(const char ref[BLOB_REF_SIZE], char *value, size_t size)
+{
+    uint64_t value_size;
+    memcpy(&value_size, ref, sizeof(value_size));
+    if (value_size > XATTR_SIZE_MAX)
+        return -EILSEQ;
+    if (size == 0)
+        return (int) value_size;
+    if (value_size > size)
+        return -ERANGE;
+
+    pthread_once(&root_once, __init_root);
+
+    char path[root_size + BLOB_PATH_EXTRA];
+    __blob_path(ref, path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        error_print("missing blob: %s errno=%d\n", path, errno);
+        return -EIO;
+    }
+    int res = __read_all(fd, value, (size_t) value_size);
+    close(fd);
+
+    return res == 0 ? (int) value_size : res;
+}
+
+int64_t blob_store_sweep(struct hash_table *live)
+{
+    pthread_once(&root_once, __init_root);
+
+    DIR *top = opendir(root);
+    if (top == NULL)
+        return errno == ENOENT ? 0 : -errno;
+
+    int64_t removed = 0;
+    struct dirent *de;
+    while ((de = readdir(top)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        char dir_path[root_size + 1 + strlen(de->d_name) + 1];
+        sprintf(dir_path, "%s/%s", root, de->d_name);
+        DIR *dir = opendir(dir_path);
+        if (dir == NULL)
+            continue;
+
+        struct dirent *blob;
+        while ((blob = readdir(dir)) != NULL) {
+            if (strcmp(blob->d_name, ".") == 0 || strcmp(blob->d_name, "..") == 0)
+                continue;
+
+            // temporaries left behind by a crash are garbage too
+            if (blob->d_name[0] != '.' && hash_table_get(live, blob->d_name) != NULL)
+                continue;
+
+            if (unlinkat(dirfd(dir), blob->d_name, 0) == 0)
+                removed++;
+        }
+        closedir(dir);
+    }
+    closedir(top);
+
+    return removed;
+}
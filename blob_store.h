@@ -0,0 +1,76 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_BLOB_STORE_H
+#define FUSE_XATTRS_BLOB_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash_table.h"
+#include "fuse_xattrs_config.h"
+
+/*
+ * Content addressed store for attribute values shared by many files.
+ *
+ * Values of at least min_size bytes are written once to
+ *
+ *   source_dir/BLOB_STORE_NAME/<xx>/<128 bit hash in hex>
+ *
+ * and sidecar records hold a reference instead: their value_size has
+ * BLOB_REF_FLAG set and their value is a u64 value size followed by the
+ * key. The store directory looks like the sidecar of a (reserved) file,
+ * so it is hidden like sidecars are.
+ *
+ * A value gets a blob the second time it is written (see blob_store_put()),
+ * the first copy stays inline.
+ *
+ * Blobs have no reference count: nothing tracks which sidecars point to
+ * them, so they are never deleted while mounted. `fuse_xattrs_tool gc`
+ * reclaims the ones no sidecar references anymore by scanning them all,
+ * offline only: a value stored meanwhile could lose its blob.
+ */
+#define BLOB_STORE_NAME ".xattr-blobs" BINARY_SIDECAR_EXT
+
+#define BLOB_REF_FLAG ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+#define BLOB_KEY_SIZE 16
+#define BLOB_REF_SIZE (sizeof(uint64_t) + BLOB_KEY_SIZE)
+#define BLOB_KEY_HEX_SIZE (BLOB_KEY_SIZE * 2 + 1)
+
+/* @param min_size - smallest value worth deduplicating, 0: DEFAULT_DEDUP_MIN */
+int blob_store_init(size_t min_size);
+int blob_store_enabled(void);
+
+/* @return 1 if a new value of size bytes should be deduplicated. */
+int blob_store_wants(size_t size);
+
+/**
+ * Store value, or find an identical copy, and fill ref. A value not seen
+ * since the mount, with no blob yet, is only remembered.
+ * @return On success, zero is returned. On failure, or -ENOENT for a value
+ *         seen for the first time, -errno is returned, and the value should
+ *         be stored inline.
+ */
+int blob_store_put(const char *value, size_t size, char ref[BLOB_REF_SIZE]);
+
+/**
+ * Read the value ref points to, like getxattr(2).
+ * @return the size of the value, or -errno (-ERANGE if size is too small).
+ */
+int blob_store_get(const char ref[BLOB_REF_SIZE], char *value, size_t size);
+
+void blob_store_key_hex(const char ref[BLOB_REF_SIZE], char hex[BLOB_KEY_HEX_SIZE]);
+
+/**
+ * Delete every blob whose hex key isn't in live.
+ * @return the number of blobs deleted, or -errno.
+ */
+int64_t blob_store_sweep(struct hash_table *live);
+
+#endif //FUSE_XATTRS_BLOB_STORE_H
@@ -0,0 +1,259 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache_snapshot.h"
+#include "sidecar_cache.h"
+#include "utils.h"
+#include "fuse_xattrs_config.h"
+
+#define SNAPSHOT_MAGIC "FXSNAP01"
+#define SNAPSHOT_MAGIC_SIZE 8
+#define SNAPSHOT_BUFFER_SIZE (1024 * 1024)
+
+static char *snapshot_path = NULL;
+static char *snapshot_tmp_path = NULL;
+static unsigned int snapshot_interval = 0;
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond;
+static pthread_t thread;
+static int running = 0;
+static int stopping = 0;
+
+static int __read_all(int fd, char *buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = read(fd, buffer, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -errno;
+        if (n == 0)
+            return -EIO;
+        buffer += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+/* @return number of entries loaded. On failure, -errno is returned. */
+static int __load(void)
+{
+    int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    struct stat st;
+    char *buffer = NULL;
+    int res = fstat(fd, &st) == 0 ? 0 : -errno;
+    if (res == 0 && (buffer = malloc(st.st_size > 0 ? (size_t) st.st_size : 1)) == NULL)
+        res = -ENOMEM;
+    if (res == 0)
+        res = __read_all(fd, buffer, (size_t) st.st_size);
+    close(fd);
+
+    const size_t size = (size_t) st.st_size;
+    if (res == 0 && (size < SNAPSHOT_MAGIC_SIZE || memcmp(buffer, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0))
+        res = -EILSEQ;
+
+    int count = 0;
+    size_t offset = SNAPSHOT_MAGIC_SIZE;
+    while (res == 0 && offset < size) {
+        uint16_t path_size;
+        uint32_t data_size;
+        struct sidecar_state state;
+
+        if (size - offset < sizeof(uint16_t)) {
+            res = -EILSEQ;
+            break;
+        }
+        memcpy(&path_size, buffer + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        const char *path = buffer + offset;
+        if (path_size == 0 || size - offset < path_size + sizeof(struct sidecar_state) + sizeof(uint32_t) ||
+            path[path_size - 1] != '\0') {
+            res = -EILSEQ;
+            break;
+        }
+        offset += path_size;
+        memcpy(&state, buffer + offset, sizeof(struct sidecar_state));
+        offset += sizeof(struct sidecar_state);
+        memcpy(&data_size, buffer + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        if (size - offset < data_size) {
+            res = -EILSEQ;
+            break;
+        }
+
+        struct sidecar_data *data = sidecar_data_new(data_size);
+        if (data == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        memcpy(data->buffer, buffer + offset, data_size);
+        offset += data_size;
+        sidecar_cache_preload(path, data, &state);
+        sidecar_data_release(data);
+        count++;
+    }
+
+    free(buffer);
+    return res != 0 ? res : count;
+}
+
+struct writer {
+    FILE *file;
+    int count;
+    int error;
+};
+
+static void __write_entry(const char *path, const struct sidecar_data *data, const struct sidecar_state *state,
+                          void *arg)
+{
+    struct writer *writer = arg;
+    const size_t path_size = strlen(path) + 1;
+    if (writer->error != 0 || path_size > UINT16_MAX)
+        return;
+
+    const uint16_t _path_size = (uint16_t) path_size;
+    const uint32_t data_size = (uint32_t) data->size;
+    if (fwrite(&_path_size, sizeof(uint16_t), 1, writer->file) != 1 ||
+        fwrite(path, path_size, 1, writer->file) != 1 ||
+        fwrite(state, sizeof(struct sidecar_state), 1, writer->file) != 1 ||
+        fwrite(&data_size, sizeof(uint32_t), 1, writer->file) != 1 ||
+        (data_size > 0 && fwrite(data->buffer, data_size, 1, writer->file) != 1)) {
+        writer->error = -EIO;
+        return;
+    }
+    writer->count++;
+}
+
+int cache_snapshot_save(void)
+{
+    if (snapshot_path == NULL)
+        return -ENOTSUP;
+
+    pthread_mutex_lock(&save_lock);
+    struct writer writer = { fopen(snapshot_tmp_path, "we"), 0, 0 };
+    if (writer.file == NULL) {
+        int res = -errno;
+        pthread_mutex_unlock(&save_lock);
+        return res;
+    }
+    setvbuf(writer.file, NULL, _IOFBF, SNAPSHOT_BUFFER_SIZE);
+
+    if (fwrite(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE, 1, writer.file) != 1)
+        writer.error = -EIO;
+    int res = writer.error == 0 ? sidecar_cache_export(__write_entry, &writer) : 0;
+    if (res == 0)
+        res = writer.error;
+    if (res == 0 && (fflush(writer.file) != 0 || fsync(fileno(writer.file)) != 0))
+        res = -errno;
+    if (fclose(writer.file) != 0 && res == 0)
+        res = -errno;
+    if (res == 0 && rename(snapshot_tmp_path, snapshot_path) != 0)
+        res = -errno;
+    if (res != 0)
+        unlink(snapshot_tmp_path);
+    pthread_mutex_unlock(&save_lock);
+
+    debug_print("saved %d entries to %s: %d\n", writer.count, snapshot_path, res);
+    return res != 0 ? res : writer.count;
+}
+
+static void *__run(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&stop_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += snapshot_interval;
+        while (!stopping && pthread_cond_timedwait(&stop_cond, &stop_lock, &deadline) != ETIMEDOUT)
+            ;
+        if (stopping)
+            break;
+
+        pthread_mutex_unlock(&stop_lock);
+        int res = cache_snapshot_save();
+        if (res < 0)
+            error_print("cannot save the cache snapshot %s: %s\n", snapshot_path, strerror(-res));
+        pthread_mutex_lock(&stop_lock);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    return NULL;
+}
+
+int cache_snapshot_init(const char *path, unsigned int interval)
+{
+    const size_t path_size = strlen(path) + 1;
+    snapshot_path = strdup(path);
+    snapshot_tmp_path = malloc(path_size + 4);
+    if (snapshot_path == NULL || snapshot_tmp_path == NULL) {
+        cache_snapshot_destroy();
+        return -ENOMEM;
+    }
+    snprintf(snapshot_tmp_path, path_size + 4, "%s.tmp", path);
+    snapshot_interval = interval > 0 ? interval : DEFAULT_SNAPSHOT_INTERVAL;
+
+    int res = __load();
+    if (res < 0)
+        error_print("cannot load the cache snapshot %s: %s\n", path, strerror(-res));
+    else
+        debug_print("loaded %d entries from %s\n", res, path);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&stop_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    stopping = 0;
+    res = pthread_create(&thread, NULL, __run, NULL);
+    if (res != 0) {
+        error_print("cannot start the cache snapshot thread\n");
+        cache_snapshot_destroy();
+        return -res;
+    }
+    running = 1;
+    return 0;
+}
+
+void cache_snapshot_destroy(void)
+{
+    if (running) {
+        pthread_mutex_lock(&stop_lock);
+        stopping = 1;
+        pthread_cond_signal(&stop_cond);
+        pthread_mutex_unlock(&stop_lock);
+        pthread_join(thread, NULL);
+        pthread_cond_destroy(&stop_cond);
+        running = 0;
+
+        int res = cache_snapshot_save();
+        if (res < 0)
+            error_print("cannot save the cache snapshot %s: %s\n", snapshot_path, strerror(-res));
+    }
+
+    free(snapshot_path);
+    free(snapshot_tmp_path);
+    snapshot_path = snapshot_tmp_path = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_CACHE_SNAPSHOT_H
+#define FUSE_XATTRS_CACHE_SNAPSHOT_H
+
+/*
+ * Sidecar cache snapshot (-o cache_snapshot=FILE): the cached sidecars
+ * are saved to FILE every cache_snapshot_interval seconds and on unmount,
+ * and loaded back with a single read when mounting, so a restarted
+ * daemon doesn't start cold.
+ *
+ * FILE holds a header, then one record per cached sidecar, most recently
+ * used first, in host byte order:
+ *
+ *     "FXSNAP01"
+ *     u16 path size (with '\0'), path, struct sidecar_state, u32 size, contents
+ *
+ * Loaded entries are only used once their sidecar is found unchanged
+ * (same inode, size, mtime and ctime), which costs a stat instead of
+ * opening and reading it. Sidecars of the directory store aren't saved.
+ * FILE is replaced atomically: a crash leaves the previous snapshot.
+ */
+
+/**
+ * Load FILE into the sidecar cache, which must be enabled, and start
+ * saving it periodically.
+ * @param interval - seconds between saves, 0: DEFAULT_SNAPSHOT_INTERVAL
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int cache_snapshot_init(const char *path, unsigned int interval);
+
+/* Stop saving, after saving one last time. */
+void cache_snapshot_destroy(void);
+
+/**
+ * Save the cache now.
+ * @return number of entries saved. On failure, -errno is returned.
+ */
+int cache_snapshot_save(void);
+
+#endif //FUSE_XATTRS_CACHE_SNAPSHOT_H
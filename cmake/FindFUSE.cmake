@@ -1,4 +1,4 @@
-# Find the FUSE includes and library
+# Find the FUSE 3 includes and library
 #
 # FUSE_INCLUDE_DIR - where to find fuse.h, etc.
 # FUSE_LIBRARIES   - List of libraries when using FUSE.
@@ -14,15 +14,15 @@ if (APPLE)
     set (FUSE_NAMES libosxfuse.dylib fuse)
     set (FUSE_SUFFIXES osxfuse fuse)
 else ()
-    set (FUSE_NAMES fuse refuse)
-    set (FUSE_SUFFIXES fuse refuse)
+    set (FUSE_NAMES fuse3)
+    set (FUSE_SUFFIXES fuse3)
 endif ()
 
 # find include
 find_path (
     FUSE_INCLUDE_DIR fuse.h
     PATHS /opt /opt/local /usr /usr/local /usr/pkg ${FUSE_ROOT_DIR} ENV FUSE_ROOT_DIR
-    PATH_SUFFIXES include ${FUSE_SUFFIXES})
+    PATH_SUFFIXES include/${FUSE_SUFFIXES} include)
 
 # find lib
 find_library (
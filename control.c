@@ -0,0 +1,450 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For pipe2 and FTW_ACTIONRETVAL */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "binary_storage.h"
+#include "blob_store.h"
+#include "dir_store.h"
+#include "sidecar_cache.h"
+#include "stat_cache.h"
+#include "sync.h"
+#include "prefetch.h"
+#include "trace.h"
+#include "journal.h"
+#include "cache_snapshot.h"
+#include "utils.h"
+#include "xattrs_config.h"
+#include "fuse_xattrs_config.h"
+
+/* a client has this long to send its command */
+#define CONTROL_RECV_TIMEOUT 5
+
+static int listen_fd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static pthread_t thread;
+static int running = 0;
+static char *socket_path = NULL;
+
+/* values in effect, changed by `set' */
+static struct {
+    unsigned int cache_size;        // MiB
+    unsigned int cache_ttl;         // seconds
+    unsigned int stat_cache_size;   // MiB
+    unsigned int stat_cache_ttl;    // seconds
+    unsigned int prefetch_threads;
+} effective;
+
+/* nftw() callbacks take no user data, commands run one at a time */
+static FILE *out = NULL;
+static size_t root_size = 0;
+static int compact = 0;
+static unsigned long files = 0;
+static unsigned long attrs = 0;
+static unsigned long dropped = 0;
+static unsigned long errors = 0;
+
+static void __print_config(void)
+{
+    fprintf(out, "source_dir=%s\n", xattrs_config.source_dir);
+    fprintf(out, "debug=%d\n", DEBUG ? 1 : 0);
+    fprintf(out, "show_sidecar=%d\n", xattrs_config.show_sidecar);
+    fprintf(out, "multithread=%d\n", xattrs_config.multithread);
+    fprintf(out, "no_security_xattrs=%d\n", xattrs_config.no_security_xattrs);
+    fprintf(out, "cache=%d\n", sidecar_cache_enabled());
+    fprintf(out, "cache_ttl=%u\n", effective.cache_ttl);
+    fprintf(out, "cache_size=%u\n", effective.cache_size);
+    fprintf(out, "cache_snapshot=%s\n", xattrs_config.cache_snapshot ? xattrs_config.cache_snapshot : "");
+    fprintf(out, "prefetch=%d\n", prefetch_enabled());
+    fprintf(out, "prefetch_threads=%u\n", effective.prefetch_threads);
+    fprintf(out, "query_index=%d\n", xattrs_config.query_index);
+    fprintf(out, "native_xattrs=%d\n", xattrs_config.native_xattrs);
+    fprintf(out, "dir_store=%d\n", dir_store_enabled());
+    fprintf(out, "dedup=%d\n", blob_store_enabled());
+    fprintf(out, "watch=%d\n", xattrs_config.watch);
+    fprintf(out, "stat_cache=%d\n", stat_cache_enabled());
+    fprintf(out, "stat_cache_ttl=%u\n", effective.stat_cache_ttl);
+    fprintf(out, "stat_cache_size=%u\n", effective.stat_cache_size);
+    fprintf(out, "ro_index=%s\n", xattrs_config.ro_index ? xattrs_config.ro_index : "");
+    fprintf(out, "trace=%s\n", xattrs_config.trace ? xattrs_config.trace : "");
+    fprintf(out, "writeback_cache=%d\n", xattrs_config.writeback_cache);
+    fprintf(out, "no_open=%d\n", xattrs_config.skip_open);
+    fprintf(out, "no_parallel_dirops=%d\n", xattrs_config.no_parallel_dirops);
+    fprintf(out, "single_writer=%d\n", xattrs_config.single_writer);
+    fprintf(out, "journal=%s\n", xattrs_config.journal ? xattrs_config.journal : "");
+    fprintf(out, "journal_sequence=%llu\n", (unsigned long long) journal_sequence());
+    fprintf(out, "generation=%d\n", xattrs_config.generation);
+    fprintf(out, "symlinks=%d\n", xattrs_config.symlinks);
+    fprintf(out, "passthrough=%d\n", __atomic_load_n(&xattrs_config.backing_files, __ATOMIC_RELAXED));
+}
+
+/* @return NULL on success, else the reason */
+static const char *__set(const char *name, const char *value)
+{
+    char *end;
+    errno = 0;
+    unsigned long number = strtoul(value, &end, 10);
+    if (value[0] == '\0' || value[0] == '-' || *end != '\0' || errno != 0 || number > 1024 * 1024)
+        return "invalid value";
+    const unsigned int n = (unsigned int) number;
+
+    if (strcmp(name, "debug") == 0) {
+        __atomic_store_n(&debug_output, n != 0, __ATOMIC_RELAXED);
+    } else if (strcmp(name, "cache_size") == 0 || strcmp(name, "cache_ttl") == 0) {
+        if (!sidecar_cache_enabled())
+            return "the sidecar cache is off, mount with -o cache";
+        if (n == 0)
+            return "invalid value";
+        if (strcmp(name, "cache_size") == 0)
+            effective.cache_size = n;
+        else
+            effective.cache_ttl = n;
+        sidecar_cache_init((size_t) effective.cache_size * 1024 * 1024, effective.cache_ttl);
+    } else if (strcmp(name, "stat_cache_size") == 0 || strcmp(name, "stat_cache_ttl") == 0) {
+        if (!stat_cache_enabled())
+            return "the stat cache is off, mount with -o stat_cache";
+        if (n == 0)
+            return "invalid value";
+        if (strcmp(name, "stat_cache_size") == 0)
+            effective.stat_cache_size = n;
+        else
+            effective.stat_cache_ttl = n;
+        // the kernel keeps the attr_timeout given at mount time
+        stat_cache_init((size_t) effective.stat_cache_size * 1024 * 1024, effective.stat_cache_ttl);
+    } else if (strcmp(name, "prefetch_threads") == 0) {
+        if (!prefetch_enabled())
+            return "prefetch is off, mount with -o prefetch";
+        if (n == 0 || prefetch_set_threads(n) != 0)
+            return "cannot change the number of threads";
+        effective.prefetch_threads = n;
+    } else if (strcmp(name, "trace") == 0) {
+        if (trace_set_enabled(n != 0) != 0)
+            return "not recording, mount with -o trace=FILE";
+    } else {
+        return "unknown setting";
+    }
+    return NULL;
+}
+
+static void __count_attr(const char *name, const char *value, size_t size, void *data)
+{
+    (void) name;
+    (void) value;
+    (void) size;
+    (*(unsigned long *) data)++;
+}
+
+/* @param path - absolute path of a file with a sidecar or a store entry */
+static void __maintain(const char *path, void *data)
+{
+    (void) data;
+    const char *relative = path[root_size] != '\0' ? path + root_size : "/";
+
+    // the same path the daemon locks and caches
+    char *_path = prepend_source_directory(relative);
+    if (_path == NULL) {
+        errors++;
+        return;
+    }
+
+    int res = compact ? binary_storage_compact(_path) : binary_storage_foreach(_path, __count_attr, &attrs);
+    if (res < 0) {
+        fprintf(out, "%s: %s\n", relative, strerror(-res));
+        errors++;
+    }
+    dropped += res == 1;
+    files++;
+    free(_path);
+}
+
+static int __maintain_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void) sb;
+    const char *name = fpath + ftwbuf->base;
+
+    if (typeflag == FTW_D && strcmp(fpath + root_size, "/" BLOB_STORE_NAME) == 0)
+        return FTW_SKIP_SUBTREE;
+    if (typeflag != FTW_F)
+        return FTW_CONTINUE;
+
+    if (dir_store_enabled()) {
+        if (strcmp(name, DIR_STORE_NAME) == 0) {
+            int res = dir_store_foreach_entry(fpath, __maintain, NULL);
+            if (res != 0) {
+                fprintf(out, "%s: %s\n", fpath + root_size, strerror(-res));
+                errors++;
+            }
+        }
+        return FTW_CONTINUE;
+    }
+
+    // the sidecar of the root is named after the extension alone
+    const int is_root_sidecar = strcmp(fpath + root_size, "/" BINARY_SIDECAR_EXT) == 0;
+    if ((!is_root_sidecar && filename_is_sidecar(name) != 1) || dir_store_is_store_name(name))
+        return FTW_CONTINUE;
+
+    char *path = strndup(fpath, strlen(fpath) - BINARY_SIDECAR_EXT_SIZE);
+    if (path == NULL) {
+        errors++;
+        return FTW_STOP;
+    }
+    __maintain(path, NULL);
+    free(path);
+
+    return FTW_CONTINUE;
+}
+
+/* @return NULL on success, else the reason */
+static const char *__walk(const char *subtree, int _compact)
+{
+    if (subtree[0] != '/' || strstr(subtree, "/../") != NULL ||
+        (strlen(subtree) >= 3 && strcmp(subtree + strlen(subtree) - 3, "/..") == 0))
+        return "PATH must be mount relative, without ..";
+
+    root_size = xattrs_config.source_dir_size;
+    while (root_size > 1 && xattrs_config.source_dir[root_size - 1] == '/')
+        root_size--;
+    char *root = malloc(root_size + strlen(subtree) + 1);
+    if (root == NULL)
+        return strerror(ENOMEM);
+    memcpy(root, xattrs_config.source_dir, root_size);
+    strcpy(root + root_size, subtree);
+
+    compact = _compact;
+    files = attrs = dropped = errors = 0;
+    int res = nftw(root, __maintain_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL);
+    free(root);
+    if (res != 0)
+        return strerror(errno);
+
+    if (compact)
+        fprintf(out, "%lu sidecars, %lu dropped, %lu errors\n", files, dropped, errors);
+    else
+        fprintf(out, "%lu sidecars, %lu attributes, %lu errors\n", files, attrs, errors);
+    return errors > 0 ? "some sidecars failed" : NULL;
+}
+
+/* @return NULL on success, else the reason */
+static const char *__run_command(char *line)
+{
+    char *saveptr = NULL;
+    const char *command = strtok_r(line, " \t", &saveptr);
+    const char *arg1 = strtok_r(NULL, " \t", &saveptr);
+    const char *arg2 = strtok_r(NULL, " \t", &saveptr);
+    const char *extra = strtok_r(NULL, " \t", &saveptr);
+    const int argc = (command != NULL) + (arg1 != NULL) + (arg2 != NULL) + (extra != NULL);
+
+    if (command == NULL)
+        return "empty command";
+
+    if (strcmp(command, "config") == 0 && argc == 1) {
+        __print_config();
+    } else if (strcmp(command, "lock-stats") == 0 && argc == 1) {
+        binary_storage_lock_stats(out);
+    } else if (strcmp(command, "sync-stats") == 0 && argc == 1) {
+        sync_stats(out);
+    } else if (strcmp(command, "drop-caches") == 0 && argc == 1) {
+        sidecar_cache_clear();
+        stat_cache_clear();
+    } else if (strcmp(command, "save-cache") == 0 && argc == 1) {
+        int res = cache_snapshot_save();
+        if (res == -ENOTSUP)
+            return "no snapshot, mount with -o cache_snapshot=PATH";
+        if (res < 0)
+            return strerror(-res);
+        fprintf(out, "%d sidecars saved\n", res);
+    } else if (strcmp(command, "set") == 0 && argc == 3) {
+        return __set(arg1, arg2);
+    } else if (strcmp(command, "scrub") == 0 && argc == 2) {
+        return __walk(arg1, 0);
+    } else if (strcmp(command, "compact") == 0 && argc == 2) {
+        return __walk(arg1, 1);
+    } else {
+        return "unknown command, see control.h";
+    }
+    return NULL;
+}
+
+static void __serve(int fd)
+{
+    const struct timeval timeout = { CONTROL_RECV_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char line[CONTROL_MAX_LINE];
+    size_t size = 0;
+    while (size < sizeof(line) - 1) {
+        ssize_t n = recv(fd, line + size, sizeof(line) - 1 - size, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        size += (size_t) n;
+        if (memchr(line, '\n', size) != NULL)
+            break;
+    }
+    line[size] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char *reply = NULL;
+    size_t reply_size = 0;
+    out = open_memstream(&reply, &reply_size);
+    if (out == NULL)
+        return;
+
+    debug_print("command: %s\n", line);
+    const char *error = __run_command(line);
+    if (error != NULL)
+        fprintf(out, "error: %s\n", error);
+    else
+        fprintf(out, "ok\n");
+    fclose(out);
+    out = NULL;
+
+    // the client may be gone: no SIGPIPE
+    for (size_t sent = 0; sent < reply_size;) {
+        ssize_t n = send(fd, reply + sent, reply_size - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += (size_t) n;
+    }
+    free(reply);
+}
+
+static void *__run(void *data)
+{
+    (void) data;
+    struct pollfd fds[2] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = stop_pipe[0], .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            error_print("poll failed errno=%d\n", errno);
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+            continue;
+        __serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/* @return 1 if a daemon answers on path */
+static int __in_use(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return 0;
+    int res = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0;
+    close(fd);
+    return res;
+}
+
+int control_init(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+
+    effective.cache_ttl = xattrs_config.cache_ttl ? xattrs_config.cache_ttl : DEFAULT_CACHE_TTL;
+    effective.cache_size = xattrs_config.cache_size ? xattrs_config.cache_size : DEFAULT_CACHE_SIZE;
+    effective.stat_cache_ttl = xattrs_config.stat_cache_ttl ? xattrs_config.stat_cache_ttl : DEFAULT_STAT_CACHE_TTL;
+    effective.stat_cache_size = xattrs_config.stat_cache_size ? xattrs_config.stat_cache_size
+                                                              : DEFAULT_STAT_CACHE_SIZE;
+    effective.prefetch_threads = xattrs_config.prefetch_threads ? xattrs_config.prefetch_threads
+                                                                : DEFAULT_PREFETCH_THREADS;
+
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || __in_use(&addr))
+            return -EADDRINUSE;
+        unlink(path);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+        return -errno;
+
+    // only the user running the daemon
+    mode_t mask = umask(0077);
+    int res = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 ? 0 : -errno;
+    umask(mask);
+    if (res == 0 && (socket_path = strdup(path)) == NULL) {
+        unlink(path);
+        res = -ENOMEM;
+    }
+    if (res == 0 && listen(listen_fd, 8) != 0)
+        res = -errno;
+    if (res == 0 && pipe2(stop_pipe, O_CLOEXEC) != 0)
+        res = -errno;
+    if (res == 0)
+        res = -pthread_create(&thread, NULL, __run, NULL);
+
+    if (res != 0) {
+        error_print("cannot listen on %s errno=%d\n", path, -res);
+        control_destroy();
+        return res;
+    }
+    running = 1;
+    return 0;
+}
+
+void control_destroy(void)
+{
+    if (running) {
+        char byte = 0;
+        if (write(stop_pipe[1], &byte, 1) == 1)
+            pthread_join(thread, NULL);
+        running = 0;
+    }
+
+    if (stop_pipe[0] != -1) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        stop_pipe[0] = stop_pipe[1] = -1;
+    }
+    if (listen_fd != -1) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (socket_path != NULL) {
+        unlink(socket_path);
+        free(socket_path);
+        socket_path = NULL;
+    }
+}
@@ -0,0 +1,49 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_CONTROL_H
+#define FUSE_XATTRS_CONTROL_H
+
+/*
+ * Control socket (-o control=PATH): changes the behavior of a mounted
+ * filesystem without remounting it.
+ *
+ * A UNIX stream socket, only reachable by the user running the daemon.
+ * A client sends one command line and reads the reply until the daemon
+ * closes the connection. The last line of the reply is "ok" or
+ * "error: <reason>". `fuse_xattrs_tool ctl PATH command...' does this.
+ *
+ *     config                 effective configuration, one name=value per line
+ *     lock-stats             how long sidecar locks were waited for, in
+ *                            buckets from 0 (not at all) to 1s and longer
+ *     sync-stats             paths waiting for fsync, whether their table
+ *                            overflowed, fsync()s and syncfs()s done
+ *     drop-caches            empty the sidecar and stat caches
+ *     save-cache             save the cache snapshot now (-o cache_snapshot)
+ *     set NAME VALUE         debug (0/1), cache_size, cache_ttl, stat_cache_size,
+ *                            stat_cache_ttl, prefetch_threads or trace (0/1,
+ *                            pauses recording); caches and the trace must
+ *                            have been enabled at mount time
+ *     scrub PATH             check every sidecar under PATH parses and its
+ *                            deduplicated values resolve
+ *     compact PATH           drop the sidecars under PATH left without
+ *                            attributes or whose file is gone
+ *
+ * Commands are served one at a time, by a thread of their own.
+ */
+#define CONTROL_MAX_LINE 4096
+
+/**
+ * Listen on socket_path, replacing a stale socket.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int control_init(const char *socket_path);
+void control_destroy(void);
+
+#endif //FUSE_XATTRS_CONTROL_H
@@ -0,0 +1,767 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dir_store.h"
+#include "binary_storage.h"
+#include "hash_table.h"
+#include "own_changes.h"
+#include "sync.h"
+#include "utils.h"
+#include "xattrs_config.h"
+
+/* Serialize updates of the same store; unrelated directories rarely contend. */
+#define DIR_STORE_LOCK_STRIPES 64
+
+static pthread_mutex_t store_locks[DIR_STORE_LOCK_STRIPES] = {
+        [0 ... DIR_STORE_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int enabled = 0;
+
+struct store_record {
+    const char *name;
+    size_t name_size;
+    const char *sidecar;
+    size_t sidecar_size;
+    size_t start; // offsets of the whole record in the store
+    size_t end;
+};
+
+void dir_store_init(void)
+{
+    enabled = 1;
+}
+
+int dir_store_enabled(void)
+{
+    return enabled;
+}
+
+static int __is_tmp_name(const char *name)
+{
+    return strlen(name) == sizeof(DIR_STORE_TMP_TEMPLATE) - 1 && strncmp(name, "..", 2) == 0 &&
+           strcmp(name + sizeof(DIR_STORE_TMP_TEMPLATE) - 1 - BINARY_SIDECAR_EXT_SIZE, BINARY_SIDECAR_EXT) == 0;
+}
+
+int dir_store_is_store_name(const char *name)
+{
+    return strcmp(name, DIR_STORE_NAME) == 0 || __is_tmp_name(name);
+}
+
+static pthread_mutex_t *__store_lock(const char *store_path)
+{
+    return &store_locks[hash_string(store_path) & (DIR_STORE_LOCK_STRIPES - 1)];
+}
+
+/*
+ * Split path into the file of its store and the entry name within it.
+ * "/a/b" is entry "b" of "/a/" DIR_STORE_NAME, the root "/src/" is
+ * entry "." of its own store.
+ */
+static char *__split(const char *path, const char **entry, const char *name)
+{
+    const char *slash = strrchr(path, '/');
+    const size_t prefix_size = slash != NULL ? (size_t) (slash - path) + 1 : 0;
+    const size_t name_size = strlen(name);
+
+    char *store_path = malloc(prefix_size + name_size + 1);
+    if (store_path == NULL)
+        return NULL;
+    memcpy(store_path, path, prefix_size);
+    memcpy(store_path + prefix_size, name, name_size + 1);
+
+    if (entry != NULL)
+        *entry = path[prefix_size] != '\0' ? path + prefix_size : ".";
+    return store_path;
+}
+
+char *dir_store_path(const char *path)
+{
+    return __split(path, NULL, DIR_STORE_NAME);
+}
+
+/*
+ * @return 1 and the record at offset, 0 at the end, -EILSEQ if corrupted,
+ * -ENODATA if the store ends in the middle of it.
+ */
+static int __next_record(const struct sidecar_data *store, size_t *offset, struct store_record *record)
+{
+    if (store == NULL || *offset >= store->size)
+        return 0;
+
+    uint16_t name_size;
+    size_t sidecar_size;
+    size_t pos = *offset;
+
+    if (pos + sizeof(name_size) > store->size)
+        return -ENODATA;
+    memcpy(&name_size, store->buffer + pos, sizeof(name_size));
+    pos += sizeof(name_size);
+
+    if (name_size == 0)
+        return -EILSEQ;
+    if (pos + name_size > store->size)
+        return -ENODATA;
+    if (store->buffer[pos + name_size - 1] != '\0')
+        return -EILSEQ;
+    record->name = store->buffer + pos;
+    record->name_size = name_size;
+    pos += name_size;
+
+    if (pos + sizeof(sidecar_size) > store->size)
+        return -ENODATA;
+    memcpy(&sidecar_size, store->buffer + pos, sizeof(sidecar_size));
+    pos += sizeof(sidecar_size);
+
+    if (sidecar_size > store->size - pos)
+        return sidecar_size > MAX_DIR_STORE_SIZE ? -EILSEQ : -ENODATA;
+    record->sidecar = store->buffer + pos;
+    record->sidecar_size = sidecar_size;
+    pos += sidecar_size;
+
+    record->start = *offset;
+    record->end = pos;
+    *offset = pos;
+    return 1;
+}
+
+/* @return 1 and the record of entry, 0 if there is none, -EILSEQ. */
+static int __find(const struct sidecar_data *store, const char *entry, struct store_record *record)
+{
+    size_t offset = 0;
+    int res;
+    while ((res = __next_record(store, &offset, record)) == 1) {
+        if (strcmp(record->name, entry) == 0)
+            return 1;
+    }
+    return res;
+}
+
+/* Read the store open as fd, st its fstat(). Same contract as __read_store(). */
+static struct sidecar_data *__read_store_fd(int fd, const struct stat *st, const char *store_path, int *res)
+{
+    if (st->st_size > MAX_DIR_STORE_SIZE) {
+        error_print("directory store too big. path: %s, size: %lld\n", store_path, (long long) st->st_size);
+        *res = -ENOSPC;
+        return NULL;
+    }
+    if (st->st_size == 0) {
+        *res = -ENOENT;
+        return NULL;
+    }
+
+    struct sidecar_data *store = sidecar_data_new((size_t) st->st_size);
+    if (store == NULL) {
+        *res = -ENOMEM;
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < store->size) {
+        ssize_t n = pread(fd, store->buffer + done, store->size - done, (off_t) done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t) n;
+    }
+    store->size = done; // shrunk meanwhile
+
+    // a record cut short: the crash of an append, it was never there
+    size_t offset = 0;
+    struct store_record record;
+    int found;
+    while ((found = __next_record(store, &offset, &record)) == 1);
+    if (found == -ENODATA)
+        store->size = offset;
+
+    *res = 0;
+    return store;
+}
+
+static struct sidecar_data *__read_store(const char *store_path, int *res)
+{
+    int fd = open(store_path, O_RDONLY);
+    if (fd == -1) {
+        *res = -errno;
+        return NULL;
+    }
+
+    struct stat st;
+    struct sidecar_data *store = NULL;
+    if (fstat(fd, &st) != 0)
+        *res = -errno;
+    else
+        store = __read_store_fd(fd, &st, store_path, res);
+    close(fd);
+    return store;
+}
+
+/**
+ * Load a store, going through the sidecar cache when enabled.
+ * Must be called with the store lock held.
+ * @return the store or NULL and -errno in res (-ENOENT if there is none).
+ */
+static struct sidecar_data *__load(const char *store_path, int *res)
+{
+    struct sidecar_data *store = sidecar_cache_lookup(store_path);
+    if (store != NULL) {
+        *res = store->size > 0 ? 0 : -ENOENT;
+        if (store->size == 0) {
+            sidecar_data_release(store);
+            return NULL;
+        }
+        return store;
+    }
+
+    const uint64_t epoch = sidecar_cache_epoch(store_path);
+    store = __read_store(store_path, res);
+    if (store != NULL || *res == -ENOENT)
+        sidecar_cache_insert(store_path, store, epoch);
+
+    return store;
+}
+
+static int __write_all(int fd, const char *buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, buffer + done, size - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == -1 ? -errno : -EIO;
+        done += (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * A store being updated. Other processes (mounts, the tool) are kept out
+ * with an exclusive lock on the store file, taken before reading it and
+ * held until the update is written, unless -o single_writer: then the
+ * store lock of this process is enough, and the store comes from the
+ * cache. A store renamed over the locked one is locked before the rename.
+ */
+struct store_handle {
+    const char *path;
+    int fd;                         // locked store, -1: none
+    struct sidecar_data *store;     // current contents, NULL if empty
+};
+
+/**
+ * Load the store at store_path for an update. Must be called with the
+ * store lock held, then __close_store().
+ * @param create - create the store if there is none, to lock it.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+static int __open_store(struct store_handle *handle, const char *store_path, int create)
+{
+    int res;
+    handle->path = store_path;
+    handle->fd = -1;
+    handle->store = NULL;
+
+    if (xattrs_config.single_writer) {
+        handle->store = __load(store_path, &res);
+        return res == -ENOENT ? 0 : res;
+    }
+
+    struct stat st;
+    for (;;) {
+        int fd = open(store_path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (fd == -1)
+            return errno == ENOENT && !create ? 0 : -errno;
+
+        binary_storage_lock_file(fd, F_WRLCK);
+        if (fstat(fd, &st) != 0) {
+            res = -errno;
+            close(fd);
+            return res;
+        }
+        // replaced or removed while we waited: lock what is there now
+        if (st.st_nlink > 0) {
+            handle->fd = fd;
+            break;
+        }
+        close(fd);
+    }
+
+    // other processes may have changed it: read it, not the cache
+    handle->store = __read_store_fd(handle->fd, &st, store_path, &res);
+    return res == -ENOENT ? 0 : res;
+}
+
+static void __close_store(struct store_handle *handle)
+{
+    // created to be locked but left empty: there are no attributes to keep
+    struct stat st;
+    if (handle->fd != -1 && handle->store == NULL && fstat(handle->fd, &st) == 0 &&
+        st.st_size == 0 && st.st_nlink > 0)
+        unlink(handle->path);
+    if (handle->fd != -1)
+        close(handle->fd);
+    handle->fd = -1;
+    sidecar_data_release(handle->store);
+    handle->store = NULL;
+}
+
+static int __write_store(struct store_handle *handle, const struct sidecar_data *store)
+{
+    if (store->size == 0) {
+        if (unlink(handle->path) != 0 && errno != ENOENT)
+            return -errno;
+        return 0;
+    }
+
+    char *tmp_path = __split(handle->path, NULL, DIR_STORE_TMP_TEMPLATE);
+    if (tmp_path == NULL)
+        return -ENOMEM;
+
+    int fd = mkstemps(tmp_path, BINARY_SIDECAR_EXT_SIZE);
+    if (fd == -1) {
+        int res = -errno;
+        error_print("cannot create %s errno=%d\n", tmp_path, errno);
+        free(tmp_path);
+        return res;
+    }
+
+    // whoever waits for the old store locks this one next
+    if (handle->fd != -1)
+        binary_storage_lock_file(fd, F_WRLCK);
+    int res = fchmod(fd, 0644) == 0 ? 0 : -errno;
+    if (res == 0)
+        res = __write_all(fd, store->buffer, store->size);
+    // renamed over the store only once its contents are on disk
+    if (res == 0 && fsync(fd) != 0)
+        res = -errno;
+    if (res == 0 && rename(tmp_path, handle->path) != 0)
+        res = -errno;
+    if (res != 0)
+        unlink(tmp_path);
+
+    if (res == 0 && handle->fd != -1) {
+        close(handle->fd);
+        handle->fd = fd;
+    } else if (close(fd) != 0 && res == 0) {
+        res = -errno;
+    }
+
+    free(tmp_path);
+    return res;
+}
+
+/**
+ * Append record to the store, if it is still old_size bytes.
+ * @return On success, zero is returned. -EAGAIN if it changed meanwhile.
+ */
+static int __append_store(struct store_handle *handle, const char *record, size_t size, size_t old_size)
+{
+    // locked: nobody else appends, a partial record can be cut off
+    int fd = handle->fd != -1 ? handle->fd : open(handle->path, O_WRONLY | O_APPEND);
+    if (fd == -1)
+        return -errno;
+
+    struct stat st;
+    int res = fstat(fd, &st) == 0 ? 0 : -errno;
+    if (res == 0 && (size_t) st.st_size != old_size)
+        res = -EAGAIN;
+    if (res == 0 && handle->fd != -1 && lseek(fd, (off_t) old_size, SEEK_SET) == -1)
+        res = -errno;
+    if (res == 0)
+        res = __write_all(fd, record, size);
+    if (res != 0 && res != -EAGAIN && handle->fd != -1 && ftruncate(fd, (off_t) old_size) != 0)
+        error_print("cannot drop a partial record from %s errno=%d\n", handle->path, errno);
+    if (handle->fd == -1 && close(fd) != 0 && res == 0)
+        res = -errno;
+
+    return res;
+}
+
+/**
+ * Replace the sidecar of entry in the store opened by __open_store().
+ * Must be called with the store lock held.
+ */
+static int __put(struct store_handle *handle, const char *entry, const char *sidecar, size_t size)
+{
+    struct sidecar_data *store = handle->store;
+    struct store_record record;
+    int found = __find(store, entry, &record);
+    if (found < 0)
+        return found;
+    if (!found && size == 0)
+        return 0;
+
+    const uint16_t name_size = (uint16_t) (strlen(entry) + 1);
+    const size_t old_size = store != NULL ? store->size : 0;
+    const size_t removed = found ? record.end - record.start : 0;
+    const size_t added = size > 0 ? sizeof(name_size) + name_size + sizeof(size) + size : 0;
+
+    struct sidecar_data *updated = sidecar_data_new(old_size - removed + added);
+    if (updated == NULL)
+        return -ENOMEM;
+
+    // everything but the old record, then the new one
+    size_t offset = 0;
+    if (found) {
+        memcpy(updated->buffer, store->buffer, record.start);
+        memcpy(updated->buffer + record.start, store->buffer + record.end, old_size - record.end);
+        offset = old_size - removed;
+    } else if (store != NULL) {
+        memcpy(updated->buffer, store->buffer, old_size);
+        offset = old_size;
+    }
+    if (size > 0) {
+        memcpy(updated->buffer + offset, &name_size, sizeof(name_size));
+        offset += sizeof(name_size);
+        memcpy(updated->buffer + offset, entry, name_size);
+        offset += name_size;
+        memcpy(updated->buffer + offset, &size, sizeof(size));
+        offset += sizeof(size);
+        memcpy(updated->buffer + offset, sidecar, size);
+    }
+
+    // a new entry goes at the end: nothing else of the store is written
+    int res = -EAGAIN;
+    if (!found && old_size > 0)
+        res = __append_store(handle, updated->buffer + old_size, added, old_size);
+    if (res != 0)
+        res = __write_store(handle, updated);
+    own_changes_record(handle->path);
+
+    sidecar_cache_invalidate(handle->path);
+    if (res == 0) {
+        // the store is ours until the handle is closed: it holds what we wrote
+        sidecar_cache_insert(handle->path, updated->size > 0 ? updated : NULL, sidecar_cache_epoch(handle->path));
+        sync_mark_dirty(handle->path);
+        sync_mark_parent_dirty(handle->path);
+        sidecar_data_release(handle->store);
+        handle->store = updated->size > 0 ? sidecar_data_ref(updated) : NULL;
+    }
+    sidecar_data_release(updated);
+
+    return res;
+}
+
+struct sidecar_data *dir_store_load(const char *path, int *size)
+{
+    const char *entry;
+    char *store_path = __split(path, &entry, DIR_STORE_NAME);
+    if (store_path == NULL) {
+        *size = -ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_t *lock = __store_lock(store_path);
+    pthread_mutex_lock(lock);
+    int res;
+    struct sidecar_data *store = __load(store_path, &res);
+    pthread_mutex_unlock(lock);
+    free(store_path);
+
+    if (store == NULL) {
+        *size = res;
+        return NULL;
+    }
+
+    struct store_record record;
+    int found = __find(store, entry, &record);
+    if (found <= 0 || record.sidecar_size == 0) {
+        sidecar_data_release(store);
+        *size = found < 0 ? found : -ENOENT;
+        return NULL;
+    }
+
+    struct sidecar_data *data = sidecar_data_new(record.sidecar_size);
+    if (data == NULL) {
+        sidecar_data_release(store);
+        *size = -ENOMEM;
+        return NULL;
+    }
+    memcpy(data->buffer, record.sidecar, record.sidecar_size);
+    sidecar_data_release(store);
+
+    *size = (int) data->size;
+    return data;
+}
+
+int dir_store_put(const char *path, const char *sidecar, size_t size)
+{
+    const char *entry;
+    char *store_path = __split(path, &entry, DIR_STORE_NAME);
+    if (store_path == NULL)
+        return -ENOMEM;
+
+    pthread_mutex_t *lock = __store_lock(store_path);
+    pthread_mutex_lock(lock);
+    struct store_handle handle;
+    int res = __open_store(&handle, store_path, size > 0);
+    if (res == 0)
+        res = __put(&handle, entry, sidecar, size);
+    __close_store(&handle);
+    pthread_mutex_unlock(lock);
+
+    free(store_path);
+    return res;
+}
+
+struct dir_store_update {
+    char *store_path;
+    char *entry;
+    pthread_mutex_t *lock;
+    struct store_handle handle;
+};
+
+struct dir_store_update *dir_store_update_begin(const char *path, struct sidecar_data **sidecar, int *size)
+{
+    *sidecar = NULL;
+    struct dir_store_update *update = malloc(sizeof(struct dir_store_update));
+    if (update == NULL) {
+        *size = -ENOMEM;
+        return NULL;
+    }
+
+    const char *entry;
+    update->store_path = __split(path, &entry, DIR_STORE_NAME);
+    update->entry = strdup(entry);
+    if (update->store_path == NULL || update->entry == NULL) {
+        free(update->store_path);
+        free(update->entry);
+        free(update);
+        *size = -ENOMEM;
+        return NULL;
+    }
+
+    update->lock = __store_lock(update->store_path);
+    pthread_mutex_lock(update->lock);
+    int res = __open_store(&update->handle, update->store_path, 1);
+
+    struct store_record record;
+    int found = res == 0 ? __find(update->handle.store, update->entry, &record) : 0;
+    if (res == 0 && found < 0)
+        res = found;
+    if (res != 0) {
+        dir_store_update_end(update, NULL, 0, 0);
+        *size = res;
+        return NULL;
+    }
+
+    if (!found || record.sidecar_size == 0) {
+        *size = -ENOENT;
+        return update;
+    }
+    if ((*sidecar = sidecar_data_new(record.sidecar_size)) == NULL) {
+        dir_store_update_end(update, NULL, 0, 0);
+        *size = -ENOMEM;
+        return NULL;
+    }
+    memcpy((*sidecar)->buffer, record.sidecar, record.sidecar_size);
+    *size = (int) record.sidecar_size;
+    return update;
+}
+
+int dir_store_update_end(struct dir_store_update *update, const char *sidecar, size_t size, int write)
+{
+    int res = write ? __put(&update->handle, update->entry, sidecar, size) : 0;
+    __close_store(&update->handle);
+    pthread_mutex_unlock(update->lock);
+
+    free(update->store_path);
+    free(update->entry);
+    free(update);
+    return res;
+}
+
+int dir_store_remove(const char *path)
+{
+    return dir_store_put(path, NULL, 0);
+}
+
+int dir_store_rename(const char *from, const char *to)
+{
+    const char *from_entry;
+    const char *to_entry;
+    char *from_store = __split(from, &from_entry, DIR_STORE_NAME);
+    char *to_store = __split(to, &to_entry, DIR_STORE_NAME);
+    if (from_store == NULL || to_store == NULL) {
+        free(from_store);
+        free(to_store);
+        return -ENOMEM;
+    }
+
+    // always in the same order, so two renames can't deadlock
+    pthread_mutex_t *first = __store_lock(from_store);
+    pthread_mutex_t *second = __store_lock(to_store);
+    if (first > second) {
+        pthread_mutex_t *tmp = first;
+        first = second;
+        second = tmp;
+    }
+    pthread_mutex_lock(first);
+    if (second != first)
+        pthread_mutex_lock(second);
+
+    // the files too, by path for other processes; one handle for a single store
+    const int same_store = strcmp(from_store, to_store) == 0;
+    struct store_handle handles[2] = { { .fd = -1, .store = NULL }, { .fd = -1, .store = NULL } };
+    struct store_handle *from_handle = &handles[0];
+    struct store_handle *to_handle = same_store ? from_handle : &handles[1];
+    struct store_handle *first_handle = same_store || strcmp(from_store, to_store) < 0 ? from_handle : to_handle;
+    struct store_handle *second_handle = first_handle == from_handle ? to_handle : from_handle;
+
+    int res = __open_store(first_handle, first_handle == from_handle ? from_store : to_store, 1);
+    if (res == 0 && !same_store)
+        res = __open_store(second_handle, second_handle == from_handle ? from_store : to_store, 1);
+
+    struct store_record record;
+    int found = 0;
+    char *sidecar = NULL;
+    if (res == 0 && (found = __find(from_handle->store, from_entry, &record)) < 0)
+        res = found;
+    // copied: putting the destination may replace the store it points into
+    if (res == 0 && found && (sidecar = malloc(record.sidecar_size > 0 ? record.sidecar_size : 1)) == NULL)
+        res = -ENOMEM;
+    if (res == 0) {
+        if (found)
+            memcpy(sidecar, record.sidecar, record.sidecar_size);
+        // the destination is replaced even when the source has no attributes
+        res = __put(to_handle, to_entry, sidecar, found ? record.sidecar_size : 0);
+        if (res == 0 && found)
+            res = __put(from_handle, from_entry, NULL, 0);
+    }
+    free(sidecar);
+
+    __close_store(&handles[0]);
+    __close_store(&handles[1]);
+    if (second != first)
+        pthread_mutex_unlock(second);
+    pthread_mutex_unlock(first);
+
+    free(from_store);
+    free(to_store);
+    return res;
+}
+
+void dir_store_prefetch(const char *dir_path)
+{
+    const size_t dir_path_size = strlen(dir_path);
+    char *store_path = malloc(dir_path_size + 1 + sizeof(DIR_STORE_NAME));
+    if (store_path == NULL)
+        return;
+    memcpy(store_path, dir_path, dir_path_size);
+    store_path[dir_path_size] = '/';
+    memcpy(store_path + dir_path_size + 1, DIR_STORE_NAME, sizeof(DIR_STORE_NAME));
+
+    pthread_mutex_t *lock = __store_lock(store_path);
+    pthread_mutex_lock(lock);
+    int res;
+    sidecar_data_release(__load(store_path, &res));
+    pthread_mutex_unlock(lock);
+
+    free(store_path);
+}
+
+int dir_store_release_dir(const char *dir_path)
+{
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+        return -ENOTEMPTY;
+
+    int only_store = 1;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+            !dir_store_is_store_name(de->d_name)) {
+            only_store = 0;
+            break;
+        }
+    }
+    closedir(dir);
+
+    if (!only_store)
+        return -ENOTEMPTY;
+
+    const size_t dir_path_size = strlen(dir_path);
+    char *store_path = malloc(dir_path_size + 1 + sizeof(DIR_STORE_NAME));
+    if (store_path == NULL)
+        return -ENOMEM;
+    memcpy(store_path, dir_path, dir_path_size);
+    store_path[dir_path_size] = '/';
+    memcpy(store_path + dir_path_size + 1, DIR_STORE_NAME, sizeof(DIR_STORE_NAME));
+
+    // along with the temporary files left behind by crashed writers
+    pthread_mutex_t *lock = __store_lock(store_path);
+    pthread_mutex_lock(lock);
+    struct store_handle handle;
+    __open_store(&handle, store_path, 0);
+    unlink(store_path);
+    __close_store(&handle);
+    dir = opendir(dir_path);
+    while (dir != NULL && (de = readdir(dir)) != NULL) {
+        if (__is_tmp_name(de->d_name))
+            unlinkat(dirfd(dir), de->d_name, 0);
+    }
+    if (dir != NULL)
+        closedir(dir);
+    own_changes_record(store_path);
+    sidecar_cache_invalidate(store_path);
+    pthread_mutex_unlock(lock);
+
+    free(store_path);
+    return 0;
+}
+
+int dir_store_foreach_entry(const char *store_path, dir_store_entry_fn fn, void *data)
+{
+    pthread_mutex_t *lock = __store_lock(store_path);
+    pthread_mutex_lock(lock);
+    int res;
+    struct sidecar_data *store = __load(store_path, &res);
+    pthread_mutex_unlock(lock);
+
+    if (store == NULL)
+        return res == -ENOENT ? 0 : res;
+
+    const char *slash = strrchr(store_path, '/');
+    const size_t prefix_size = slash != NULL ? (size_t) (slash - store_path) + 1 : 0;
+
+    struct store_record record;
+    size_t offset = 0;
+    while ((res = __next_record(store, &offset, &record)) == 1) {
+        if (record.sidecar_size == 0)
+            continue;
+
+        // "." is the directory holding the store itself
+        const size_t entry_size = strcmp(record.name, ".") == 0 ? 0 : record.name_size - 1;
+        char *path = malloc(prefix_size + entry_size + 1);
+        if (path == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        memcpy(path, store_path, prefix_size);
+        memcpy(path + prefix_size, record.name, entry_size);
+        path[prefix_size + entry_size] = '\0';
+
+        fn(path, data);
+        free(path);
+    }
+    sidecar_data_release(store);
+
+    return res;
+}
@@ -0,0 +1,105 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_DIR_STORE_H
+#define FUSE_XATTRS_DIR_STORE_H
+
+#include <stddef.h>
+
+#include "sidecar_cache.h"
+#include "fuse_xattrs_config.h"
+
+/*
+ * Per-directory store: the attributes of every entry of a directory are
+ * packed in a single file inside it, instead of one sidecar per entry.
+ * The store holds one record per entry, laid out like a sidecar record
+ * whose name is the entry name and whose value is the entry's sidecar:
+ *
+ *   u16 name_size (with '\0'), name, size_t sidecar_size, sidecar
+ *
+ * The root directory keeps its own attributes under ".". Stores are read
+ * in one go and cached as a unit, under a per-directory lock. New entries
+ * are appended to the store, so filling a directory doesn't rewrite it
+ * once per file; a record cut short by a crash meanwhile is ignored.
+ * Other updates write a temporary file, unique to the writer (other
+ * mounts and the tool share the directory), synced and renamed over the
+ * store. Unless -o single_writer, an update holds an exclusive lock on
+ * the store file from reading it until it is written (the replacing file
+ * is locked before its rename), so writers don't lose each other's records.
+ *
+ * The store looks like the sidecar of ".", which can't be a real file, and
+ * temporary files like sidecars of "..XXXXXX", so both are hidden like
+ * sidecars.
+ */
+#define DIR_STORE_NAME "." BINARY_SIDECAR_EXT
+#define DIR_STORE_TMP_TEMPLATE "..XXXXXX" BINARY_SIDECAR_EXT
+
+void dir_store_init(void);
+int dir_store_enabled(void);
+
+/* @return 1 if name is the store or one of its temporary files. */
+int dir_store_is_store_name(const char *name);
+
+/* @param path - absolute (source) path of a file or directory. */
+char *dir_store_path(const char *path);
+
+/**
+ * Same contract as a sidecar read: the sidecar of path, or NULL and
+ * -errno in size (-ENOENT when path has no attributes).
+ */
+struct sidecar_data *dir_store_load(const char *path, int *size);
+
+/**
+ * Replace the sidecar of path. An empty sidecar drops the entry.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int dir_store_put(const char *path, const char *sidecar, size_t size);
+
+/*
+ * Read-modify-write of the sidecar of path, locked like dir_store_put()
+ * throughout, so that another process can't update the store in between.
+ */
+struct dir_store_update;
+
+/**
+ * Lock the store of path and read the sidecar of path into *sidecar: same
+ * contract as dir_store_load() for *sidecar and size.
+ * @return the update to finish with dir_store_update_end(), or NULL and
+ *         -errno in size if the store can't be locked or read.
+ */
+struct dir_store_update *dir_store_update_begin(const char *path, struct sidecar_data **sidecar, int *size);
+
+/**
+ * Replace the sidecar read by dir_store_update_begin() with the given one
+ * if write is set, then unlock the store and free update.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int dir_store_update_end(struct dir_store_update *update, const char *sidecar, size_t size, int write);
+
+int dir_store_remove(const char *path);
+int dir_store_rename(const char *from, const char *to);
+
+/* @param dir_path - absolute (source) path of a directory. */
+void dir_store_prefetch(const char *dir_path);
+
+/**
+ * rmdir helper: if the store is all that is left in dir_path, delete it.
+ * @return 0 if the store was deleted, -ENOTEMPTY otherwise.
+ */
+int dir_store_release_dir(const char *dir_path);
+
+typedef void (*dir_store_entry_fn)(const char *path, void *data);
+
+/**
+ * Call fn with the absolute path of every entry of the store at store_path.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int dir_store_foreach_entry(const char *store_path, dir_store_entry_fn fn, void *data);
+
+#endif //FUSE_XATTRS_DIR_STORE_H
@@ -9,8 +9,6 @@
   See the file COPYING.
 */
 
-#define FUSE_USE_VERSION 30
-
 /* For pread()/pwrite()/utimensat() */
 #define _XOPEN_SOURCE 700
 
@@ -20,26 +18,64 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stddef.h>
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <sys/xattr.h>
 
 #include "fuse_xattrs_config.h"
 
 #include "xattrs_config.h"
 #include "utils.h"
+#include "arena.h"
+#include "alloc_stats.h"
 #include "passthrough.h"
 
 #include "binary_storage.h"
+#include "native_storage.h"
+#include "dir_store.h"
+#include "blob_store.h"
+#include "sidecar_cache.h"
+#include "stat_cache.h"
+#include "prefetch.h"
+#include "query_index.h"
+#include "ro_index.h"
+#include "packed_xattrs.h"
+#include "watcher.h"
+#include "control.h"
+#include "trace.h"
+#include "journal.h"
+#include "cache_snapshot.h"
+
+/* Journal every attribute of a packed set, already validated by packed_xattrs_set(). */
+static void __journal_packed(const char *path, const char *value, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        uint16_t name_size;
+        uint32_t value_size;
+        memcpy(&name_size, value + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        journal_record(JOURNAL_SET, path, value + offset);
+        offset += name_size;
+        memcpy(&value_size, value + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t) + value_size;
+    }
+}
 
-static int xmp_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+static int __setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    if (query_is_path(path) || ro_index_enabled()) {
+        return -EROFS;
+    }
+
     if (get_namespace(name) != USER) {
         debug_print("Only user namespace is supported. name=%s\n", name);
         return -ENOTSUP;
@@ -53,70 +89,147 @@ static int xmp_setxattr(const char *path, const char *name, const char *value, s
         return -ENOSPC;
     }
 
-    char *_path = prepend_source_directory(path);
+    char *_path = arena_prepend_source_directory(path);
+    if (_path == NULL)
+        return -ENOMEM;
+
+    if (strcmp(name, PACKED_XATTRS_NAME) == 0) {
+        debug_print("path=%s name=%s size=%zu\n", _path, name, size);
+        int res = xattrs_config.native_xattrs ? -ENOTSUP : packed_xattrs_set(_path, value, size);
+        if (res == 0)
+            __journal_packed(path, value, size);
+        return res;
+    }
+    if (strcmp(name, GENERATION_XATTR_NAME) == 0) {
+        return -EPERM;
+    }
 
-#ifdef DEBUG
-    char *sanitized_value = sanitize_value(value, size);
-    debug_print("path=%s name=%s value=%s size=%zu XATTR_CREATE=%d XATTR_REPLACE=%d\n",
-                _path, name, sanitized_value, size, flags & XATTR_CREATE, flags & XATTR_REPLACE);
+    if (DEBUG) {
+        char *sanitized_value = arena_sanitize_value(value, size);
+        debug_print("path=%s name=%s value=%s size=%zu XATTR_CREATE=%d XATTR_REPLACE=%d\n",
+                    _path, name, sanitized_value, size, flags & XATTR_CREATE, flags & XATTR_REPLACE);
+    }
 
-    free(sanitized_value);
-#endif
+    int rtval = xattrs_config.native_xattrs ? native_storage_write_key(_path, name, value, size, flags)
+                                             : binary_storage_write_key(_path, name, value, size, flags);
 
-    int rtval = binary_storage_write_key(_path, name, value, size, flags);
-    free(_path);
+    // native xattrs change st_ctime
+    if (xattrs_config.native_xattrs)
+        stat_cache_invalidate(path);
 
+    if (rtval == 0)
+        journal_record(JOURNAL_SET, path, name);
     return rtval;
 }
 
-static int xmp_getxattr(const char *path, const char *name, char *value, size_t size)
+/* Value of GENERATION_XATTR_NAME: the generation in decimal. */
+static int __getgeneration(const char *_path, char *value, size_t size)
 {
+    uint64_t generation;
+    int res = binary_storage_generation(_path, &generation);
+    if (res != 0)
+        return res;
+
+    char text[32];
+    int text_size = snprintf(text, sizeof(text), "%llu", (unsigned long long) generation);
+    if (size == 0)
+        return text_size;
+    if ((size_t) text_size > size)
+        return -ERANGE;
+    memcpy(value, text, (size_t) text_size);
+    return text_size;
+}
+
+static int __getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    /* checked first and silently: the kernel probes security.capability on every write */
+    if (get_namespace(name) != USER) {
+        return -ENOTSUP;
+    }
+
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
-    if (get_namespace(name) != USER) {
-        debug_print("Only user namespace is supported. name=%s\n", name);
-        return -ENOTSUP;
+    if (query_is_path(path)) {
+        return -ENODATA;
     }
+
     if (strlen(name) > XATTR_NAME_MAX) {
         debug_print("attribute name must be equal or smaller than %d bytes\n", XATTR_NAME_MAX);
         return -ERANGE;
     }
 
-    char *_path = prepend_source_directory(path);
+    // only sidecars keep generations
+    const int generation = strcmp(name, GENERATION_XATTR_NAME) == 0;
+    if (generation && (!xattrs_config.generation || xattrs_config.native_xattrs || ro_index_enabled())) {
+        return -ENODATA;
+    }
+
+    if (ro_index_enabled()) {
+        if (strcmp(name, PACKED_XATTRS_NAME) == 0)
+            return packed_xattrs_get_with(path, ro_index_list_keys, ro_index_read_key, value, size);
+        return ro_index_read_key(path, name, value, size);
+    }
+
+    char *_path = arena_prepend_source_directory(path);
+    if (_path == NULL)
+        return -ENOMEM;
     debug_print("path=%s name=%s size=%zu\n", _path, name, size);
-    int rtval = binary_storage_read_key(_path, name, value, size);
-    free(_path);
+
+    if (generation) {
+        return __getgeneration(_path, value, size);
+    }
+    if (strcmp(name, PACKED_XATTRS_NAME) == 0) {
+        return xattrs_config.native_xattrs
+               ? packed_xattrs_get_with(_path, native_storage_list_keys, native_storage_read_key, value, size)
+               : packed_xattrs_get(_path, value, size);
+    }
+    int rtval = xattrs_config.native_xattrs ? native_storage_read_key(_path, name, value, size)
+                                             : binary_storage_read_key(_path, name, value, size);
 
     return rtval;
 }
 
-static int xmp_listxattr(const char *path, char *list, size_t size)
+static int __listxattr(const char *path, char *list, size_t size)
 {
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return 0;
+    }
+
     if (size > XATTR_LIST_MAX) {
         debug_print("The size of the list of attribute names for this file exceeds the system-imposed limit.\n");
         return -E2BIG;
     }
 
-    char *_path = prepend_source_directory(path);
+    if (ro_index_enabled()) {
+        return ro_index_list_keys(path, list, size);
+    }
+
+    char *_path = arena_prepend_source_directory(path);
+    if (_path == NULL)
+        return -ENOMEM;
     debug_print("path=%s size=%zu\n", _path, size);
-    int rtval = binary_storage_list_keys(_path, list, size);
-    free(_path);
+    int rtval = xattrs_config.native_xattrs ? native_storage_list_keys(_path, list, size)
+                                             : binary_storage_list_keys(_path, list, size);
 
     return rtval;
 }
 
-static int xmp_removexattr(const char *path, const char *name)
+static int __removexattr(const char *path, const char *name)
 {
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    if (query_is_path(path) || ro_index_enabled()) {
+        return -EROFS;
+    }
+
     if (get_namespace(name) != USER) {
         debug_print("Only user namespace is supported. name=%s\n", name);
         return -ENOTSUP;
@@ -125,16 +238,221 @@ static int xmp_removexattr(const char *path, const char *name)
         debug_print("attribute name must be equal or smaller than %d bytes\n", XATTR_NAME_MAX);
         return -ERANGE;
     }
+    if (strcmp(name, PACKED_XATTRS_NAME) == 0 || strcmp(name, GENERATION_XATTR_NAME) == 0) {
+        return -EPERM;
+    }
 
-    char *_path = prepend_source_directory(path);
+    char *_path = arena_prepend_source_directory(path);
+    if (_path == NULL)
+        return -ENOMEM;
     debug_print("path=%s name=%s\n", _path, name);
-    int rtval = binary_storage_remove_key(_path, name);
-    free(_path);
+    int rtval = xattrs_config.native_xattrs ? native_storage_remove_key(_path, name)
+                                             : binary_storage_remove_key(_path, name);
+
+    if (xattrs_config.native_xattrs)
+        stat_cache_invalidate(path);
 
+    if (rtval == 0)
+        journal_record(JOURNAL_REMOVE, path, name);
     return rtval;
 }
 
+/* xattr requests run off the arena of their thread, rewound once served */
+static int xmp_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    uint64_t allocs = alloc_stats_begin();
+    struct arena_mark mark = arena_mark();
+    int res = __setxattr(path, name, value, size, flags);
+    arena_rewind(mark);
+    alloc_stats_end(ALLOC_OP_SETXATTR, allocs);
+    return res;
+}
+
+static int xmp_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    uint64_t allocs = alloc_stats_begin();
+    struct arena_mark mark = arena_mark();
+    int res = __getxattr(path, name, value, size);
+    arena_rewind(mark);
+    alloc_stats_end(ALLOC_OP_GETXATTR, allocs);
+    return res;
+}
+
+static int xmp_listxattr(const char *path, char *list, size_t size)
+{
+    uint64_t allocs = alloc_stats_begin();
+    struct arena_mark mark = arena_mark();
+    int res = __listxattr(path, list, size);
+    arena_rewind(mark);
+    alloc_stats_end(ALLOC_OP_LISTXATTR, allocs);
+    return res;
+}
+
+static int xmp_removexattr(const char *path, const char *name)
+{
+    uint64_t allocs = alloc_stats_begin();
+    struct arena_mark mark = arena_mark();
+    int res = __removexattr(path, name);
+    arena_rewind(mark);
+    alloc_stats_end(ALLOC_OP_REMOVEXATTR, allocs);
+    return res;
+}
+
+/* tell the kernel about changes made outside the mount */
+static struct fuse *fuse_instance = NULL;
+
+static void xmp_invalidate(const char *path)
+{
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 2)
+    fuse_invalidate_path(fuse_instance, path);
+#else
+    (void) path; // not exposed by the high-level API: rely on attr_timeout
+#endif
+}
+
+static void xmp_source_changed(const char *path)
+{
+    if (xattrs_config.symlinks)
+        passthrough_source_changed(path);
+    xmp_invalidate(path);
+}
+
+/* options of the connection given on the command line, see fuse_parse_conn_info_opts() */
+static struct fuse_conn_info_opts *conn_opts = NULL;
+
+static void negotiate_capabilities(struct fuse_conn_info *conn)
+{
+    // libfuse enables async_read, parallel_dirops and readdirplus=auto by
+    // default; larger writes also raise the size of read requests
+    conn->max_write = DEFAULT_MAX_WRITE;
+    if (xattrs_config.no_parallel_dirops)
+        conn->want &= ~FUSE_CAP_PARALLEL_DIROPS;
+    fuse_apply_conn_info_opts(conn_opts, conn);
+
+    if (xattrs_config.no_open) {
+#ifdef FUSE_CAP_NO_OPEN_SUPPORT
+        if (conn->capable & FUSE_CAP_NO_OPEN_SUPPORT) {
+            xattrs_config.skip_open = 1;
+            // there is no open left to truncate: the kernel sends a setattr
+            conn->want &= ~FUSE_CAP_ATOMIC_O_TRUNC;
+        }
+#endif
+        if (!xattrs_config.skip_open)
+            fprintf(stderr, "no_open: not supported by the kernel\n");
+    }
+
+    // backing files are registered at open
+    if (xattrs_config.passthrough && xattrs_config.skip_open) {
+        fprintf(stderr, "passthrough: not used with no_open\n");
+    } else if (xattrs_config.passthrough) {
+#ifdef FUSE_CAP_PASSTHROUGH
+        if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+            conn->want |= FUSE_CAP_PASSTHROUGH;
+            if (conn->want & FUSE_CAP_WRITEBACK_CACHE)
+                fprintf(stderr, "passthrough: writeback_cache disabled, the kernel can't do both\n");
+            conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+            xattrs_config.backing_files = 1;
+        }
+#endif
+        if (!xattrs_config.backing_files)
+            fprintf(stderr, "passthrough: not supported by the kernel or libfuse\n");
+    }
+
+    xattrs_config.writeback_cache = (conn->want & FUSE_CAP_WRITEBACK_CACHE) != 0;
+}
+
+static void *xmp_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void) cfg;
+    negotiate_capabilities(conn);
+
+    /*
+     * security.* is never supported, so let the kernel skip the
+     * security.capability probe it does before each write by handing
+     * suid/sgid clearing over to us. Not with backing files: their
+     * writes never reach us, and run with our credentials, so the source
+     * filesystem keeps the bits when we run as root. The kernel then
+     * clears them itself, with a setattr.
+     */
+    if (xattrs_config.no_security_xattrs && xattrs_config.backing_files) {
+        fprintf(stderr, "no_security_xattrs: suid/sgid left to the kernel with passthrough\n");
+    } else if (xattrs_config.no_security_xattrs) {
+#if defined(FUSE_CAP_HANDLE_KILLPRIV_V2)
+        if (conn->capable & FUSE_CAP_HANDLE_KILLPRIV_V2) {
+            conn->want |= FUSE_CAP_HANDLE_KILLPRIV_V2;
+            xattrs_config.handle_killpriv = 1;
+        }
+#elif defined(FUSE_CAP_HANDLE_KILLPRIV)
+        if (conn->capable & FUSE_CAP_HANDLE_KILLPRIV) {
+            conn->want |= FUSE_CAP_HANDLE_KILLPRIV;
+            xattrs_config.handle_killpriv = 1;
+        }
+#else
+        fprintf(stderr, "no_security_xattrs: not supported by this libfuse version\n");
+#endif
+    }
+
+    if (xattrs_config.dir_store)
+        dir_store_init();
+    if (xattrs_config.dedup)
+        blob_store_init(xattrs_config.dedup_min);
+
+    // threads must be started here: fuse_main() forks when daemonizing
+    if (xattrs_config.cache || xattrs_config.prefetch || xattrs_config.cache_snapshot) {
+        unsigned int ttl = xattrs_config.cache_ttl ? xattrs_config.cache_ttl : DEFAULT_CACHE_TTL;
+        unsigned int size = xattrs_config.cache_size ? xattrs_config.cache_size : DEFAULT_CACHE_SIZE;
+        sidecar_cache_init((size_t) size * 1024 * 1024, ttl);
+    }
+    if (xattrs_config.cache_snapshot) {
+        int res = cache_snapshot_init(xattrs_config.cache_snapshot, xattrs_config.cache_snapshot_interval);
+        if (res != 0)
+            fprintf(stderr, "cannot use the cache snapshot %s: %s\n", xattrs_config.cache_snapshot, strerror(-res));
+    }
+    if (xattrs_config.stat_cache) {
+        unsigned int ttl = xattrs_config.stat_cache_ttl ? xattrs_config.stat_cache_ttl : DEFAULT_STAT_CACHE_TTL;
+        unsigned int size = xattrs_config.stat_cache_size ? xattrs_config.stat_cache_size : DEFAULT_STAT_CACHE_SIZE;
+        stat_cache_init((size_t) size * 1024 * 1024, ttl);
+    }
+    if (xattrs_config.prefetch) {
+        unsigned int threads = xattrs_config.prefetch_threads ? xattrs_config.prefetch_threads
+                                                              : DEFAULT_PREFETCH_THREADS;
+        prefetch_init(threads);
+    }
+    if (xattrs_config.query_index)
+        query_index_init();
+
+    fuse_instance = fuse_get_context()->fuse;
+    if (xattrs_config.symlinks)
+        passthrough_symlinks_init(fuse_instance);
+    if (xattrs_config.watch)
+        watcher_init(xmp_source_changed);
+    if (xattrs_config.control) {
+        int res = control_init(xattrs_config.control);
+        if (res != 0)
+            fprintf(stderr, "cannot listen on %s: %s\n", xattrs_config.control, strerror(-res));
+    }
+
+    return NULL;
+}
+
+static void xmp_destroy(void *private_data)
+{
+    (void) private_data;
+    control_destroy();
+    journal_close();
+    watcher_destroy();
+    passthrough_symlinks_destroy();
+    prefetch_destroy();
+    query_index_destroy();
+    cache_snapshot_destroy();
+    sidecar_cache_clear();
+    stat_cache_clear();
+    alloc_stats_report();
+}
+
 static struct fuse_operations xmp_oper = {
+        .init        = xmp_init,
+        .destroy     = xmp_destroy,
         .getattr     = xmp_getattr,
         .access      = xmp_access,
         .readlink    = xmp_readlink,
@@ -159,6 +477,7 @@ static struct fuse_operations xmp_oper = {
         .statfs      = xmp_statfs,
         .release     = xmp_release,
         .fsync       = xmp_fsync,
+        .fsyncdir    = xmp_fsyncdir,
 #ifdef HAVE_POSIX_FALLOCATE
         .fallocate   = xmp_fallocate,
 #endif
@@ -168,57 +487,54 @@ static struct fuse_operations xmp_oper = {
         .removexattr = xmp_removexattr,
 };
 
-/**
- * Check if the path is valid. If it's a relative path,
- * prepend the working path.
- * @param path relative or absolute path to eval.
- * @return new string with absolute path
- */
-const char *sanitized_source_directory(const char *path) {
-    char *absolute_path;
-    if (strlen(path) == 0) {
-        return NULL;
-    }
-
-    /* absolute path, we don't do anything */
-    if (path[0] == '/') {
-        if (is_directory(path) == -1) {
-            return NULL;
-        }
-        absolute_path = strdup(path);
-        return absolute_path;
-    }
-
-    char *pwd = get_current_dir_name();
-    size_t len = strlen(pwd) + 1 + strlen(path) + 1;
-    int has_trailing_backslash = (path[strlen(path)-1] == '/');
-    if (!has_trailing_backslash)
-        len++;
-
-    absolute_path = (char*) malloc(sizeof(char) * len);
-    memset(absolute_path, '\0', len);
-    sprintf(absolute_path, "%s/%s", pwd, path);
-
-    if(!has_trailing_backslash)
-        absolute_path[len-2] = '/';
-
-    if (is_directory(absolute_path) == -1) {
-        free(absolute_path);
-        return NULL;
-    }
-
-    return absolute_path;
-}
-
 enum {
     KEY_HELP,
     KEY_VERSION,
+    KEY_KERNEL_TIMEOUT,
 };
 
+/* kernel timeouts given explicitly, the others follow stat_cache_ttl */
+static int attr_timeout_set = 0;
+static int entry_timeout_set = 0;
+static int negative_timeout_set = 0;
+
 #define FUSE_XATTRS_OPT(t, p, v) { t, offsetof(struct xattrs_config, p), v }
 
 static struct fuse_opt xattrs_opts[] = {
         FUSE_XATTRS_OPT("show_sidecar",    show_sidecar, 1),
+        FUSE_XATTRS_OPT("multithread",     multithread, 1),
+        FUSE_XATTRS_OPT("no_security_xattrs", no_security_xattrs, 1),
+        FUSE_XATTRS_OPT("cache",           cache, 1),
+        FUSE_XATTRS_OPT("cache_ttl=%u",    cache_ttl, 0),
+        FUSE_XATTRS_OPT("cache_size=%u",   cache_size, 0),
+        FUSE_XATTRS_OPT("cache_snapshot=%s", cache_snapshot, 0),
+        FUSE_XATTRS_OPT("cache_snapshot_interval=%u", cache_snapshot_interval, 0),
+        FUSE_XATTRS_OPT("prefetch",        prefetch, 1),
+        FUSE_XATTRS_OPT("prefetch_threads=%u", prefetch_threads, 0),
+        FUSE_XATTRS_OPT("query_index",     query_index, 1),
+        FUSE_XATTRS_OPT("native_xattrs",   native_xattrs, 1),
+        FUSE_XATTRS_OPT("dir_store",       dir_store, 1),
+        FUSE_XATTRS_OPT("dedup",           dedup, 1),
+        FUSE_XATTRS_OPT("dedup_min=%u",    dedup_min, 0),
+        FUSE_XATTRS_OPT("watch",           watch, 1),
+        FUSE_XATTRS_OPT("stat_cache",      stat_cache, 1),
+        FUSE_XATTRS_OPT("stat_cache_ttl=%u", stat_cache_ttl, 0),
+        FUSE_XATTRS_OPT("stat_cache_size=%u", stat_cache_size, 0),
+        FUSE_XATTRS_OPT("ro_index=%s",     ro_index, 0),
+        FUSE_XATTRS_OPT("control=%s",      control, 0),
+        FUSE_XATTRS_OPT("trace=%s",        trace, 0),
+        FUSE_XATTRS_OPT("no_open",         no_open, 1),
+        FUSE_XATTRS_OPT("no_parallel_dirops", no_parallel_dirops, 1),
+        FUSE_XATTRS_OPT("single_writer",   single_writer, 1),
+        FUSE_XATTRS_OPT("journal=%s",      journal, 0),
+        FUSE_XATTRS_OPT("journal_size=%u", journal_size, 0),
+        FUSE_XATTRS_OPT("generation",      generation, 1),
+        FUSE_XATTRS_OPT("symlinks",        symlinks, 1),
+        FUSE_XATTRS_OPT("passthrough",     passthrough, 1),
+
+        FUSE_OPT_KEY("attr_timeout=",      KEY_KERNEL_TIMEOUT),
+        FUSE_OPT_KEY("entry_timeout=",     KEY_KERNEL_TIMEOUT),
+        FUSE_OPT_KEY("negative_timeout=",  KEY_KERNEL_TIMEOUT),
 
         FUSE_OPT_KEY("-V",                 KEY_VERSION),
         FUSE_OPT_KEY("--version",          KEY_VERSION),
@@ -227,6 +543,9 @@ static struct fuse_opt xattrs_opts[] = {
         FUSE_OPT_END
 };
 
+/* left to fuse_main(), checked against the source directory for -o symlinks */
+static const char *mountpoint = NULL;
+
 static int xattrs_opt_proc(void *data, const char *arg, int key,
                            struct fuse_args *outargs) {
     (void) data;
@@ -237,6 +556,8 @@ static int xattrs_opt_proc(void *data, const char *arg, int key,
                 xattrs_config.source_dir_size = strlen(xattrs_config.source_dir);
                 return 0;
             }
+            if (!mountpoint)
+                mountpoint = arg;
             break;
 
         case KEY_HELP:
@@ -250,12 +571,84 @@ static int xattrs_opt_proc(void *data, const char *arg, int key,
                             "\n"
                             "FUSE XATTRS options:\n"
                             "    -o show_sidecar  don't hide sidecar files\n"
-                            "\n", outargs->argv[0]);
-
-            fuse_opt_add_arg(outargs, "-ho");
-            fuse_main(outargs->argc, outargs->argv, &xmp_oper, NULL);
+                            "    -o multithread   serve requests from multiple threads\n"
+                            "    -o no_security_xattrs\n"
+                            "                     let the kernel skip security.* probes on write\n"
+                            "                     (not with passthrough)\n"
+                            "    -o cache         cache sidecar contents in memory\n"
+                            "    -o cache_ttl=N   seconds a cached sidecar stays valid (default: %d)\n"
+                            "    -o cache_size=N  MiB of cached sidecars (default: %d)\n"
+                            "    -o cache_snapshot=PATH\n"
+                            "                     save the cache to PATH and load it back when mounting\n"
+                            "                     (implies cache)\n"
+                            "    -o cache_snapshot_interval=N\n"
+                            "                     seconds between saves of the cache (default: %d)\n"
+                            "    -o prefetch      load sidecars while listing directories (implies cache)\n"
+                            "    -o prefetch_threads=N\n"
+                            "                     I/O threads used by prefetch (default: %d)\n"
+                            "    -o query_index   index attribute values under /" QUERY_DIR_NAME "\n"
+                            "    -o native_xattrs use native xattrs where the source filesystem supports them\n"
+                            "    -o dir_store     keep the attributes of a directory in a single file\n"
+                            "    -o dedup         store identical attribute values only once\n"
+                            "    -o dedup_min=N   smallest value (bytes) worth deduplicating (default: %d)\n"
+                            "    -o watch         invalidate caches when the source directory changes\n"
+                            "                     outside the mount\n"
+                            "    -o stat_cache    cache file attributes in memory\n"
+                            "    -o stat_cache_ttl=N\n"
+                            "                     seconds cached attributes stay valid (default: %d), also the\n"
+                            "                     default attr_timeout/entry_timeout/negative_timeout\n"
+                            "    -o stat_cache_size=N\n"
+                            "                     MiB of cached attributes (default: %d)\n"
+                            "    -o ro_index=FILE serve attributes from an index written by\n"
+                            "                     `fuse_xattrs_tool freeze', mount read-only\n"
+                            "    -o control=PATH  accept runtime commands on the UNIX socket PATH\n"
+                            "    -o trace=FILE    record every operation to FILE, see `fuse_xattrs_tool replay'\n"
+                            "    -o no_open       don't have the kernel send open and release (skips their\n"
+                            "                     permission checks, use with default_permissions)\n"
+                            "    -o no_parallel_dirops\n"
+                            "                     serialize lookups and readdirs of a directory\n"
+                            "    -o single_writer no other process writes attributes of the source\n"
+                            "                     directory: don't lock sidecars\n"
+                            "    -o journal=FILE  append every attribute change to FILE\n"
+                            "    -o journal_size=N\n"
+                            "                     MiB of journal before rotating it (default: %d)\n"
+                            "    -o generation    keep a counter of changes per file, read as the\n"
+                            "                     attribute " GENERATION_XATTR_NAME "\n"
+                            "    -o symlinks      show regular files as symbolic links to their source\n"
+                            "                     path: their data doesn't go through the mount\n"
+                            "    -o passthrough   have the kernel read and write open files on the source\n"
+                            "                     filesystem itself (Linux 6.9, needs CAP_SYS_ADMIN)\n"
+                            "\n"
+                            "FUSE connection options:\n"
+                            "    -o writeback_cache\n"
+                            "                     let the kernel cache writes\n"
+                            "    -o readdirplus=yes|no|auto\n"
+                            "                     return attributes with directory entries (default: auto)\n"
+                            "    -o async_read / -o sync_read\n"
+                            "                     let the kernel issue several reads at once (default: async)\n"
+                            "    -o max_write=N   bytes per write request (default: %d)\n"
+                            "    -o max_readahead=N\n"
+                            "                     bytes the kernel may read ahead\n"
+                            "    -o max_background=N\n"
+                            "    -o congestion_threshold=N\n"
+                            "                     requests in flight, total and before writers wait\n"
+                            "\n", outargs->argv[0],
+                    DEFAULT_CACHE_TTL, DEFAULT_CACHE_SIZE, DEFAULT_SNAPSHOT_INTERVAL, DEFAULT_PREFETCH_THREADS,
+                    DEFAULT_DEDUP_MIN, DEFAULT_STAT_CACHE_TTL, DEFAULT_STAT_CACHE_SIZE, DEFAULT_JOURNAL_SIZE, DEFAULT_MAX_WRITE);
+
+            // FUSE options only, without a second usage line
+            fflush(stderr);
+            printf("FUSE options:\n");
+            fuse_cmdline_help();
+            fuse_lib_help(outargs);
             exit(1);
 
+        case KEY_KERNEL_TIMEOUT:
+            attr_timeout_set |= strncmp(arg, "attr_timeout=", 13) == 0;
+            entry_timeout_set |= strncmp(arg, "entry_timeout=", 14) == 0;
+            negative_timeout_set |= strncmp(arg, "negative_timeout=", 17) == 0;
+            return 1;
+
         case KEY_VERSION:
             printf("FUSE_XATTRS version %d.%d\n", FUSE_XATTRS_VERSION_MAJOR, FUSE_XATTRS_VERSION_MINOR);
             fuse_opt_add_arg(outargs, "--version");
@@ -279,9 +672,86 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // fuse_main() leaves the working directory when daemonizing
+    if (xattrs_config.control && xattrs_config.control[0] != '/') {
+        fprintf(stderr, "the control socket path must be absolute: %s\n", xattrs_config.control);
+        exit(1);
+    }
+    if (xattrs_config.cache_snapshot && xattrs_config.cache_snapshot[0] != '/') {
+        fprintf(stderr, "the cache snapshot path must be absolute: %s\n", xattrs_config.cache_snapshot);
+        exit(1);
+    }
+
+    // the links would point back into the mount
+    if (xattrs_config.symlinks && mountpoint) {
+        char *source = realpath(xattrs_config.source_dir, NULL);
+        char *mounted = realpath(mountpoint, NULL);
+        const int over = source != NULL && mounted != NULL && strcmp(source, mounted) == 0;
+        free(source);
+        free(mounted);
+        if (over) {
+            fprintf(stderr, "symlinks: the source directory can't be mounted over\n");
+            exit(1);
+        }
+    }
+
+    // consumes the options it knows, fuse_main() would reject them
+    conn_opts = fuse_parse_conn_info_opts(&args);
+    if (conn_opts == NULL) {
+        exit(1);
+    }
+
     umask(0);
 
-    // disable multi-threading
-    fuse_opt_add_arg(&args, "-s");
-    return fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    // mapped before fuse_main() forks: the daemon inherits the mapping
+    if (xattrs_config.ro_index) {
+        int res = ro_index_open(xattrs_config.ro_index);
+        if (res != 0) {
+            fprintf(stderr, "cannot open index %s: %s\n", xattrs_config.ro_index, strerror(-res));
+            exit(1);
+        }
+        fuse_opt_add_arg(&args, "-oro");
+    }
+
+    const struct fuse_operations *operations = &xmp_oper;
+    if (xattrs_config.trace) {
+        int res = trace_open(xattrs_config.trace);
+        if (res != 0) {
+            fprintf(stderr, "cannot open trace %s: %s\n", xattrs_config.trace, strerror(-res));
+            exit(1);
+        }
+        operations = trace_operations(&xmp_oper);
+    }
+
+    // relative to the working directory fuse_main() leaves
+    if (xattrs_config.journal) {
+        int res = journal_open(xattrs_config.journal, xattrs_config.journal_size);
+        if (res != 0) {
+            fprintf(stderr, "cannot open journal %s: %s\n", xattrs_config.journal, strerror(-res));
+            exit(1);
+        }
+    }
+
+    // multi-threading is opt-in
+    if (!xattrs_config.multithread)
+        fuse_opt_add_arg(&args, "-s");
+
+    // the kernel may cache as long as we do
+    if (xattrs_config.stat_cache) {
+        unsigned int ttl = xattrs_config.stat_cache_ttl ? xattrs_config.stat_cache_ttl : DEFAULT_STAT_CACHE_TTL;
+        char opt[64];
+        if (!attr_timeout_set) {
+            sprintf(opt, "-oattr_timeout=%u", ttl);
+            fuse_opt_add_arg(&args, opt);
+        }
+        if (!entry_timeout_set) {
+            sprintf(opt, "-oentry_timeout=%u", ttl);
+            fuse_opt_add_arg(&args, opt);
+        }
+        if (!negative_timeout_set) {
+            sprintf(opt, "-onegative_timeout=%u", ttl);
+            fuse_opt_add_arg(&args, opt);
+        }
+    }
+    return fuse_main(args.argc, args.argv, operations, NULL);
 }
@@ -0,0 +1,136 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fuse_xattrs_client.h"
+#include "binary_storage.h"
+#include "packed_xattrs.h"
+#include "dir_store.h"
+#include "native_storage.h"
+#include "arena.h"
+#include "utils.h"
+#include "xattrs_config.h"
+#include "fuse_xattrs_config.h"
+
+/* the library is built with -fvisibility=hidden, only the API is exported */
+#define FUSE_XATTRS_CLIENT_API __attribute__((visibility("default")))
+
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static int open_flags = 0;
+
+/* @return size of path without its trailing slashes */
+static size_t __trimmed_size(const char *path)
+{
+    size_t size = strlen(path);
+    while (size > 1 && path[size - 1] == '/')
+        size--;
+    return size;
+}
+
+static int __same_directory(const char *a, const char *b)
+{
+    const size_t size = __trimmed_size(a);
+    return size == __trimmed_size(b) && strncmp(a, b, size) == 0;
+}
+
+FUSE_XATTRS_CLIENT_API
+int fuse_xattrs_client_open(const char *source_dir, int flags)
+{
+    if (flags & ~(FUSE_XATTRS_CLIENT_DIR_STORE | FUSE_XATTRS_CLIENT_NATIVE))
+        return -EINVAL;
+
+    const char *sanitized = sanitized_source_directory(source_dir);
+    if (sanitized == NULL)
+        return -ENOENT;
+
+    int res = 0;
+    pthread_mutex_lock(&open_lock);
+    if (xattrs_config.source_dir != NULL) {
+        // blob and store paths are resolved once
+        if (flags != open_flags || !__same_directory(sanitized, xattrs_config.source_dir))
+            res = -EBUSY;
+        free((void *) sanitized);
+    } else {
+        if (flags & FUSE_XATTRS_CLIENT_DIR_STORE)
+            dir_store_init();
+        open_flags = flags;
+        xattrs_config.source_dir_size = strlen(sanitized);
+        xattrs_config.source_dir = sanitized;
+    }
+    pthread_mutex_unlock(&open_lock);
+    return res;
+}
+
+/* Same checks as the daemon, on top of the FUSE lookup of path. */
+static int __check_path(const char *path)
+{
+    if (xattrs_config.source_dir == NULL)
+        return -EBADF;
+    if (path == NULL || path[0] != '/')
+        return -EINVAL;
+    if (filename_is_sidecar(path) == 1)
+        return -ENOENT;
+    return 0;
+}
+
+FUSE_XATTRS_CLIENT_API
+int fuse_xattrs_client_get(const char *path, const char *name, char *value, size_t size)
+{
+    int res = __check_path(path);
+    if (res != 0)
+        return res;
+    if (get_namespace(name) != USER)
+        return -ENOTSUP;
+    if (strlen(name) > XATTR_NAME_MAX)
+        return -ERANGE;
+
+    struct arena_mark mark = arena_mark();
+    char *_path = arena_prepend_source_directory(path);
+    if (_path == NULL)
+        res = -ENOMEM;
+    else if (strcmp(name, PACKED_XATTRS_NAME) == 0 && (open_flags & FUSE_XATTRS_CLIENT_NATIVE))
+        res = packed_xattrs_get_with(_path, native_storage_list_keys, native_storage_read_key, value, size);
+    else if (strcmp(name, PACKED_XATTRS_NAME) == 0)
+        res = packed_xattrs_get(_path, value, size);
+    else if (open_flags & FUSE_XATTRS_CLIENT_NATIVE)
+        res = native_storage_read_key(_path, name, value, size);
+    else
+        res = binary_storage_read_key(_path, name, value, size);
+    arena_rewind(mark);
+    return res;
+}
+
+FUSE_XATTRS_CLIENT_API
+int fuse_xattrs_client_list(const char *path, char *list, size_t size)
+{
+    int res = __check_path(path);
+    if (res != 0)
+        return res;
+
+    struct arena_mark mark = arena_mark();
+    char *_path = arena_prepend_source_directory(path);
+    if (_path == NULL)
+        res = -ENOMEM;
+    else if (open_flags & FUSE_XATTRS_CLIENT_NATIVE)
+        res = native_storage_list_keys(_path, list, size);
+    else
+        res = binary_storage_list_keys(_path, list, size);
+    arena_rewind(mark);
+    return res;
+}
+
+FUSE_XATTRS_CLIENT_API
+int fuse_xattrs_client_get_all(const char *path, char *value, size_t size)
+{
+    return fuse_xattrs_client_get(path, PACKED_XATTRS_NAME, value, size);
+}
@@ -0,0 +1,62 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_CLIENT_H
+#define FUSE_XATTRS_CLIENT_H
+
+#include <stddef.h>
+
+/*
+ * libfuse_xattrs_client: read the attributes of a fuse_xattrs mount
+ * straight from its source directory, without going through the kernel.
+ *
+ * It reads the same sidecars (or directory stores and blobs) as the
+ * daemon and takes the same locks on them, so a value is never seen half
+ * rewritten. Nothing is cached: a value set through the mount is visible
+ * as soon as setxattr returned.
+ *
+ * Paths are relative to the mount point ("/dir/file"). Functions follow
+ * getxattr(2)/listxattr(2): with size 0 they return the size needed, and
+ * they return -errno on failure instead of setting errno. They are
+ * thread-safe. A file that doesn't exist reads as having no attributes.
+ */
+
+#define FUSE_XATTRS_CLIENT_VERSION 1
+
+/* open flags, matching the mount options of the daemon */
+#define FUSE_XATTRS_CLIENT_DIR_STORE 0x1    /* -o dir_store */
+#define FUSE_XATTRS_CLIENT_NATIVE    0x2    /* -o native_xattrs */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Must be called first. A process reads a single source directory: opening
+ * it again is a no-op, opening another one fails with -EBUSY. flags must
+ * match the layout the mount writes: without FUSE_XATTRS_CLIENT_NATIVE,
+ * attributes a -o native_xattrs mount stored natively aren't seen. Unknown
+ * flags fail with -EINVAL.
+ * @param source_dir - source directory of the mount, as given to fuse_xattrs.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int fuse_xattrs_client_open(const char *source_dir, int flags);
+
+int fuse_xattrs_client_get(const char *path, const char *name, char *value, size_t size);
+
+int fuse_xattrs_client_list(const char *path, char *list, size_t size);
+
+/* Every attribute at once, encoded as the user.fuse_xattrs.all attribute. */
+int fuse_xattrs_client_get_all(const char *path, char *value, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //FUSE_XATTRS_CLIENT_H
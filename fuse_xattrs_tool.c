@@ -0,0 +1,288 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "archive.h"
+#include "blob_gc.h"
+#include "blob_store.h"
+#include "control.h"
+#include "dir_store.h"
+#include "import.h"
+#include "replay.h"
+#include "ro_index.h"
+#include "sidecar_cache.h"
+#include "utils.h"
+#include "xattrs_config.h"
+#include "fuse_xattrs_config.h"
+
+/*
+ * Offline maintenance of a source directory. It works on the sidecars
+ * directly, so the source directory should not be mounted meanwhile.
+ * `ctl' is the exception: it talks to a mounted filesystem, and so may
+ * `replay'.
+ */
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s command [options] source_dir [archive]\n"
+                    "       %s import [options] source_dir native_dir\n"
+                    "       %s replay [options] trace mountpoint|source_dir\n"
+                    "       %s ctl socket command...\n"
+                    "\n"
+                    "commands:\n"
+                    "    dump             write every attribute of source_dir to archive\n"
+                    "    restore          apply archive to source_dir\n"
+                    "    gc               delete deduplicated values no file references anymore\n"
+                    "    freeze           write a read-only index for -o ro_index (archive: index file)\n"
+                    "    import           copy the native user.* attributes of native_dir into source_dir\n"
+                    "    replay           run a trace recorded with -o trace=FILE again\n"
+                    "    ctl              send a command to the -o control socket of a mount\n"
+                    "\n"
+                    "options:\n"
+                    "    -j N             worker threads (default: %d, replay: one per recorded thread)\n"
+                    "    -d               source_dir uses per-directory stores (-o dir_store)\n"
+                    "    -D               deduplicate restored values (-o dedup)\n"
+                    "    -f               replay: as fast as possible instead of with the recorded timing\n"
+                    "                     import: also files imported before\n"
+                    "    -S               replay: call the storage engine on source_dir, not a mount\n"
+                    "    -c               replay -S: with the sidecar cache (-o cache)\n"
+                    "    -h   --help      print help\n"
+                    "    -V   --version   print version\n"
+                    "\n"
+                    "archive defaults to the standard output (dump) or input (restore).\n"
+                    "\n", prog, prog, prog, prog, DEFAULT_TOOL_THREADS);
+}
+
+/* Send the command to a mounted filesystem, print its reply. */
+static int ctl(const char *socket_path, int argc, char *argv[])
+{
+    char line[CONTROL_MAX_LINE];
+    size_t size = 0;
+    for (int i = 0; i < argc; i++) {
+        const size_t arg_size = strlen(argv[i]);
+        if (size + arg_size + 2 > sizeof(line)) {
+            fprintf(stderr, "command too long\n");
+            return 1;
+        }
+        memcpy(line + size, argv[i], arg_size);
+        size += arg_size;
+        line[size++] = i + 1 < argc ? ' ' : '\n';
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "cannot connect to %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    if (write(fd, line, size) != (ssize_t) size) {
+        fprintf(stderr, "cannot send the command: %s\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    // the reply ends with "ok" or "error: ..."
+    char reply[4096];
+    char tail[5] = "\n";  // last bytes seen, after a virtual leading newline
+    size_t tail_size = 1;
+    ssize_t n;
+    while ((n = read(fd, reply, sizeof(reply))) > 0) {
+        fwrite(reply, 1, (size_t) n, stdout);
+        for (ssize_t i = 0; i < n; i++) {
+            if (tail_size == sizeof(tail) - 1) {
+                memmove(tail, tail + 1, tail_size - 1);
+                tail_size--;
+            }
+            tail[tail_size++] = reply[i];
+        }
+        tail[tail_size] = '\0';
+    }
+    close(fd);
+
+    return strcmp(tail, "\nok\n") == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    const char *command = argv[1];
+    if (strcmp(command, "-h") == 0 || strcmp(command, "--help") == 0) {
+        usage(argv[0]);
+        exit(0);
+    }
+    if (strcmp(command, "-V") == 0 || strcmp(command, "--version") == 0) {
+        printf("FUSE_XATTRS version %d.%d\n", FUSE_XATTRS_VERSION_MAJOR, FUSE_XATTRS_VERSION_MINOR);
+        exit(0);
+    }
+
+    if (strcmp(command, "ctl") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "usage: %s ctl socket command...\n", argv[0]);
+            exit(1);
+        }
+        return ctl(argv[2], argc - 3, argv + 3);
+    }
+
+    int dump = 0;
+    int gc = 0;
+    int freeze = 0;
+    int replaying = 0;
+    int importing = 0;
+    if (strcmp(command, "dump") == 0) {
+        dump = 1;
+    } else if (strcmp(command, "gc") == 0) {
+        gc = 1;
+    } else if (strcmp(command, "freeze") == 0) {
+        freeze = 1;
+    } else if (strcmp(command, "replay") == 0) {
+        replaying = 1;
+    } else if (strcmp(command, "import") == 0) {
+        importing = 1;
+    } else if (strcmp(command, "restore") != 0) {
+        fprintf(stderr, "unknown command: %s\n", command);
+        fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+        exit(1);
+    }
+
+    unsigned int threads = DEFAULT_TOOL_THREADS;
+    struct replay_options replay_options = { .threads = 0, .fast = 0, .storage = 0 };
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "j:dDfSch")) != -1) {
+        switch (opt) {
+            case 'f':
+                replay_options.fast = 1;
+                break;
+            case 'S':
+                replay_options.storage = 1;
+                break;
+            case 'c':
+                sidecar_cache_init((size_t) DEFAULT_CACHE_SIZE * 1024 * 1024, DEFAULT_CACHE_TTL);
+                break;
+            case 'd':
+                dir_store_init();
+                break;
+            case 'D':
+                blob_store_init(0);
+                break;
+            case 'j':
+                threads = (unsigned int) strtoul(optarg, NULL, 10);
+                replay_options.threads = threads;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (replaying) {
+        if (argc - optind != 2) {
+            fprintf(stderr, "usage: %s replay [options] trace mountpoint|source_dir\n", argv[0]);
+            exit(1);
+        }
+        const char *dir = argv[optind + 1];
+        if (replay_options.storage) {
+            xattrs_config.source_dir = sanitized_source_directory(dir);
+            if (!xattrs_config.source_dir)
+                exit(1);
+            xattrs_config.source_dir_size = strlen(xattrs_config.source_dir);
+            dir = xattrs_config.source_dir;
+        }
+        // it would be most of what gets measured
+        debug_output = 0;
+        int res = replay(argv[optind], dir, &replay_options);
+        if (res != 0) {
+            fprintf(stderr, "replay failed: %s\n", strerror(-res));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (optind >= argc || argc - optind > (gc ? 1 : 2)) {
+        fprintf(stderr, "missing source directory\n");
+        fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+        exit(1);
+    }
+
+    xattrs_config.source_dir = sanitized_source_directory(argv[optind]);
+    if (!xattrs_config.source_dir) {
+        exit(1);
+    }
+    xattrs_config.source_dir_size = strlen(xattrs_config.source_dir);
+
+    if (freeze && optind + 1 >= argc) {
+        fprintf(stderr, "missing index file\n");
+        exit(1);
+    }
+    if (importing && optind + 1 >= argc) {
+        fprintf(stderr, "missing native directory\n");
+        exit(1);
+    }
+
+    if (importing) {
+        int res = import_native(argv[optind + 1], threads, replay_options.fast);
+        if (res != 0) {
+            fprintf(stderr, "import failed: %s\n", strerror(-res));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (gc || freeze) {
+        int res = gc ? blob_gc() : ro_index_build(argv[optind + 1]);
+        if (res != 0) {
+            fprintf(stderr, "%s failed: %s\n", command, strerror(-res));
+            return 1;
+        }
+        return 0;
+    }
+
+    const char *archive = optind + 1 < argc ? argv[optind + 1] : "-";
+    FILE *file;
+    if (strcmp(archive, "-") == 0) {
+        file = dump ? stdout : stdin;
+    } else {
+        file = fopen(archive, dump ? "w" : "r");
+        if (file == NULL) {
+            fprintf(stderr, "cannot open %s: %s\n", archive, strerror(errno));
+            exit(1);
+        }
+    }
+    setvbuf(file, NULL, _IOFBF, 1024 * 1024);
+
+    int res = dump ? archive_dump(file, threads) : archive_restore(file, threads);
+    if (fclose(file) != 0 && res == 0) {
+        res = -errno;
+    }
+
+    if (res != 0) {
+        fprintf(stderr, "%s failed: %s\n", command, strerror(-res));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "hash_table.h"
+
+#define HASH_TABLE_INITIAL_BUCKETS 64
+
+struct hash_entry {
+    struct hash_entry *next;
+    uint64_t hash;
+    void *value;
+    char key[];
+};
+
+struct hash_table {
+    struct hash_entry **buckets;
+    size_t bucket_count;
+    size_t size;
+};
+
+/* FNV-1a, 64 bits */
+uint64_t hash_bytes(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t hash_string(const char *string)
+{
+    return hash_bytes(string, strlen(string));
+}
+
+struct hash_table *hash_table_new(void)
+{
+    struct hash_table *table = malloc(sizeof(struct hash_table));
+    if (table == NULL)
+        return NULL;
+
+    table->bucket_count = HASH_TABLE_INITIAL_BUCKETS;
+    table->size = 0;
+    table->buckets = calloc(table->bucket_count, sizeof(struct hash_entry *));
+    if (table->buckets == NULL) {
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void hash_table_clear(struct hash_table *table, hash_table_free_fn free_value)
+{
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        struct hash_entry *entry = table->buckets[i];
+        while (entry != NULL) {
+            struct hash_entry *next = entry->next;
+            if (free_value != NULL)
+                free_value(entry->value);
+            free(entry);
+            entry = next;
+        }
+        table->buckets[i] = NULL;
+    }
+    table->size = 0;
+}
+
+void hash_table_free(struct hash_table *table, hash_table_free_fn free_value)
+{
+    if (table == NULL)
+        return;
+
+    hash_table_clear(table, free_value);
+    free(table->buckets);
+    free(table);
+}
+
+static struct hash_entry **__find(struct hash_table *table, const char *key, uint64_t hash)
+{
+    struct hash_entry **entry = &table->buckets[hash & (table->bucket_count - 1)];
+    while (*entry != NULL) {
+        if ((*entry)->hash == hash && strcmp((*entry)->key, key) == 0)
+            return entry;
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+static void __grow(struct hash_table *table)
+{
+    size_t bucket_count = table->bucket_count * 2;
+    struct hash_entry **buckets = calloc(bucket_count, sizeof(struct hash_entry *));
+    if (buckets == NULL)
+        return; // keep working with longer chains
+
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        struct hash_entry *entry = table->buckets[i];
+        while (entry != NULL) {
+            struct hash_entry *next = entry->next;
+            size_t idx = entry->hash & (bucket_count - 1);
+            entry->next = buckets[idx];
+            buckets[idx] = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+}
+
+void *hash_table_get(struct hash_table *table, const char *key)
+{
+    struct hash_entry *entry = *__find(table, key, hash_string(key));
+    return entry != NULL ? entry->value : NULL;
+}
+
+/**
+ * Insert or replace the value for key. The previous value (if any) is
+ * not freed.
+ * @return 0 on success, -ENOMEM on failure.
+ */
+int hash_table_put(struct hash_table *table, const char *key, void *value)
+{
+    uint64_t hash = hash_string(key);
+    struct hash_entry **slot = __find(table, key, hash);
+    if (*slot != NULL) {
+        (*slot)->value = value;
+        return 0;
+    }
+
+    size_t key_size = strlen(key) + 1;
+    struct hash_entry *entry = malloc(sizeof(struct hash_entry) + key_size);
+    if (entry == NULL)
+        return -ENOMEM;
+
+    entry->next = NULL;
+    entry->hash = hash;
+    entry->value = value;
+    memcpy(entry->key, key, key_size);
+    *slot = entry;
+
+    if (++table->size > table->bucket_count)
+        __grow(table);
+
+    return 0;
+}
+
+void *hash_table_remove(struct hash_table *table, const char *key)
+{
+    struct hash_entry **slot = __find(table, key, hash_string(key));
+    struct hash_entry *entry = *slot;
+    if (entry == NULL)
+        return NULL;
+
+    void *value = entry->value;
+    *slot = entry->next;
+    free(entry);
+    table->size--;
+
+    return value;
+}
+
+void hash_table_foreach(struct hash_table *table, hash_table_foreach_fn fn, void *data)
+{
+    for (size_t i = 0; i < table->bucket_count; i++) {
+        struct hash_entry *entry = table->buckets[i];
+        while (entry != NULL) {
+            struct hash_entry *next = entry->next;
+            fn(entry->key, entry->value, data);
+            entry = next;
+        }
+    }
+}
+
+size_t hash_table_size(struct hash_table *table)
+{
+    return table->size;
+}
@@ -0,0 +1,39 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_HASH_TABLE_H
+#define FUSE_XATTRS_HASH_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal string-keyed hash table (separate chaining). Keys are copied,
+ * values are owned by the caller. Not thread-safe: callers serialize access.
+ */
+struct hash_table;
+
+typedef void (*hash_table_free_fn)(void *value);
+typedef void (*hash_table_foreach_fn)(const char *key, void *value, void *data);
+
+uint64_t hash_bytes(const void *data, size_t size);
+uint64_t hash_string(const char *string);
+
+struct hash_table *hash_table_new(void);
+void hash_table_free(struct hash_table *table, hash_table_free_fn free_value);
+
+void *hash_table_get(struct hash_table *table, const char *key);
+int hash_table_put(struct hash_table *table, const char *key, void *value);
+void *hash_table_remove(struct hash_table *table, const char *key);
+void hash_table_clear(struct hash_table *table, hash_table_free_fn free_value);
+/* fn may remove the key it is called with, but no other key. */
+void hash_table_foreach(struct hash_table *table, hash_table_foreach_fn fn, void *data);
+size_t hash_table_size(struct hash_table *table);
+
+#endif //FUSE_XATTRS_HASH_TABLE_H
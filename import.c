@@ -0,0 +1,316 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For nftw() actions and syncfs() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "import.h"
+#include "binary_storage.h"
+#include "blob_store.h"
+#include "dir_store.h"
+#include "packed_xattrs.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include "xattrs_config.h"
+#include "fuse_xattrs_config.h"
+
+#define IMPORT_MAX_QUEUED 256   // files waiting for a worker
+
+struct import_stats {
+    uint64_t scanned;
+    uint64_t files;     // with attributes
+    uint64_t attrs;
+    uint64_t bytes;     // names and values
+    uint64_t current;   // imported before
+    uint64_t skipped;
+    uint64_t errors;
+};
+
+struct import_job {
+    char *native_path;
+    char *path;         // absolute, in the source directory
+};
+
+/* nftw() callbacks take no user data */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct import_stats stats;
+static struct thread_pool *pool = NULL;
+static size_t root_size = 0;
+static int force_import = 0;
+static int walk_error = 0;
+
+/* Per worker, large enough for any list and value */
+static __thread char names[XATTR_LIST_MAX];
+static __thread char value[XATTR_SIZE_MAX];
+
+static void __import_job_free(struct import_job *job)
+{
+    free(job->native_path);
+    free(job->path);
+    free(job);
+}
+
+/**
+ * Read the user.* attributes of path into *_attrs, their values into *data.
+ * @return the number of attributes, or -errno.
+ */
+static ssize_t __read_native(const char *path, struct binary_storage_attr **_attrs, char **data, uint64_t *bytes)
+{
+    ssize_t list_size = llistxattr(path, names, sizeof(names));
+    if (list_size == -1)
+        return errno == ENOTSUP ? 0 : -errno;
+    if (list_size == 0)
+        return 0;
+
+    size_t listed = 0;
+    for (ssize_t i = 0; i < list_size; i++)
+        listed += names[i] == '\0';
+    struct binary_storage_attr *attrs = *_attrs = malloc(listed * sizeof(struct binary_storage_attr));
+    if (attrs == NULL)
+        return -ENOMEM;
+
+    size_t count = 0;
+    size_t data_size = 0;
+    size_t data_alloc = 0;
+    for (char *name = names; name < names + list_size; name += strlen(name) + 1) {
+        if (strncmp(name, "user.", 5) != 0 ||
+            strcmp(name, PACKED_XATTRS_NAME) == 0 || strcmp(name, GENERATION_XATTR_NAME) == 0)
+            continue;
+
+        ssize_t size = lgetxattr(path, name, value, sizeof(value));
+        if (size == -1 && errno == ENODATA)
+            continue;   // removed meanwhile
+        if (size == -1)
+            return -errno;
+
+        if (data_size + (size_t) size > data_alloc) {
+            size_t alloc = data_alloc > 0 ? data_alloc : 4096;
+            while (alloc < data_size + (size_t) size)
+                alloc *= 2;
+            char *grown = realloc(*data, alloc);
+            if (grown == NULL)
+                return -ENOMEM;
+            *data = grown;
+            data_alloc = alloc;
+        }
+        memcpy(*data + data_size, value, (size_t) size);
+
+        // offsets until the values stop moving
+        attrs[count].name = name;
+        attrs[count].value = (const char *) (uintptr_t) data_size;
+        attrs[count].size = (size_t) size;
+        data_size += (size_t) size;
+        *bytes += strlen(name) + 1 + (size_t) size;
+        count++;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        attrs[i].value = *data + (uintptr_t) attrs[i].value;
+    return (ssize_t) count;
+}
+
+struct imported_match {
+    const struct binary_storage_attr *attrs;
+    size_t count;
+    size_t matched;
+};
+
+static void __imported_attr(const char *name, const char *value, size_t size, void *data)
+{
+    struct imported_match *match = data;
+    for (size_t i = 0; i < match->count; i++) {
+        if (strcmp(match->attrs[i].name, name) == 0) {
+            if (match->attrs[i].size == size && memcmp(match->attrs[i].value, value, size) == 0)
+                match->matched++;
+            return;
+        }
+    }
+}
+
+/* Whether the sidecar of path already holds every one of attrs with the same value */
+static int __imported(const char *path, const struct binary_storage_attr *attrs, size_t count)
+{
+    if (force_import)
+        return 0;
+
+    struct imported_match match = { .attrs = attrs, .count = count, .matched = 0 };
+    return binary_storage_foreach(path, __imported_attr, &match) == 0 && match.matched == count;
+}
+
+static void __import_job(void *arg)
+{
+    struct import_job *job = arg;
+    struct import_stats job_stats = { .scanned = 1 };
+    struct binary_storage_attr *attrs = NULL;
+    char *data = NULL;
+
+    struct stat st;
+    if (lstat(job->path, &st) != 0) {
+        job_stats.skipped++;
+    } else {
+        uint64_t bytes = 0;
+        ssize_t count = __read_native(job->native_path, &attrs, &data, &bytes);
+        int res = count < 0 ? (int) count : 0;
+        if (count > 0 && __imported(job->path, attrs, (size_t) count)) {
+            job_stats.current++;
+            count = 0;
+        } else if (count > 0) {
+            res = binary_storage_write_keys(job->path, attrs, (size_t) count);
+        }
+
+        if (res != 0) {
+            fprintf(stderr, "cannot import the attributes of %s: %s\n", job->native_path, strerror(-res));
+            job_stats.errors++;
+        } else if (count > 0) {
+            job_stats.files++;
+            job_stats.attrs += (uint64_t) count;
+            job_stats.bytes = bytes;
+        }
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    stats.scanned += job_stats.scanned;
+    stats.files += job_stats.files;
+    stats.attrs += job_stats.attrs;
+    stats.bytes += job_stats.bytes;
+    stats.current += job_stats.current;
+    stats.skipped += job_stats.skipped;
+    stats.errors += job_stats.errors;
+    pthread_mutex_unlock(&stats_lock);
+
+    free(attrs);
+    free(data);
+    __import_job_free(job);
+}
+
+static int __import_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    const char *name = fpath + ftwbuf->base;
+    const char *relative = fpath[root_size] != '\0' ? fpath + root_size : "/";
+
+    if (typeflag == FTW_DNR || typeflag == FTW_NS) {
+        fprintf(stderr, "cannot read %s: %s\n", fpath, strerror(errno));
+        pthread_mutex_lock(&stats_lock);
+        stats.errors++;
+        pthread_mutex_unlock(&stats_lock);
+        return FTW_CONTINUE;
+    }
+    if (typeflag == FTW_D && strcmp(relative, "/" BLOB_STORE_NAME) == 0)
+        return FTW_SKIP_SUBTREE;
+    if (typeflag != FTW_F && typeflag != FTW_D)
+        return FTW_CONTINUE;    // symbolic links can't have user.* attributes
+
+    // sidecars and stores, when importing a source directory in place
+    if (typeflag == FTW_F && (filename_is_sidecar(name) || strcmp(name, DIR_STORE_NAME) == 0 ||
+                              strcmp(relative, "/" BINARY_SIDECAR_EXT) == 0))
+        return FTW_CONTINUE;
+
+    struct import_job *job = malloc(sizeof(struct import_job));
+    if (job == NULL) {
+        walk_error = -ENOMEM;
+        return FTW_STOP;
+    }
+    job->native_path = strdup(fpath);
+    job->path = prepend_source_directory(relative);
+    if (job->native_path == NULL || job->path == NULL) {
+        __import_job_free(job);
+        walk_error = -ENOMEM;
+        return FTW_STOP;
+    }
+
+    int res = thread_pool_submit(pool, __import_job, job, 1);
+    if (res != 0) {
+        __import_job_free(job);
+        walk_error = res;
+        return FTW_STOP;
+    }
+    return FTW_CONTINUE;
+}
+
+static void __report(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+    double mib = (double) stats.bytes / (1024 * 1024);
+
+    fprintf(stderr, "import: %" PRIu64 " files (%" PRIu64 " with attributes), %" PRIu64
+                    " attributes, %.1f MiB in %.2fs (%.1f MiB/s, %.0f files/s)\n",
+            stats.scanned, stats.files, stats.attrs, mib, seconds,
+            seconds > 0 ? mib / seconds : 0, seconds > 0 ? (double) stats.scanned / seconds : 0);
+
+    if (stats.current > 0)
+        fprintf(stderr, "import: %" PRIu64 " files up to date (imported before, -f imports them again)\n",
+                stats.current);
+    if (stats.skipped > 0)
+        fprintf(stderr, "import: %" PRIu64 " files skipped (missing from the source directory)\n", stats.skipped);
+    if (stats.errors > 0)
+        fprintf(stderr, "import: %" PRIu64 " errors\n", stats.errors);
+}
+
+int import_native(const char *native_dir, unsigned int threads, int force)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *root = realpath(native_dir, NULL);
+    if (root == NULL) {
+        int res = -errno;
+        fprintf(stderr, "cannot open %s: %s\n", native_dir, strerror(errno));
+        return res;
+    }
+    root_size = strcmp(root, "/") == 0 ? 0 : strlen(root);
+    force_import = force;
+    walk_error = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    pool = thread_pool_new(threads > 0 ? threads : 1, IMPORT_MAX_QUEUED);
+    if (pool == NULL) {
+        free(root);
+        return -ENOMEM;
+    }
+
+    int res = 0;
+    if (nftw(root, __import_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0)
+        res = walk_error != 0 ? walk_error : -errno;
+    thread_pool_free(pool);
+    pool = NULL;
+    free(root);
+
+    // imported sidecars are only durable once the filesystem is synced
+    int fd = open(xattrs_config.source_dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || syncfs(fd) != 0) {
+        fprintf(stderr, "cannot sync %s: %s\n", xattrs_config.source_dir, strerror(errno));
+        if (res == 0)
+            res = -EIO;
+    }
+    if (fd != -1)
+        close(fd);
+
+    __report(&start);
+
+    if (res != 0)
+        return res;
+    return stats.errors > 0 ? -EIO : 0;
+}
@@ -0,0 +1,32 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_IMPORT_H
+#define FUSE_XATTRS_IMPORT_H
+
+/*
+ * Import of the native user.* attributes of a tree into the sidecars of
+ * xattrs_config.source_dir, without a mount: each file costs a llistxattr,
+ * one lgetxattr per attribute and a single sidecar rewrite. native_dir may
+ * be the source directory itself, or a copy of it (same relative paths).
+ *
+ * Imports can be resumed: a file whose sidecar already holds each of its
+ * native attributes with the same value was imported before and is not
+ * rewritten, unless force is set.
+ */
+
+/**
+ * Import the attributes of every file and directory below native_dir
+ * with threads workers. Files missing from the source directory are
+ * skipped.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int import_native(const char *native_dir, unsigned int threads, int force);
+
+#endif //FUSE_XATTRS_IMPORT_H
@@ -0,0 +1,248 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For memrchr */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "arena.h"
+#include "utils.h"
+#include "fuse_xattrs_config.h"
+
+// read back at startup to find the last sequence number, longer than any line
+#define JOURNAL_TAIL_SIZE (64 * 1024)
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static char *journal_path = NULL;
+static char *rotate_from = NULL;
+static char *rotate_to = NULL;
+static uint64_t journal_limit = 0;  // bytes before rotating
+static uint64_t journal_size = 0;   // bytes in journal_fd
+static uint64_t sequence = 0;
+
+static const char *op_names[] = {
+        [JOURNAL_SET]    = "set",
+        [JOURNAL_REMOVE] = "remove",
+        [JOURNAL_RENAME] = "rename",
+        [JOURNAL_UNLINK] = "unlink",
+};
+
+static int __write_all(int fd, const char *buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, buffer, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return -errno;
+        buffer += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * Find the sequence number of the last line of the journal open on fd,
+ * dropping a line left incomplete by a crash.
+ * @return the sequence number, 0 if there are no lines.
+ */
+static uint64_t __recover(int fd, uint64_t *size)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        *size = 0;
+        return 0;
+    }
+
+    const off_t start = st.st_size > JOURNAL_TAIL_SIZE ? st.st_size - JOURNAL_TAIL_SIZE : 0;
+    const size_t tail_size = (size_t) (st.st_size - start);
+    char *tail = malloc(tail_size + 1);
+    uint64_t last = 0;
+    *size = (uint64_t) st.st_size;
+
+    if (tail != NULL && pread(fd, tail, tail_size, start) == (ssize_t) tail_size) {
+        tail[tail_size] = '\0';
+        char *end = memrchr(tail, '\n', tail_size);
+        const size_t complete = end != NULL ? (size_t) (end - tail) + 1 : 0;
+        if (complete < tail_size && ftruncate(fd, start + (off_t) complete) == 0)
+            *size = (uint64_t) (start + (off_t) complete);
+
+        if (end != NULL) {
+            *end = '\0';
+            char *line = memrchr(tail, '\n', (size_t) (end - tail));
+            last = strtoull(line != NULL ? line + 1 : tail, NULL, 10);
+        }
+    }
+    free(tail);
+    return last;
+}
+
+/* @param last - set to the sequence number of its last line */
+static int __open_journal(uint64_t *last)
+{
+    journal_fd = open(journal_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (journal_fd == -1)
+        return -errno;
+    *last = __recover(journal_fd, &journal_size);
+    return 0;
+}
+
+int journal_open(const char *path, unsigned int size)
+{
+    char cwd[PATH_MAX];
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL)
+        return -errno;
+
+    const size_t path_size = (path[0] != '/' ? strlen(cwd) + 1 : 0) + strlen(path) + 1;
+    const size_t rotated_size = path_size + 12;   // ".<int>"
+    journal_path = malloc(path_size);
+    rotate_from = malloc(rotated_size);
+    rotate_to = malloc(rotated_size);
+    if (journal_path == NULL || rotate_from == NULL || rotate_to == NULL) {
+        journal_close();
+        return -ENOMEM;
+    }
+    if (path[0] != '/')
+        snprintf(journal_path, path_size, "%s/%s", cwd, path);
+    else
+        strcpy(journal_path, path);
+
+    journal_limit = (uint64_t) (size > 0 ? size : DEFAULT_JOURNAL_SIZE) * 1024 * 1024;
+
+    int res = __open_journal(&sequence);
+    if (res != 0) {
+        journal_close();
+        return res;
+    }
+
+    // a journal rotated right before a restart is empty
+    if (sequence == 0) {
+        snprintf(rotate_from, rotated_size, "%s.1", journal_path);
+        int fd = open(rotate_from, O_RDWR | O_CLOEXEC);
+        if (fd != -1) {
+            uint64_t rotated;
+            sequence = __recover(fd, &rotated);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+void journal_close(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd != -1)
+        close(journal_fd);
+    journal_fd = -1;
+    free(journal_path);
+    free(rotate_from);
+    free(rotate_to);
+    journal_path = rotate_from = rotate_to = NULL;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/* Must be called with journal_lock held. */
+static void __rotate(void)
+{
+    const size_t rotated_size = strlen(journal_path) + 12;
+    for (int i = JOURNAL_FILES - 1; i >= 1; i--) {
+        snprintf(rotate_from, rotated_size, "%s.%d", journal_path, i);
+        snprintf(rotate_to, rotated_size, "%s.%d", journal_path, i + 1);
+        if (rename(rotate_from, rotate_to) != 0 && errno != ENOENT)
+            error_print("cannot rotate %s: %s\n", rotate_from, strerror(errno));
+    }
+    snprintf(rotate_to, rotated_size, "%s.1", journal_path);
+    if (rename(journal_path, rotate_to) != 0) {
+        error_print("cannot rotate %s: %s\n", journal_path, strerror(errno));
+        return;
+    }
+
+    close(journal_fd);
+    uint64_t last;
+    int res = __open_journal(&last);
+    if (res != 0)
+        error_print("cannot open %s: %s, journaling stopped\n", journal_path, strerror(-res));
+}
+
+/* Copy src to dst, escaped. @return the end of dst, which needs 3 * strlen(src) bytes */
+static char *__escape(char *dst, const char *src)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (const unsigned char *c = (const unsigned char *) src; *c != '\0'; c++) {
+        if (*c <= ' ' || *c == '%' || *c == 0x7f) {
+            *dst++ = '%';
+            *dst++ = hex[*c >> 4];
+            *dst++ = hex[*c & 0xf];
+        } else {
+            *dst++ = (char) *c;
+        }
+    }
+    return dst;
+}
+
+void journal_record(enum journal_op op, const char *path, const char *arg)
+{
+    if (__atomic_load_n(&journal_fd, __ATOMIC_RELAXED) == -1)
+        return;
+
+    struct arena_mark mark = arena_mark();
+    const size_t size = 64 + 3 * strlen(path) + (arg != NULL ? 1 + 3 * strlen(arg) : 0) + 1;
+    char *line = arena_alloc(size);
+    if (line == NULL) {
+        error_print("cannot journal a change of %s\n", path);
+        arena_rewind(mark);
+        return;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd != -1) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        // a failed write still takes its number: consumers see the gap
+        char *end = line + snprintf(line, size, "%llu %lld.%09ld %s ", (unsigned long long) ++sequence,
+                                    (long long) ts.tv_sec, ts.tv_nsec, op_names[op]);
+        end = __escape(end, path);
+        if (arg != NULL) {
+            *end++ = ' ';
+            end = __escape(end, arg);
+        }
+        *end++ = '\n';
+
+        int res = __write_all(journal_fd, line, (size_t) (end - line));
+        if (res != 0) {
+            error_print("cannot write the journal: %s\n", strerror(-res));
+            if (ftruncate(journal_fd, (off_t) journal_size) != 0)
+                error_print("cannot truncate the journal: %s\n", strerror(errno));
+        } else if ((journal_size += (uint64_t) (end - line)) >= journal_limit) {
+            __rotate();
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+    arena_rewind(mark);
+}
+
+uint64_t journal_sequence(void)
+{
+    pthread_mutex_lock(&journal_lock);
+    uint64_t res = journal_fd != -1 ? sequence : 0;
+    pthread_mutex_unlock(&journal_lock);
+    return res;
+}
@@ -0,0 +1,63 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_JOURNAL_H
+#define FUSE_XATTRS_JOURNAL_H
+
+#include <stdint.h>
+
+/*
+ * Change journal (-o journal=FILE): every attribute change made through
+ * the mount is appended to FILE as a line of text, so that indexers can
+ * follow changes instead of rescanning the tree:
+ *
+ *     SEQ TIME set PATH NAME         NAME was set on PATH
+ *     SEQ TIME remove PATH NAME      NAME was removed from PATH
+ *     SEQ TIME rename PATH NEWPATH   a file with attributes, or a directory, moved
+ *     SEQ TIME unlink PATH           a file with attributes was removed
+ *
+ * With -o dir_store or -o native_xattrs, every rename and unlink is logged.
+ * SEQ grows by one per line, also across rotations and restarts; TIME is
+ * seconds.nanoseconds since the epoch. A gap in SEQ means lines could not
+ * be written (disk full): consumers should rescan. Paths are relative to
+ * the mount root ("/dir/file"). Bytes below 0x21, '%' and 0x7f in paths
+ * and names are written as %XX. Setting user.fuse_xattrs.all logs one set
+ * per attribute.
+ *
+ * Past journal_size MiB, FILE is renamed FILE.1 (FILE.1 to FILE.2 and so
+ * on, JOURNAL_FILES are kept) and a new FILE started. A consumer keeps
+ * the last SEQ it handled; when FILE was rotated under it, it finishes
+ * FILE.1 first.
+ */
+enum journal_op {
+    JOURNAL_SET,
+    JOURNAL_REMOVE,
+    JOURNAL_RENAME,
+    JOURNAL_UNLINK,
+};
+
+/**
+ * Start appending to journal_path, before fuse_main() (it may leave the
+ * working directory).
+ * @param size - MiB before rotating, 0: DEFAULT_JOURNAL_SIZE
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int journal_open(const char *journal_path, unsigned int size);
+void journal_close(void);
+
+/**
+ * Log a change, if journaling.
+ * @param arg - attribute name or new path, NULL for JOURNAL_UNLINK
+ */
+void journal_record(enum journal_op op, const char *path, const char *arg);
+
+/* @return sequence number of the last line written, 0 when not journaling. */
+uint64_t journal_sequence(void);
+
+#endif //FUSE_XATTRS_JOURNAL_H
@@ -0,0 +1,312 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "native_storage.h"
+#include "binary_storage.h"
+#include "query_index.h"
+#include "utils.h"
+#include "fuse_xattrs_config.h"
+
+#define NATIVE_PROBE_NAME "user.fuse_xattrs.probe"
+#define NATIVE_MAX_DEVICES 64 // probe results kept, later devices are probed every time
+
+struct device_support {
+    dev_t dev;
+    int supported;
+};
+
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct device_support devices[NATIVE_MAX_DEVICES];
+static size_t devices_size = 0;
+
+/* @return 1 or 0 when known, -1 when the probe was inconclusive. */
+static int __probe(const char *path)
+{
+    // reading a missing attribute doesn't touch the file
+    if (lgetxattr(path, NATIVE_PROBE_NAME, NULL, 0) >= 0 || errno == ENODATA)
+        return 1;
+    if (errno == ENOTSUP)
+        return 0;
+
+    debug_print("inconclusive probe: path=%s errno=%d\n", path, errno);
+    return -1;
+}
+
+int native_storage_supported(const char *path)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return 0;
+
+    // the kernel only allows user.* on regular files and directories
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+        return 0;
+
+    pthread_mutex_lock(&devices_lock);
+    for (size_t i = 0; i < devices_size; i++) {
+        if (devices[i].dev == st.st_dev) {
+            int supported = devices[i].supported;
+            pthread_mutex_unlock(&devices_lock);
+            return supported;
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+
+    int supported = __probe(path);
+    if (supported == -1)
+        return 0;
+
+    pthread_mutex_lock(&devices_lock);
+    if (devices_size < NATIVE_MAX_DEVICES) {
+        size_t i;
+        for (i = 0; i < devices_size && devices[i].dev != st.st_dev; i++);
+        if (i == devices_size) {
+            devices[devices_size].dev = st.st_dev;
+            devices[devices_size].supported = supported;
+            devices_size++;
+            debug_print("device %lu: native xattrs %s\n", (unsigned long) st.st_dev,
+                        supported ? "supported" : "not supported");
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+
+    return supported;
+}
+
+/* @return 1 if the sidecar of path holds name. Expects the sidecar locked. */
+static int __in_sidecar(const char *path, const char *name)
+{
+    return binary_storage_read_key_locked(path, name, NULL, 0) >= 0;
+}
+
+/* A value the native xattrs refuse, but a sidecar can still hold. */
+static int __too_large(int res)
+{
+    return res == -ENOSPC || res == -E2BIG || res == -ERANGE;
+}
+
+/* Store the value of name in the sidecar, out of the native xattrs. */
+static int __write_sidecar(const char *path, const char *name, const char *value, size_t size, int flags,
+                           int in_sidecar)
+{
+    const int in_native = lgetxattr(path, name, NULL, 0) >= 0;
+    if ((flags & XATTR_CREATE) && in_native)
+        return -EEXIST;
+    if ((flags & XATTR_REPLACE) && !in_native && !in_sidecar)
+        return -ENODATA;
+
+    int res = binary_storage_write_key_locked(path, name, value, size, 0);
+    // the native copy would hide it
+    if (res == 0 && in_native && lremovexattr(path, name) != 0 && errno != ENODATA)
+        res = -errno;
+    return res;
+}
+
+int native_storage_write_key(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    if (!native_storage_supported(path))
+        return binary_storage_write_key(path, name, value, size, flags);
+
+    // no other request sees name in both places, or in none
+    pthread_mutex_t *lock = binary_storage_lock(path);
+    const int in_sidecar = __in_sidecar(path, name);
+    int res = 0;
+    if (in_sidecar && (flags & XATTR_CREATE)) {
+        res = -EEXIST;
+    } else if (lsetxattr(path, name, value, size, in_sidecar ? 0 : flags) == 0) {
+        // XATTR_REPLACE is already satisfied by the sidecar copy
+        if (in_sidecar)
+            binary_storage_remove_key_locked(path, name);
+        query_index_set(path, name, value, size);
+    } else {
+        res = -errno;
+        if (res == -ENOTSUP)
+            res = binary_storage_write_key_locked(path, name, value, size, flags);
+        else if (__too_large(res))
+            res = __write_sidecar(path, name, value, size, flags, in_sidecar);
+    }
+    binary_storage_unlock(lock);
+
+    return res;
+}
+
+int native_storage_read_key(const char *path, const char *name, char *value, size_t size)
+{
+    if (!native_storage_supported(path))
+        return binary_storage_read_key(path, name, value, size);
+
+    ssize_t res = lgetxattr(path, name, value, size);
+    if (res >= 0)
+        return (int) res;
+    if (errno != ENODATA)
+        return -errno;
+
+    // again with writes held off: name may have just moved out of the sidecar
+    pthread_mutex_t *lock = binary_storage_lock(path);
+    res = lgetxattr(path, name, value, size);
+    if (res < 0)
+        res = errno == ENODATA ? binary_storage_read_key_locked(path, name, value, size) : -errno;
+    binary_storage_unlock(lock);
+
+    return (int) res;
+}
+
+/* @return the user.* names of path, NULL and -errno in *size on failure. */
+static char *__native_list(const char *path, ssize_t *size)
+{
+    for (;;) {
+        ssize_t needed = llistxattr(path, NULL, 0);
+        if (needed < 0) {
+            *size = -errno;
+            return NULL;
+        }
+
+        char *list = malloc(needed > 0 ? (size_t) needed : 1);
+        if (list == NULL) {
+            *size = -ENOMEM;
+            return NULL;
+        }
+
+        ssize_t res = llistxattr(path, list, (size_t) needed);
+        if (res < 0) {
+            free(list);
+            if (errno == ERANGE)
+                continue; // grew meanwhile
+            *size = -errno;
+            return NULL;
+        }
+
+        // security.selinux and friends aren't ours to show
+        ssize_t kept = 0;
+        for (ssize_t offset = 0; offset < res;) {
+            size_t len = strlen(list + offset) + 1;
+            if (get_namespace(list + offset) == USER) {
+                memmove(list + kept, list + offset, len);
+                kept += len;
+            }
+            offset += len;
+        }
+
+        *size = kept;
+        return list;
+    }
+}
+
+/* @return the names in the sidecar of path, NULL and -errno in *size on failure. */
+static char *__sidecar_list(const char *path, ssize_t *size)
+{
+    for (;;) {
+        int needed = binary_storage_list_keys(path, NULL, 0);
+        if (needed < 0) {
+            *size = needed;
+            return NULL;
+        }
+
+        char *list = malloc(needed > 0 ? (size_t) needed : 1);
+        if (list == NULL) {
+            *size = -ENOMEM;
+            return NULL;
+        }
+
+        int res = needed > 0 ? binary_storage_list_keys(path, list, (size_t) needed) : 0;
+        if (res < 0) {
+            free(list);
+            if (res == -ERANGE)
+                continue;
+            *size = res;
+            return NULL;
+        }
+
+        *size = res;
+        return list;
+    }
+}
+
+static int __list_contains(const char *list, ssize_t size, const char *name)
+{
+    for (ssize_t offset = 0; offset < size; offset += strlen(list + offset) + 1) {
+        if (strcmp(list + offset, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+int native_storage_list_keys(const char *path, char *list, size_t size)
+{
+    if (!native_storage_supported(path))
+        return binary_storage_list_keys(path, list, size);
+
+    ssize_t native_size;
+    char *native = __native_list(path, &native_size);
+    if (native == NULL)
+        return (int) native_size;
+
+    ssize_t sidecar_size;
+    char *sidecar = __sidecar_list(path, &sidecar_size);
+    if (sidecar == NULL) {
+        free(native);
+        return (int) sidecar_size;
+    }
+
+    // native names first, then the sidecar ones not migrated yet
+    size_t total = (size_t) native_size;
+    for (ssize_t offset = 0; offset < sidecar_size;) {
+        size_t len = strlen(sidecar + offset) + 1;
+        if (!__list_contains(native, native_size, sidecar + offset)) {
+            memmove(sidecar + (total - native_size), sidecar + offset, len);
+            total += len;
+        }
+        offset += len;
+    }
+
+    int res;
+    if (total > XATTR_LIST_MAX) {
+        res = -E2BIG;
+    } else if (size == 0) {
+        res = (int) total;
+    } else if (total > size) {
+        res = -ERANGE;
+    } else {
+        memcpy(list, native, (size_t) native_size);
+        memcpy(list + native_size, sidecar, total - native_size);
+        res = (int) total;
+    }
+
+    free(native);
+    free(sidecar);
+    return res;
+}
+
+int native_storage_remove_key(const char *path, const char *name)
+{
+    if (!native_storage_supported(path))
+        return binary_storage_remove_key(path, name);
+
+    pthread_mutex_t *lock = binary_storage_lock(path);
+    int native_res = lremovexattr(path, name) == 0 ? 0 : -errno;
+    if (native_res == 0)
+        query_index_remove(path, name);
+
+    int sidecar_res = binary_storage_remove_key_locked(path, name);
+    binary_storage_unlock(lock);
+    if (sidecar_res == -ENOENT)
+        sidecar_res = -ENODATA; // no sidecar at all
+
+    if (native_res == 0 || sidecar_res == 0)
+        return 0;
+    return native_res != -ENODATA ? native_res : sidecar_res;
+}
@@ -0,0 +1,35 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_NATIVE_STORAGE_H
+#define FUSE_XATTRS_NATIVE_STORAGE_H
+
+#include <stddef.h>
+
+/*
+ * Hybrid storage: user.* attributes of regular files and directories
+ * living on a filesystem with native xattr support are stored there, the
+ * rest goes to sidecars. Support is probed once per st_dev.
+ *
+ * Attributes stored in a sidecar before may still be there: reads fall
+ * back to the sidecar, writes and removes move them out of it. Values the
+ * native xattrs refuse for lack of space or size (ENOSPC, E2BIG, ERANGE)
+ * stay in the sidecar. A move holds the sidecar lock, so other requests
+ * never see an attribute in both places or in neither.
+ *
+ * Same interface as binary_storage, path is the absolute (source) path.
+ */
+int native_storage_supported(const char *path);
+
+int native_storage_write_key(const char *path, const char *name, const char *value, size_t size, int flags);
+int native_storage_read_key(const char *path, const char *name, char *value, size_t size);
+int native_storage_list_keys(const char *path, char *list, size_t size);
+int native_storage_remove_key(const char *path, const char *name);
+
+#endif //FUSE_XATTRS_NATIVE_STORAGE_H
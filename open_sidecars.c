@@ -0,0 +1,191 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "open_sidecars.h"
+#include "hash_table.h"
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_table *entries = NULL;
+
+static unsigned long kept_fds = 0;
+static unsigned long max_fds = 0;
+static pthread_once_t max_fds_once = PTHREAD_ONCE_INIT;
+
+static void __max_fds_init(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+        max_fds = 1024 / OPEN_SIDECARS_FD_SHARE;
+    else
+        max_fds = (unsigned long) limit.rlim_cur / OPEN_SIDECARS_FD_SHARE;
+}
+
+int open_sidecars_fd_available(void)
+{
+    pthread_once(&max_fds_once, __max_fds_init);
+    return __atomic_load_n(&kept_fds, __ATOMIC_RELAXED) < max_fds;
+}
+
+void open_sidecars_keep_fd(struct open_sidecar *entry, int fd, int writable)
+{
+    open_sidecars_forget(entry);
+    entry->fd = fd;
+    entry->writable = writable;
+    __atomic_add_fetch(&kept_fds, 1, __ATOMIC_RELAXED);
+}
+
+struct open_sidecar *open_sidecars_get(const char *path)
+{
+    pthread_mutex_lock(&table_lock);
+    struct open_sidecar *entry = entries != NULL ? hash_table_get(entries, path) : NULL;
+    pthread_mutex_unlock(&table_lock);
+
+    return entry;
+}
+
+int open_sidecars_hold(const char *path)
+{
+    int res = 0;
+    pthread_mutex_lock(&table_lock);
+    if (entries == NULL)
+        entries = hash_table_new();
+
+    struct open_sidecar *entry = entries != NULL ? hash_table_get(entries, path) : NULL;
+    if (entry != NULL) {
+        entry->handles++;
+    } else if ((entry = calloc(1, sizeof(struct open_sidecar))) == NULL) {
+        res = -ENOMEM;
+    } else {
+        entry->handles = 1;
+        entry->fd = -1;
+        if (entries == NULL || hash_table_put(entries, path, entry) != 0) {
+            free(entry);
+            res = -ENOMEM;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    return res;
+}
+
+void open_sidecars_forget(struct open_sidecar *entry)
+{
+    if (entry->fd != -1) {
+        close(entry->fd);
+        __atomic_sub_fetch(&kept_fds, 1, __ATOMIC_RELAXED);
+    }
+    entry->fd = -1;
+    entry->writable = 0;
+    sidecar_data_release(entry->data);
+    entry->data = NULL;
+}
+
+static void __free_entry(void *value)
+{
+    struct open_sidecar *entry = value;
+    open_sidecars_forget(entry);
+    free(entry);
+}
+
+void open_sidecars_release(const char *path)
+{
+    struct open_sidecar *entry = NULL;
+
+    pthread_mutex_lock(&table_lock);
+    if (entries != NULL && (entry = hash_table_get(entries, path)) != NULL) {
+        if (--entry->handles == 0)
+            hash_table_remove(entries, path);
+        else
+            entry = NULL;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    if (entry != NULL)
+        __free_entry(entry);
+}
+
+/* Must be called with table_lock held. */
+static void __move(const char *from, const char *to)
+{
+    struct open_sidecar *entry = hash_table_remove(entries, from);
+    if (entry == NULL)
+        return;
+
+    struct open_sidecar *replaced = hash_table_get(entries, to);
+    if (replaced != NULL) {
+        // handles of the replaced file now name this one; its sidecar is gone
+        entry->handles += replaced->handles;
+        open_sidecars_forget(entry);
+        hash_table_remove(entries, to);
+        __free_entry(replaced);
+    }
+
+    if (hash_table_put(entries, to, entry) != 0)
+        __free_entry(entry);
+}
+
+struct prefix_match {
+    const char *prefix;
+    size_t prefix_size;
+    char **paths;
+    size_t count;
+};
+
+static void __collect_prefixed(const char *key, void *value, void *data)
+{
+    (void) value;
+    struct prefix_match *match = data;
+
+    if (strncmp(key, match->prefix, match->prefix_size) == 0 && key[match->prefix_size] == '/')
+        match->paths[match->count++] = strdup(key);
+}
+
+void open_sidecars_rename(const char *from, const char *to, int is_directory)
+{
+    pthread_mutex_lock(&table_lock);
+    if (entries == NULL) {
+        pthread_mutex_unlock(&table_lock);
+        return;
+    }
+
+    if (!is_directory) {
+        __move(from, to);
+        pthread_mutex_unlock(&table_lock);
+        return;
+    }
+
+    struct prefix_match match = { from, strlen(from), NULL, 0 };
+    match.paths = malloc(sizeof(char *) * (hash_table_size(entries) + 1));
+    if (match.paths != NULL)
+        hash_table_foreach(entries, __collect_prefixed, &match);
+
+    const size_t to_size = strlen(to);
+    for (size_t i = 0; i < match.count; i++) {
+        if (match.paths[i] == NULL)
+            continue;
+        const char *suffix = match.paths[i] + match.prefix_size;
+        char *new_path = malloc(to_size + strlen(suffix) + 1);
+        if (new_path != NULL) {
+            memcpy(new_path, to, to_size);
+            strcpy(new_path + to_size, suffix);
+            __move(match.paths[i], new_path);
+            free(new_path);
+        }
+        free(match.paths[i]);
+    }
+    free(match.paths);
+    pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,63 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_OPEN_SIDECARS_H
+#define FUSE_XATTRS_OPEN_SIDECARS_H
+
+#include <sys/stat.h>
+
+#include "sidecar_cache.h"
+
+/*
+ * Sidecars of the files that have open handles, keyed by (source) path.
+ * While a file is open its sidecar fd and contents stay resident, so
+ * repeated xattr calls on it neither reopen nor reparse the sidecar.
+ *
+ * The table has its own lock, but the fields of an entry belong to the
+ * sidecar lock of its path (see binary_storage.c): entries are only
+ * created, modified and freed with it held.
+ *
+ * A resident sidecar doubles the descriptors an open file costs, so at
+ * most 1/OPEN_SIDECARS_FD_SHARE of RLIMIT_NOFILE are kept: past that,
+ * open files read and write their sidecars like closed ones do. A file
+ * without a sidecar keeps no fd either, its sidecar is opened (created)
+ * on the first write; the absence is remembered by the sidecar cache.
+ */
+#define OPEN_SIDECARS_FD_SHARE 4
+
+struct open_sidecar {
+    unsigned int handles;
+    int fd;                     // -1: not opened yet, or there is no sidecar
+    int writable;
+    struct stat st;             // of fd when data was loaded or written
+    struct sidecar_data *data;  // NULL: not loaded, size 0: no attributes
+};
+
+/* @return the entry of path, or NULL if it isn't open. */
+struct open_sidecar *open_sidecars_get(const char *path);
+
+/* @return On success, zero is returned. On failure, -errno is returned. */
+int open_sidecars_hold(const char *path);
+
+/* Drop a handle; the last one closes the sidecar. */
+void open_sidecars_release(const char *path);
+
+/* @return 1 if another sidecar fd can be kept open. */
+int open_sidecars_fd_available(void);
+
+/* Keep fd, open on the sidecar of entry, in place of the previous one. */
+void open_sidecars_keep_fd(struct open_sidecar *entry, int fd, int writable);
+
+/* Close the sidecar and drop its contents, they are reloaded on demand. */
+void open_sidecars_forget(struct open_sidecar *entry);
+
+/* Move the entries of from (and below it, for a directory) to to. */
+void open_sidecars_rename(const char *from, const char *to, int is_directory);
+
+#endif //FUSE_XATTRS_OPEN_SIDECARS_H
@@ -0,0 +1,162 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "own_changes.h"
+#include "hash_table.h"
+
+#define OWN_CHANGES_MAX 4096    // written paths remembered, dropped all at once beyond
+#define INODE_KEY_SIZE 48
+
+struct own_state {
+    ino_t ino;
+    off_t size;                 // -1: removed
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_table *written = NULL;   // path -> struct own_state
+static struct hash_table *opened = NULL;    // inode -> unsigned int handles
+static int enabled = 0;
+
+static void __state(const char *path, struct own_state *state)
+{
+    struct stat st;
+    memset(state, 0, sizeof(struct own_state));
+    if (lstat(path, &st) != 0) {
+        state->size = -1;
+        return;
+    }
+    state->ino = st.st_ino;
+    state->size = st.st_size;
+    state->mtime = st.st_mtim;
+    state->ctime = st.st_ctim;
+}
+
+static void __inode_key(const struct stat *st, char *key)
+{
+    snprintf(key, INODE_KEY_SIZE, "%llu:%llu", (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+}
+
+void own_changes_enable(void)
+{
+    pthread_mutex_lock(&lock);
+    if (written == NULL)
+        written = hash_table_new();
+    if (opened == NULL)
+        opened = hash_table_new();
+    enabled = written != NULL && opened != NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+int own_changes_enabled(void)
+{
+    return enabled;
+}
+
+void own_changes_record(const char *path)
+{
+    if (!enabled)
+        return;
+
+    struct own_state *state = malloc(sizeof(struct own_state));
+    if (state == NULL)
+        return;
+    __state(path, state);
+
+    pthread_mutex_lock(&lock);
+    free(hash_table_remove(written, path));
+    if (hash_table_size(written) >= OWN_CHANGES_MAX)
+        hash_table_clear(written, free);
+    if (hash_table_put(written, path, state) != 0)
+        free(state);
+    pthread_mutex_unlock(&lock);
+}
+
+int own_changes_match(const char *path)
+{
+    if (!enabled)
+        return 0;
+
+    struct own_state current;
+    __state(path, &current);
+
+    pthread_mutex_lock(&lock);
+    struct own_state *state = hash_table_get(written, path);
+    const int match = state != NULL && state->ino == current.ino && state->size == current.size &&
+                      state->mtime.tv_sec == current.mtime.tv_sec &&
+                      state->mtime.tv_nsec == current.mtime.tv_nsec &&
+                      state->ctime.tv_sec == current.ctime.tv_sec &&
+                      state->ctime.tv_nsec == current.ctime.tv_nsec;
+    // changed by someone else since: nothing to skip until our next write
+    if (state != NULL && !match)
+        free(hash_table_remove(written, path));
+    pthread_mutex_unlock(&lock);
+
+    return match;
+}
+
+void own_changes_open(int fd)
+{
+    struct stat st;
+    if (!enabled || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+
+    char key[INODE_KEY_SIZE];
+    __inode_key(&st, key);
+
+    pthread_mutex_lock(&lock);
+    unsigned int *handles = hash_table_get(opened, key);
+    if (handles != NULL) {
+        (*handles)++;
+    } else if ((handles = malloc(sizeof(unsigned int))) != NULL) {
+        *handles = 1;
+        if (hash_table_put(opened, key, handles) != 0)
+            free(handles);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void own_changes_release(int fd)
+{
+    struct stat st;
+    if (!enabled || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+
+    char key[INODE_KEY_SIZE];
+    __inode_key(&st, key);
+
+    pthread_mutex_lock(&lock);
+    unsigned int *handles = hash_table_get(opened, key);
+    if (handles != NULL && --(*handles) == 0)
+        free(hash_table_remove(opened, key));
+    pthread_mutex_unlock(&lock);
+}
+
+int own_changes_is_open(const struct stat *st)
+{
+    if (!enabled)
+        return 0;
+
+    char key[INODE_KEY_SIZE];
+    __inode_key(st, key);
+
+    pthread_mutex_lock(&lock);
+    const int is_open = hash_table_get(opened, key) != NULL;
+    pthread_mutex_unlock(&lock);
+
+    return is_open;
+}
@@ -0,0 +1,45 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_OWN_CHANGES_H
+#define FUSE_XATTRS_OWN_CHANGES_H
+
+#include <sys/stat.h>
+
+/*
+ * What this process changed in the source directory, so the watcher
+ * (-o watch) can skip the events of its own writes. Nothing is recorded
+ * until own_changes_enable() is called.
+ *
+ * Sidecars and stores are remembered with the state (inode, size, times)
+ * they were left in: as long as they still match it, an event on them is
+ * ours. Data files are remembered by inode while they have handles open
+ * through the mount.
+ */
+
+void own_changes_enable(void);
+int own_changes_enabled(void);
+
+/**
+ * Record that path was just written or removed by us.
+ * @param path - absolute path of a sidecar or a store.
+ */
+void own_changes_record(const char *path);
+
+/* @return 1 if path is still as we left it, 0 otherwise. */
+int own_changes_match(const char *path);
+
+/* A handle of the file fd was opened through the mount, or is released. */
+void own_changes_open(int fd);
+void own_changes_release(int fd);
+
+/* @return 1 if the file st describes has handles open through the mount. */
+int own_changes_is_open(const struct stat *st);
+
+#endif //FUSE_XATTRS_OWN_CHANGES_H
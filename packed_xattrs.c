@@ -0,0 +1,200 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "packed_xattrs.h"
+#include "binary_storage.h"
+#include "hash_table.h"
+#include "arena.h"
+#include "utils.h"
+#include "fuse_xattrs_config.h"
+
+#define RECORD_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
+
+struct packer {
+    char *out;
+    size_t size;
+    size_t used;
+};
+
+/* @return where the value of the record goes */
+static char *__pack_header(char *p, const char *name, size_t name_size, size_t value_size)
+{
+    const uint16_t _name_size = (uint16_t) name_size;
+    const uint32_t _value_size = (uint32_t) value_size;
+
+    memcpy(p, &_name_size, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    memcpy(p, name, name_size);
+    p += name_size;
+    memcpy(p, &_value_size, sizeof(uint32_t));
+    return p + sizeof(uint32_t);
+}
+
+/* Append a record, or only account for it once out is full. */
+static void __pack(const char *name, const char *value, size_t value_size, void *data)
+{
+    struct packer *packer = data;
+    const size_t name_size = strlen(name) + 1;
+    const size_t record_size = RECORD_HEADER_SIZE + name_size + value_size;
+
+    if (packer->out != NULL && packer->used + record_size <= packer->size)
+        memcpy(__pack_header(packer->out + packer->used, name, name_size, value_size), value, value_size);
+    packer->used += record_size;
+}
+
+static int __packed_size(const struct packer *packer)
+{
+    if (packer->used > XATTR_SIZE_MAX)
+        return -E2BIG;
+    if (packer->size > 0 && packer->used > packer->size)
+        return -ERANGE;
+    return (int) packer->used;
+}
+
+int packed_xattrs_get(const char *path, char *value, size_t size)
+{
+    struct packer packer = { size > 0 ? value : NULL, size, 0 };
+
+    int res = binary_storage_foreach(path, __pack, &packer);
+    if (res != 0)
+        return res;
+    return __packed_size(&packer);
+}
+
+int packed_xattrs_get_with(const char *path, packed_xattrs_list_fn list_fn, packed_xattrs_read_fn read_fn,
+                           char *value, size_t size)
+{
+    struct packer packer = { size > 0 ? value : NULL, size, 0 };
+    struct arena_mark mark = arena_mark();
+
+    int list_size = list_fn(path, NULL, 0);
+    char *list = list_size > 0 ? arena_alloc((size_t) list_size) : NULL;
+    if (list_size > 0 && list == NULL)
+        list_size = -ENOMEM;
+    if (list_size > 0)
+        list_size = list_fn(path, list, (size_t) list_size);
+
+    int res = list_size < 0 ? list_size : 0;
+    for (int offset = 0; offset < list_size && res == 0; offset += (int) strlen(list + offset) + 1) {
+        const char *name = list + offset;
+        const size_t name_size = strlen(name) + 1;
+
+        // read straight into place when it fits
+        int value_size = read_fn(path, name, NULL, 0);
+        if (value_size == -ENODATA)
+            continue; // removed meanwhile
+        if (value_size < 0) {
+            res = value_size;
+            break;
+        }
+
+        const size_t record_size = RECORD_HEADER_SIZE + name_size + (size_t) value_size;
+        if (packer.out != NULL && packer.used + record_size <= packer.size) {
+            char *p = packer.out + packer.used;
+            int read_size = value_size > 0 ? read_fn(path, name, p + record_size - value_size, (size_t) value_size) : 0;
+            if (read_size < 0) {
+                res = read_size == -ERANGE ? -EAGAIN : read_size; // grew meanwhile
+                break;
+            }
+            // shrunk meanwhile: the header comes first, the value needs no move
+            __pack_header(p, name, name_size, (size_t) read_size);
+            packer.used += record_size - (size_t) (value_size - read_size);
+        } else {
+            packer.used += record_size;
+        }
+    }
+
+    arena_rewind(mark);
+    return res != 0 ? res : __packed_size(&packer);
+}
+
+int packed_xattrs_set(const char *path, const char *value, size_t size)
+{
+    struct arena_mark mark = arena_mark();
+    size_t count = 0;
+    int res = 0;
+
+    // validate everything before writing anything
+    for (size_t offset = 0; offset < size && res == 0; count++) {
+        uint16_t name_size;
+        uint32_t value_size;
+        if (size - offset < sizeof(uint16_t)) {
+            res = -EINVAL;
+            break;
+        }
+        memcpy(&name_size, value + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+
+        const char *name = value + offset;
+        if (name_size < 2 || name_size > XATTR_NAME_MAX + 1 || size - offset < name_size ||
+            memchr(name, '\0', name_size) != name + name_size - 1) {
+            res = -EINVAL;
+            break;
+        }
+        if (get_namespace(name) != USER || strcmp(name, PACKED_XATTRS_NAME) == 0 ||
+            strcmp(name, GENERATION_XATTR_NAME) == 0) {
+            res = -ENOTSUP;
+            break;
+        }
+        offset += name_size;
+
+        if (size - offset < sizeof(uint32_t)) {
+            res = -EINVAL;
+            break;
+        }
+        memcpy(&value_size, value + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        if (size - offset < value_size) {
+            res = -EINVAL;
+            break;
+        }
+        offset += value_size;
+    }
+
+    struct binary_storage_attr *attrs = NULL;
+    if (res == 0 && count > 0 && (attrs = arena_alloc(count * sizeof(struct binary_storage_attr))) == NULL)
+        res = -ENOMEM;
+
+    struct hash_table *names = res == 0 && count > 1 ? hash_table_new() : NULL;
+    if (res == 0 && count > 1 && names == NULL)
+        res = -ENOMEM;
+
+    size_t offset = 0;
+    for (size_t i = 0; i < count && res == 0; i++) {
+        uint16_t name_size;
+        uint32_t value_size;
+        memcpy(&name_size, value + offset, sizeof(uint16_t));
+        offset += sizeof(uint16_t);
+        attrs[i].name = value + offset;
+        offset += name_size;
+        memcpy(&value_size, value + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+        attrs[i].value = value + offset;
+        attrs[i].size = value_size;
+        offset += value_size;
+
+        // the sidecar would keep both
+        if (names != NULL && hash_table_get(names, attrs[i].name) != NULL)
+            res = -EINVAL;
+        else if (names != NULL && hash_table_put(names, attrs[i].name, &attrs[i]) != 0)
+            res = -ENOMEM;
+    }
+    if (names != NULL)
+        hash_table_free(names, NULL);
+
+    if (res == 0 && count > 0)
+        res = binary_storage_write_keys(path, attrs, count);
+
+    arena_rewind(mark);
+    return res;
+}
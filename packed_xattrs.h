@@ -0,0 +1,50 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_PACKED_XATTRS_H
+#define FUSE_XATTRS_PACKED_XATTRS_H
+
+#include <stddef.h>
+
+/*
+ * Virtual attribute carrying every attribute of a file at once, so a
+ * client needs one round trip (and the daemon one sidecar read) instead
+ * of listxattr plus a getxattr per name.
+ *
+ * Its value is a sequence of records, back to back, in host byte order:
+ *
+ *     u16 name_size (with '\0'), name, u32 value_size, value
+ *
+ * the same records as the archive format (see archive.h). getxattr
+ * returns all the attributes of the file, in no particular order.
+ * setxattr with a sequence of records sets all of them in a single
+ * rewrite of the sidecar, leaving the other attributes alone. It is never
+ * stored nor listed, removing it fails with EPERM.
+ */
+#define PACKED_XATTRS_NAME "user.fuse_xattrs.all"
+
+typedef int (*packed_xattrs_list_fn)(const char *path, char *list, size_t size);
+typedef int (*packed_xattrs_read_fn)(const char *path, const char *name, char *value, size_t size);
+
+/**
+ * Pack the attributes of path, read with a single binary_storage_foreach().
+ * @param value - destination, or NULL with size 0 to get the size needed.
+ * @return size of the packed attributes, or -errno (-ERANGE if it doesn't
+ *         fit, -E2BIG if it exceeds XATTR_SIZE_MAX).
+ */
+int packed_xattrs_get(const char *path, char *value, size_t size);
+
+/* Same as packed_xattrs_get(), for other storages: one list, then a read per name. */
+int packed_xattrs_get_with(const char *path, packed_xattrs_list_fn list_fn, packed_xattrs_read_fn read_fn,
+                           char *value, size_t size);
+
+/* @return On success, zero is returned. On failure, -errno is returned. */
+int packed_xattrs_set(const char *path, const char *value, size_t size);
+
+#endif //FUSE_XATTRS_PACKED_XATTRS_H
@@ -9,10 +9,8 @@
   See the file COPYING.
 */
 
-#define FUSE_USE_VERSION 30
-
-/* For pread()/pwrite()/utimensat() */
-#define _XOPEN_SOURCE 700
+/* For pread()/pwrite()/utimensat() and renameat2() */
+#define _GNU_SOURCE
 
 #include <fuse.h>
 #include <stdio.h>
@@ -21,30 +19,503 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <linux/capability.h>
+
+#ifdef FUSE_CAP_PASSTHROUGH
+#include <fuse_lowlevel.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "xattrs_config.h"
 #include "utils.h"
+#include "arena.h"
+#include "alloc_stats.h"
+#include "sync.h"
+#include "sidecar_cache.h"
+#include "stat_cache.h"
+#include "prefetch.h"
+#include "query_index.h"
+#include "dir_store.h"
+#include "binary_storage.h"
+#include "journal.h"
+#include "own_changes.h"
+#include "hash_table.h"
+#include "thread_pool.h"
 
 static int chown_new_file(const char *path, struct fuse_context *fc)
 {
     return lchown(path, fc->uid, fc->gid);
 }
 
-int xmp_getattr(const char *path, struct stat *stbuf) {
+/*
+ * When the kernel delegates killpriv to us (see no_security_xattrs), suid/sgid
+ * must still be dropped on write/truncate. The source filesystem does it by
+ * itself unless we hold CAP_FSETID, i.e. unless we run as root.
+ *
+ * The high level API doesn't forward the kernel's kill flags, so its rule is
+ * applied here: the bits go when the writer lacks CAP_FSETID, sgid only
+ * along with group execute. Open files seen without bits to drop aren't
+ * fstat()ed again until a chmod could have added some.
+ */
+static unsigned int killpriv_epoch = 1;     // bumped by chmod with suid/sgid
+static unsigned int *killpriv_clean = NULL; // by fd: epoch last seen clean
+static size_t killpriv_size = 0;
+static pthread_once_t killpriv_once = PTHREAD_ONCE_INIT;
+
+static void __killpriv_init(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+        return;
+    killpriv_clean = calloc(limit.rlim_cur, sizeof(unsigned int));
+    if (killpriv_clean != NULL)
+        killpriv_size = limit.rlim_cur;
+}
+
+static int __killpriv_bits(mode_t mode)
+{
+    return (mode & S_ISUID) || ((mode & S_ISGID) && (mode & S_IXGRP));
+}
+
+/* whether the requester holds CAP_FSETID, and keeps the bits on write */
+static int __caller_has_fsetid(void)
+{
+    struct fuse_context *fc = fuse_get_context();
+    int res = fc->uid == 0;
+    if (fc->pid <= 0)
+        return res;
+
+    char status_path[32];
+    snprintf(status_path, sizeof(status_path), "/proc/%d/status", (int) fc->pid);
+    FILE *status = fopen(status_path, "r");
+    if (status == NULL)
+        return res;
+
+    char line[128];
+    unsigned long long caps;
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "CapEff: %llx", &caps) == 1) {
+            res = (caps >> CAP_FSETID) & 1;
+            break;
+        }
+    }
+    fclose(status);
+    return res;
+}
+
+/* a new open file: nothing known about its bits yet */
+static void killpriv_open(int fd)
+{
+    if (killpriv_clean != NULL && fd >= 0 && (size_t) fd < killpriv_size)
+        __atomic_store_n(&killpriv_clean[fd], 0, __ATOMIC_RELAXED);
+}
+
+/* fd of the open file fi, or with fi == NULL, of a single request */
+static void drop_suid_sgid(int fd, struct fuse_file_info *fi)
+{
+    if (!xattrs_config.handle_killpriv || geteuid() != 0)
+        return;
+
+    pthread_once(&killpriv_once, __killpriv_init);
+    unsigned int *clean = NULL;
+    unsigned int epoch = __atomic_load_n(&killpriv_epoch, __ATOMIC_ACQUIRE);
+    if (fi != NULL && fi->fh != 0 && (size_t) fd < killpriv_size) {
+        clean = &killpriv_clean[fd];
+        if (__atomic_load_n(clean, __ATOMIC_RELAXED) == epoch)
+            return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+
+    if (__killpriv_bits(st.st_mode)) {
+        if (__caller_has_fsetid())
+            return;
+        if (fchmod(fd, st.st_mode & ~(S_ISUID | S_ISGID) & 07777) == -1) {
+            error_print("cannot drop suid/sgid bits. errno=%d\n", errno);
+            return;
+        }
+    }
+    if (clean != NULL)
+        __atomic_store_n(clean, epoch, __ATOMIC_RELAXED);
+}
+
+static int passthrough_is_open(const struct stat *st);
+
+static int __getattr(const char *path, struct stat *stbuf) {
     int res;
 
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return query_getattr(path, stbuf);
+    }
+
+    res = stat_cache_lookup(path, stbuf);
+    // the kernel writes files open with passthrough behind our back
+    if (res > 0 && passthrough_is_open(stbuf))
+        res = 0;
+    if (res != 0)
+        return res > 0 ? 0 : res;
+
+    const uint64_t epoch = stat_cache_epoch(path);
+    struct arena_mark mark = arena_mark();
+    char *_path = arena_prepend_source_directory(path);
+    res = _path == NULL ? -ENOMEM : lstat(_path, stbuf) == -1 ? -errno : 0;
+    arena_rewind(mark);
+
+    if (res != 0) {
+        if (res == -ENOENT)
+            stat_cache_insert(path, NULL, epoch);
+        return res;
+    }
+
+    if (!passthrough_is_open(stbuf))
+        stat_cache_insert(path, stbuf, epoch);
+    return 0;
+}
+
+/*
+ * -o symlinks: regular files are shown as symbolic links to their source
+ * path, so that the kernel opens the source file and reads and writes it
+ * without us. Everything else, attributes included, still goes by name.
+ */
+
+/*
+ * Files created through the mount were handed to the kernel as regular
+ * files, and a node can't change type under it: they stay regular while
+ * the kernel may still use that node. Keyed by source inode, so that
+ * renames keep them. Once our last handle on one is released the kernel
+ * is told to forget its entry, so that the table only holds files in use
+ * and files made by mknod() that weren't opened yet.
+ */
+#define CREATED_KEY_SIZE 48
+#define CREATED_MAX_QUEUED 1024
+
+struct created_file {
+    char *path;          // in the mount, follows renames through it
+    unsigned int opens;  // our handles on it
+};
+
+static pthread_mutex_t created_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_table *created = NULL;   // "dev:ino" -> struct created_file
+static size_t created_count = 0;            // atomic, lookups are skipped while zero
+
+// NULL: entries are only dropped by unlinks, the kernel can't be told
+static struct fuse *created_fuse = NULL;
+static struct thread_pool *created_pool = NULL;
+
+static void __created_key(const struct stat *st, char *key)
+{
+    snprintf(key, CREATED_KEY_SIZE, "%llu:%llu", (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+}
+
+static void __created_free(struct created_file *file)
+{
+    if (file == NULL)
+        return;
+    free(file->path);
+    free(file);
+}
+
+/* The kernel has a regular node for path, st of its source file. */
+static void __created_add(const char *path, const struct stat *st, unsigned int opens)
+{
+    if (!S_ISREG(st->st_mode))
+        return;
+
+    char key[CREATED_KEY_SIZE];
+    __created_key(st, key);
+
+    pthread_mutex_lock(&created_lock);
+    if (created == NULL)
+        created = hash_table_new();
+    struct created_file *file = created != NULL ? hash_table_get(created, key) : NULL;
+    if (file == NULL && created != NULL) {
+        file = calloc(1, sizeof(struct created_file));
+        char *copy = strdup(path);
+        if (file != NULL && copy != NULL && hash_table_put(created, key, file) == 0) {
+            file->path = copy;
+            __atomic_add_fetch(&created_count, 1, __ATOMIC_RELAXED);
+        } else {
+            free(copy);
+            free(file);
+            file = NULL;
+        }
+    }
+    if (file != NULL)
+        file->opens += opens;
+    pthread_mutex_unlock(&created_lock);
+}
+
+static void __created_add_path(const char *path, const char *_path)
+{
+    struct stat st;
+    if (lstat(_path, &st) == 0)
+        __created_add(path, &st, 0);
+}
+
+static void __created_add_fd(const char *path, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+        __created_add(path, &st, 1);
+}
+
+static int __created(const struct stat *st)
+{
+    if (__atomic_load_n(&created_count, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    char key[CREATED_KEY_SIZE];
+    __created_key(st, key);
+
+    pthread_mutex_lock(&created_lock);
+    const int res = hash_table_get(created, key) != NULL;
+    pthread_mutex_unlock(&created_lock);
+    return res;
+}
+
+/*
+ * Whether _path, about to be unlinked or replaced, is the last link to a
+ * created file: st is then given to __created_remove() once it's gone.
+ */
+static int __created_last_link(const char *_path, struct stat *st)
+{
+    return __atomic_load_n(&created_count, __ATOMIC_RELAXED) > 0 && lstat(_path, st) == 0 &&
+           S_ISREG(st->st_mode) && st->st_nlink == 1 && __created(st);
+}
+
+/* Must be called with created_lock held. */
+static void __created_remove_key(const char *key)
+{
+    struct created_file *file = hash_table_remove(created, key);
+    if (file != NULL) {
+        __created_free(file);
+        __atomic_sub_fetch(&created_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void __created_remove(const struct stat *st)
+{
+    char key[CREATED_KEY_SIZE];
+    __created_key(st, key);
+
+    pthread_mutex_lock(&created_lock);
+    __created_remove_key(key);
+    pthread_mutex_unlock(&created_lock);
+}
+
+struct created_rename {
+    const char *from;
+    const char *to;
+};
+
+static void __rename_below(const char *key, void *value, void *data)
+{
+    (void) key;
+    struct created_file *file = value;
+    struct created_rename *moved = data;
+    const size_t from_size = strlen(moved->from);
+    if (strncmp(file->path, moved->from, from_size) != 0 || file->path[from_size] != '/')
+        return;
+
+    char *path = malloc(strlen(moved->to) + strlen(file->path + from_size) + 1);
+    if (path == NULL)
+        return;
+    strcpy(path, moved->to);
+    strcat(path, file->path + from_size);
+    free(file->path);
+    file->path = path;
+}
+
+/* from was renamed through the mount to to, _to in the source. */
+static void __created_renamed(const char *from, const char *to, const char *_to)
+{
+    struct stat st;
+    if (__atomic_load_n(&created_count, __ATOMIC_RELAXED) == 0 || lstat(_to, &st) != 0)
+        return;
+
+    if (S_ISDIR(st.st_mode)) {
+        struct created_rename moved = { .from = from, .to = to };
+        pthread_mutex_lock(&created_lock);
+        hash_table_foreach(created, __rename_below, &moved);
+        pthread_mutex_unlock(&created_lock);
+        return;
+    }
+
+    char key[CREATED_KEY_SIZE];
+    __created_key(&st, key);
+    char *copy = strdup(to);
+
+    pthread_mutex_lock(&created_lock);
+    struct created_file *file = hash_table_get(created, key);
+    if (file != NULL && copy != NULL) {
+        free(file->path);
+        file->path = copy;
+        copy = NULL;
+    }
+    pthread_mutex_unlock(&created_lock);
+    free(copy);
+}
+
+/*
+ * Run by created_pool: telling the kernel from the thread of a request
+ * could wait on a lock held by another request waiting for us.
+ */
+static void __created_forget_job(void *arg)
+{
+    char *key = arg;
+    char *path = NULL;
+
+    pthread_mutex_lock(&created_lock);
+    struct created_file *file = hash_table_get(created, key);
+    // opened again in the meantime: still the kernel's regular file
+    if (file != NULL && file->opens == 0) {
+        path = file->path;
+        file->path = NULL;
+        __created_remove_key(key);
+    }
+    pthread_mutex_unlock(&created_lock);
+
+    // next lookup finds a link: the kernel drops its regular node for it
+    if (path != NULL)
+        fuse_invalidate_path(created_fuse, path);
+    free(path);
+    free(key);
+}
+
+/* One of our handles on a file is being closed. */
+static void __created_release(int fd)
+{
+    struct stat st;
+    if (__atomic_load_n(&created_count, __ATOMIC_RELAXED) == 0 || fstat(fd, &st) != 0)
+        return;
+
+    char key[CREATED_KEY_SIZE];
+    __created_key(&st, key);
+
+    pthread_mutex_lock(&created_lock);
+    struct created_file *file = hash_table_get(created, key);
+    const int last = file != NULL && file->opens > 0 && --file->opens == 0;
+    pthread_mutex_unlock(&created_lock);
+
+    if (!last || created_pool == NULL)
+        return;
+    char *copy = strdup(key);
+    if (copy != NULL && thread_pool_submit(created_pool, __created_forget_job, copy, 0) != 0)
+        free(copy); // kept until unlinked, or released again
+}
+
+/* Collects the keys of entries at a path that doesn't hold their file anymore. */
+struct created_stale {
+    const char *path;
+    const char *current;  // key of the file at path, NULL: none
+    char **keys;
+    size_t count;
+};
+
+static void __collect_stale(const char *key, void *value, void *data)
+{
+    struct created_file *file = value;
+    struct created_stale *stale = data;
+    if (file->path == NULL || strcmp(file->path, stale->path) != 0)
+        return;
+    if (stale->current != NULL && strcmp(stale->current, key) == 0)
+        return;
+
+    char *copy = strdup(key);
+    if (copy != NULL)
+        stale->keys[stale->count++] = copy;
+}
+
+void passthrough_source_changed(const char *path)
+{
+    if (__atomic_load_n(&created_count, __ATOMIC_RELAXED) == 0)
+        return;
+
+    char current[CREATED_KEY_SIZE];
+    struct stat st;
     char *_path = prepend_source_directory(path);
-    res = lstat(_path, stbuf);
+    const int exists = _path != NULL && lstat(_path, &st) == 0;
     free(_path);
+    if (exists)
+        __created_key(&st, current);
+
+    pthread_mutex_lock(&created_lock);
+    struct created_stale stale = { .path = path, .current = exists ? current : NULL, .count = 0 };
+    stale.keys = malloc((hash_table_size(created) + 1) * sizeof(char *));
+    if (stale.keys != NULL) {
+        hash_table_foreach(created, __collect_stale, &stale);
+        for (size_t i = 0; i < stale.count; i++) {
+            __created_remove_key(stale.keys[i]);
+            free(stale.keys[i]);
+        }
+        free(stale.keys);
+    }
+    pthread_mutex_unlock(&created_lock);
+}
 
-    if (res == -1)
-        return -errno;
+void passthrough_symlinks_init(struct fuse *fuse)
+{
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 2)
+    created_pool = thread_pool_new(1, CREATED_MAX_QUEUED);
+    if (created_pool != NULL)
+        created_fuse = fuse;
+#else
+    (void) fuse; // fuse_invalidate_path() needs 3.2
+#endif
+}
 
-    return 0;
+void passthrough_symlinks_destroy(void)
+{
+    if (created_pool != NULL)
+        thread_pool_free(created_pool);
+    created_pool = NULL;
+}
+
+/* Entry name of a directory listing, st filled by fstatat() or NULL */
+static int __created_at(int dir_fd, const char *name, const struct stat *st)
+{
+    struct stat entry;
+    if (__atomic_load_n(&created_count, __ATOMIC_RELAXED) == 0)
+        return 0;
+    if (st == NULL && fstatat(dir_fd, name, &entry, AT_SYMLINK_NOFOLLOW) != 0)
+        return 0;
+    return __created(st != NULL ? st : &entry);
+}
+
+/* source_dir without its trailing '/', link targets are that plus the path */
+static size_t __source_root_size(void)
+{
+    size_t size = xattrs_config.source_dir_size;
+    while (size > 0 && xattrs_config.source_dir[size - 1] == '/')
+        size--;
+    return size;
+}
+
+static void __as_symlink(const char *path, struct stat *stbuf)
+{
+    stbuf->st_mode = S_IFLNK | 0777;
+    stbuf->st_size = (off_t) (__source_root_size() + strlen(path));
+    stbuf->st_blocks = 0;
+}
+
+int xmp_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    uint64_t allocs = alloc_stats_begin();
+    int res = __getattr(path, stbuf);
+
+    // open files (fi, after create) stay what the kernel opened
+    if (xattrs_config.symlinks && res == 0 && fi == NULL && S_ISREG(stbuf->st_mode) && !__created(stbuf))
+        __as_symlink(path, stbuf);
+
+    alloc_stats_end(ALLOC_OP_GETATTR, allocs);
+    return res;
 }
 
 int xmp_access(const char *path, int mask) {
@@ -53,6 +524,14 @@ int xmp_access(const char *path, int mask) {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        struct stat st;
+        res = query_getattr(path, &st);
+        if (res == 0 && (mask & W_OK))
+            res = -EROFS;
+        return res;
+    }
+
     char *_path = prepend_source_directory(path);
     res = access(_path, mask);
     free(_path);
@@ -69,6 +548,21 @@ int xmp_readlink(const char *path, char *buf, size_t size) {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return query_readlink(path, buf, size);
+    }
+
+    if (xattrs_config.symlinks) {
+        struct stat st;
+        res = __getattr(path, &st);
+        if (res != 0)
+            return res;
+        if (S_ISREG(st.st_mode) && !__created(&st)) {
+            snprintf(buf, size, "%.*s%s", (int) __source_root_size(), xattrs_config.source_dir, path);
+            return 0;
+        }
+    }
+
     char *_path = prepend_source_directory(path);
     res = readlink(_path, buf, size - 1);
     free(_path);
@@ -81,38 +575,68 @@ int xmp_readlink(const char *path, char *buf, size_t size) {
 }
 
 int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                off_t offset, struct fuse_file_info *fi)
+                off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
     DIR *dp;
     struct dirent *de;
 
     (void) offset;
 
+    if (query_is_path(path)) {
+        return query_readdir(path, buf, filler);
+    }
+
+    char *_path = prepend_source_directory(path);
+    struct prefetch_batch *batch = prefetch_begin(_path);
+
     if (fi != NULL && fi->fh != 0) {
         dp = fdopendir(fi->fh);
     } else {
-        char *_path = prepend_source_directory(path);
         dp = opendir(_path);
-        free(_path);
     }
+    free(_path);
 
-    if (dp == NULL)
-        return -errno;
+    if (dp == NULL) {
+        int res = -errno;
+        prefetch_end(batch);
+        return res;
+    }
 
     while ((de = readdir(dp)) != NULL) {
+        prefetch_add(batch, de->d_name);
+
         if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(de->d_name) == 1) {
             continue;
         }
 
+        // readdirplus: full attributes save the kernel a lookup per entry
         struct stat st;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = de->d_ino;
-        st.st_mode = de->d_type << 12;
-        if (filler(buf, de->d_name, &st, 0))
+        enum fuse_fill_dir_flags fill_flags = 0;
+        if ((flags & FUSE_READDIR_PLUS) && fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            fill_flags = FUSE_FILL_DIR_PLUS;
+        } else {
+            memset(&st, 0, sizeof(st));
+            st.st_ino = de->d_ino;
+            st.st_mode = de->d_type << 12;
+        }
+        if (xattrs_config.symlinks && S_ISREG(st.st_mode) &&
+            !__created_at(dirfd(dp), de->d_name, fill_flags == FUSE_FILL_DIR_PLUS ? &st : NULL)) {
+            // the source path of the entry: source root, path, '/', name
+            st.st_mode = S_IFLNK | 0777;
+            st.st_size = (off_t) (__source_root_size() + (path[1] != '\0' ? strlen(path) : 0) + 1 +
+                                  strlen(de->d_name));
+            st.st_blocks = 0;
+        }
+        if (filler(buf, de->d_name, &st, 0, fill_flags)) {
+            // the listing is incomplete: don't trust it for sidecar presence
+            prefetch_cancel(batch);
+            batch = NULL;
             break;
+        }
     }
 
     closedir(dp);
+    prefetch_end(batch);
     return 0;
 }
 
@@ -122,6 +646,10 @@ int xmp_mknod(const char *path, mode_t mode, dev_t rdev) {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
 
     /* On Linux this could just be 'mknod(path, mode, rdev)' but this
@@ -134,6 +662,7 @@ int xmp_mknod(const char *path, mode_t mode, dev_t rdev) {
         res = mkfifo(_path, mode);
     else
         res = mknod(_path, mode, rdev);
+    stat_cache_invalidate_name(path);
 
     if (res == -1) {
         free(_path);
@@ -142,6 +671,8 @@ int xmp_mknod(const char *path, mode_t mode, dev_t rdev) {
 
     struct fuse_context *fc = fuse_get_context();
     res = chown_new_file(_path, fc);
+    if (res == 0 && xattrs_config.symlinks && S_ISREG(mode))
+        __created_add_path(path, _path);
 
     free(_path);
     return res;
@@ -153,8 +684,13 @@ int xmp_mkdir(const char *path, mode_t mode) {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
     res = mkdir(_path, mode);
+    stat_cache_invalidate_name(path);
 
     if (res == -1) {
         free(_path);
@@ -174,19 +710,46 @@ int xmp_unlink(const char *path) {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
+    struct stat created_st;
+    const int created_last = xattrs_config.symlinks && __created_last_link(_path, &created_st);
     res = unlink(_path);
+    stat_cache_invalidate_name(path);
 
     if (res == -1) {
         free(_path);
         return -errno;
     }
+    if (created_last)
+        __created_remove(&created_st);
+
+    sidecar_cache_invalidate(_path);
+    binary_storage_forget(_path);
+    query_index_remove_path(_path);
+
+    if (dir_store_enabled()) {
+        if (dir_store_remove(_path) != 0)
+            error_print("Error removing attributes from the directory store: %s\n", _path);
+        journal_record(JOURNAL_UNLINK, path, NULL);
+        free(_path);
+        return 0;
+    }
 
     char *sidecar_path = get_sidecar_path(_path);
     if (is_regular_file(sidecar_path)) {
         if (unlink(sidecar_path) == -1) {
             error_print("Error removing sidecar file: %s\n", sidecar_path);
+        } else {
+            own_changes_record(sidecar_path);
+            sync_mark_parent_dirty(sidecar_path);
         }
+        journal_record(JOURNAL_UNLINK, path, NULL);
+    } else if (xattrs_config.native_xattrs) {
+        journal_record(JOURNAL_UNLINK, path, NULL);
     }
     free(sidecar_path);
     free(_path);
@@ -201,12 +764,28 @@ int xmp_rmdir(const char *path) {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
     res = rmdir(_path);
-    free(_path);
 
-    if (res == -1)
+    // the directory store doesn't count as content
+    if (res == -1 && errno == ENOTEMPTY && dir_store_enabled() && dir_store_release_dir(_path) == 0)
+        res = rmdir(_path);
+    stat_cache_invalidate_name(path);
+
+    if (res == -1) {
+        free(_path);
         return -errno;
+    }
+
+    if (dir_store_enabled()) {
+        sidecar_cache_invalidate(_path);
+        dir_store_remove(_path);
+    }
+    free(_path);
 
     return 0;
 }
@@ -219,8 +798,13 @@ int xmp_symlink(const char *from, const char *to) {
         }
     }
 
+    if (query_is_path(to)) {
+        return -EROFS;
+    }
+
     char *_to = prepend_source_directory(to);
     res = symlink(from, _to);
+    stat_cache_invalidate_name(to);
 
     if (res == -1) {
         free(_to);
@@ -234,36 +818,88 @@ int xmp_symlink(const char *from, const char *to) {
     return res;
 }
 
-int xmp_rename(const char *from, const char *to) {
+int xmp_rename(const char *from, const char *to, unsigned int flags) {
     int res;
+    // RENAME_EXCHANGE would have to swap the sidecars as well
+    if (flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;
+    }
+
     if (xattrs_config.show_sidecar == 0) {
         if (filename_is_sidecar(from) == 1 || filename_is_sidecar(to)) {
             return -ENOENT;
         }
     }
 
+    if (query_is_path(from) || query_is_path(to)) {
+        return -EROFS;
+    }
+
     char *_from = prepend_source_directory(from);
     char *_to = prepend_source_directory(to);
-    res = rename(_from, _to);
+    struct stat created_st;
+    const int created_last = xattrs_config.symlinks && strcmp(from, to) != 0 &&
+                             __created_last_link(_to, &created_st);
+    res = flags ? renameat2(AT_FDCWD, _from, AT_FDCWD, _to, flags) : rename(_from, _to);
+    stat_cache_invalidate_name(from);
+    stat_cache_invalidate_name(to);
 
     if (res == -1) {
         free(_from);
         free(_to);
         return -errno;
     }
+    if (created_last)
+        __created_remove(&created_st);
+    if (xattrs_config.symlinks)
+        __created_renamed(from, to, _to);
+
+    struct stat st;
+    const int is_directory = lstat(_to, &st) == 0 && S_ISDIR(st.st_mode);
+    binary_storage_rename(_from, _to, is_directory);
+    if (is_directory) {
+        // every cached path below the directory moved
+        sidecar_cache_clear();
+        stat_cache_clear();
+    } else {
+        sidecar_cache_invalidate(_from);
+        sidecar_cache_invalidate(_to);
+    }
+
+    if (dir_store_enabled()) {
+        if (dir_store_rename(_from, _to) != 0)
+            error_print("Error moving attributes in the directory store. from: %s to: %s\n", _from, _to);
+        query_index_rename(_from, _to, is_directory);
+        journal_record(JOURNAL_RENAME, from, to);
+        free(_from);
+        free(_to);
+        return 0;
+    }
 
     char *from_sidecar_path = get_sidecar_path(_from);
     char *to_sidecar_path = get_sidecar_path(_to);
 
     // FIXME: Remove to_sidecar_path if it exists ?
-    if (is_regular_file(from_sidecar_path)) {
+    // (after RENAME_NOREPLACE, one there belonged to no file: replaced)
+    const int has_sidecar = is_regular_file(from_sidecar_path);
+    if (has_sidecar) {
         if (rename(from_sidecar_path, to_sidecar_path) == -1) {
             error_print("Error renaming sidecar. from: %s to: %s\n", from_sidecar_path, to_sidecar_path);
+        } else {
+            own_changes_record(from_sidecar_path);
+            own_changes_record(to_sidecar_path);
+            sync_mark_parent_dirty(from_sidecar_path);
+            sync_mark_parent_dirty(to_sidecar_path);
         }
     }
+    // attributes below a directory move with it
+    if (has_sidecar || is_directory || xattrs_config.native_xattrs)
+        journal_record(JOURNAL_RENAME, from, to);
     free(from_sidecar_path);
     free(to_sidecar_path);
 
+    query_index_rename(_from, _to, is_directory);
+
     free(_from);
     free(_to);
 
@@ -279,9 +915,15 @@ int xmp_link(const char *from, const char *to) {
         }
     }
 
+    if (query_is_path(to)) {
+        return -EROFS;
+    }
+
     char *_from = prepend_source_directory(from);
     char *_to = prepend_source_directory(to);
     res = link(_from, _to);
+    stat_cache_invalidate(from); // st_nlink
+    stat_cache_invalidate_name(to);
     free(_from);
     free(_to);
 
@@ -291,14 +933,25 @@ int xmp_link(const char *from, const char *to) {
     return 0;
 }
 
-int xmp_chmod(const char *path, mode_t mode) {
+int xmp_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    (void) fi;
     int res;
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
     res = chmod(_path, mode);
+    stat_cache_invalidate(path);
+    if (res == 0 && (mode & (S_ISUID | S_ISGID))) {
+        // 0 stands for unknown
+        if (__atomic_add_fetch(&killpriv_epoch, 1, __ATOMIC_RELEASE) == 0)
+            __atomic_add_fetch(&killpriv_epoch, 1, __ATOMIC_RELEASE);
+    }
     free(_path);
 
     if (res == -1)
@@ -307,14 +960,20 @@ int xmp_chmod(const char *path, mode_t mode) {
     return 0;
 }
 
-int xmp_chown(const char *path, uid_t uid, gid_t gid) {
+int xmp_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+    (void) fi;
     int res;
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
     res = lchown(_path, uid, gid);
+    stat_cache_invalidate(path);
     free(_path);
 
     if (res == -1)
@@ -323,34 +982,65 @@ int xmp_chown(const char *path, uid_t uid, gid_t gid) {
     return 0;
 }
 
-int xmp_truncate(const char *path, off_t size) {
+int xmp_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
     int res;
-    if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
+    if (path != NULL && xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    // ftruncate(2) of an open file
+    if (fi != NULL && fi->fh != 0) {
+        if (ftruncate(fi->fh, size) == -1)
+            return -errno;
+        drop_suid_sgid(fi->fh, fi);
+        if (path != NULL)
+            stat_cache_invalidate(path);
+        return 0;
+    }
+
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
     res = truncate(_path, size);
-    free(_path);
+    stat_cache_invalidate(path);
 
-    if (res == -1)
+    if (res == -1) {
+        free(_path);
         return -errno;
+    }
+
+    if (xattrs_config.handle_killpriv) {
+        int fd = open(_path, O_RDONLY);
+        if (fd != -1) {
+            drop_suid_sgid(fd, NULL);
+            close(fd);
+        }
+    }
+    free(_path);
 
     return 0;
 }
 
 #ifdef HAS_UTIMENSAT
-int xmp_utimens(const char *path, const struct timespec ts[2])
+int xmp_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi)
 {
+    (void) fi;
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     int res;
 
     char *_path = prepend_source_directory(path);
     /* don't use utime/utimes since they follow symlinks */
     res = utimensat(0, _path, ts, AT_SYMLINK_NOFOLLOW);
+    stat_cache_invalidate(path);
     free(_path);
     if (res == -1)
         return -errno;
@@ -359,28 +1049,234 @@ int xmp_utimens(const char *path, const struct timespec ts[2])
 }
 #endif
 
+/*
+ * With writeback_cache the kernel reads pages of files open write-only to
+ * fill its cache, and handles O_APPEND by itself.
+ */
+static int open_flags(int flags)
+{
+    if (xattrs_config.writeback_cache) {
+        if ((flags & O_ACCMODE) == O_WRONLY)
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        flags &= ~O_APPEND;
+    }
+    return flags;
+}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+/* From <linux/fuse.h> (Linux 6.9): the headers of the build host may be older than libfuse */
+struct backing_map {
+    int32_t fd;
+    uint32_t flags;
+    uint64_t padding;
+};
+#define BACKING_OPEN  _IOW(229, 1, struct backing_map)
+#define BACKING_CLOSE _IOW(229, 2, uint32_t)
+
+/* backing file ids by fd, until release, 0 for none */
+static pthread_mutex_t backing_lock = PTHREAD_MUTEX_INITIALIZER;
+static int32_t *backing_ids = NULL;
+static size_t backing_ids_size = 0;
+
+static int __session_fd(void)
+{
+    return fuse_session_fd(fuse_get_session(fuse_get_context()->fuse));
+}
+
+static int __remember_backing(int fd, int32_t id)
+{
+    int res = 0;
+    pthread_mutex_lock(&backing_lock);
+    if ((size_t) fd >= backing_ids_size) {
+        size_t size = backing_ids_size > 0 ? backing_ids_size : 1024;
+        while (size <= (size_t) fd)
+            size *= 2;
+        int32_t *grown = realloc(backing_ids, size * sizeof(int32_t));
+        if (grown == NULL) {
+            res = -ENOMEM;
+        } else {
+            memset(grown + backing_ids_size, 0, (size - backing_ids_size) * sizeof(int32_t));
+            backing_ids = grown;
+            backing_ids_size = size;
+        }
+    }
+    if (res == 0)
+        backing_ids[fd] = id;
+    pthread_mutex_unlock(&backing_lock);
+    return res;
+}
+
+/* @return the backing id registered for fd, forgotten, or 0. */
+static int32_t __forget_backing(int fd)
+{
+    int32_t id = 0;
+    pthread_mutex_lock(&backing_lock);
+    if ((size_t) fd < backing_ids_size) {
+        id = backing_ids[fd];
+        backing_ids[fd] = 0;
+    }
+    pthread_mutex_unlock(&backing_lock);
+    return id;
+}
+
+/* Open backing files by inode ("dev:ino" -> handles), not stat cached meanwhile */
+#define BACKING_KEY_SIZE 48
+
+static struct hash_table *backing_inodes = NULL;
+static size_t backing_inode_count = 0;     // atomic, lookups are skipped while zero
+
+static void __backing_key(const struct stat *st, char *key)
+{
+    snprintf(key, BACKING_KEY_SIZE, "%llu:%llu", (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+}
+
+/* @param delta - 1 when fd is registered, -1 when it is released. */
+static void __count_backing_inode(int fd, int delta)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return;
+
+    char key[BACKING_KEY_SIZE];
+    __backing_key(&st, key);
+
+    pthread_mutex_lock(&backing_lock);
+    if (backing_inodes == NULL)
+        backing_inodes = hash_table_new();
+    unsigned int *handles = backing_inodes != NULL ? hash_table_get(backing_inodes, key) : NULL;
+    if (handles != NULL) {
+        *handles += delta;
+        if (*handles == 0) {
+            free(hash_table_remove(backing_inodes, key));
+            __atomic_sub_fetch(&backing_inode_count, 1, __ATOMIC_RELAXED);
+        }
+    } else if (delta > 0 && backing_inodes != NULL && (handles = malloc(sizeof(unsigned int))) != NULL) {
+        *handles = 1;
+        if (hash_table_put(backing_inodes, key, handles) == 0)
+            __atomic_add_fetch(&backing_inode_count, 1, __ATOMIC_RELAXED);
+        else
+            free(handles);
+    }
+    pthread_mutex_unlock(&backing_lock);
+}
+#endif
+
+/* @return 1 if st is the inode of a file open with passthrough. */
+static int passthrough_is_open(const struct stat *st)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (__atomic_load_n(&backing_inode_count, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    char key[BACKING_KEY_SIZE];
+    __backing_key(st, key);
+
+    pthread_mutex_lock(&backing_lock);
+    const int res = backing_inodes != NULL && hash_table_get(backing_inodes, key) != NULL;
+    pthread_mutex_unlock(&backing_lock);
+    return res;
+#else
+    (void) st;
+    return 0;
+#endif
+}
+
+/*
+ * -o passthrough: register fd with the kernel as the backing file of the
+ * open fi. Reads, writes and mmap of it are then done by the kernel on the
+ * source file, without reaching us. Failing that, the first time, data
+ * goes through the daemon for every file from then on: the kernel refuses
+ * to mix both on a file.
+ */
+static void passthrough_open(int fd, struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (!__atomic_load_n(&xattrs_config.backing_files, __ATOMIC_RELAXED))
+        return;
+
+    struct backing_map map = { .fd = fd };
+    int id = ioctl(__session_fd(), BACKING_OPEN, &map);
+    if (id > 0 && __remember_backing(fd, id) != 0) {
+        uint32_t _id = (uint32_t) id;
+        ioctl(__session_fd(), BACKING_CLOSE, &_id);
+        return;
+    }
+    if (id <= 0) {
+        if (__atomic_exchange_n(&xattrs_config.backing_files, 0, __ATOMIC_RELAXED))
+            fprintf(stderr, "passthrough: cannot register backing files (%s), data goes through the daemon\n",
+                    strerror(errno));
+        return;
+    }
+    fi->backing_id = id;
+    __count_backing_inode(fd, 1);
+#else
+    (void) fd;
+    (void) fi;
+#endif
+}
+
+/* @return 1 if the kernel did the I/O of fd itself. */
+static int passthrough_release(int fd)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    uint32_t id = (uint32_t) __forget_backing(fd);
+    if (id == 0)
+        return 0;
+    __count_backing_inode(fd, -1);
+    if (ioctl(__session_fd(), BACKING_CLOSE, &id) == -1)
+        error_print("cannot close backing file %u. errno=%d\n", id, errno);
+    return 1;
+#else
+    (void) fd;
+    return 0;
+#endif
+}
+
 int xmp_open(const char *path, struct fuse_file_info *fi) {
     int fd;
     if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
         return -ENOENT;
     }
 
-    char *_path = prepend_source_directory(path);
-    fd = open(_path, fi->flags);
-    free(_path);
+    // taken as success: the kernel stops sending opens and releases
+    if (xattrs_config.skip_open) {
+        return -ENOSYS;
+    }
 
-    if (fd == -1)
+    char *_path = prepend_source_directory(path);
+    fd = open(_path, open_flags(fi->flags));
+    if (fd == -1) {
+        free(_path);
         return -errno;
+    }
+    binary_storage_open(_path);
+    free(_path);
 
     fi->fh = fd;
+    // links are followed to the source: the kernel opened a regular node
+    if (xattrs_config.symlinks)
+        __created_add_fd(path, fd);
+    killpriv_open(fd);
+    own_changes_open(fd);
+    if (fi->flags & O_TRUNC) {
+        stat_cache_invalidate(path);
+        drop_suid_sgid(fd, fi);
+    }
+
+    passthrough_open(fd, fi);
     return 0;
 }
 
 int xmp_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     int res;
 
+    if (query_is_path(path)) {
+        return -EROFS;
+    }
+
     char *_path = prepend_source_directory(path);
-    int fd = open(_path, fi->flags, mode & 0777);
+    int fd = open(_path, open_flags(fi->flags), mode & 0777);
+    stat_cache_invalidate_name(path);
     if (fd == -1) {
         free(_path);
         return -errno;
@@ -390,22 +1286,58 @@ int xmp_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     res = chown_new_file(_path, fc);
 
     fi->fh = fd;
+    killpriv_open(fd);
+    own_changes_open(fd);
+    if (res == 0) {
+        if (xattrs_config.symlinks)
+            __created_add_fd(path, fd);
+        binary_storage_open(_path);
+        passthrough_open(fd, fi);
+    }
 
     free(_path);
     return res;
 }
 
+/*
+ * Descriptor of the open file fi, or with no_open or without fi, of path
+ * opened for a single request. Give it back with put_fd().
+ * @return On failure, -errno (-EBADF: neither a handle nor a path).
+ */
+static int get_fd(const char *path, struct fuse_file_info *fi, int flags)
+{
+    if (fi != NULL && fi->fh != 0)
+        return (int) fi->fh;
+    if (path == NULL || (fi != NULL && !xattrs_config.skip_open))
+        return -EBADF;
+
+    struct arena_mark mark = arena_mark();
+    char *_path = arena_prepend_source_directory(path);
+    int fd = _path == NULL ? -ENOMEM : open(_path, flags);
+    if (fd == -1)
+        fd = -errno;
+    arena_rewind(mark);
+    return fd;
+}
+
+static void put_fd(int fd, struct fuse_file_info *fi)
+{
+    if (fi == NULL || fi->fh == 0)
+        close(fd);
+}
+
 int xmp_read(const char *path, char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi)
 {
-    (void) path;
-    if (fi == NULL || fi->fh == 0) {
-        return -1;
+    int fd = get_fd(path, fi, O_RDONLY);
+    if (fd < 0) {
+        return fd;
     }
 
-    int res = pread(fi->fh, buf, size, offset);
+    int res = pread(fd, buf, size, offset);
     if (res == -1)
         res = -errno;
+    put_fd(fd, fi);
 
     return res;
 }
@@ -413,14 +1345,18 @@ int xmp_read(const char *path, char *buf, size_t size, off_t offset,
 int xmp_write(const char *path, const char *buf, size_t size,
               off_t offset, struct fuse_file_info *fi)
 {
-    (void) path;
-    if (fi == NULL || fi->fh == 0) {
-        return -1;
+    int fd = get_fd(path, fi, O_WRONLY);
+    if (fd < 0) {
+        return fd;
     }
 
-    int res = pwrite(fi->fh, buf, size, offset);
+    int res = pwrite(fd, buf, size, offset);
     if (res == -1)
         res = -errno;
+    else
+        drop_suid_sgid(fd, fi);
+    put_fd(fd, fi);
+    stat_cache_invalidate(path);
 
     return res;
 }
@@ -442,35 +1378,92 @@ int xmp_statfs(const char *path, struct statvfs *stbuf) {
 }
 
 int xmp_release(const char *path, struct fuse_file_info *fi) {
-    (void) path;
+    // writes we didn't see changed its size and times
+    if (passthrough_release((int) fi->fh) && path != NULL)
+        stat_cache_invalidate(path);
+    if (xattrs_config.symlinks)
+        __created_release((int) fi->fh);
+
+    if (path != NULL) {
+        char *_path = prepend_source_directory(path);
+        binary_storage_release(_path);
+        free(_path);
+    }
+    own_changes_release((int) fi->fh);
     return close(fi->fh);
 }
 
+/* flush the sidecar of _path and its directory entry, if they are dirty */
+static int sync_sidecar(const char *_path)
+{
+    char *sidecar_path = dir_store_enabled() ? dir_store_path(_path) : get_sidecar_path(_path);
+    int res = sync_flush(sidecar_path, 0);
+    if (res == 0)
+        res = sync_flush_parent(sidecar_path, 0);
+    free(sidecar_path);
+
+    return res;
+}
+
 int xmp_fsync(const char *path, int isdatasync,
               struct fuse_file_info *fi) {
-    /* Just a stub.	 This method is optional and can safely be left
-       unimplemented */
+    int fd = get_fd(path, fi, O_RDONLY);
+    if (fd < 0) {
+        return fd;
+    }
+
+    int res;
+    if (isdatasync)
+        res = fdatasync(fd);
+    else
+        res = fsync(fd);
+    if (res == -1)
+        res = -errno;
+    put_fd(fd, fi);
+
+    if (res != 0)
+        return res;
 
-    (void) path;
+    char *_path = prepend_source_directory(path);
+    res = sync_sidecar(_path);
+    free(_path);
+
+    return res;
+}
+
+int xmp_fsyncdir(const char *path, int isdatasync,
+                 struct fuse_file_info *fi) {
     (void) isdatasync;
     (void) fi;
-    return 0;
+
+    if (xattrs_config.show_sidecar == 0 && filename_is_sidecar(path) == 1)  {
+        return -ENOENT;
+    }
+
+    char *_path = prepend_source_directory(path);
+    int res = sync_flush(_path, 1);
+    if (res == 0)
+        res = sync_sidecar(_path);
+    free(_path);
+
+    return res;
 }
 
 #ifdef HAVE_POSIX_FALLOCATE
 int xmp_fallocate(const char *path, int mode,
                   off_t offset, off_t length, struct fuse_file_info *fi)
 {
-    (void) path;
-    if (fi == NULL || fi->fh == 0) {
-        return -1;
-    }
-
-    int res;
     if (mode)
         return -EOPNOTSUPP;
 
-    res = -posix_fallocate(fi->fh, offset, length);
+    int fd = get_fd(path, fi, O_WRONLY);
+    if (fd < 0) {
+        return fd;
+    }
+
+    int res = -posix_fallocate(fd, offset, length);
+    put_fd(fd, fi);
+    stat_cache_invalidate(path);
     return res;
 }
 #endif
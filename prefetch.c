@@ -0,0 +1,187 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "prefetch.h"
+#include "thread_pool.h"
+#include "hash_table.h"
+#include "sidecar_cache.h"
+#include "binary_storage.h"
+#include "dir_store.h"
+#include "utils.h"
+#include "fuse_xattrs_config.h"
+
+/* Jobs beyond this are dropped: prefetching is best effort. */
+#define PREFETCH_MAX_QUEUED 4096
+
+struct prefetch_batch {
+    char *dir_path;
+    size_t dir_path_size;
+    uint64_t epoch;
+    struct hash_table *names;
+};
+
+static struct thread_pool *pool = NULL;
+
+int prefetch_init(unsigned int threads)
+{
+    if (!sidecar_cache_enabled())
+        return -1;
+
+    pool = thread_pool_new(threads, PREFETCH_MAX_QUEUED);
+    if (pool == NULL) {
+        error_print("cannot start prefetch threads\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void prefetch_destroy(void)
+{
+    thread_pool_free(pool);
+    pool = NULL;
+}
+
+int prefetch_enabled(void)
+{
+    return pool != NULL;
+}
+
+int prefetch_set_threads(unsigned int threads)
+{
+    return pool != NULL ? thread_pool_resize(pool, threads) : -ENOTSUP;
+}
+
+static void __prefetch_store(void *arg)
+{
+    char *dir_path = arg;
+    dir_store_prefetch(dir_path);
+    free(dir_path);
+}
+
+struct prefetch_batch *prefetch_begin(const char *dir_path)
+{
+    if (pool == NULL)
+        return NULL;
+
+    // the whole directory is a single read: no per-entry bookkeeping
+    if (dir_store_enabled()) {
+        char *path = strdup(dir_path);
+        if (path != NULL && thread_pool_submit(pool, __prefetch_store, path, 0) != 0)
+            free(path);
+        return NULL;
+    }
+
+    struct prefetch_batch *batch = malloc(sizeof(struct prefetch_batch));
+    if (batch == NULL)
+        return NULL;
+
+    // taken before the listing: any later change in the directory voids negative entries
+    batch->epoch = sidecar_cache_dir_epoch(dir_path);
+    batch->dir_path_size = strlen(dir_path);
+    batch->dir_path = strdup(dir_path);
+    batch->names = hash_table_new();
+    if (batch->dir_path == NULL || batch->names == NULL) {
+        free(batch->dir_path);
+        hash_table_free(batch->names, NULL);
+        free(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+void prefetch_add(struct prefetch_batch *batch, const char *name)
+{
+    if (batch == NULL)
+        return;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return;
+
+    hash_table_put(batch->names, name, batch);
+}
+
+static char *__join(struct prefetch_batch *batch, const char *name)
+{
+    const size_t name_size = strlen(name);
+    const int needs_slash = batch->dir_path_size == 0 || batch->dir_path[batch->dir_path_size - 1] != '/';
+    char *path = malloc(batch->dir_path_size + needs_slash + name_size + 1);
+    if (path == NULL)
+        return NULL;
+
+    memcpy(path, batch->dir_path, batch->dir_path_size);
+    if (needs_slash)
+        path[batch->dir_path_size] = '/';
+    memcpy(path + batch->dir_path_size + needs_slash, name, name_size + 1);
+
+    return path;
+}
+
+static void __prefetch_job(void *arg)
+{
+    char *path = arg;
+    binary_storage_prefetch(path);
+    free(path);
+}
+
+static void __schedule(const char *name, void *value, void *data)
+{
+    (void) value;
+    struct prefetch_batch *batch = data;
+
+    if (filename_is_sidecar(name) == 1)
+        return;
+
+    const size_t name_size = strlen(name);
+    char sidecar_name[name_size + BINARY_SIDECAR_EXT_SIZE + 1];
+    memcpy(sidecar_name, name, name_size);
+    memcpy(sidecar_name + name_size, BINARY_SIDECAR_EXT, BINARY_SIDECAR_EXT_SIZE + 1);
+
+    char *path = __join(batch, name);
+    if (path == NULL)
+        return;
+
+    if (hash_table_get(batch->names, sidecar_name) == NULL) {
+        sidecar_cache_insert_listed(path, NULL, batch->epoch);
+        free(path);
+        return;
+    }
+
+    if (sidecar_cache_contains(path)) {
+        free(path);
+        return;
+    }
+
+    if (thread_pool_submit(pool, __prefetch_job, path, 0) != 0)
+        free(path);
+}
+
+void prefetch_cancel(struct prefetch_batch *batch)
+{
+    if (batch == NULL)
+        return;
+
+    hash_table_free(batch->names, NULL);
+    free(batch->dir_path);
+    free(batch);
+}
+
+void prefetch_end(struct prefetch_batch *batch)
+{
+    if (batch == NULL)
+        return;
+
+    hash_table_foreach(batch->names, __schedule, batch);
+    prefetch_cancel(batch);
+}
@@ -0,0 +1,36 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_PREFETCH_H
+#define FUSE_XATTRS_PREFETCH_H
+
+/*
+ * Readdir driven sidecar prefetch.
+ *
+ * Tools like `getfattr -R` or `rsync -X` follow every readdir with xattr
+ * calls on each entry. While a directory is listed we already know which
+ * entries have a sidecar: those are loaded into the sidecar cache by a
+ * small pool of I/O threads, the rest are cached as having no attributes.
+ */
+struct prefetch_batch;
+
+int prefetch_init(unsigned int threads);
+void prefetch_destroy(void);
+int prefetch_enabled(void);
+
+/* @return On success, zero is returned. On failure, -errno is returned. */
+int prefetch_set_threads(unsigned int threads);
+
+/* @param dir_path - absolute (source) path of the directory being listed. */
+struct prefetch_batch *prefetch_begin(const char *dir_path);
+void prefetch_add(struct prefetch_batch *batch, const char *name);
+void prefetch_end(struct prefetch_batch *batch);
+void prefetch_cancel(struct prefetch_batch *batch);
+
+#endif //FUSE_XATTRS_PREFETCH_H
@@ -0,0 +1,634 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For nftw() */
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+
+#include "query_index.h"
+#include "hash_table.h"
+#include "binary_storage.h"
+#include "dir_store.h"
+#include "xattrs_config.h"
+#include "utils.h"
+#include "fuse_xattrs_config.h"
+
+#define QUERY_DIR "/" QUERY_DIR_NAME
+#define QUERY_DIR_SIZE (sizeof(QUERY_DIR) - 1)
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int enabled = 0;
+static time_t mount_time;
+
+/* encoded name -> encoded value -> entry name -> path */
+static struct hash_table *by_name = NULL;
+/* path -> name -> encoded value */
+static struct hash_table *by_path = NULL;
+
+static pthread_t scan_thread;
+static int scanning = 0;
+static int rescan = 0;     // a directory moved while scanning
+static int stopping = 0;
+/* paths removed while scanning: the scan must not bring them back */
+static struct hash_table *tombstones = NULL;
+
+static int __encode(const char *src, size_t size, char *dst, size_t dst_size)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    if (size == 0) {
+        if (dst_size < 2)
+            return -1;
+        dst[0] = '%';
+        dst[1] = '\0';
+        return 1;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < size; i++) {
+        const unsigned char c = (unsigned char) src[i];
+        const int plain = c > 0x20 && c < 0x7f && c != '/' && c != '%' && !(i == 0 && c == '.');
+        if (len + (plain ? 1 : 3) >= dst_size)
+            return -1;
+
+        if (plain) {
+            dst[len++] = c;
+        } else {
+            dst[len++] = '%';
+            dst[len++] = hex[c >> 4];
+            dst[len++] = hex[c & 0xf];
+        }
+    }
+    dst[len] = '\0';
+
+    return (int) len;
+}
+
+static void __entry_name(const char *path, char *entry)
+{
+    if (__encode(path + 1, strlen(path + 1), entry, NAME_MAX + 1) >= 0)
+        return;
+
+    const char *base = strrchr(path, '/') + 1;
+    int n = snprintf(entry, NAME_MAX + 1, "%016" PRIx64 "-", hash_string(path));
+    if (__encode(base, strlen(base), entry + n, NAME_MAX + 1 - n) < 0)
+        entry[n - 1] = '\0';
+}
+
+/* absolute source path -> mount relative path with a single leading '/' */
+static const char *__relative(const char *path)
+{
+    const char *rel = path + xattrs_config.source_dir_size;
+    if (*rel != '/')
+        rel--; // source_dir ends with '/'
+    while (rel[1] == '/')
+        rel++;
+    return rel;
+}
+
+static void __free_set(void *set)
+{
+    hash_table_free(set, free);
+}
+
+static void __free_values(void *values)
+{
+    hash_table_free(values, __free_set);
+}
+
+static void __free_names(void *names)
+{
+    hash_table_free(names, free);
+}
+
+static void __del(const char *path, const char *name)
+{
+    struct hash_table *names = hash_table_get(by_path, path);
+    if (names == NULL)
+        return;
+
+    char *enc_value = hash_table_remove(names, name);
+    if (enc_value == NULL)
+        return;
+
+    char enc_name[NAME_MAX + 1];
+    if (__encode(name, strlen(name), enc_name, sizeof(enc_name)) >= 0) {
+        struct hash_table *values = hash_table_get(by_name, enc_name);
+        struct hash_table *set = values != NULL ? hash_table_get(values, enc_value) : NULL;
+        if (set != NULL) {
+            char entry[NAME_MAX + 1];
+            __entry_name(path, entry);
+            free(hash_table_remove(set, entry));
+            if (hash_table_size(set) == 0) {
+                hash_table_remove(values, enc_value);
+                __free_set(set);
+            }
+        }
+        if (values != NULL && hash_table_size(values) == 0) {
+            hash_table_remove(by_name, enc_name);
+            __free_values(values);
+        }
+    }
+    free(enc_value);
+
+    if (hash_table_size(names) == 0) {
+        hash_table_remove(by_path, path);
+        __free_names(names);
+    }
+}
+
+static struct hash_table *__get_or_create(struct hash_table *table, const char *key)
+{
+    struct hash_table *child = hash_table_get(table, key);
+    if (child != NULL)
+        return child;
+
+    child = hash_table_new();
+    if (child != NULL && hash_table_put(table, key, child) != 0) {
+        hash_table_free(child, NULL);
+        return NULL;
+    }
+    return child;
+}
+
+static void __add_encoded(const char *path, const char *name, const char *enc_name, const char *enc_value)
+{
+    struct hash_table *names = __get_or_create(by_path, path);
+    struct hash_table *values = __get_or_create(by_name, enc_name);
+    struct hash_table *set = values != NULL ? __get_or_create(values, enc_value) : NULL;
+    char *value_copy = strdup(enc_value);
+    char *path_copy = strdup(path);
+    if (names == NULL || set == NULL || value_copy == NULL || path_copy == NULL) {
+        error_print("cannot allocate memory.\n");
+        free(value_copy);
+        free(path_copy);
+        return;
+    }
+
+    hash_table_put(names, name, value_copy);
+
+    char entry[NAME_MAX + 1];
+    __entry_name(path, entry);
+    free(hash_table_get(set, entry));
+    hash_table_put(set, entry, path_copy);
+}
+
+static void __add(const char *path, const char *name, const char *value, size_t size)
+{
+    char enc_name[NAME_MAX + 1];
+    char enc_value[NAME_MAX + 1];
+
+    __del(path, name);
+    if (__encode(name, strlen(name), enc_name, sizeof(enc_name)) < 0)
+        return;
+    if (__encode(value, size, enc_value, sizeof(enc_value)) < 0)
+        return;
+
+    __add_encoded(path, name, enc_name, enc_value);
+}
+
+struct path_names {
+    size_t count;
+    char **names;
+    char **enc_values;
+};
+
+static void __collect_name(const char *name, void *value, void *data)
+{
+    struct path_names *collected = data;
+    collected->names[collected->count] = strdup(name);
+    collected->enc_values[collected->count] = strdup(value);
+    collected->count++;
+}
+
+/* detach every attribute of path, optionally re-adding them under new_path */
+static void __move(const char *path, const char *new_path)
+{
+    struct hash_table *names = hash_table_get(by_path, path);
+    if (names == NULL)
+        return;
+
+    struct path_names collected = { 0, NULL, NULL };
+    const size_t size = hash_table_size(names);
+    collected.names = calloc(size, sizeof(char *));
+    collected.enc_values = calloc(size, sizeof(char *));
+    if (collected.names != NULL && collected.enc_values != NULL)
+        hash_table_foreach(names, __collect_name, &collected);
+
+    for (size_t i = 0; i < collected.count; i++) {
+        char enc_name[NAME_MAX + 1];
+        if (collected.names[i] != NULL && collected.enc_values[i] != NULL) {
+            __del(path, collected.names[i]);
+            if (new_path != NULL && __encode(collected.names[i], strlen(collected.names[i]),
+                                             enc_name, sizeof(enc_name)) >= 0)
+                __add_encoded(new_path, collected.names[i], enc_name, collected.enc_values[i]);
+        }
+        free(collected.names[i]);
+        free(collected.enc_values[i]);
+    }
+    free(collected.names);
+    free(collected.enc_values);
+}
+
+static void __tombstone(const char *path)
+{
+    if (scanning && tombstones != NULL)
+        hash_table_put(tombstones, path, tombstones);
+}
+
+static void __revive(const char *path)
+{
+    if (tombstones != NULL)
+        hash_table_remove(tombstones, path);
+}
+
+void query_index_set(const char *path, const char *name, const char *value, size_t size)
+{
+    if (!enabled)
+        return;
+
+    const char *rel = __relative(path);
+    pthread_rwlock_wrlock(&index_lock);
+    __revive(rel);
+    __add(rel, name, value, size);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+void query_index_remove(const char *path, const char *name)
+{
+    if (!enabled)
+        return;
+
+    pthread_rwlock_wrlock(&index_lock);
+    __del(__relative(path), name);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+void query_index_remove_path(const char *path)
+{
+    if (!enabled)
+        return;
+
+    const char *rel = __relative(path);
+    pthread_rwlock_wrlock(&index_lock);
+    __tombstone(rel);
+    __move(rel, NULL);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+struct prefix_match {
+    const char *prefix;
+    size_t prefix_size;
+    size_t count;
+    size_t allocated;
+    char **paths;
+};
+
+static void __collect_prefixed(const char *path, void *value, void *data)
+{
+    (void) value;
+    struct prefix_match *match = data;
+    if (strncmp(path, match->prefix, match->prefix_size) != 0 || path[match->prefix_size] != '/')
+        return;
+
+    if (match->count == match->allocated) {
+        size_t allocated = match->allocated ? match->allocated * 2 : 64;
+        char **paths = realloc(match->paths, allocated * sizeof(char *));
+        if (paths == NULL)
+            return;
+        match->paths = paths;
+        match->allocated = allocated;
+    }
+    match->paths[match->count++] = strdup(path);
+}
+
+static void __reload_attr(const char *name, const char *value, size_t size, void *data)
+{
+    const char *rel = data;
+    pthread_rwlock_wrlock(&index_lock);
+    if (tombstones == NULL || hash_table_get(tombstones, rel) == NULL)
+        __add(rel, name, value, size);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+/* re-read the attributes of path from its sidecar */
+static void __reload(const char *path)
+{
+    const char *rel = __relative(path);
+
+    pthread_rwlock_wrlock(&index_lock);
+    __move(rel, NULL);
+    pthread_rwlock_unlock(&index_lock);
+
+    binary_storage_foreach(path, __reload_attr, (void *) rel);
+}
+
+void query_index_reload(const char *path)
+{
+    if (!enabled)
+        return;
+
+    __reload(path);
+}
+
+void query_index_rename(const char *from, const char *to, int is_directory)
+{
+    if (!enabled)
+        return;
+
+    const char *rel_from = __relative(from);
+    const char *rel_to = __relative(to);
+
+    pthread_rwlock_wrlock(&index_lock);
+    __tombstone(rel_from);
+    __revive(rel_to);
+    __move(rel_to, NULL); // replaced by the rename
+    __move(rel_from, rel_to);
+
+    if (is_directory) {
+        struct prefix_match match = { rel_from, strlen(rel_from), 0, 0, NULL };
+        hash_table_foreach(by_path, __collect_prefixed, &match);
+
+        const size_t to_size = strlen(rel_to);
+        for (size_t i = 0; i < match.count; i++) {
+            if (match.paths[i] == NULL)
+                continue;
+            const char *suffix = match.paths[i] + match.prefix_size;
+            char *new_path = malloc(to_size + strlen(suffix) + 1);
+            if (new_path != NULL) {
+                memcpy(new_path, rel_to, to_size);
+                strcpy(new_path + to_size, suffix);
+                __tombstone(match.paths[i]);
+                __move(match.paths[i], new_path);
+                free(new_path);
+            }
+            free(match.paths[i]);
+        }
+        free(match.paths);
+
+        if (scanning)
+            rescan = 1;
+    }
+    const int reload = scanning && !is_directory;
+    pthread_rwlock_unlock(&index_lock);
+
+    // the scan may already have passed the destination directory
+    if (reload)
+        __reload(to);
+}
+
+static void __scan_store_entry(const char *path, void *data)
+{
+    (void) data;
+    __reload(path);
+}
+
+static int __scan_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void) sb;
+
+    if (__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+        return 1;
+
+    if (typeflag != FTW_F || filename_is_sidecar(fpath) != 1)
+        return 0;
+
+    if (dir_store_enabled()) {
+        if (strcmp(fpath + ftwbuf->base, DIR_STORE_NAME) == 0)
+            dir_store_foreach_entry(fpath, __scan_store_entry, NULL);
+        return 0;
+    }
+    if (dir_store_is_store_name(fpath + ftwbuf->base))
+        return 0;
+
+    char *path = strndup(fpath, strlen(fpath) - BINARY_SIDECAR_EXT_SIZE);
+    if (path != NULL) {
+        __reload(path);
+        free(path);
+    }
+
+    return 0;
+}
+
+static void *__scan(void *data)
+{
+    (void) data;
+
+    int again;
+    do {
+        pthread_rwlock_wrlock(&index_lock);
+        rescan = 0;
+        pthread_rwlock_unlock(&index_lock);
+
+        debug_print("building query index: %s\n", xattrs_config.source_dir);
+        nftw(xattrs_config.source_dir, __scan_entry, 64, FTW_PHYS);
+
+        pthread_rwlock_wrlock(&index_lock);
+        again = rescan && !stopping;
+        if (!again) {
+            scanning = 0;
+            hash_table_free(tombstones, NULL);
+            tombstones = NULL;
+        }
+        pthread_rwlock_unlock(&index_lock);
+    } while (again);
+
+    debug_print("query index ready: %zu files\n", hash_table_size(by_path));
+    return NULL;
+}
+
+int query_index_init(void)
+{
+    by_name = hash_table_new();
+    by_path = hash_table_new();
+    tombstones = hash_table_new();
+    if (by_name == NULL || by_path == NULL || tombstones == NULL) {
+        error_print("cannot allocate query index\n");
+        return -1;
+    }
+
+    mount_time = time(NULL);
+    scanning = 1;
+    enabled = 1;
+
+    if (pthread_create(&scan_thread, NULL, __scan, NULL) != 0) {
+        error_print("cannot start query index scan\n");
+        enabled = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void query_index_destroy(void)
+{
+    if (!enabled)
+        return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(scan_thread, NULL);
+
+    pthread_rwlock_wrlock(&index_lock);
+    enabled = 0;
+    hash_table_free(by_name, __free_values);
+    hash_table_free(by_path, __free_names);
+    hash_table_free(tombstones, NULL);
+    by_name = by_path = tombstones = NULL;
+    pthread_rwlock_unlock(&index_lock);
+}
+
+int query_index_enabled(void)
+{
+    return enabled;
+}
+
+int query_is_path(const char *path)
+{
+    return enabled
+           && strncmp(path, QUERY_DIR, QUERY_DIR_SIZE) == 0
+           && (path[QUERY_DIR_SIZE] == '\0' || path[QUERY_DIR_SIZE] == '/');
+}
+
+/*
+ * Split "/.xattr-query/a/b/c" into its components.
+ * @return number of components after the query dir, -1 if too deep.
+ */
+static int __split(const char *path, char parts[3][NAME_MAX + 1])
+{
+    const char *p = path + QUERY_DIR_SIZE;
+    int depth = 0;
+    while (*p == '/') {
+        p++;
+        if (*p == '\0')
+            break;
+        if (depth == 3)
+            return -1;
+
+        const char *end = strchr(p, '/');
+        size_t size = end != NULL ? (size_t) (end - p) : strlen(p);
+        if (size > NAME_MAX)
+            return -1;
+        memcpy(parts[depth], p, size);
+        parts[depth][size] = '\0';
+        depth++;
+        p += size;
+    }
+    return depth;
+}
+
+/* caller holds index_lock */
+static const char *__lookup(int depth, char parts[3][NAME_MAX + 1], struct hash_table **table)
+{
+    struct hash_table *values = depth >= 1 ? hash_table_get(by_name, parts[0]) : by_name;
+    struct hash_table *set = depth >= 2 && values != NULL ? hash_table_get(values, parts[1]) : values;
+    const char *target = depth == 3 && set != NULL ? hash_table_get(set, parts[2]) : NULL;
+
+    *table = set;
+    return target;
+}
+
+static void __fill_dir_stat(struct stat *stbuf)
+{
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = mount_time;
+}
+
+int query_getattr(const char *path, struct stat *stbuf)
+{
+    char parts[3][NAME_MAX + 1];
+    int depth = __split(path, parts);
+    if (depth < 0)
+        return -ENOENT;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    __fill_dir_stat(stbuf);
+
+    int res = 0;
+    struct hash_table *table;
+    pthread_rwlock_rdlock(&index_lock);
+    const char *target = __lookup(depth, parts, &table);
+    if (depth == 3 && target != NULL) {
+        stbuf->st_mode = S_IFLNK | 0777;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = (off_t) (strlen("../../..") + strlen(target));
+    } else if (table == NULL || depth == 3) {
+        res = -ENOENT;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    return res;
+}
+
+int query_readlink(const char *path, char *buf, size_t size)
+{
+    char parts[3][NAME_MAX + 1];
+    if (__split(path, parts) != 3)
+        return -EINVAL;
+
+    int res = 0;
+    struct hash_table *table;
+    pthread_rwlock_rdlock(&index_lock);
+    const char *target = __lookup(3, parts, &table);
+    if (target == NULL)
+        res = -ENOENT;
+    else
+        snprintf(buf, size, "../../..%s", target); // back to the mount root
+    pthread_rwlock_unlock(&index_lock);
+
+    return res;
+}
+
+struct fill_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+static void __fill_entry(const char *name, void *value, void *data)
+{
+    (void) value;
+    struct fill_ctx *ctx = data;
+    ctx->filler(ctx->buf, name, NULL, 0, 0);
+}
+
+int query_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+    char parts[3][NAME_MAX + 1];
+    int depth = __split(path, parts);
+    if (depth < 0 || depth == 3)
+        return depth < 0 ? -ENOENT : -ENOTDIR;
+
+    int res = 0;
+    struct hash_table *table;
+    pthread_rwlock_rdlock(&index_lock);
+    __lookup(depth, parts, &table);
+    if (table == NULL) {
+        res = -ENOENT;
+    } else {
+        struct fill_ctx ctx = { buf, filler };
+        filler(buf, ".", NULL, 0, 0);
+        filler(buf, "..", NULL, 0, 0);
+        hash_table_foreach(table, __fill_entry, &ctx);
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    return res;
+}
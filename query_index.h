@@ -0,0 +1,52 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_QUERY_INDEX_H
+#define FUSE_XATTRS_QUERY_INDEX_H
+
+#include <fuse.h>
+
+/*
+ * Secondary index from (attribute name, value) to the files carrying it,
+ * exposed as a read-only virtual directory on the mount root:
+ *
+ *   /.xattr-query/<name>/<value>/<entry>  ->  symlink to the file
+ *
+ * Names, values and entries are percent-encoded: every byte outside the
+ * printable ASCII range, space, '/', '%' and a leading '.' become %XX. An
+ * empty value is spelled "%". Entries are the encoded mount relative path
+ * of the file, or a hash prefixed basename when that doesn't fit NAME_MAX.
+ * Values whose encoding doesn't fit NAME_MAX are not indexed.
+ *
+ * The index lives in memory. It is built by a background scan at mount
+ * time and kept up to date by binary_storage, the rename/unlink hooks and,
+ * with -o watch, changes made outside the mount.
+ */
+#define QUERY_DIR_NAME ".xattr-query"
+
+int query_index_init(void);
+void query_index_destroy(void);
+int query_index_enabled(void);
+
+/* @param path - absolute (source) path of the file. */
+void query_index_set(const char *path, const char *name, const char *value, size_t size);
+void query_index_remove(const char *path, const char *name);
+void query_index_remove_path(const char *path);
+void query_index_rename(const char *from, const char *to, int is_directory);
+
+/* the sidecar of path changed behind our back */
+void query_index_reload(const char *path);
+
+/* @param path - mount relative path, as received by fuse operations. */
+int query_is_path(const char *path);
+int query_getattr(const char *path, struct stat *stbuf);
+int query_readlink(const char *path, char *buf, size_t size);
+int query_readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+
+#endif //FUSE_XATTRS_QUERY_INDEX_H
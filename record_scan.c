@@ -0,0 +1,197 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "record_scan.h"
+#include "blob_store.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    #include <immintrin.h>
+    #define RECORD_SCAN_X86 1
+#endif
+
+#define HEADER_SIZE sizeof(uint16_t)
+#define VECTOR_MAX 32
+
+/* The header a matching record starts with. */
+struct record_key {
+    unsigned char head[VECTOR_MAX];     // u16 name size, then the name, zero padded
+    size_t size;                        // HEADER_SIZE + name size
+    const char *name;
+    uint32_t mask16;                    // bytes of head to compare in a 16 bytes vector
+    uint32_t mask32;                    // in a 32 bytes one
+};
+
+static void __make_key(struct record_key *key, const char *name, size_t name_size)
+{
+    const uint16_t _name_size = (uint16_t) name_size;
+    const size_t head_name_size = name_size < VECTOR_MAX - HEADER_SIZE ? name_size : VECTOR_MAX - HEADER_SIZE;
+
+    memset(key->head, 0, sizeof(key->head));
+    memcpy(key->head, &_name_size, HEADER_SIZE);
+    memcpy(key->head + HEADER_SIZE, name, head_name_size);
+    key->size = HEADER_SIZE + name_size;
+    key->name = name;
+    key->mask16 = key->size >= 16 ? 0xffff : (1u << key->size) - 1;
+    key->mask32 = key->size >= 32 ? 0xffffffff : (1u << key->size) - 1;
+}
+
+static inline int __match_scalar(const char *record, size_t avail, const struct record_key *key)
+{
+    (void) avail;
+    return memcmp(record, key->head, HEADER_SIZE) == 0 &&
+           memcmp(record + HEADER_SIZE, key->name, key->size - HEADER_SIZE) == 0;
+}
+
+/* The sizes are equal: compare the name past the first compared bytes. */
+static inline int __match_tail(const char *record, const struct record_key *key, size_t compared)
+{
+    return key->size <= compared ||
+           memcmp(record + compared, key->name + compared - HEADER_SIZE, key->size - compared) == 0;
+}
+
+#ifdef RECORD_SCAN_X86
+static inline int __match_sse2(const char *record, size_t avail, const struct record_key *key)
+{
+    if (avail < 16)
+        return __match_scalar(record, avail, key);
+
+    const __m128i candidate = _mm_loadu_si128((const __m128i *) record);
+    const __m128i head = _mm_loadu_si128((const __m128i *) key->head);
+    const uint32_t equal = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(candidate, head));
+    return (equal & key->mask16) == key->mask16 && __match_tail(record, key, 16);
+}
+
+__attribute__((target("avx2")))
+static inline int __match_avx2(const char *record, size_t avail, const struct record_key *key)
+{
+    if (avail < 32)
+        return __match_sse2(record, avail, key);
+
+    const __m256i candidate = _mm256_loadu_si256((const __m256i *) record);
+    const __m256i head = _mm256_loadu_si256((const __m256i *) key->head);
+    const uint32_t equal = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(candidate, head));
+    return (equal & key->mask32) == key->mask32 && __match_tail(record, key, 32);
+}
+#endif
+
+/*
+ * The walk is the same for every kernel, only the compare differs: one
+ * copy of it per kernel, so that the compare is inlined and the whole
+ * loop compiled for the kernel's target.
+ */
+#define RECORD_SCAN_FIND(kernel, ...)                                                           \
+__VA_ARGS__                                                                                     \
+static ssize_t __find_##kernel(const char *buffer, size_t size, const struct record_key *key)  \
+{                                                                                               \
+    size_t offset = 0;                                                                          \
+    while (offset < size) {                                                                     \
+        const char *record = buffer + offset;                                                   \
+        const size_t avail = size - offset;                                                     \
+        uint16_t name_size;                                                                     \
+        size_t value_size;                                                                      \
+                                                                                                \
+        if (avail < HEADER_SIZE)                                                                \
+            return -EILSEQ;                                                                     \
+        memcpy(&name_size, record, HEADER_SIZE);                                                \
+        const size_t value_offset = HEADER_SIZE + name_size;                                    \
+        if (avail < value_offset + sizeof(size_t))                                              \
+            return -EILSEQ;                                                                     \
+        memcpy(&value_size, record + value_offset, sizeof(size_t));                             \
+        value_size &= ~BLOB_REF_FLAG;                                                           \
+        if (value_size > avail - value_offset - sizeof(size_t))                                 \
+            return -EILSEQ;                                                                     \
+                                                                                                \
+        if (__match_##kernel(record, avail, key))                                               \
+            return (ssize_t) offset;                                                            \
+        offset += value_offset + sizeof(size_t) + value_size;                                   \
+    }                                                                                           \
+    return -ENOENT;                                                                             \
+}
+
+RECORD_SCAN_FIND(scalar, )
+#ifdef RECORD_SCAN_X86
+RECORD_SCAN_FIND(sse2, )
+RECORD_SCAN_FIND(avx2, __attribute__((target("avx2"))))
+#endif
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static enum record_scan_kernel kernel = RECORD_SCAN_SCALAR;
+
+static int __supported(enum record_scan_kernel candidate)
+{
+    switch (candidate) {
+        case RECORD_SCAN_SCALAR:
+            return 1;
+#ifdef RECORD_SCAN_X86
+        case RECORD_SCAN_SSE2:
+            return 1;   // part of x86-64
+        case RECORD_SCAN_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 0;
+    }
+}
+
+static void __pick_kernel(void)
+{
+    if (__supported(RECORD_SCAN_AVX2))
+        kernel = RECORD_SCAN_AVX2;
+    else if (__supported(RECORD_SCAN_SSE2))
+        kernel = RECORD_SCAN_SSE2;
+}
+
+ssize_t record_scan_find(const char *buffer, size_t size, const char *name, size_t name_size)
+{
+    if (name_size > UINT16_MAX)
+        return -ENOENT;
+
+    pthread_once(&kernel_once, __pick_kernel);
+    struct record_key key;
+    __make_key(&key, name, name_size);
+
+    switch (kernel) {
+#ifdef RECORD_SCAN_X86
+        case RECORD_SCAN_AVX2:
+            return __find_avx2(buffer, size, &key);
+        case RECORD_SCAN_SSE2:
+            return __find_sse2(buffer, size, &key);
+#endif
+        default:
+            return __find_scalar(buffer, size, &key);
+    }
+}
+
+int record_scan_use(enum record_scan_kernel candidate)
+{
+    pthread_once(&kernel_once, __pick_kernel);
+    if (!__supported(candidate))
+        return -ENOTSUP;
+    kernel = candidate;
+    return 0;
+}
+
+const char *record_scan_kernel_name(void)
+{
+    pthread_once(&kernel_once, __pick_kernel);
+    switch (kernel) {
+        case RECORD_SCAN_AVX2:
+            return "avx2";
+        case RECORD_SCAN_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
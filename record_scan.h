@@ -0,0 +1,50 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_RECORD_SCAN_H
+#define FUSE_XATTRS_RECORD_SCAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Attribute lookup in a loaded sidecar, walking its records in place:
+ *
+ *     u16 name size (with the '\0'), name, size_t value size, value
+ *
+ * Each record header is compared against the key (its name size and
+ * name, laid out the same way) with a single vector compare covering
+ * the size and the leading bytes of the name; only longer names need a
+ * memcmp of the rest. The kernel is chosen once from the CPU: AVX2,
+ * SSE2, or scalar elsewhere.
+ */
+enum record_scan_kernel {
+    RECORD_SCAN_SCALAR,
+    RECORD_SCAN_SSE2,
+    RECORD_SCAN_AVX2,
+};
+
+/**
+ * Find the record named name, of name_size bytes with the '\0'.
+ * @return offset of the record in buffer, -ENOENT if there is none, or
+ *         -EILSEQ if the records before it don't parse.
+ */
+ssize_t record_scan_find(const char *buffer, size_t size, const char *name, size_t name_size);
+
+/**
+ * Use kernel from now on instead of the one picked for this CPU, for
+ * benchmarks.
+ * @return On success, zero is returned. -ENOTSUP if the CPU can't run it.
+ */
+int record_scan_use(enum record_scan_kernel kernel);
+
+/* @return name of the kernel in use. */
+const char *record_scan_kernel_name(void);
+
+#endif //FUSE_XATTRS_RECORD_SCAN_H
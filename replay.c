@@ -0,0 +1,707 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For fallocate() and nftw() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include "replay.h"
+#include "trace.h"
+#include "arena.h"
+#include "binary_storage.h"
+#include "hash_table.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+#define REPLAY_MAX_BUFFER (16 * 1024 * 1024)  // larger reads and writes are clamped
+#define REPLAY_LATE_NS 1000000                // behind schedule by more than this
+
+static const char *const op_names[TRACE_OP_COUNT] = {
+        [TRACE_GETATTR] = "getattr",
+        [TRACE_ACCESS] = "access",
+        [TRACE_READLINK] = "readlink",
+        [TRACE_READDIR] = "readdir",
+        [TRACE_MKNOD] = "mknod",
+        [TRACE_MKDIR] = "mkdir",
+        [TRACE_SYMLINK] = "symlink",
+        [TRACE_UNLINK] = "unlink",
+        [TRACE_RMDIR] = "rmdir",
+        [TRACE_RENAME] = "rename",
+        [TRACE_LINK] = "link",
+        [TRACE_CHMOD] = "chmod",
+        [TRACE_CHOWN] = "chown",
+        [TRACE_TRUNCATE] = "truncate",
+        [TRACE_UTIMENS] = "utimens",
+        [TRACE_OPEN] = "open",
+        [TRACE_CREATE] = "create",
+        [TRACE_READ] = "read",
+        [TRACE_WRITE] = "write",
+        [TRACE_STATFS] = "statfs",
+        [TRACE_RELEASE] = "release",
+        [TRACE_FSYNC] = "fsync",
+        [TRACE_FSYNCDIR] = "fsyncdir",
+        [TRACE_FALLOCATE] = "fallocate",
+        [TRACE_SETXATTR] = "setxattr",
+        [TRACE_GETXATTR] = "getxattr",
+        [TRACE_LISTXATTR] = "listxattr",
+        [TRACE_REMOVEXATTR] = "removexattr",
+};
+
+struct entry {
+    struct trace_record record;
+    uint32_t name;          // offset in names, 0: no name
+    int32_t result;         // replayed
+    uint32_t latency;       // replayed, ns
+    uint8_t replayed;
+    uint8_t late;
+};
+
+struct trace {
+    struct entry *entries;
+    size_t count;
+    char *names;            // '\0' terminated names, starting with ""
+    size_t names_size;
+    uint32_t threads;       // recorded
+};
+
+/* what the trace tells about a path before using it */
+struct replay_path {
+    int seen;
+    int exists;             // create it before replaying
+    mode_t type;            // S_IFREG, S_IFDIR or S_IFLNK
+    uint64_t size;          // largest read extent
+};
+
+struct worker {
+    struct trace *trace;
+    const struct replay_options *options;
+    const char *dir;
+    uint64_t start;         // CLOCK_MONOTONIC, ns
+    size_t *indexes;        // of its entries, in order
+    size_t count;
+    char *buffer;
+    size_t buffer_size;
+    struct hash_table *fds; // hash -> open descriptor + 1
+};
+
+static uint64_t __now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void __sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+            .tv_sec = (time_t) (deadline / 1000000000),
+            .tv_nsec = (long) (deadline % 1000000000),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int __load(FILE *file, struct trace *trace)
+{
+    struct trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1)
+        return ferror(file) ? -errno : -EINVAL;
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION
+        || header.record_size < sizeof(struct trace_record)) {
+        fprintf(stderr, "replay: not a trace, or of an unsupported version\n");
+        return -EINVAL;
+    }
+
+    size_t alloc = 0;
+    size_t names_alloc = 256;
+    trace->names = malloc(names_alloc);
+    if (trace->names == NULL)
+        return -ENOMEM;
+    trace->names[0] = '\0';
+    trace->names_size = 1;
+
+    const size_t skip = header.record_size - sizeof(struct trace_record);
+    struct trace_record record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (skip > 0 && fseek(file, (long) skip, SEEK_CUR) != 0)
+            return -errno;
+        if (record.op == 0 || record.op >= TRACE_OP_COUNT) {
+            fprintf(stderr, "replay: corrupted trace, record %zu\n", trace->count);
+            return -EINVAL;
+        }
+
+        if (trace->count == alloc) {
+            alloc = alloc ? alloc * 2 : 4096;
+            struct entry *entries = realloc(trace->entries, alloc * sizeof(*entries));
+            if (entries == NULL)
+                return -ENOMEM;
+            trace->entries = entries;
+        }
+        struct entry *entry = &trace->entries[trace->count];
+        memset(entry, 0, sizeof(*entry));
+        entry->record = record;
+
+        if (record.name_size > 0) {
+            if (trace->names_size + record.name_size + 1 > names_alloc) {
+                names_alloc *= 2;
+                char *names = realloc(trace->names, names_alloc);
+                if (names == NULL)
+                    return -ENOMEM;
+                trace->names = names;
+            }
+            if (fread(trace->names + trace->names_size, record.name_size, 1, file) != 1)
+                return -EINVAL;
+            entry->name = (uint32_t) trace->names_size;
+            trace->names_size += record.name_size;
+            trace->names[trace->names_size++] = '\0';
+        }
+
+        if (record.thread > trace->threads)
+            trace->threads = record.thread;
+        trace->count++;
+    }
+    return ferror(file) ? -EIO : 0;
+}
+
+static int __by_start(const void *a, const void *b)
+{
+    const struct trace_record *x = &((const struct entry *) a)->record;
+    const struct trace_record *y = &((const struct entry *) b)->record;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static void __hash_name(uint64_t hash, char name[17])
+{
+    sprintf(name, "%016" PRIx64, hash);
+}
+
+static struct replay_path *__path(struct hash_table *paths, uint64_t hash)
+{
+    char name[17];
+    __hash_name(hash, name);
+    struct replay_path *path = hash_table_get(paths, name);
+    if (path == NULL) {
+        path = calloc(1, sizeof(*path));
+        if (path == NULL || hash_table_put(paths, name, path) != 0) {
+            free(path);
+            return NULL;
+        }
+    }
+    return path;
+}
+
+static int __creates(enum trace_op op)
+{
+    return op == TRACE_CREATE || op == TRACE_MKNOD || op == TRACE_MKDIR || op == TRACE_SYMLINK;
+}
+
+/* Find out which paths exist before the trace starts, and what they are. */
+static int __classify(struct trace *trace, struct hash_table *paths)
+{
+    for (size_t i = 0; i < trace->count; i++) {
+        const struct trace_record *record = &trace->entries[i].record;
+        struct replay_path *path = __path(paths, record->path_hash);
+        if (path == NULL)
+            return -ENOMEM;
+
+        if (!path->seen) {
+            path->seen = 1;
+            path->exists = !(__creates(record->op) && record->result >= 0) && record->result != -ENOENT;
+        }
+        if (path->type == 0) {
+            if (record->op == TRACE_READDIR || record->op == TRACE_MKDIR || record->op == TRACE_RMDIR
+                || record->op == TRACE_FSYNCDIR)
+                path->type = S_IFDIR;
+            else if (record->op == TRACE_READLINK || record->op == TRACE_SYMLINK)
+                path->type = S_IFLNK;
+        }
+        if (record->op == TRACE_READ && record->offset + record->size > path->size)
+            path->size = record->offset + record->size;
+
+        if (record->op == TRACE_RENAME || record->op == TRACE_LINK) {
+            struct replay_path *other = __path(paths, record->other_hash);
+            if (other == NULL)
+                return -ENOMEM;
+            if (!other->seen) {
+                other->seen = 1;
+                other->exists = record->result < 0;
+            }
+            if (other->type == 0)
+                other->type = path->type;
+        }
+    }
+    return 0;
+}
+
+struct setup {
+    const char *dir;
+    uint64_t created;
+    int res;
+};
+
+static void __create_path(const char *key, void *value, void *data)
+{
+    const struct replay_path *path = value;
+    struct setup *setup = data;
+    if (!path->exists || setup->res != 0)
+        return;
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/" REPLAY_DIR_NAME "/%s", setup->dir, key);
+
+    int res = 0;
+    if (path->type == S_IFDIR) {
+        res = mkdir(file, 0755);
+    } else if (path->type == S_IFLNK) {
+        res = symlink(REPLAY_DIR_NAME, file);
+    } else {
+        int fd = open(file, O_CREAT | O_WRONLY | O_EXCL, 0644);
+        if (fd == -1 || (path->size > 0 && ftruncate(fd, (off_t) path->size) != 0))
+            res = -1;
+        if (fd != -1)
+            close(fd);
+    }
+    if (res != 0) {
+        setup->res = -errno;
+        fprintf(stderr, "replay: cannot create %s: %s\n", file, strerror(errno));
+        return;
+    }
+    setup->created++;
+}
+
+static int __remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void) st;
+    (void) ftw;
+    if ((flag == FTW_DP ? rmdir(path) : unlink(path)) != 0)
+        fprintf(stderr, "replay: cannot remove %s: %s\n", path, strerror(errno));
+    return 0;
+}
+
+static void __path_of(const struct worker *worker, uint64_t hash, char *path, size_t size)
+{
+    char name[17];
+    __hash_name(hash, name);
+    snprintf(path, size, "%s/" REPLAY_DIR_NAME "/%s", worker->dir, name);
+}
+
+static void __forget_fd(struct worker *worker, uint64_t hash)
+{
+    char name[17];
+    __hash_name(hash, name);
+    void *fd = hash_table_remove(worker->fds, name);
+    if (fd != NULL)
+        close((int) (intptr_t) fd - 1);
+}
+
+/* @return a descriptor of path kept open for read, write and friends, -1 on failure */
+static int __fd_of(struct worker *worker, uint64_t hash, const char *path)
+{
+    char name[17];
+    __hash_name(hash, name);
+    void *cached = hash_table_get(worker->fds, name);
+    if (cached != NULL)
+        return (int) (intptr_t) cached - 1;
+
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+        fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    if (hash_table_put(worker->fds, name, (void *) (intptr_t) (fd + 1)) != 0) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    return fd;
+}
+
+static void __close_fd(void *value)
+{
+    close((int) (intptr_t) value - 1);
+}
+
+#define SYSCALL(call) ((call) < 0 ? -errno : 0)
+
+/* @return 0 when the operation cannot be replayed, else 1 and its result */
+static int __replay_mount(struct worker *worker, const struct entry *entry, int *result)
+{
+    const struct trace_record *record = &entry->record;
+    const char *name = worker->trace->names + entry->name;
+    const size_t size = record->size < worker->buffer_size ? record->size : worker->buffer_size;
+    char path[PATH_MAX];
+    char other[PATH_MAX];
+    __path_of(worker, record->path_hash, path, sizeof(path));
+    int fd = -1;
+
+    // descriptors are opened before the clock starts
+    if (record->op == TRACE_READ || record->op == TRACE_WRITE || record->op == TRACE_FSYNC
+        || record->op == TRACE_FALLOCATE) {
+        fd = __fd_of(worker, record->path_hash, path);
+        if (fd == -1) {
+            *result = -errno;
+            return 1;
+        }
+    }
+    if (record->op == TRACE_RENAME || record->op == TRACE_LINK)
+        __path_of(worker, record->other_hash, other, sizeof(other));
+    if (record->op == TRACE_UNLINK || record->op == TRACE_RENAME || record->op == TRACE_RMDIR)
+        __forget_fd(worker, record->path_hash);
+    if (record->op == TRACE_RENAME)
+        __forget_fd(worker, record->other_hash);
+
+    const int flags = (int) record->flags & (O_ACCMODE | O_APPEND | O_TRUNC);
+    struct stat st;
+    struct statvfs stvfs;
+    DIR *dir;
+    ssize_t n;
+
+    switch ((enum trace_op) record->op) {
+        case TRACE_GETATTR:
+            *result = SYSCALL(lstat(path, &st));
+            break;
+        case TRACE_ACCESS:
+            *result = SYSCALL(access(path, (int) record->flags));
+            break;
+        case TRACE_READLINK:
+            n = readlink(path, worker->buffer, size);
+            *result = n < 0 ? -errno : 0;
+            break;
+        case TRACE_READDIR:
+            dir = opendir(path);
+            if (dir == NULL) {
+                *result = -errno;
+                break;
+            }
+            while (readdir(dir) != NULL)
+                ;
+            closedir(dir);
+            *result = 0;
+            break;
+        case TRACE_MKNOD:
+            *result = SYSCALL(mknod(path, record->flags, 0));
+            break;
+        case TRACE_MKDIR:
+            *result = SYSCALL(mkdir(path, record->flags & 07777));
+            break;
+        case TRACE_SYMLINK:
+            *result = SYSCALL(symlink(REPLAY_DIR_NAME, path));
+            break;
+        case TRACE_UNLINK:
+            *result = SYSCALL(unlink(path));
+            break;
+        case TRACE_RMDIR:
+            *result = SYSCALL(rmdir(path));
+            break;
+        case TRACE_RENAME:
+            *result = SYSCALL(rename(path, other));
+            break;
+        case TRACE_LINK:
+            *result = SYSCALL(link(path, other));
+            break;
+        case TRACE_CHMOD:
+            *result = SYSCALL(chmod(path, record->flags & 07777));
+            break;
+        case TRACE_CHOWN:
+            // unchanged owner: still a setattr, without privileges
+            *result = SYSCALL(lchown(path, (uid_t) -1, (gid_t) -1));
+            break;
+        case TRACE_TRUNCATE:
+            *result = SYSCALL(truncate(path, (off_t) record->size));
+            break;
+        case TRACE_UTIMENS:
+            *result = SYSCALL(utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW));
+            break;
+        case TRACE_OPEN:
+        case TRACE_CREATE:
+            fd = record->op == TRACE_CREATE ? open(path, flags | O_CREAT, 0644) : open(path, flags);
+            *result = fd < 0 ? -errno : 0;
+            if (fd >= 0)
+                close(fd);
+            break;
+        case TRACE_READ:
+            n = pread(fd, worker->buffer, size, (off_t) record->offset);
+            *result = n < 0 ? -errno : (int) n;
+            break;
+        case TRACE_WRITE:
+            n = pwrite(fd, worker->buffer, size, (off_t) record->offset);
+            *result = n < 0 ? -errno : (int) n;
+            break;
+        case TRACE_STATFS:
+            *result = SYSCALL(statvfs(path, &stvfs));
+            break;
+        case TRACE_FSYNC:
+            *result = SYSCALL(record->flags ? fdatasync(fd) : fsync(fd));
+            break;
+        case TRACE_FSYNCDIR:
+            fd = open(path, O_RDONLY | O_DIRECTORY);
+            *result = fd < 0 ? -errno : SYSCALL(fsync(fd));
+            if (fd >= 0)
+                close(fd);
+            break;
+        case TRACE_FALLOCATE:
+            *result = SYSCALL(fallocate(fd, (int) record->flags, (off_t) record->offset, (off_t) record->size));
+            break;
+        case TRACE_SETXATTR:
+            *result = SYSCALL(lsetxattr(path, name, worker->buffer, size, (int) record->flags));
+            break;
+        case TRACE_GETXATTR:
+            n = lgetxattr(path, name, worker->buffer, size);
+            *result = n < 0 ? -errno : (int) n;
+            break;
+        case TRACE_LISTXATTR:
+            n = llistxattr(path, worker->buffer, size);
+            *result = n < 0 ? -errno : (int) n;
+            break;
+        case TRACE_REMOVEXATTR:
+            *result = SYSCALL(lremovexattr(path, name));
+            break;
+        default:
+            // release: open is replayed with its close
+            return 0;
+    }
+    return 1;
+}
+
+/* Same order of checks as the daemon before it reaches the storage. */
+static int __replay_storage(struct worker *worker, const struct entry *entry, int *result)
+{
+    const struct trace_record *record = &entry->record;
+    const char *name = worker->trace->names + entry->name;
+    const size_t size = record->size < worker->buffer_size ? record->size : worker->buffer_size;
+
+    if (record->op != TRACE_SETXATTR && record->op != TRACE_GETXATTR && record->op != TRACE_LISTXATTR
+        && record->op != TRACE_REMOVEXATTR)
+        return 0;
+    if (record->op != TRACE_LISTXATTR && get_namespace(name) != USER) {
+        *result = -ENOTSUP;
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    __path_of(worker, record->path_hash, path, sizeof(path));
+    struct arena_mark mark = arena_mark();
+    switch ((enum trace_op) record->op) {
+        case TRACE_SETXATTR:
+            *result = binary_storage_write_key(path, name, worker->buffer, size, (int) record->flags);
+            break;
+        case TRACE_GETXATTR:
+            *result = binary_storage_read_key(path, name, worker->buffer, size);
+            break;
+        case TRACE_LISTXATTR:
+            *result = binary_storage_list_keys(path, worker->buffer, size);
+            break;
+        default:
+            *result = binary_storage_remove_key(path, name);
+            break;
+    }
+    arena_rewind(mark);
+    return 1;
+}
+
+static void __replay_job(void *arg)
+{
+    struct worker *worker = arg;
+    for (size_t i = 0; i < worker->count; i++) {
+        struct entry *entry = &worker->trace->entries[worker->indexes[i]];
+        if (!worker->options->fast) {
+            const uint64_t deadline = worker->start + entry->record.start;
+            const uint64_t now = __now();
+            if (now < deadline)
+                __sleep_until(deadline);
+            else
+                entry->late = now - deadline > REPLAY_LATE_NS;
+        }
+
+        int result = 0;
+        const uint64_t begin = __now();
+        entry->replayed = (uint8_t) (worker->options->storage ? __replay_storage(worker, entry, &result)
+                                                               : __replay_mount(worker, entry, &result));
+        const uint64_t latency = __now() - begin;
+        entry->latency = latency > UINT32_MAX ? UINT32_MAX : (uint32_t) latency;
+        entry->result = result;
+    }
+}
+
+static int __by_latency(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *) a;
+    const uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void __report(const struct trace *trace, const struct replay_options *options, unsigned int threads,
+                     double seconds)
+{
+    uint64_t replayed = 0;
+    uint64_t late = 0;
+    for (size_t i = 0; i < trace->count; i++) {
+        replayed += trace->entries[i].replayed;
+        late += trace->entries[i].late;
+    }
+
+    printf("replayed %" PRIu64 " of %zu operations in %.3fs: %.0f ops/s, %u threads, %s\n",
+           replayed, trace->count, seconds, seconds > 0 ? (double) replayed / seconds : 0, threads,
+           options->fast ? "as fast as possible" : "original timing");
+    if (late > 0)
+        printf("%" PRIu64 " operations started more than %d ms late\n", late, REPLAY_LATE_NS / 1000000);
+
+    uint32_t *latencies = malloc((replayed > 0 ? replayed : 1) * sizeof(*latencies));
+    if (latencies == NULL)
+        return;
+
+    // diverged: succeeded where the recorded one failed, or the other way around
+    printf("%-12s %10s %12s %12s %12s %10s\n", "operation", "count", "mean (us)", "p99 (us)", "recorded (us)",
+           "diverged");
+    for (int op = 1; op < TRACE_OP_COUNT; op++) {
+        size_t count = 0;
+        uint64_t diverged = 0;
+        double total = 0;
+        double recorded = 0;
+        for (size_t i = 0; i < trace->count; i++) {
+            const struct entry *entry = &trace->entries[i];
+            if (entry->record.op != op || !entry->replayed)
+                continue;
+            latencies[count++] = entry->latency;
+            total += entry->latency;
+            recorded += entry->record.duration;
+            diverged += (entry->result < 0) != (entry->record.result < 0);
+        }
+        if (count == 0)
+            continue;
+        qsort(latencies, count, sizeof(*latencies), __by_latency);
+        printf("%-12s %10zu %12.1f %12.1f %12.1f %10" PRIu64 "\n", op_names[op], count,
+               total / (double) count / 1000, latencies[(count - 1) * 99 / 100] / 1000.0,
+               recorded / (double) count / 1000, diverged);
+    }
+    free(latencies);
+}
+
+static int __run(struct trace *trace, const char *dir, const struct replay_options *options)
+{
+    const unsigned int threads = options->threads ? options->threads : (trace->threads ? trace->threads : 1);
+    struct worker *workers = calloc(threads, sizeof(*workers));
+    if (workers == NULL)
+        return -ENOMEM;
+
+    int res = 0;
+    size_t buffer_size = 1;
+    for (size_t i = 0; i < trace->count; i++) {
+        const struct trace_record *record = &trace->entries[i].record;
+        struct worker *worker = &workers[(record->thread > 0 ? record->thread - 1 : 0) % threads];
+        worker->count++;
+        if (record->op != TRACE_TRUNCATE && record->op != TRACE_FALLOCATE && record->size > buffer_size)
+            buffer_size = record->size < REPLAY_MAX_BUFFER ? record->size : REPLAY_MAX_BUFFER;
+    }
+    for (unsigned int i = 0; i < threads && res == 0; i++) {
+        workers[i].trace = trace;
+        workers[i].options = options;
+        workers[i].dir = dir;
+        workers[i].buffer_size = buffer_size;
+        workers[i].indexes = malloc((workers[i].count ? workers[i].count : 1) * sizeof(size_t));
+        workers[i].buffer = malloc(buffer_size);
+        workers[i].fds = hash_table_new();
+        if (workers[i].indexes == NULL || workers[i].buffer == NULL || workers[i].fds == NULL)
+            res = -ENOMEM;
+        else
+            memset(workers[i].buffer, 'x', buffer_size);
+        workers[i].count = 0;
+    }
+
+    if (res == 0) {
+        for (size_t i = 0; i < trace->count; i++) {
+            const struct trace_record *record = &trace->entries[i].record;
+            struct worker *worker = &workers[(record->thread > 0 ? record->thread - 1 : 0) % threads];
+            worker->indexes[worker->count++] = i;
+        }
+
+        struct thread_pool *pool = thread_pool_new(threads, threads);
+        if (pool == NULL) {
+            res = -ENOMEM;
+        } else {
+            const uint64_t start = __now();
+            for (unsigned int i = 0; i < threads; i++) {
+                workers[i].start = start;
+                thread_pool_submit(pool, __replay_job, &workers[i], 1);
+            }
+            thread_pool_free(pool);
+            __report(trace, options, threads, (double) (__now() - start) / 1e9);
+        }
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        if (workers[i].fds != NULL)
+            hash_table_free(workers[i].fds, __close_fd);
+        free(workers[i].indexes);
+        free(workers[i].buffer);
+    }
+    free(workers);
+    return res;
+}
+
+int replay(const char *trace_path, const char *dir, const struct replay_options *options)
+{
+    FILE *file = fopen(trace_path, "r");
+    if (file == NULL)
+        return -errno;
+    setvbuf(file, NULL, _IOFBF, 1024 * 1024);
+
+    struct trace trace;
+    memset(&trace, 0, sizeof(trace));
+    int res = __load(file, &trace);
+    fclose(file);
+    if (res == 0)
+        qsort(trace.entries, trace.count, sizeof(*trace.entries), __by_start);
+
+    struct hash_table *paths = hash_table_new();
+    if (res == 0 && paths == NULL)
+        res = -ENOMEM;
+    if (res == 0)
+        res = __classify(&trace, paths);
+
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%s/" REPLAY_DIR_NAME, dir);
+    if (res == 0 && mkdir(root, 0755) != 0) {
+        res = -errno;
+        fprintf(stderr, "replay: cannot create %s: %s\n", root, strerror(errno));
+    }
+
+    if (res == 0) {
+        struct setup setup = { .dir = dir, .created = 0, .res = 0 };
+        hash_table_foreach(paths, __create_path, &setup);
+        res = setup.res;
+        if (res == 0) {
+            fprintf(stderr, "replay: %zu operations, %zu paths (%" PRIu64 " existing)\n",
+                    trace.count, hash_table_size(paths), setup.created);
+            res = __run(&trace, dir, options);
+        }
+        nftw(root, __remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    if (paths != NULL)
+        hash_table_free(paths, free);
+    free(trace.entries);
+    free(trace.names);
+    return res;
+}
@@ -0,0 +1,42 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_REPLAY_H
+#define FUSE_XATTRS_REPLAY_H
+
+/*
+ * Runs a trace recorded with -o trace=FILE (see trace.h) again.
+ *
+ * Traces only keep hashes of the paths, so every path becomes a file,
+ * directory or symlink named after its hash in REPLAY_DIR_NAME, created
+ * beforehand if the trace used it before creating it. Values and file
+ * contents are synthetic, of the recorded sizes.
+ *
+ * The operations of a recorded thread run in order on the same replay
+ * thread. Against a mount, every operation but release is replayed with
+ * the matching system call (open is followed by close). Against the
+ * storage engine, only the attribute operations are.
+ */
+#define REPLAY_DIR_NAME "fuse_xattrs_replay"
+
+struct replay_options {
+    unsigned int threads;   // 0: one per recorded thread
+    int fast;               // ignore the recorded timing
+    int storage;            // call the storage engine, dir is xattrs_config.source_dir
+};
+
+/**
+ * Replay trace_path under dir, a mountpoint or the source directory
+ * with options->storage, then print per operation latencies. The files
+ * created for the replay are removed.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int replay(const char *trace_path, const char *dir, const struct replay_options *options);
+
+#endif //FUSE_XATTRS_REPLAY_H
@@ -0,0 +1,196 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ro_index.h"
+#include "hash_table.h"
+#include "utils.h"
+
+#if __linux__
+    #include <sys/xattr.h>
+    #define ERR_NO_ATTR ENODATA
+#else
+    #include <attr/xattr.h>
+    #define ERR_NO_ATTR ENOATTR
+#endif
+
+/* mapped once before serving requests and never changed: no locking */
+static const char *map = NULL;
+static size_t map_size = 0;
+static const struct ro_index_header *header = NULL;
+static const uint32_t *seeds = NULL;
+static const uint64_t *slots = NULL;
+
+static uint64_t __mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t ro_index_hash(const char *path)
+{
+    return hash_string(path);
+}
+
+uint32_t ro_index_bucket(uint64_t hash, uint32_t bucket_count)
+{
+    return (uint32_t) (__mix(hash) % bucket_count);
+}
+
+uint64_t ro_index_slot(uint64_t hash, uint32_t seed, uint64_t file_count)
+{
+    return __mix(hash ^ (((uint64_t) seed + 1) * 0x9e3779b97f4a7c15ULL)) % file_count;
+}
+
+static int __valid_header(const struct ro_index_header *h, size_t size)
+{
+    if (size < sizeof(struct ro_index_header) || memcmp(h->magic, RO_INDEX_MAGIC, sizeof(h->magic)) != 0)
+        return 0;
+    if (h->version != RO_INDEX_VERSION || h->size != size)
+        return 0;
+    if (h->file_count > 0 && h->bucket_count == 0)
+        return 0;
+    if (h->seeds_offset % sizeof(uint32_t) != 0 || h->slots_offset % sizeof(uint64_t) != 0)
+        return 0;
+    if (h->seeds_offset > size || h->bucket_count > (size - h->seeds_offset) / sizeof(uint32_t))
+        return 0;
+    if (h->slots_offset > size || h->file_count > (size - h->slots_offset) / sizeof(uint64_t))
+        return 0;
+    return 1;
+}
+
+int ro_index_open(const char *index_path)
+{
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+
+    const size_t size = (size_t) st.st_size;
+    void *addr = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    int res = addr == MAP_FAILED ? (size > 0 ? -errno : -EINVAL) : 0;
+    close(fd);
+    if (res != 0)
+        return res;
+
+    if (!__valid_header(addr, size)) {
+        error_print("not a valid index: %s\n", index_path);
+        munmap(addr, size);
+        return -EINVAL;
+    }
+    madvise(addr, size, MADV_RANDOM);
+
+    map = addr;
+    map_size = size;
+    header = addr;
+    seeds = (const uint32_t *) (map + header->seeds_offset);
+    slots = (const uint64_t *) (map + header->slots_offset);
+    return 0;
+}
+
+int ro_index_enabled(void)
+{
+    return map != NULL;
+}
+
+/*
+ * @return the record of path, NULL if it has no attributes. Sizes are
+ *         checked against the mapping, a corrupt index reads as empty.
+ */
+static const struct ro_index_record *__find(const char *path)
+{
+    if (header->file_count == 0)
+        return NULL;
+
+    const uint64_t hash = ro_index_hash(path);
+    const uint32_t seed = seeds[ro_index_bucket(hash, header->bucket_count)];
+    const uint64_t offset = slots[ro_index_slot(hash, seed, header->file_count)];
+    if (offset % sizeof(uint64_t) != 0 || offset > map_size - sizeof(struct ro_index_record))
+        return NULL;
+
+    const struct ro_index_record *record = (const struct ro_index_record *) (map + offset);
+    const size_t available = map_size - offset - sizeof(struct ro_index_record);
+    if (record->path_size > available || record->list_size > available - record->path_size)
+        return NULL;
+
+    const char *record_path = (const char *) (record + 1);
+    if (record->path_size == 0 || record_path[record->path_size - 1] != '\0' || strcmp(path, record_path) != 0)
+        return NULL;
+    return record;
+}
+
+int ro_index_read_key(const char *path, const char *name, char *value, size_t size)
+{
+    const struct ro_index_record *record = __find(path);
+    if (record == NULL)
+        return -ERR_NO_ATTR;
+
+    const char *names = (const char *) (record + 1) + record->path_size;
+    const char *names_end = names + record->list_size;
+    const char *p = names_end;
+    const char *end = map + map_size;
+    const size_t wanted_size = strlen(name) + 1;
+
+    for (uint32_t i = 0; i < record->count && names < names_end; i++) {
+        const size_t name_size = strnlen(names, (size_t) (names_end - names)) + 1;
+
+        uint32_t value_size;
+        if ((size_t) (end - p) < sizeof(uint32_t))
+            return -EILSEQ;
+        memcpy(&value_size, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        if ((size_t) (end - p) < value_size)
+            return -EILSEQ;
+
+        if (name_size == wanted_size && memcmp(names, name, name_size) == 0) {
+            if (size == 0)
+                return (int) value_size;
+            if (value_size > size)
+                return -ERANGE;
+            memcpy(value, p, value_size);
+            return (int) value_size;
+        }
+        names += name_size;
+        p += value_size;
+    }
+
+    return -ERR_NO_ATTR;
+}
+
+int ro_index_list_keys(const char *path, char *list, size_t size)
+{
+    const struct ro_index_record *record = __find(path);
+    if (record == NULL)
+        return 0;
+
+    if (size == 0)
+        return (int) record->list_size;
+    if (record->list_size > size)
+        return -ERANGE;
+
+    memcpy(list, (const char *) (record + 1) + record->path_size, record->list_size);
+    return (int) record->list_size;
+}
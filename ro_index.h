@@ -0,0 +1,73 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_RO_INDEX_H
+#define FUSE_XATTRS_RO_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Immutable index of every attribute under the source directory, built
+ * offline by `fuse_xattrs_tool freeze` and mapped by `-o ro_index=FILE`.
+ *
+ * Files are found through a minimal perfect hash of their mount relative
+ * path: a path hashes to a bucket, whose seed sends it to its own slot.
+ * The slot points to the record of the file, which holds everything
+ * getxattr and listxattr need. Lookups only read the mapping.
+ *
+ * Layout, in host byte order:
+ *     header
+ *     records, 8 bytes aligned
+ *     uint32_t seeds[bucket_count]
+ *     uint64_t slots[file_count]   offsets of the records
+ */
+#define RO_INDEX_MAGIC "FXROIDX"
+#define RO_INDEX_VERSION 1
+
+struct ro_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucket_count;
+    uint64_t file_count;
+    uint64_t seeds_offset;
+    uint64_t slots_offset;
+    uint64_t size;
+};
+
+/*
+ * Followed by the path ('\0' terminated), the attribute names as
+ * listxattr returns them, then for each attribute in the same order a
+ * uint32_t size and the value.
+ */
+struct ro_index_record {
+    uint32_t path_size;
+    uint32_t list_size;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+uint64_t ro_index_hash(const char *path);
+uint32_t ro_index_bucket(uint64_t hash, uint32_t bucket_count);
+uint64_t ro_index_slot(uint64_t hash, uint32_t seed, uint64_t file_count);
+
+/* @return On success, zero is returned. On failure, -errno is returned. */
+int ro_index_open(const char *index_path);
+int ro_index_enabled(void);
+
+/* Same contract as binary_storage_read_key(), path is mount relative. */
+int ro_index_read_key(const char *path, const char *name, char *value, size_t size);
+
+/* Same contract as binary_storage_list_keys(), path is mount relative. */
+int ro_index_list_keys(const char *path, char *list, size_t size);
+
+/* Write the index of every attribute under the source directory. */
+int ro_index_build(const char *index_path);
+
+#endif //FUSE_XATTRS_RO_INDEX_H
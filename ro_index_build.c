@@ -0,0 +1,325 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For FTW_ACTIONRETVAL */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#include "ro_index.h"
+#include "binary_storage.h"
+#include "blob_store.h"
+#include "dir_store.h"
+#include "utils.h"
+#include "xattrs_config.h"
+#include "fuse_xattrs_config.h"
+
+/* give up on a bucket after this many seeds: only identical hashes get there */
+#define MAX_SEED_TRIES (1U << 24)
+
+struct indexed_file {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t bucket;
+    uint32_t bucket_size;
+};
+
+/* nftw() callbacks take no user data */
+static FILE *out = NULL;
+static uint64_t out_offset = 0;
+static struct indexed_file *files = NULL;
+static size_t file_count = 0;
+static size_t file_capacity = 0;
+static uint64_t attr_count = 0;
+static uint64_t errors = 0;
+
+static int __write(const void *data, size_t size)
+{
+    if (size > 0 && fwrite(data, size, 1, out) != 1)
+        return -EIO;
+    out_offset += size;
+    return 0;
+}
+
+static int __pad(size_t alignment)
+{
+    static const char zeros[8] = { 0 };
+    return __write(zeros, (size_t) ((alignment - out_offset % alignment) % alignment));
+}
+
+struct attr_lists {
+    FILE *names;
+    FILE *values;
+    uint32_t count;
+    int failed;
+};
+
+static void __collect(const char *name, const char *value, size_t size, void *data)
+{
+    struct attr_lists *lists = data;
+    const uint32_t value_size = (uint32_t) size;
+
+    if (fwrite(name, strlen(name) + 1, 1, lists->names) != 1 ||
+        fwrite(&value_size, sizeof(uint32_t), 1, lists->values) != 1 ||
+        (size > 0 && fwrite(value, size, 1, lists->values) != 1))
+        lists->failed = 1;
+    lists->count++;
+}
+
+static void __index_path(const char *path, void *data)
+{
+    (void) data;
+
+    // mount relative, as the daemon sees it
+    size_t root_size = xattrs_config.source_dir_size;
+    while (root_size > 1 && xattrs_config.source_dir[root_size - 1] == '/')
+        root_size--;
+    const char *relative = path[root_size] != '\0' ? path + root_size : "/";
+
+    struct attr_lists lists = { NULL, NULL, 0, 0 };
+    char *names = NULL;
+    char *values = NULL;
+    size_t names_size = 0;
+    size_t values_size = 0;
+    lists.names = open_memstream(&names, &names_size);
+    lists.values = open_memstream(&values, &values_size);
+
+    int res = lists.names != NULL && lists.values != NULL ? 0 : -ENOMEM;
+    if (res == 0)
+        res = binary_storage_foreach(path, __collect, &lists);
+    if (lists.names != NULL && fclose(lists.names) != 0)
+        lists.failed = 1;
+    if (lists.values != NULL && fclose(lists.values) != 0)
+        lists.failed = 1;
+    if (res == 0 && lists.failed)
+        res = -ENOMEM;
+
+    if (res == 0 && lists.count > 0 && file_count == file_capacity) {
+        size_t capacity = file_capacity > 0 ? file_capacity * 2 : 1024;
+        struct indexed_file *grown = realloc(files, capacity * sizeof(struct indexed_file));
+        if (grown == NULL) {
+            res = -ENOMEM;
+        } else {
+            files = grown;
+            file_capacity = capacity;
+        }
+    }
+
+    if (res == 0 && lists.count > 0) {
+        struct ro_index_record record = {
+                (uint32_t) strlen(relative) + 1, (uint32_t) names_size, lists.count, 0
+        };
+        struct indexed_file *file = &files[file_count++];
+        file->hash = ro_index_hash(relative);
+        file->offset = out_offset;
+        attr_count += lists.count;
+
+        if (__write(&record, sizeof(record)) != 0 || __write(relative, record.path_size) != 0 ||
+            __write(names, names_size) != 0 || __write(values, values_size) != 0 || __pad(8) != 0)
+            res = -EIO;
+    }
+
+    if (res != 0) {
+        fprintf(stderr, "cannot index the attributes of %s: %s\n", path, strerror(-res));
+        errors++;
+    }
+    free(names);
+    free(values);
+}
+
+static int __index_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void) sb;
+    const char *name = fpath + ftwbuf->base;
+
+    if (typeflag == FTW_D && ftwbuf->level == 1 && strcmp(name, BLOB_STORE_NAME) == 0)
+        return FTW_SKIP_SUBTREE;
+    if (typeflag != FTW_F)
+        return FTW_CONTINUE;
+
+    if (dir_store_enabled()) {
+        if (strcmp(name, DIR_STORE_NAME) == 0) {
+            int res = dir_store_foreach_entry(fpath, __index_path, NULL);
+            if (res != 0) {
+                fprintf(stderr, "cannot read the directory store %s: %s\n", fpath, strerror(-res));
+                errors++;
+            }
+        }
+        return FTW_CONTINUE;
+    }
+
+    // the sidecar of the root is named after the extension alone
+    const int is_root_sidecar = ftwbuf->level == 1 && strcmp(name, BINARY_SIDECAR_EXT) == 0;
+    if ((!is_root_sidecar && filename_is_sidecar(name) != 1) || dir_store_is_store_name(name))
+        return FTW_CONTINUE;
+
+    char *path = strndup(fpath, strlen(fpath) - BINARY_SIDECAR_EXT_SIZE);
+    if (path == NULL) {
+        errors++;
+        return FTW_STOP;
+    }
+    __index_path(path, NULL);
+    free(path);
+
+    return FTW_CONTINUE;
+}
+
+/* biggest buckets first, while most slots are still free */
+static int __cmp_bucket(const void *a, const void *b)
+{
+    const struct indexed_file *x = a;
+    const struct indexed_file *y = b;
+    if (x->bucket_size != y->bucket_size)
+        return x->bucket_size > y->bucket_size ? -1 : 1;
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/* Find a seed for each bucket sending its files to free slots. */
+static int __place(uint32_t bucket_count, uint32_t *seeds, uint64_t *slots)
+{
+    uint32_t *sizes = calloc(bucket_count, sizeof(uint32_t));
+    char *taken = calloc(file_count, 1);
+    if (sizes == NULL || taken == NULL) {
+        free(sizes);
+        free(taken);
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < file_count; i++) {
+        files[i].bucket = ro_index_bucket(files[i].hash, bucket_count);
+        sizes[files[i].bucket]++;
+    }
+    for (size_t i = 0; i < file_count; i++)
+        files[i].bucket_size = sizes[files[i].bucket];
+    qsort(files, file_count, sizeof(struct indexed_file), __cmp_bucket);
+
+    int res = 0;
+    for (size_t first = 0; first < file_count && res == 0; first += files[first].bucket_size) {
+        const size_t last = first + files[first].bucket_size;
+        uint32_t seed;
+        for (seed = 0; seed < MAX_SEED_TRIES; seed++) {
+            size_t i;
+            for (i = first; i < last; i++) {
+                uint64_t slot = ro_index_slot(files[i].hash, seed, file_count);
+                if (taken[slot])
+                    break;
+                taken[slot] = 1;
+            }
+            if (i == last)
+                break;
+            while (i-- > first)
+                taken[ro_index_slot(files[i].hash, seed, file_count)] = 0;
+        }
+
+        if (seed == MAX_SEED_TRIES) {
+            fprintf(stderr, "freeze: cannot place bucket %" PRIu32 ", paths with the same hash?\n",
+                    files[first].bucket);
+            res = -EILSEQ;
+            break;
+        }
+        seeds[files[first].bucket] = seed;
+        for (size_t i = first; i < last; i++)
+            slots[ro_index_slot(files[i].hash, seed, file_count)] = files[i].offset;
+    }
+
+    free(sizes);
+    free(taken);
+    return res;
+}
+
+static int __build(void)
+{
+    struct ro_index_header header;
+    memset(&header, 0, sizeof(header));
+    int res = __write(&header, sizeof(header));
+    if (res != 0)
+        return res;
+
+    if (nftw(xattrs_config.source_dir, __index_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL) != 0) {
+        fprintf(stderr, "cannot walk %s: %s\n", xattrs_config.source_dir, strerror(errno));
+        errors++;
+    }
+    if (errors > 0) {
+        // an incomplete index would hide attributes
+        fprintf(stderr, "freeze: %" PRIu64 " errors, not writing the index\n", errors);
+        return -EIO;
+    }
+    if (file_count > UINT32_MAX)
+        return -EFBIG;
+
+    const uint32_t bucket_count = file_count > 0 ? (uint32_t) ((file_count + 3) / 4) : 0;
+    uint32_t *seeds = calloc(bucket_count > 0 ? bucket_count : 1, sizeof(uint32_t));
+    uint64_t *slots = calloc(file_count > 0 ? file_count : 1, sizeof(uint64_t));
+    res = seeds != NULL && slots != NULL ? __place(bucket_count, seeds, slots) : -ENOMEM;
+
+    memcpy(header.magic, RO_INDEX_MAGIC, sizeof(header.magic));
+    header.version = RO_INDEX_VERSION;
+    header.bucket_count = bucket_count;
+    header.file_count = file_count;
+
+    if (res == 0 && (res = __pad(sizeof(uint32_t))) == 0) {
+        header.seeds_offset = out_offset;
+        res = __write(seeds, bucket_count * sizeof(uint32_t));
+    }
+    if (res == 0 && (res = __pad(sizeof(uint64_t))) == 0) {
+        header.slots_offset = out_offset;
+        res = __write(slots, file_count * sizeof(uint64_t));
+    }
+    header.size = out_offset;
+
+    if (res == 0 && (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1))
+        res = -EIO;
+
+    free(seeds);
+    free(slots);
+    return res;
+}
+
+int ro_index_build(const char *index_path)
+{
+    // never rewrite an index in place: a daemon may have it mapped
+    const size_t path_size = strlen(index_path);
+    char *tmp_path = malloc(path_size + sizeof(".tmp"));
+    if (tmp_path == NULL)
+        return -ENOMEM;
+    memcpy(tmp_path, index_path, path_size);
+    memcpy(tmp_path + path_size, ".tmp", sizeof(".tmp"));
+
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        int res = -errno;
+        fprintf(stderr, "cannot open %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return res;
+    }
+    setvbuf(out, NULL, _IOFBF, 1024 * 1024);
+
+    int res = __build();
+    if (fclose(out) != 0 && res == 0)
+        res = -errno;
+    if (res == 0 && rename(tmp_path, index_path) != 0)
+        res = -errno;
+    if (res != 0)
+        unlink(tmp_path);
+    else
+        fprintf(stderr, "freeze: %zu files, %" PRIu64 " attributes, %" PRIu64 " bytes\n",
+                file_count, attr_count, out_offset);
+
+    free(tmp_path);
+    free(files);
+    files = NULL;
+    out = NULL;
+    return res;
+}
@@ -2,7 +2,7 @@
 
 mkdir -p test/mount
 mkdir -p test/source
-./fuse_xattrs -o nonempty test/source/ test/mount/
+./fuse_xattrs test/source/ test/mount/
 
 if [ $? -ne 0 ]; then
     echo "Error mounting the filesystem."
@@ -19,7 +19,7 @@ set -e
 
 popd
 
-fusermount -zu test/mount
+fusermount3 -zu test/mount
 rm -d test/source
 rm -d test/mount
 
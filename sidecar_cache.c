@@ -0,0 +1,424 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sidecar_cache.h"
+#include "hash_table.h"
+#include "arena.h"
+
+struct cache_entry {
+    struct cache_entry *prev; // LRU list, most recently used first
+    struct cache_entry *next;
+    struct sidecar_data *data;
+    time_t expires;
+    size_t cost;
+    int has_state;
+    int unverified;             // loaded from a snapshot, not checked yet
+    struct sidecar_state state;
+    char key[];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_table *entries = NULL;
+static struct cache_entry lru = { &lru, &lru, NULL, 0, 0, 0, 0, {0}, };
+
+static int enabled = 0;
+static size_t budget = 0;
+static size_t used = 0;
+static unsigned int ttl = 0;
+
+/*
+ * Invalidation counters, by hash of the path and by hash of its directory.
+ * Unrelated paths only share one on a collision.
+ */
+#define EPOCH_STRIPES 1024
+static uint64_t path_epochs[EPOCH_STRIPES];
+static uint64_t dir_epochs[EPOCH_STRIPES];
+
+static uint64_t *__path_epoch(const char *path)
+{
+    return &path_epochs[hash_string(path) % EPOCH_STRIPES];
+}
+
+/* @param size - of the directory part of the path, trailing '/' ignored */
+static uint64_t *__dir_epoch(const char *dir_path, size_t size)
+{
+    while (size > 1 && dir_path[size - 1] == '/')
+        size--;
+    return &dir_epochs[hash_bytes(dir_path, size) % EPOCH_STRIPES];
+}
+
+static uint64_t *__parent_epoch(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return __dir_epoch(path, slash != NULL ? (size_t) (slash - path) : 0);
+}
+
+static void __bump(uint64_t *counter)
+{
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELEASE);
+}
+
+struct sidecar_data *sidecar_data_new(size_t size)
+{
+    struct sidecar_data *data = malloc(sizeof(struct sidecar_data) + size);
+    if (data == NULL)
+        return NULL;
+
+    data->refcount = 1;
+    data->size = size;
+    return data;
+}
+
+struct sidecar_data *sidecar_data_new_arena(size_t size)
+{
+    struct sidecar_data *data = arena_alloc(sizeof(struct sidecar_data) + size);
+    if (data == NULL)
+        return NULL;
+
+    data->refcount = 0;
+    data->size = size;
+    return data;
+}
+
+struct sidecar_data *sidecar_data_ref(struct sidecar_data *data)
+{
+    __atomic_add_fetch(&data->refcount, 1, __ATOMIC_RELAXED);
+    return data;
+}
+
+void sidecar_data_release(struct sidecar_data *data)
+{
+    if (data == NULL || __atomic_load_n(&data->refcount, __ATOMIC_RELAXED) == 0)
+        return;
+
+    if (__atomic_sub_fetch(&data->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        free(data);
+}
+
+static time_t __now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void __unlink_entry(struct cache_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void __push_front(struct cache_entry *entry)
+{
+    entry->next = lru.next;
+    entry->prev = &lru;
+    lru.next->prev = entry;
+    lru.next = entry;
+}
+
+static void __push_back(struct cache_entry *entry)
+{
+    entry->next = &lru;
+    entry->prev = lru.prev;
+    lru.prev->next = entry;
+    lru.prev = entry;
+}
+
+static void __drop_entry(struct cache_entry *entry)
+{
+    __unlink_entry(entry);
+    hash_table_remove(entries, entry->key);
+    used -= entry->cost;
+    sidecar_data_release(entry->data);
+    free(entry);
+}
+
+void sidecar_cache_init(size_t _budget, unsigned int _ttl)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (entries == NULL)
+        entries = hash_table_new();
+    budget = _budget;
+    ttl = _ttl;
+    enabled = (entries != NULL);
+    while (used > budget && lru.prev != &lru)
+        __drop_entry(lru.prev);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int sidecar_cache_enabled(void)
+{
+    return enabled;
+}
+
+uint64_t sidecar_cache_epoch(const char *path)
+{
+    return __atomic_load_n(__path_epoch(path), __ATOMIC_ACQUIRE);
+}
+
+uint64_t sidecar_cache_dir_epoch(const char *dir_path)
+{
+    return __atomic_load_n(__dir_epoch(dir_path, strlen(dir_path)), __ATOMIC_ACQUIRE);
+}
+
+struct sidecar_data *sidecar_cache_lookup(const char *path)
+{
+    if (!enabled)
+        return NULL;
+
+    struct sidecar_data *data = NULL;
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *entry = hash_table_get(entries, path);
+    if (entry != NULL && !entry->unverified) {
+        if (entry->expires <= __now()) {
+            __drop_entry(entry);
+        } else {
+            __unlink_entry(entry);
+            __push_front(entry);
+            data = sidecar_data_ref(entry->data);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return data;
+}
+
+int sidecar_cache_contains(const char *path)
+{
+    if (!enabled)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *entry = hash_table_get(entries, path);
+    int res = entry != NULL && !entry->unverified && entry->expires > __now();
+    pthread_mutex_unlock(&cache_lock);
+
+    return res;
+}
+
+/* @param counter - checked against _epoch under cache_lock */
+static void __insert(const char *path, struct sidecar_data *data, const uint64_t *counter, uint64_t _epoch,
+                     const struct sidecar_state *state)
+{
+    if (!enabled)
+        return;
+
+    const size_t key_size = strlen(path) + 1;
+    const size_t cost = sizeof(struct cache_entry) + key_size + (data != NULL ? data->size : 0);
+    if (cost > budget)
+        return;
+
+    struct cache_entry *entry = malloc(sizeof(struct cache_entry) + key_size);
+    if (entry == NULL)
+        return;
+    memcpy(entry->key, path, key_size);
+    entry->cost = cost;
+    entry->has_state = state != NULL;
+    entry->unverified = 0;
+    if (state != NULL)
+        entry->state = *state;
+    entry->data = data != NULL ? sidecar_data_ref(data) : sidecar_data_new(0);
+    if (entry->data == NULL) {
+        free(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (_epoch != *counter) {
+        // path was invalidated since the caller loaded data
+        pthread_mutex_unlock(&cache_lock);
+        sidecar_data_release(entry->data);
+        free(entry);
+        return;
+    }
+
+    struct cache_entry *old = hash_table_get(entries, path);
+    if (old != NULL)
+        __drop_entry(old);
+
+    if (hash_table_put(entries, entry->key, entry) != 0) {
+        pthread_mutex_unlock(&cache_lock);
+        sidecar_data_release(entry->data);
+        free(entry);
+        return;
+    }
+    entry->expires = __now() + ttl;
+    __push_front(entry);
+    used += cost;
+
+    while (used > budget && lru.prev != &lru)
+        __drop_entry(lru.prev);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void sidecar_cache_insert(const char *path, struct sidecar_data *data, uint64_t _epoch)
+{
+    __insert(path, data, __path_epoch(path), _epoch, NULL);
+}
+
+void sidecar_cache_insert_state(const char *path, struct sidecar_data *data, uint64_t _epoch,
+                                const struct sidecar_state *state)
+{
+    __insert(path, data, __path_epoch(path), _epoch, state);
+}
+
+void sidecar_cache_insert_listed(const char *path, struct sidecar_data *data, uint64_t dir_epoch)
+{
+    __insert(path, data, __parent_epoch(path), dir_epoch, NULL);
+}
+
+void sidecar_cache_invalidate(const char *path)
+{
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    __bump(__path_epoch(path));
+    __bump(__parent_epoch(path));
+    struct cache_entry *entry = hash_table_get(entries, path);
+    if (entry != NULL)
+        __drop_entry(entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void sidecar_cache_clear(void)
+{
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < EPOCH_STRIPES; i++) {
+        __bump(&path_epochs[i]);
+        __bump(&dir_epochs[i]);
+    }
+    while (lru.next != &lru)
+        __drop_entry(lru.next);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+struct sidecar_data *sidecar_cache_lookup_unverified(const char *path, struct sidecar_state *state)
+{
+    if (!enabled)
+        return NULL;
+
+    struct sidecar_data *data = NULL;
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *entry = hash_table_get(entries, path);
+    if (entry != NULL && entry->unverified) {
+        *state = entry->state;
+        data = sidecar_data_ref(entry->data);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return data;
+}
+
+void sidecar_cache_verified(const char *path, int valid)
+{
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry *entry = hash_table_get(entries, path);
+    if (entry != NULL && entry->unverified) {
+        if (valid) {
+            entry->unverified = 0;
+            entry->expires = __now() + ttl;
+            __unlink_entry(entry);
+            __push_front(entry);
+        } else {
+            __drop_entry(entry);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+struct exported_entry {
+    char *key;
+    struct sidecar_data *data;
+    struct sidecar_state state;
+};
+
+int sidecar_cache_export(sidecar_cache_entry_fn fn, void *arg)
+{
+    if (!enabled)
+        return 0;
+
+    // copied out, the cache stays usable while fn writes them
+    pthread_mutex_lock(&cache_lock);
+    size_t count = 0;
+    for (struct cache_entry *entry = lru.next; entry != &lru; entry = entry->next)
+        count += entry->has_state;
+
+    struct exported_entry *exported = count > 0 ? calloc(count, sizeof(struct exported_entry)) : NULL;
+    if (count > 0 && exported == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        return -ENOMEM;
+    }
+
+    size_t used_count = 0;
+    int res = 0;
+    for (struct cache_entry *entry = lru.next; entry != &lru && res == 0; entry = entry->next) {
+        if (!entry->has_state)
+            continue;
+        struct exported_entry *e = &exported[used_count++];
+        e->key = strdup(entry->key);
+        e->data = sidecar_data_ref(entry->data);
+        e->state = entry->state;
+        if (e->key == NULL)
+            res = -ENOMEM;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    for (size_t i = 0; i < used_count; i++) {
+        if (res == 0)
+            fn(exported[i].key, exported[i].data, &exported[i].state, arg);
+        free(exported[i].key);
+        sidecar_data_release(exported[i].data);
+    }
+    free(exported);
+    return res;
+}
+
+void sidecar_cache_preload(const char *path, struct sidecar_data *data, const struct sidecar_state *state)
+{
+    if (!enabled)
+        return;
+
+    const size_t key_size = strlen(path) + 1;
+    const size_t cost = sizeof(struct cache_entry) + key_size + data->size;
+    struct cache_entry *entry = malloc(sizeof(struct cache_entry) + key_size);
+    if (entry == NULL)
+        return;
+    memcpy(entry->key, path, key_size);
+    entry->cost = cost;
+    entry->has_state = 1;
+    entry->unverified = 1;
+    entry->state = *state;
+    entry->expires = 0;
+
+    // never evicts what was loaded since the mount
+    pthread_mutex_lock(&cache_lock);
+    if (used + cost > budget || hash_table_get(entries, path) != NULL ||
+        hash_table_put(entries, entry->key, entry) != 0) {
+        pthread_mutex_unlock(&cache_lock);
+        free(entry);
+        return;
+    }
+    entry->data = sidecar_data_ref(data);
+    __push_back(entry);
+    used += cost;
+    pthread_mutex_unlock(&cache_lock);
+}
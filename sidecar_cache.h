@@ -0,0 +1,97 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_SIDECAR_CACHE_H
+#define FUSE_XATTRS_SIDECAR_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Raw sidecar contents, shared between the cache and its readers. */
+struct sidecar_data {
+    int refcount; // 0: allocated from the request arena, never shared
+    size_t size;  // 0: the file has no attributes
+    char buffer[];
+};
+
+struct sidecar_data *sidecar_data_new(size_t size);
+/* For contents nobody keeps past the request; releasing them is a no-op. */
+struct sidecar_data *sidecar_data_new_arena(size_t size);
+struct sidecar_data *sidecar_data_ref(struct sidecar_data *data);
+void sidecar_data_release(struct sidecar_data *data);
+
+/*
+ * In-memory cache of sidecar contents keyed by the (source) path of the
+ * file they belong to. Entries expire after ttl seconds and the least
+ * recently used ones are evicted once budget bytes are in use.
+ *
+ * Invalidating a path bumps the epoch of the path and the one of its
+ * directory. Inserts carry the epoch of the path read before the sidecar
+ * was loaded and are dropped if it changed meanwhile, so a slow loader can
+ * never overwrite a newer invalidation. Inserts of other paths go through.
+ * Entries derived from a directory listing carry the directory's epoch
+ * instead, read before the listing.
+ *
+ * Entries may also carry the state of the sidecar they were read from,
+ * which lets them be saved to a snapshot and loaded back after a restart
+ * (see cache_snapshot.h). Loaded entries are unverified: lookups skip
+ * them until the sidecar is found in the same state.
+ */
+void sidecar_cache_init(size_t budget, unsigned int ttl);
+int sidecar_cache_enabled(void);
+uint64_t sidecar_cache_epoch(const char *path);
+uint64_t sidecar_cache_dir_epoch(const char *dir_path);
+
+/* @return a reference to release with sidecar_data_release(), or NULL on miss. */
+struct sidecar_data *sidecar_cache_lookup(const char *path);
+int sidecar_cache_contains(const char *path);
+
+/* Sidecar file an entry was read from, as in __same_file_state(). */
+struct sidecar_state {
+    uint64_t ino;
+    int64_t size;               // -1: there was no sidecar
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+/* @param data - NULL records that path has no sidecar. */
+void sidecar_cache_insert(const char *path, struct sidecar_data *data, uint64_t epoch);
+/* @param state - of the sidecar data was read from, NULL if unknown (the entry isn't saved). */
+void sidecar_cache_insert_state(const char *path, struct sidecar_data *data, uint64_t epoch,
+                                const struct sidecar_state *state);
+/* @param dir_epoch - of the directory of path, from sidecar_cache_dir_epoch(). */
+void sidecar_cache_insert_listed(const char *path, struct sidecar_data *data, uint64_t dir_epoch);
+
+/**
+ * An unverified entry of path: its sidecar must be checked to still be in
+ * state before sidecar_cache_verified() makes it a regular entry.
+ * @return a reference to release with sidecar_data_release(), or NULL.
+ */
+struct sidecar_data *sidecar_cache_lookup_unverified(const char *path, struct sidecar_state *state);
+/* @param valid - the sidecar is unchanged, else the entry is dropped. */
+void sidecar_cache_verified(const char *path, int valid);
+
+typedef void (*sidecar_cache_entry_fn)(const char *path, const struct sidecar_data *data,
+                                       const struct sidecar_state *state, void *arg);
+
+/**
+ * Call fn for every entry with a known state, most recently used first.
+ * fn runs without the cache locked.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int sidecar_cache_export(sidecar_cache_entry_fn fn, void *arg);
+
+/* Add an unverified entry, behind the ones already cached. */
+void sidecar_cache_preload(const char *path, struct sidecar_data *data, const struct sidecar_state *state);
+void sidecar_cache_invalidate(const char *path);
+void sidecar_cache_clear(void);
+
+#endif //FUSE_XATTRS_SIDECAR_CACHE_H
@@ -0,0 +1,229 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stat_cache.h"
+#include "hash_table.h"
+
+struct stat_entry {
+    struct stat_entry *prev; // LRU list, most recently used first
+    struct stat_entry *next;
+    int missing;
+    struct stat st;
+    time_t expires;
+    size_t cost;
+    char key[];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_table *entries = NULL;
+static struct stat_entry lru = { &lru, &lru, 0 };
+
+static int enabled = 0;
+static size_t budget = 0;
+static size_t used = 0;
+static unsigned int ttl = 0;
+
+/* Invalidation counters by hash of the path, shared only on a collision */
+#define EPOCH_STRIPES 1024
+static uint64_t epochs[EPOCH_STRIPES];
+
+static uint64_t *__epoch(const char *path)
+{
+    return &epochs[hash_string(path) % EPOCH_STRIPES];
+}
+
+static void __bump(const char *path)
+{
+    __atomic_add_fetch(__epoch(path), 1, __ATOMIC_RELEASE);
+}
+
+static time_t __now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void __unlink_entry(struct stat_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void __push_front(struct stat_entry *entry)
+{
+    entry->next = lru.next;
+    entry->prev = &lru;
+    lru.next->prev = entry;
+    lru.next = entry;
+}
+
+static void __drop_entry(struct stat_entry *entry)
+{
+    __unlink_entry(entry);
+    hash_table_remove(entries, entry->key);
+    used -= entry->cost;
+    free(entry);
+}
+
+static void __drop_path(const char *path)
+{
+    struct stat_entry *entry = hash_table_get(entries, path);
+    if (entry != NULL)
+        __drop_entry(entry);
+}
+
+void stat_cache_init(size_t _budget, unsigned int _ttl)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (entries == NULL)
+        entries = hash_table_new();
+    budget = _budget;
+    ttl = _ttl;
+    enabled = (entries != NULL);
+    while (used > budget && lru.prev != &lru)
+        __drop_entry(lru.prev);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int stat_cache_enabled(void)
+{
+    return enabled;
+}
+
+uint64_t stat_cache_epoch(const char *path)
+{
+    return __atomic_load_n(__epoch(path), __ATOMIC_ACQUIRE);
+}
+
+int stat_cache_lookup(const char *path, struct stat *stbuf)
+{
+    if (!enabled)
+        return 0;
+
+    int res = 0;
+    pthread_mutex_lock(&cache_lock);
+    struct stat_entry *entry = hash_table_get(entries, path);
+    if (entry != NULL) {
+        if (entry->expires <= __now()) {
+            __drop_entry(entry);
+        } else {
+            __unlink_entry(entry);
+            __push_front(entry);
+            if (entry->missing) {
+                res = -ENOENT;
+            } else {
+                *stbuf = entry->st;
+                res = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return res;
+}
+
+void stat_cache_insert(const char *path, const struct stat *stbuf, uint64_t _epoch)
+{
+    if (!enabled)
+        return;
+
+    // a write through one link leaves the entries of the others stale
+    if (stbuf != NULL && !S_ISDIR(stbuf->st_mode) && stbuf->st_nlink > 1)
+        return;
+
+    const size_t key_size = strlen(path) + 1;
+    const size_t cost = sizeof(struct stat_entry) + key_size;
+    if (cost > budget)
+        return;
+
+    struct stat_entry *entry = malloc(sizeof(struct stat_entry) + key_size);
+    if (entry == NULL)
+        return;
+    memcpy(entry->key, path, key_size);
+    entry->cost = cost;
+    entry->missing = stbuf == NULL;
+    if (stbuf != NULL)
+        entry->st = *stbuf;
+
+    pthread_mutex_lock(&cache_lock);
+    if (_epoch != *__epoch(path)) {
+        // path was invalidated since the caller called lstat()
+        pthread_mutex_unlock(&cache_lock);
+        free(entry);
+        return;
+    }
+
+    __drop_path(path);
+    if (hash_table_put(entries, entry->key, entry) != 0) {
+        pthread_mutex_unlock(&cache_lock);
+        free(entry);
+        return;
+    }
+    entry->expires = __now() + ttl;
+    __push_front(entry);
+    used += cost;
+
+    while (used > budget && lru.prev != &lru)
+        __drop_entry(lru.prev);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void stat_cache_invalidate(const char *path)
+{
+    if (!enabled)
+        return;
+
+    const int saved_errno = errno;
+    pthread_mutex_lock(&cache_lock);
+    __bump(path);
+    __drop_path(path);
+    pthread_mutex_unlock(&cache_lock);
+    errno = saved_errno;
+}
+
+void stat_cache_invalidate_name(const char *path)
+{
+    if (!enabled)
+        return;
+
+    const char *slash = strrchr(path, '/');
+    const size_t parent_size = slash == NULL || slash == path ? 1 : (size_t) (slash - path);
+    char parent[parent_size + 1];
+    memcpy(parent, slash == NULL ? "/" : path, parent_size);
+    parent[parent_size] = '\0';
+
+    const int saved_errno = errno;
+    pthread_mutex_lock(&cache_lock);
+    __bump(path);
+    __bump(parent);
+    __drop_path(path);
+    __drop_path(parent);
+    pthread_mutex_unlock(&cache_lock);
+    errno = saved_errno;
+}
+
+void stat_cache_clear(void)
+{
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < EPOCH_STRIPES; i++)
+        __atomic_add_fetch(&epochs[i], 1, __ATOMIC_RELEASE);
+    while (lru.next != &lru)
+        __drop_entry(lru.next);
+    pthread_mutex_unlock(&cache_lock);
+}
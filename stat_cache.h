@@ -0,0 +1,54 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_STAT_CACHE_H
+#define FUSE_XATTRS_STAT_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * lstat() results keyed by mount relative path, so a hit costs neither an
+ * allocation nor a syscall. Missing files are cached too: build systems
+ * probe many paths that don't exist.
+ *
+ * Same rules as the sidecar cache: entries expire after ttl seconds, the
+ * least recently used ones are evicted past budget bytes, and inserts
+ * carrying an epoch older than the last invalidation of their path are
+ * dropped.
+ *
+ * Mutating operations invalidate what they change. Files with several
+ * hard links aren't cached: a change through one path would leave the
+ * others stale. Changes made outside the mount (without -o watch) are
+ * only seen once the entry expires.
+ */
+void stat_cache_init(size_t budget, unsigned int ttl);
+int stat_cache_enabled(void);
+/* @return the epoch to insert the lstat() of path with, taken before it. */
+uint64_t stat_cache_epoch(const char *path);
+
+/* @return 1 and stbuf on a hit, -ENOENT if path is known to be missing, 0 on miss. */
+int stat_cache_lookup(const char *path, struct stat *stbuf);
+
+/* @param stbuf - NULL records that path doesn't exist. */
+void stat_cache_insert(const char *path, const struct stat *stbuf, uint64_t epoch);
+
+/*
+ * The attributes of path changed. Invalidations preserve errno, so they
+ * can follow the syscall that caused them, whatever its outcome.
+ */
+void stat_cache_invalidate(const char *path);
+
+/* path was created, removed or renamed: its parent directory changed too. */
+void stat_cache_invalidate_name(const char *path);
+
+void stat_cache_clear(void);
+
+#endif //FUSE_XATTRS_STAT_CACHE_H
@@ -0,0 +1,277 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sync.h"
+#include "hash_table.h"
+#include "utils.h"
+
+/*
+ * Upper bound of tracked paths. Past it new marks are dropped and every
+ * flush falls back to syncfs() until one completes without new drops.
+ * That syncfs() also makes every path marked before it durable: they are
+ * dropped, so that flushes go back to one fsync() per path.
+ */
+#define SYNC_MAX_TRACKED 65536
+
+struct sync_entry {
+    unsigned long dirty_gen;  // bumped on every change
+    unsigned long synced_gen; // last generation known to be on disk
+    unsigned long mark;       // value of marks when last marked
+    int syncing;
+    int users;
+    pthread_cond_t cond;
+};
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_table *dirty_paths = NULL;
+static int overflowed = 0;
+static unsigned long dropped_marks = 0;
+static unsigned long marks = 0;
+static unsigned long fsyncs = 0;
+static unsigned long syncfss = 0;
+
+static char *__parent_path(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+        return strdup(".");
+    if (slash == path)
+        return strdup("/");
+    return strndup(path, slash - path);
+}
+
+static struct sync_entry *__get_entry(const char *path, int create)
+{
+    if (dirty_paths == NULL) {
+        if (!create)
+            return NULL;
+        dirty_paths = hash_table_new();
+        if (dirty_paths == NULL)
+            return NULL;
+    }
+
+    struct sync_entry *entry = hash_table_get(dirty_paths, path);
+    if (entry != NULL || !create)
+        return entry;
+
+    if (hash_table_size(dirty_paths) >= SYNC_MAX_TRACKED)
+        return NULL;
+
+    entry = calloc(1, sizeof(struct sync_entry));
+    if (entry == NULL)
+        return NULL;
+    pthread_cond_init(&entry->cond, NULL);
+
+    if (hash_table_put(dirty_paths, path, entry) != 0) {
+        pthread_cond_destroy(&entry->cond);
+        free(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+static void __put_entry(const char *path, struct sync_entry *entry)
+{
+    if (entry->users > 0 || entry->syncing || entry->synced_gen < entry->dirty_gen)
+        return;
+
+    hash_table_remove(dirty_paths, path);
+    pthread_cond_destroy(&entry->cond);
+    free(entry);
+}
+
+struct synced_paths {
+    unsigned long mark;
+    char **paths;
+    size_t count;
+};
+
+static void __collect_synced(const char *path, void *value, void *data)
+{
+    struct sync_entry *entry = value;
+    struct synced_paths *synced = data;
+    if (entry->users > 0 || entry->syncing || entry->mark > synced->mark)
+        return;
+
+    char *copy = strdup(path);
+    if (copy != NULL)
+        synced->paths[synced->count++] = copy;
+}
+
+/* Drop the entries marked up to mark, made durable by a syncfs(). */
+static void __drop_synced(unsigned long mark)
+{
+    if (dirty_paths == NULL)
+        return;
+
+    struct synced_paths synced = { .mark = mark, .count = 0 };
+    synced.paths = malloc((hash_table_size(dirty_paths) + 1) * sizeof(char *));
+    if (synced.paths == NULL)
+        return;
+
+    hash_table_foreach(dirty_paths, __collect_synced, &synced);
+    for (size_t i = 0; i < synced.count; i++) {
+        struct sync_entry *entry = hash_table_remove(dirty_paths, synced.paths[i]);
+        pthread_cond_destroy(&entry->cond);
+        free(entry);
+        free(synced.paths[i]);
+    }
+    free(synced.paths);
+}
+
+static int __fsync_path(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        // removed in the meantime: nothing left to sync
+        return errno == ENOENT ? 0 : -errno;
+    }
+
+    int res = 0;
+    if (fsync(fd) == -1)
+        res = -errno;
+    close(fd);
+
+    return res;
+}
+
+static int __syncfs_path(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        char *parent = __parent_path(path);
+        fd = open(parent, O_RDONLY | O_CLOEXEC);
+        free(parent);
+    }
+    if (fd == -1)
+        return -errno;
+
+    int res = 0;
+    if (syncfs(fd) == -1)
+        res = -errno;
+    close(fd);
+
+    return res;
+}
+
+void sync_mark_dirty(const char *path)
+{
+    pthread_mutex_lock(&sync_lock);
+    struct sync_entry *entry = __get_entry(path, 1);
+    if (entry == NULL) {
+        overflowed = 1;
+        dropped_marks++;
+    } else {
+        entry->dirty_gen++;
+        entry->mark = ++marks;
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+void sync_mark_parent_dirty(const char *path)
+{
+    char *parent = __parent_path(path);
+    sync_mark_dirty(parent);
+    free(parent);
+}
+
+int sync_flush(const char *path, int force)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&sync_lock);
+    if (overflowed) {
+        const unsigned long dropped = dropped_marks;
+        const unsigned long mark = marks;
+        syncfss++;
+        pthread_mutex_unlock(&sync_lock);
+
+        res = __syncfs_path(path);
+
+        pthread_mutex_lock(&sync_lock);
+        if (res == 0) {
+            __drop_synced(mark);
+            if (dropped == dropped_marks)
+                overflowed = 0;
+        }
+        pthread_mutex_unlock(&sync_lock);
+        return res;
+    }
+
+    struct sync_entry *entry = __get_entry(path, force);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&sync_lock);
+        return force ? __fsync_path(path) : 0;
+    }
+
+    if (force)
+        entry->dirty_gen++;
+
+    const unsigned long target = entry->dirty_gen;
+    entry->users++;
+    while (entry->synced_gen < target) {
+        if (entry->syncing) {
+            // someone else is already syncing; its fsync may cover us
+            pthread_cond_wait(&entry->cond, &sync_lock);
+            continue;
+        }
+
+        entry->syncing = 1;
+        const unsigned long gen = entry->dirty_gen;
+        fsyncs++;
+        pthread_mutex_unlock(&sync_lock);
+
+        res = __fsync_path(path);
+
+        pthread_mutex_lock(&sync_lock);
+        entry->syncing = 0;
+        if (res == 0)
+            entry->synced_gen = gen;
+        pthread_cond_broadcast(&entry->cond);
+
+        if (res != 0) {
+            error_print("fsync failed. path: %s, res: %d\n", path, res);
+            break;
+        }
+    }
+    entry->users--;
+    __put_entry(path, entry);
+    pthread_mutex_unlock(&sync_lock);
+
+    return res;
+}
+
+int sync_flush_parent(const char *path, int force)
+{
+    char *parent = __parent_path(path);
+    int res = sync_flush(parent, force);
+    free(parent);
+    return res;
+}
+
+void sync_stats(FILE *out)
+{
+    pthread_mutex_lock(&sync_lock);
+    fprintf(out, "tracked=%zu\n", dirty_paths != NULL ? hash_table_size(dirty_paths) : 0);
+    fprintf(out, "overflowed=%d\n", overflowed);
+    fprintf(out, "fsync=%lu\n", fsyncs);
+    fprintf(out, "syncfs=%lu\n", syncfss);
+    pthread_mutex_unlock(&sync_lock);
+}
@@ -0,0 +1,39 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_SYNC_H
+#define FUSE_XATTRS_SYNC_H
+
+#include <stdio.h>
+
+/*
+ * Dirty tracking and coalesced fsync for sidecars and directories.
+ *
+ * Every change to a sidecar (or to the directory entries holding one) is
+ * recorded with sync_mark_dirty(). sync_flush() makes the recorded changes
+ * durable; concurrent callers waiting on the same path share a single
+ * fsync() (group commit).
+ */
+
+void sync_mark_dirty(const char *path);
+void sync_mark_parent_dirty(const char *path);
+
+/**
+ * fsync path if it has pending changes.
+ * @param path - absolute path to a sidecar or a directory.
+ * @param force - sync even if nothing was recorded (fsyncdir).
+ * @return On success, zero is returned.  On failure, -errno is returned.
+ */
+int sync_flush(const char *path, int force);
+int sync_flush_parent(const char *path, int force);
+
+/* Print the tracked paths and the fsync()s and syncfs()s done, one name=value per line. */
+void sync_stats(FILE *out);
+
+#endif //FUSE_XATTRS_SYNC_H
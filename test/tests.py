@@ -12,7 +12,16 @@
 import unittest
 import xattr
 from pathlib import Path
+import contextlib
+import ctypes
+import multiprocessing
 import os
+import re
+import resource
+import shutil
+import struct
+import subprocess
+import time
 
 if xattr.__version__ != '0.9.1':
     print("WARNING, only tested with xattr version 0.9.1")
@@ -23,6 +32,31 @@ if xattr.__version__ != '0.9.1':
 # - corrupt metadata files
 
 
+@contextlib.contextmanager
+def mounted(mountpoint, *options):
+    """A second mount of ./source/ on mountpoint with -o options, for the block."""
+    command = ["../fuse_xattrs"]
+    if options:
+        command += ["-o", ",".join(options)]
+    command += ["./source/", mountpoint]
+
+    os.makedirs(mountpoint, exist_ok=True)
+    try:
+        subprocess.check_call(command, stderr=subprocess.DEVNULL)
+        try:
+            yield mountpoint
+        finally:
+            subprocess.call(["fusermount3", "-zu", mountpoint])
+            # files the daemon writes on exit are complete once it's gone
+            for _ in range(100):
+                if subprocess.call(["pgrep", "-f", re.escape(" ".join(command))],
+                                   stdout=subprocess.DEVNULL) != 0:
+                    break
+                time.sleep(0.05)
+    finally:
+        os.rmdir(mountpoint)
+
+
 class TestXAttrs(unittest.TestCase):
     def setUp(self):
         self.sourceDir = "./source/"
@@ -237,6 +271,105 @@ class TestXAttrs(unittest.TestCase):
         self.assertEqual(ex.exception.errno, 61)
         self.assertEqual(ex.exception.strerror, "No data available")
 
+    def test_xattr_packed(self):
+        enc = "utf-8"
+        packedKey = "user.fuse_xattrs.all"
+
+        def pack(attrs):
+            packed = b""
+            for key, value in attrs:
+                name = bytes(key, enc) + b"\0"
+                packed += struct.pack("=H", len(name)) + name + struct.pack("=I", len(value)) + value
+            return packed
+
+        def unpack(packed):
+            attrs = {}
+            offset = 0
+            while offset < len(packed):
+                (name_size,) = struct.unpack_from("=H", packed, offset)
+                name = packed[offset + 2:offset + 1 + name_size].decode(enc)
+                offset += 2 + name_size
+                (value_size,) = struct.unpack_from("=I", packed, offset)
+                attrs[name] = packed[offset + 4:offset + 4 + value_size]
+                offset += 4 + value_size
+            return attrs
+
+        xattr.setxattr(self.randomFile, "user.foo", bytes("bar", enc))
+        xattr.setxattr(self.randomFile, packedKey, pack([("user.a", b"1"), ("user.b", b"")]))
+
+        attrs = unpack(xattr.getxattr(self.randomFile, packedKey))
+        self.assertEqual(attrs, {"user.foo": b"bar", "user.a": b"1", "user.b": b""})
+        self.assertEqual(len(xattr.listxattr(self.randomFile)), 3)
+
+        with self.assertRaises(OSError) as ex:
+            xattr.removexattr(self.randomFile, packedKey)
+        self.assertEqual(ex.exception.errno, 1)
+        self.assertEqual(ex.exception.strerror, "Operation not permitted")
+
+    def test_record_scan(self):
+        # names around the 16 and 32 bytes compared at once, sharing prefixes
+        names = [b"user.a", b"user.ab", b"user.b" * 2, b"user." + b"x" * 9, b"user." + b"x" * 10,
+                 b"user." + b"x" * 25, b"user." + b"x" * 26, b"user." + b"x" * 40, b"user." + b"x" * 41]
+        values = [b"%d" % i * i for i in range(len(names))]
+        missing = [b"user.", b"user.abc", b"user." + b"x" * 11, b"user." + b"x" * 27, b"user." + b"y" * 41]
+
+        records = []
+        for name, value in zip(names, values):
+            records.append(struct.pack("=H", len(name) + 1) + name + b"\0" + struct.pack("=Q", len(value)) + value)
+        sidecar = b"".join(records)
+
+        def parsed(size):
+            """name -> value of the records the daemon's parser reads in size bytes, and whether they all parse."""
+            attrs, offset = {}, 0
+            for record, name, value in zip(records, names, values):
+                if offset + len(record) > size:
+                    return attrs, offset == size
+                attrs[name] = value
+                offset += len(record)
+            return attrs, True
+
+        def check(size):
+            with open(self.randomSourceFileSidecar, "wb") as fp:
+                fp.write(sidecar[:size])
+            attrs, complete = parsed(size)
+            for name in names + missing:
+                try:
+                    result = xattr.getxattr(self.randomFile, name.decode())
+                except OSError as ex:
+                    result = ex.errno
+                if name in attrs:
+                    self.assertEqual(result, attrs[name], "size %d, %s" % (size, name))
+                else:
+                    self.assertEqual(result, 61 if complete else 84, "size %d, %s" % (size, name))  # ENODATA, EILSEQ
+
+        check(len(sidecar))
+        # the lookup agrees with the record by record parse of every attribute at once
+        packed = xattr.getxattr(self.randomFile, "user.fuse_xattrs.all")
+        for name, value in zip(names, values):
+            self.assertIn(struct.pack("=H", len(name) + 1) + name + b"\0" + struct.pack("=I", len(value)) + value, packed)
+        self.assertEqual(sorted(xattr.listxattr(self.randomFile)), sorted(name.decode() for name in names))
+
+        for size in range(len(sidecar)):
+            check(size)
+        os.remove(self.randomSourceFileSidecar)
+
+    def test_client_library(self):
+        enc = "utf-8"
+        client = ctypes.CDLL("../libfuse_xattrs_client.so")
+        self.assertEqual(client.fuse_xattrs_client_open(bytes(self.sourceDir, enc), 0), 0)
+        xattr.setxattr(self.randomFile, "user.foo", bytes("bar", enc))
+
+        path = bytes("/" + self.randomFilename, enc)
+        value = ctypes.create_string_buffer(16)
+        size = client.fuse_xattrs_client_get(path, b"user.foo", value, len(value))
+        self.assertEqual(value.raw[:size], bytes("bar", enc))
+
+        size = client.fuse_xattrs_client_list(path, value, len(value))
+        self.assertEqual(value.raw[:size], b"user.foo\0")
+
+        # errors are returned as -errno
+        self.assertEqual(client.fuse_xattrs_client_get(path, b"user.bar", value, len(value)), -61)
+
     def test_hide_sidecar(self):
         xattr.setxattr(self.randomFile, "user.foo", bytes("bar", "utf-8"))
         self.assertTrue(os.path.isfile(self.randomFile))
@@ -262,6 +395,41 @@ class TestXAttrs(unittest.TestCase):
         # FIXME: if one assert fails, the file isn't going to be deleted
         os.remove(self.mountDir + test_filename)
 
+    def test_rename_flags(self):
+        libc = ctypes.CDLL(None, use_errno=True)
+        at_fdcwd, rename_noreplace, rename_exchange = -100, 1, 2
+        other = self.mountDir + "rename_other"
+        moved = self.mountDir + "rename_moved"
+
+        def renameat2(source, target, flags):
+            res = libc.renameat2(at_fdcwd, source.encode(), at_fdcwd, target.encode(), flags)
+            return 0 if res == 0 else ctypes.get_errno()
+
+        try:
+            xattr.setxattr(self.randomFile, "user.foo", b"bar")
+            open(other, "w").close()
+
+            self.assertEqual(renameat2(self.randomFile, other, rename_noreplace), 17)  # EEXIST
+            self.assertEqual(renameat2(self.randomFile, other, rename_exchange), 22)  # EINVAL
+            self.assertEqual(xattr.getxattr(self.randomFile, "user.foo"), b"bar")
+
+            self.assertEqual(renameat2(self.randomFile, moved, rename_noreplace), 0)
+            self.assertFalse(os.path.isfile(self.randomFile))
+            self.assertEqual(xattr.getxattr(moved, "user.foo"), b"bar")
+            self.assertFalse(os.path.isfile(self.randomSourceFileSidecar))
+        finally:
+            for path in (other, moved):
+                if os.path.isfile(path):
+                    os.remove(path)
+
+    def test_help(self):
+        result = subprocess.run(["../fuse_xattrs", "-h"], stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        output = result.stdout.decode()
+        self.assertEqual(output.count("usage:"), 1)
+        self.assertIn("FUSE XATTRS options:", output)
+        self.assertIn("FUSE options:", output)
+        self.assertIn("kernel_cache", output)
+
     def test_remove_file_with_sidecar(self):
         xattr.setxattr(self.randomFile, "user.foo", bytes("bar", "utf-8"))
         self.assertTrue(os.path.isfile(self.randomFile))
@@ -283,5 +451,823 @@ class TestXAttrs(unittest.TestCase):
         self.assertFalse(os.path.isfile(self.randomSourceFile))
         self.assertFalse(os.path.isfile(self.randomSourceFileSidecar))
 
+    def test_fsync(self):
+        xattr.setxattr(self.randomFile, "user.foo", bytes("bar", "utf-8"))
+
+        fd = os.open(self.randomFile, os.O_RDWR)
+        try:
+            os.write(fd, bytes("foo", "utf-8"))
+            os.fsync(fd)
+            os.fdatasync(fd)
+        finally:
+            os.close(fd)
+
+        dir_fd = os.open(self.mountDir, os.O_RDONLY)
+        try:
+            os.fsync(dir_fd)
+        finally:
+            os.close(dir_fd)
+
+        self.assertEqual(xattr.getxattr(self.randomFile, "user.foo"), bytes("bar", "utf-8"))
+
+    def test_dump_restore(self):
+        enc = "utf-8"
+        archive = "./attrs.archive"
+        xattr.setxattr(self.randomFile, "user.foo", bytes("bar", enc))
+        xattr.setxattr(self.randomFile, "user.empty", bytes())
+
+        try:
+            subprocess.check_call(["../fuse_xattrs_tool", "dump", self.sourceDir, archive],
+                                  stderr=subprocess.DEVNULL)
+
+            xattr.removexattr(self.randomFile, "user.foo")
+            xattr.setxattr(self.randomFile, "user.empty", bytes("x", enc))
+            xattr.setxattr(self.randomFile, "user.kept", bytes("y", enc))
+
+            subprocess.check_call(["../fuse_xattrs_tool", "restore", self.sourceDir, archive],
+                                  stderr=subprocess.DEVNULL)
+        finally:
+            if os.path.isfile(archive):
+                os.remove(archive)
+
+        self.assertEqual(xattr.getxattr(self.randomFile, "user.foo"), bytes("bar", enc))
+        self.assertEqual(xattr.getxattr(self.randomFile, "user.empty"), bytes())
+        self.assertEqual(xattr.getxattr(self.randomFile, "user.kept"), bytes("y", enc))
+
+    def test_native_xattrs(self):
+        try:
+            xattr.setxattr(self.randomSourceFile, "user.probe", b"")
+            xattr.removexattr(self.randomSourceFile, "user.probe")
+        except OSError as ex:
+            self.skipTest("no user xattrs on the source filesystem: " + ex.strerror)
+
+        # in the sidecar, from before
+        xattr.setxattr(self.randomFile, "user.moved", b"old")
+
+        with mounted("./hybrid/", "native_xattrs") as hybridDir:
+            filename = hybridDir + self.randomFilename
+            xattr.setxattr(filename, "user.foo", b"bar")
+            self.assertEqual(xattr.getxattr(filename, "user.foo"), b"bar")
+            self.assertEqual(xattr.getxattr(self.randomSourceFile, "user.foo"), b"bar")
+
+            # read from the sidecar, moved out of it by the next write
+            self.assertEqual(xattr.getxattr(filename, "user.moved"), b"old")
+            xattr.setxattr(filename, "user.moved", b"new")
+            self.assertEqual(xattr.getxattr(self.randomSourceFile, "user.moved"), b"new")
+            with self.assertRaises(OSError) as ex:
+                xattr.getxattr(self.randomFile, "user.moved")
+            self.assertEqual(ex.exception.errno, 61)  # ENODATA
+
+            # too large for most native xattrs, then kept in the sidecar
+            value = b"x" * 60000
+            xattr.setxattr(filename, "user.large", value)
+            self.assertEqual(xattr.getxattr(filename, "user.large"), value)
+            in_native = "user.large" in xattr.listxattr(self.randomSourceFile)
+            in_sidecar = "user.large" in xattr.listxattr(self.randomFile)
+            self.assertNotEqual(in_native, in_sidecar)
+            self.assertEqual(sorted(xattr.listxattr(filename)), ["user.foo", "user.large", "user.moved"])
+
+            # the client library reads both, once told the layout (a process opens it once)
+            def client_reads():
+                client = ctypes.CDLL("../libfuse_xattrs_client.so")
+                if client.fuse_xattrs_client_open(bytes(self.sourceDir, "utf-8"), 0x2) != 0:
+                    os._exit(1)
+                path = bytes("/" + self.randomFilename, "utf-8")
+                buffer = ctypes.create_string_buffer(65536)
+                size = client.fuse_xattrs_client_get(path, b"user.large", buffer, len(buffer))
+                if buffer.raw[:size] != value:
+                    os._exit(2)
+                size = client.fuse_xattrs_client_list(path, buffer, len(buffer))
+                if sorted(buffer.raw[:size].split(b"\0")[:-1]) != [b"user.foo", b"user.large", b"user.moved"]:
+                    os._exit(3)
+                os._exit(0)
+
+            process = multiprocessing.Process(target=client_reads)
+            process.start()
+            process.join()
+            self.assertEqual(process.exitcode, 0)
+
+    def test_import_native(self):
+        enc = "utf-8"
+        nativeDir = "./native/"
+        nativeFile = nativeDir + self.randomFilename
+        missingFile = nativeDir + "missing.txt"
+
+        os.makedirs(nativeDir, exist_ok=True)
+        try:
+            Path(nativeFile).touch()
+            Path(missingFile).touch()
+            xattr.setxattr(nativeFile, "user.foo", bytes("bar", enc))
+            xattr.setxattr(nativeFile, "user.empty", bytes())
+            xattr.setxattr(missingFile, "user.foo", bytes("bar", enc))
+
+            subprocess.check_call(["../fuse_xattrs_tool", "import", self.sourceDir, nativeDir],
+                                  stderr=subprocess.DEVNULL)
+            self.assertEqual(xattr.getxattr(self.randomFile, "user.foo"), bytes("bar", enc))
+            self.assertEqual(xattr.getxattr(self.randomFile, "user.empty"), bytes())
+            self.assertFalse(os.path.exists(self.mountDir + "missing.txt"))
+
+            # imported before: a second run leaves the sidecar alone
+            sidecar = self.randomSourceFileSidecar
+            before = os.stat(sidecar)
+            report = subprocess.run(["../fuse_xattrs_tool", "import", self.sourceDir, nativeDir],
+                                    stderr=subprocess.PIPE, check=True).stderr
+            self.assertIn(b"1 files up to date", report)
+            self.assertEqual(os.stat(sidecar).st_ino, before.st_ino)
+            self.assertEqual(os.stat(sidecar).st_mtime_ns, before.st_mtime_ns)
+
+            # whatever the timestamps, a value that differs is imported again
+            xattr.setxattr(nativeFile, "user.foo", bytes("baz", enc))
+            os.utime(sidecar, ns=(before.st_atime_ns, os.stat(nativeFile).st_ctime_ns + 10 ** 9))
+            report = subprocess.run(["../fuse_xattrs_tool", "import", self.sourceDir, nativeDir],
+                                    stderr=subprocess.PIPE, check=True).stderr
+            self.assertNotIn(b"up to date", report)
+            self.assertEqual(xattr.getxattr(self.randomFile, "user.foo"), bytes("baz", enc))
+            self.assertEqual(xattr.getxattr(self.randomFile, "user.empty"), bytes())
+        finally:
+            for filename in (nativeFile, missingFile):
+                if os.path.exists(filename):
+                    os.remove(filename)
+            os.rmdir(nativeDir)
+
+    def test_ro_index(self):
+        enc = "utf-8"
+        index = "./attrs.index"
+        xattr.setxattr(self.randomFile, "user.foo", bytes("bar", enc))
+
+        try:
+            subprocess.check_call(["../fuse_xattrs_tool", "freeze", self.sourceDir, index],
+                                  stderr=subprocess.DEVNULL)
+            with mounted("./frozen/", "ro_index=" + index) as frozenDir:
+                frozenFile = frozenDir + self.randomFilename
+                self.assertEqual(xattr.getxattr(frozenFile, "user.foo"), bytes("bar", enc))
+                self.assertEqual(len(xattr.listxattr(frozenFile)), 1)
+                with self.assertRaises(OSError) as ex:
+                    xattr.setxattr(frozenFile, "user.foo", bytes("baz", enc))
+                self.assertEqual(ex.exception.errno, 30)
+                self.assertEqual(ex.exception.strerror, "Read-only file system")
+        finally:
+            if os.path.isfile(index):
+                os.remove(index)
+
+    def test_query_index(self):
+        xattr.setxattr(self.randomFile, "user.color", b"red")
+
+        def indexed(value):
+            # built and reloaded in the background
+            for _ in range(100):
+                if os.path.lexists(index + value + "/" + self.randomFilename):
+                    return True
+                time.sleep(0.05)
+            return False
+
+        # uncached lookups: the directory changes under the kernel
+        with mounted("./query/", "query_index", "watch", "entry_timeout=0", "negative_timeout=0",
+                     "attr_timeout=0") as queryDir:
+            index = queryDir + ".xattr-query/user.color/"
+            filename = queryDir + self.randomFilename
+
+            # by value, from the scan at mount time
+            self.assertTrue(indexed("red"))
+            self.assertEqual(os.listdir(index + "red"), [self.randomFilename])
+            self.assertEqual(os.readlink(index + "red/" + self.randomFilename), "../../../" + self.randomFilename)
+            self.assertEqual(xattr.getxattr(index + "red/" + self.randomFilename, "user.color"), b"red")
+
+            xattr.setxattr(filename, "user.color", b"blue")
+            self.assertTrue(os.path.lexists(index + "blue/" + self.randomFilename))
+            self.assertFalse(os.path.lexists(index + "red/" + self.randomFilename))
+
+            xattr.removexattr(filename, "user.color")
+            self.assertFalse(os.path.lexists(index + "blue/" + self.randomFilename))
+
+            # changed through the other mount: reloaded from the sidecar
+            xattr.setxattr(self.randomFile, "user.color", b"green")
+            self.assertTrue(indexed("green"))
+
+    def test_watch(self):
+        directory = "watched/"
+        os.makedirs(self.sourceDir + directory, exist_ok=True)
+        open(self.sourceDir + directory + "file", "w").close()
+
+        def seen(filename, value):
+            # the watcher thread drops the cached attributes
+            for _ in range(100):
+                if xattr.getxattr(filename, "user.foo") == value:
+                    return True
+                time.sleep(0.05)
+            return False
+
+        try:
+            with mounted("./watch/", "watch", "cache", "stat_cache", "attr_timeout=0") as watchDir:
+                # our own writes, read back from the cache
+                for i in range(20):
+                    xattr.setxattr(self.randomFile.replace(self.mountDir, watchDir), "user.foo", b"%d" % i)
+                    self.assertEqual(xattr.getxattr(self.randomFile.replace(self.mountDir, watchDir),
+                                                    "user.foo"), b"%d" % i)
+
+                # written while open through the mount
+                with open(watchDir + directory + "file", "wb") as fp:
+                    fp.write(b"x" * 100)
+                self.assertEqual(os.stat(watchDir + directory + "file").st_size, 100)
+
+                # changed through the other mount
+                xattr.setxattr(self.randomFile, "user.foo", b"other")
+                self.assertTrue(seen(self.randomFile.replace(self.mountDir, watchDir), b"other"))
+
+                # moved out of the tree, then made again
+                os.rename(self.sourceDir + directory, "./watched_out")
+                os.makedirs(self.sourceDir + directory)
+                open(self.sourceDir + directory + "file", "w").close()
+                xattr.setxattr(self.mountDir + directory + "file", "user.foo", b"new")
+                self.assertTrue(seen(watchDir + directory + "file", b"new"))
+                # events from the old directory don't reach the new one
+                with open("./watched_out/file", "wb") as fp:
+                    fp.write(b"old")
+                xattr.setxattr(self.mountDir + directory + "file", "user.foo", b"newer")
+                self.assertTrue(seen(watchDir + directory + "file", b"newer"))
+        finally:
+            for path in (self.sourceDir + directory, "./watched_out/"):
+                if os.path.isdir(path):
+                    for name in os.listdir(path):
+                        os.remove(path + name)
+                    os.rmdir(path)
+
+    def test_stat_cache(self):
+        link = self.randomFilename + ".link"
+
+        # every stat reaches the daemon, answered from its cache
+        try:
+            with mounted("./stat_cache/", "stat_cache", "attr_timeout=0") as cacheDir:
+                filename = cacheDir + self.randomFilename
+                self.assertEqual(os.stat(filename).st_size, 0)
+
+                with open(filename, "wb") as fp:
+                    fp.write(b"data")
+                    fp.flush()
+                    self.assertEqual(os.stat(filename).st_size, 4)
+                self.assertEqual(os.stat(filename).st_size, 4)
+
+                os.truncate(filename, 2)
+                self.assertEqual(os.stat(filename).st_size, 2)
+
+                os.utime(filename, (1000000000, 1000000000))
+                self.assertEqual(os.stat(filename).st_mtime, 1000000000)
+
+                # written through another link
+                os.link(filename, cacheDir + link)
+                self.assertEqual(os.stat(cacheDir + link).st_size, 2)
+                with open(cacheDir + link, "ab") as fp:
+                    fp.write(b"more")
+                self.assertEqual(os.stat(filename).st_size, 6)
+                self.assertEqual(os.stat(filename).st_nlink, 2)
+        finally:
+            if os.path.lexists(self.sourceDir + link):
+                os.remove(self.sourceDir + link)
+
+    def test_open_sidecars(self):
+        names = ["open%d" % i for i in range(48)]
+
+        # the daemon keeps at most a quarter of its descriptors on sidecars
+        limits = resource.getrlimit(resource.RLIMIT_NOFILE)
+        resource.setrlimit(resource.RLIMIT_NOFILE, (128, limits[1]))
+        try:
+            with mounted("./open_sidecars/", "cache") as openDir:
+                files = [open(openDir + name, "w") for name in names]
+                try:
+                    for _ in range(3):
+                        for name in names:
+                            self.assertEqual(xattr.listxattr(openDir + name), [])
+                            with self.assertRaises(OSError) as ex:
+                                xattr.getxattr(openDir + name, "user.foo")
+                            self.assertEqual(ex.exception.errno, 61)
+
+                    for name in names:
+                        xattr.setxattr(openDir + name, "user.foo", name.encode())
+                    for name in names:
+                        self.assertEqual(xattr.getxattr(openDir + name, "user.foo"), name.encode())
+                        self.assertEqual(xattr.getxattr(self.mountDir + name, "user.foo"), name.encode())
+                finally:
+                    for fp in files:
+                        fp.close()
+        finally:
+            resource.setrlimit(resource.RLIMIT_NOFILE, limits)
+            for name in names:
+                for path in (self.sourceDir + name, self.sourceDir + name + ".xattr"):
+                    if os.path.isfile(path):
+                        os.remove(path)
+
+    def test_dir_store(self):
+        directory = "stored/"
+        names = ["stored%d" % i for i in range(50)]
+        os.makedirs(self.sourceDir + directory, exist_ok=True)
+
+        try:
+            with mounted("./dir_store/", "dir_store") as storeDir:
+                for name in names:
+                    filename = storeDir + directory + name
+                    open(filename, "w").close()
+                    xattr.setxattr(filename, "user.foo", name.encode())
+                xattr.setxattr(storeDir + directory + names[0], "user.foo", b"changed")
+                xattr.removexattr(storeDir + directory + names[1], "user.foo")
+
+                self.assertEqual(sorted(os.listdir(storeDir + directory)), sorted(names))
+                self.assertEqual(xattr.getxattr(storeDir + directory + names[0], "user.foo"), b"changed")
+                self.assertEqual(xattr.listxattr(storeDir + directory + names[1]), [])
+                for name in names[2:]:
+                    self.assertEqual(xattr.getxattr(storeDir + directory + name, "user.foo"), name.encode())
+
+                # a single store per directory, no temporary file left behind
+                self.assertEqual(sorted(os.listdir(self.sourceDir + directory)), sorted(names + ["..xattr"]))
+
+                for name in names:
+                    os.remove(storeDir + directory + name)
+                os.rmdir(storeDir + directory)
+        finally:
+            if os.path.isdir(self.sourceDir + directory):
+                for name in os.listdir(self.sourceDir + directory):
+                    os.remove(self.sourceDir + directory + name)
+                os.rmdir(self.sourceDir + directory)
+
+    def test_dedup_gc(self):
+        blobsDir = self.sourceDir + ".xattr-blobs.xattr/"
+        names = ["dedup%d" % i for i in range(3)]
+        value = b"x" * 100
+
+        def blobs():
+            if not os.path.isdir(blobsDir):
+                return []
+            return [blob for directory in os.listdir(blobsDir) for blob in os.listdir(blobsDir + directory)]
+
+        try:
+            with mounted("./dedup/", "dedup") as dedupDir:
+                for name in names:
+                    open(dedupDir + name, "w").close()
+
+                # the first copy stays inline, the second one makes a blob
+                xattr.setxattr(dedupDir + names[0], "user.foo", value)
+                self.assertEqual(blobs(), [])
+                for name in names[1:]:
+                    xattr.setxattr(dedupDir + name, "user.foo", value)
+                self.assertEqual(len(blobs()), 1)
+                for name in names:
+                    self.assertEqual(xattr.getxattr(dedupDir + name, "user.foo"), value)
+
+            # still referenced: kept
+            subprocess.check_call(["../fuse_xattrs_tool", "gc", self.sourceDir], stderr=subprocess.DEVNULL)
+            self.assertEqual(len(blobs()), 1)
+
+            for name in names[1:]:
+                xattr.removexattr(self.mountDir + name, "user.foo")
+            subprocess.check_call(["../fuse_xattrs_tool", "gc", self.sourceDir], stderr=subprocess.DEVNULL)
+            self.assertEqual(blobs(), [])
+            self.assertEqual(xattr.getxattr(self.mountDir + names[0], "user.foo"), value)
+        finally:
+            for name in names:
+                if os.path.exists(self.mountDir + name):
+                    os.remove(self.mountDir + name)
+
+    def test_symlinks(self):
+        enc = "utf-8"
+        xattr.setxattr(self.randomFile, "user.foo", bytes("bar", enc))
+        with open(self.randomFile, "w") as fp:
+            fp.write("data")
+
+        with mounted("./symlinks/", "symlinks") as linksDir:
+            link = linksDir + self.randomFilename
+            self.assertTrue(os.path.islink(link))
+            self.assertEqual(os.path.normpath(os.readlink(link)), os.path.abspath(self.randomSourceFile))
+            with open(link) as fp:
+                self.assertEqual(fp.read(), "data")
+            self.assertIn("user.foo", xattr.listxattr(link, symlink=True))
+            self.assertFalse(os.path.lexists(link + ".xattr"))
+
+            # values of a link: refused by the kernel, read by name with the client library
+            with self.assertRaises(OSError) as ex:
+                xattr.getxattr(link, "user.foo", symlink=True)
+            self.assertEqual(ex.exception.errno, 61)
+            client = ctypes.CDLL("../libfuse_xattrs_client.so")
+            self.assertEqual(client.fuse_xattrs_client_open(bytes(self.sourceDir, enc), 0), 0)
+            value = ctypes.create_string_buffer(64)
+            size = client.fuse_xattrs_client_get(bytes("/" + self.randomFilename, enc), b"user.foo", value, 64)
+            self.assertEqual(value.raw[:size], bytes("bar", enc))
+
+            # created through the mount: regular while open, also once looked up again
+            created = linksDir + "created.txt"
+            made = linksDir + "made.txt"
+            writer = open(created, "w")
+            writer.write("new")
+            writer.flush()
+            os.mknod(made)
+            for filename in (created, made):
+                self.assertFalse(os.path.islink(filename))
+            os.rename(created, created + ".moved")
+            created += ".moved"
+            links = {entry.name: entry.is_symlink() for entry in os.scandir(linksDir)}
+            self.assertEqual((links[self.randomFilename], links["created.txt.moved"], links["made.txt"]),
+                             (True, False, False))
+            self.assertFalse(os.path.islink(created))
+            xattr.setxattr(created, "user.foo", bytes("baz", enc))
+            self.assertEqual(xattr.getxattr(created, "user.foo"), bytes("baz", enc))
+
+            # closed: the kernel is told to forget it, it's a link like the others
+            writer.close()
+            for _ in range(100):
+                if os.path.islink(created):
+                    break
+                time.sleep(0.05)
+            self.assertTrue(os.path.islink(created))
+            with open(created) as fp:
+                self.assertEqual(fp.read(), "new")
+            self.assertFalse(os.path.islink(made))
+
+            os.remove(created)
+            os.remove(made)
+            Path(self.sourceDir + "made.txt").touch()
+            try:
+                self.assertTrue(os.path.islink(made))
+            finally:
+                os.remove(self.sourceDir + "made.txt")
+
+    def test_passthrough(self):
+        enc = "utf-8"
+
+        # served by the kernel where it can, by the daemon elsewhere
+        with mounted("./passthrough/", "passthrough") as passthroughDir:
+            filename = passthroughDir + self.randomFilename
+            with open(filename, "w") as fp:
+                fp.write("data")
+            with open(filename) as fp:
+                self.assertEqual(fp.read(), "data")
+            with open(self.randomSourceFile) as fp:
+                self.assertEqual(fp.read(), "data")
+            self.assertEqual(os.stat(filename).st_size, 4)
+
+            xattr.setxattr(filename, "user.foo", bytes("bar", enc))
+            self.assertEqual(xattr.getxattr(self.randomFile, "user.foo"), bytes("bar", enc))
+
+        # the daemon never sees those writes, so it mustn't answer from its stat cache
+        with mounted("./passthrough/", "passthrough", "stat_cache", "stat_cache_ttl=60") as passthroughDir:
+            filename = passthroughDir + self.randomFilename
+            with open(filename, "a") as fp:
+                self.assertEqual(os.stat(filename).st_size, 4)
+                fp.write("more")
+                fp.flush()
+                time.sleep(1.5)  # past the kernel's own attribute timeout
+                self.assertEqual(os.stat(filename).st_size, 8)
+
+    @unittest.skipUnless(os.geteuid() == 0, "writes as another user")
+    def test_no_security_xattrs(self):
+        with mounted("./killpriv/", "no_security_xattrs", "allow_other") as killprivDir:
+            filename = killprivDir + "killpriv_file"
+            with open(filename, "w") as f:
+                f.write("foo")
+
+            with self.assertRaises(OSError) as ex:
+                xattr.getxattr(filename, "security.capability")
+            self.assertEqual(ex.exception.errno, 95)  # ENOTSUP
+
+            # kept for a writer with CAP_FSETID
+            os.chmod(filename, 0o6777)
+            with open(filename, "a") as f:
+                f.write("bar")
+            self.assertEqual(os.stat(filename).st_mode & 0o7777, 0o6777)
+
+            # dropped for one without
+            pid = os.fork()
+            if pid == 0:
+                try:
+                    fd = os.open(filename, os.O_WRONLY | os.O_APPEND)
+                    os.setgid(65534)
+                    os.setuid(65534)
+                    os.write(fd, b"baz")
+                    os._exit(0)
+                finally:
+                    os._exit(1)
+            self.assertEqual(os.waitpid(pid, 0)[1], 0)
+            self.assertEqual(os.stat(filename).st_mode & 0o7777, 0o777)
+
+            with open(filename) as f:
+                self.assertEqual(f.read(), "foobarbaz")
+            os.remove(filename)
+
+    @unittest.skipUnless(os.geteuid() == 0, "writes as another user")
+    def test_no_security_xattrs_passthrough(self):
+        # passthrough writes never reach the daemon: the bits must still go
+        with mounted("./killpriv/", "no_security_xattrs", "passthrough", "allow_other") as killprivDir:
+            filename = killprivDir + "killpriv_file"
+            with open(filename, "w") as f:
+                f.write("foo")
+            os.chmod(filename, 0o6777)
+
+            pid = os.fork()
+            if pid == 0:
+                try:
+                    fd = os.open(filename, os.O_WRONLY | os.O_APPEND)
+                    os.setgid(65534)
+                    os.setuid(65534)
+                    os.write(fd, b"bar")
+                    os._exit(0)
+                finally:
+                    os._exit(1)
+            self.assertEqual(os.waitpid(pid, 0)[1], 0)
+            self.assertEqual(os.stat(filename).st_mode & 0o7777, 0o777)
+            self.assertEqual(os.stat(self.sourceDir + "killpriv_file").st_mode & 0o7777, 0o777)
+
+            with open(filename) as f:
+                self.assertEqual(f.read(), "foobar")
+            os.remove(filename)
+
+    def test_prefetch(self):
+        socketPath = os.path.abspath("./prefetch.sock")
+        snapshotPath = os.path.abspath("./prefetch.snapshot")
+        names = ["prefetched%d" % i for i in range(20)]
+        os.makedirs(self.mountDir + "prefetched", exist_ok=True)
+        for name in names:
+            filename = self.mountDir + "prefetched/" + name
+            open(filename, "w").close()
+            xattr.setxattr(filename, "user.foo", b"old")
+
+        def ctl(*command):
+            return subprocess.check_output(["../fuse_xattrs_tool", "ctl", socketPath] + list(command))
+
+        try:
+            with mounted("./prefetch/", "cache", "prefetch", "control=" + socketPath,
+                         "cache_snapshot=" + snapshotPath) as prefetchDir:
+                directory = prefetchDir + "prefetched/"
+
+                # loaded in the background by the listing, without a getxattr
+                os.listdir(directory)
+                for _ in range(100):
+                    saved = int(ctl("save-cache").split()[0])
+                    if saved >= len(names):
+                        break
+                    time.sleep(0.05)
+                self.assertGreaterEqual(saved, len(names))
+
+                # writes racing with the prefetch of their file win
+                ctl("drop-caches")
+                os.listdir(directory)
+                for name in names:
+                    xattr.setxattr(directory + name, "user.foo", b"new")
+                time.sleep(0.5)
+                for name in names:
+                    self.assertEqual(xattr.getxattr(directory + name, "user.foo"), b"new")
+        finally:
+            for name in names:
+                os.remove(self.mountDir + "prefetched/" + name)
+            os.rmdir(self.mountDir + "prefetched")
+            if os.path.exists(snapshotPath):
+                os.remove(snapshotPath)
+
+    def test_control_socket(self):
+        socketPath = os.path.abspath("./control.sock")
+
+        with mounted("./control/", "cache", "control=" + socketPath):
+            config = subprocess.check_output(["../fuse_xattrs_tool", "ctl", socketPath, "config"])
+            self.assertIn(b"cache=1\n", config)
+            self.assertTrue(config.endswith(b"ok\n"))
+
+            subprocess.check_call(["../fuse_xattrs_tool", "ctl", socketPath, "set", "cache_size", "8"],
+                                  stdout=subprocess.DEVNULL)
+            config = subprocess.check_output(["../fuse_xattrs_tool", "ctl", socketPath, "config"])
+            self.assertIn(b"cache_size=8\n", config)
+
+            res = subprocess.call(["../fuse_xattrs_tool", "ctl", socketPath, "set", "nope", "1"],
+                                  stdout=subprocess.DEVNULL)
+            self.assertEqual(res, 1)
+
+    def test_sync_overflow(self):
+        socketPath = os.path.abspath("./sync.sock")
+        sourceDirectory = self.sourceDir + "overflow/"
+        names = ["f%d" % i for i in range(65536 + 16)]
+        os.makedirs(sourceDirectory, exist_ok=True)
+        for name in names:
+            open(sourceDirectory + name, "w").close()
+
+        def stats():
+            output = subprocess.check_output(["../fuse_xattrs_tool", "ctl", socketPath, "sync-stats"])
+            return dict(line.split("=") for line in output.decode().split("\n") if "=" in line)
+
+        try:
+            with mounted("./sync/", "control=" + socketPath) as syncDir:
+                directory = syncDir + "overflow/"
+
+                # more sidecars waiting for fsync than can be tracked: a syncfs covers them all
+                for name in names:
+                    xattr.setxattr(directory + name, "user.foo", b"bar")
+                self.assertEqual(stats()["overflowed"], "1")
+                fd = os.open(directory + names[0], os.O_RDONLY)
+                try:
+                    os.fsync(fd)
+                finally:
+                    os.close(fd)
+                before = stats()
+                self.assertEqual((before["overflowed"], before["syncfs"], before["tracked"]), ("0", "1", "0"))
+
+                # then one fsync per sidecar again
+                xattr.setxattr(directory + names[1], "user.foo", b"baz")
+                fd = os.open(directory + names[1], os.O_RDONLY)
+                try:
+                    os.fsync(fd)
+                finally:
+                    os.close(fd)
+                after = stats()
+                self.assertEqual(after["syncfs"], "1")
+                self.assertGreater(int(after["fsync"]), int(before["fsync"]))
+        finally:
+            shutil.rmtree(sourceDirectory)
+
+    def test_trace_replay(self):
+        tracePath = os.path.abspath("./workload.trace")
+        replayDir = "./replay/"
+
+        os.makedirs(replayDir, exist_ok=True)
+        try:
+            # recorded until the daemon is gone
+            with mounted("./trace/", "trace=" + tracePath) as traceDir:
+                filename = traceDir + "traced_file"
+                open(filename, "w").close()
+                for i in range(10):
+                    xattr.setxattr(filename, "user.foo", b"bar%d" % i)
+                    self.assertEqual(xattr.getxattr(filename, "user.foo"), b"bar%d" % i)
+                os.remove(filename)
+
+            output = subprocess.check_output(["../fuse_xattrs_tool", "replay", "-f", "-S", tracePath, replayDir],
+                                             stderr=subprocess.DEVNULL)
+            self.assertIn(b"setxattr ", output)
+            self.assertRegex(output, rb"getxattr +[0-9]+ ")
+            self.assertEqual(os.listdir(replayDir), [])
+        finally:
+            os.rmdir(replayDir)
+            if os.path.exists(tracePath):
+                os.remove(tracePath)
+
+    def test_writeback_cache_no_open(self):
+        # no_open is refused by older kernels, the mount still works
+        with mounted("./caps/", "writeback_cache", "no_open") as capsDir:
+            filename = capsDir + "caps_file"
+            with open(filename, "w") as f:
+                f.write("foo")
+            with open(filename, "a") as f:
+                f.write("bar")
+            with open(filename, "r") as f:
+                self.assertEqual(f.read(), "foobar")
+            self.assertEqual(os.stat(filename).st_size, 6)
+
+            xattr.setxattr(filename, "user.foo", b"bar")
+            self.assertEqual(xattr.getxattr(filename, "user.foo"), b"bar")
+            os.remove(filename)
+
+    def test_concurrent_mounts(self):
+        filename = "shared_file"
+        open(self.mountDir + filename, "w").close()
+
+        def writer(directory, prefix):
+            for i in range(50):
+                xattr.setxattr(directory + filename, "user.%s%d" % (prefix, i), b"value")
+
+        try:
+            with mounted("./shared/") as sharedDir:
+                writers = [multiprocessing.Process(target=writer, args=(directory, prefix))
+                           for directory, prefix in [(self.mountDir, "a"), (self.mountDir, "b"),
+                                                     (sharedDir, "c"), (sharedDir, "d")]]
+                for process in writers:
+                    process.start()
+                for process in writers:
+                    process.join()
+                    self.assertEqual(process.exitcode, 0)
+
+                # no update lost between the two mounts
+                self.assertEqual(len(xattr.listxattr(self.mountDir + filename)), 200)
+                self.assertEqual(len(xattr.listxattr(sharedDir + filename)), 200)
+        finally:
+            os.remove(self.mountDir + filename)
+
+    def test_concurrent_reads(self):
+        filenames = ["arena%d" % i for i in range(8)]
+        # small and large values: the request arenas of the workers grow and rewind
+        expected = {filename: {"user.%s.%d" % (filename, j): (filename * (j * 2000 + 1)).encode()
+                               for j in range(6)}
+                    for filename in filenames}
+
+        def reader(directory):
+            for _ in range(50):
+                for filename, attrs in expected.items():
+                    if sorted(xattr.listxattr(directory + filename)) != sorted(attrs):
+                        os._exit(1)
+                    for name, value in attrs.items():
+                        if xattr.getxattr(directory + filename, name) != value:
+                            os._exit(1)
+
+        try:
+            for filename, attrs in expected.items():
+                open(self.mountDir + filename, "w").close()
+                for name, value in attrs.items():
+                    xattr.setxattr(self.mountDir + filename, name, value)
+
+            with mounted("./concurrent/", "multithread") as concurrentDir:
+                readers = [multiprocessing.Process(target=reader, args=(directory,))
+                           for directory in [self.mountDir, concurrentDir] * 4]
+                for process in readers:
+                    process.start()
+                for process in readers:
+                    process.join()
+                    self.assertEqual(process.exitcode, 0)
+        finally:
+            for filename in filenames:
+                if os.path.isfile(self.mountDir + filename):
+                    os.remove(self.mountDir + filename)
+
+    def test_journal_generation(self):
+        journalPath = os.path.abspath("./changes.journal")
+        xattr.setxattr(self.randomFile, "user.older", b"1")
+
+        try:
+            with mounted("./journal/", "journal=" + journalPath, "generation") as journalDir:
+                filename = journalDir + "journaled_file"
+                open(filename, "w").close()
+                self.assertEqual(xattr.getxattr(filename, "user.fuse_xattrs.generation"), b"0")
+
+                xattr.setxattr(filename, "user.foo", b"bar")
+                first = int(xattr.getxattr(filename, "user.fuse_xattrs.generation"))
+                xattr.setxattr(filename, "user.foo", b"baz")
+                second = int(xattr.getxattr(filename, "user.fuse_xattrs.generation"))
+                self.assertGreater(first, 0)
+                self.assertGreater(second, first)
+                self.assertEqual(xattr.listxattr(filename), ["user.foo"])
+
+                with self.assertRaises(OSError) as ex:
+                    xattr.setxattr(filename, "user.fuse_xattrs.generation", b"1")
+                self.assertEqual(ex.exception.errno, 1)  # EPERM
+
+                # set before generations were kept: derived from the sidecar until it
+                # changes, reads don't write
+                with open(self.randomSourceFileSidecar, "rb") as fp:
+                    sidecar = fp.read()
+                older = journalDir + self.randomFilename
+                legacy = int(xattr.getxattr(older, "user.fuse_xattrs.generation"))
+                self.assertNotEqual(legacy, 0)
+                self.assertEqual(int(xattr.getxattr(older, "user.fuse_xattrs.generation")), legacy)
+                with open(self.randomSourceFileSidecar, "rb") as fp:
+                    self.assertEqual(fp.read(), sidecar)
+                xattr.setxattr(older, "user.older", b"2")
+                self.assertGreater(int(xattr.getxattr(older, "user.fuse_xattrs.generation")), 0)
+                self.assertNotEqual(int(xattr.getxattr(older, "user.fuse_xattrs.generation")), legacy)
+
+                xattr.removexattr(filename, "user.foo")
+                xattr.setxattr(filename, "user.a b", b"1")
+                os.rename(filename, filename + "_moved")
+                os.remove(filename + "_moved")
+
+            with open(journalPath) as journal:
+                lines = [line.split() for line in journal]
+            self.assertEqual([line[2:] for line in lines], [
+                ["set", "/journaled_file", "user.foo"],
+                ["set", "/journaled_file", "user.foo"],
+                ["set", "/" + self.randomFilename, "user.older"],
+                ["remove", "/journaled_file", "user.foo"],
+                ["set", "/journaled_file", "user.a%20b"],
+                ["rename", "/journaled_file", "/journaled_file_moved"],
+                ["unlink", "/journaled_file_moved"],
+            ])
+            self.assertEqual([int(line[0]) for line in lines], list(range(1, 8)))
+
+            # dropping the last attribute of such a sidecar is a change as well
+            legacyFile = self.mountDir + "legacy_file"
+            Path(legacyFile).touch()
+            xattr.setxattr(legacyFile, "user.older", b"1")
+            with mounted("./journal/", "generation") as journalDir:
+                legacy = journalDir + "legacy_file"
+                self.assertNotEqual(xattr.getxattr(legacy, "user.fuse_xattrs.generation"), b"0")
+                xattr.removexattr(legacy, "user.older")
+                self.assertEqual(xattr.getxattr(legacy, "user.fuse_xattrs.generation"), b"0")
+                os.remove(legacy)
+        finally:
+            if os.path.exists(journalPath):
+                os.remove(journalPath)
+
+    def test_cache_snapshot(self):
+        snapshotPath = os.path.abspath("./cache.snapshot")
+        snapshotDir = "./snapshot/"
+        filename = snapshotDir + "snapshot_file"
+
+        try:
+            # saved once the daemon is gone
+            with mounted(snapshotDir, "cache_snapshot=" + snapshotPath):
+                open(filename, "w").close()
+                xattr.setxattr(filename, "user.foo", b"bar")
+                self.assertEqual(xattr.getxattr(filename, "user.foo"), b"bar")
+            self.assertTrue(os.path.exists(snapshotPath))
+
+            # changed while unmounted: the saved entry is out of date
+            xattr.setxattr(self.mountDir + "snapshot_file", "user.foo", b"baz")
+
+            with mounted(snapshotDir, "cache_snapshot=" + snapshotPath):
+                self.assertEqual(xattr.getxattr(filename, "user.foo"), b"baz")
+                os.remove(filename)
+        finally:
+            if os.path.exists(snapshotPath):
+                os.remove(snapshotPath)
+
 if __name__ == '__main__':
     unittest.main()
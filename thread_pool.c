@@ -0,0 +1,215 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+#include "utils.h"
+
+struct thread_pool_job {
+    struct thread_pool_job *next;
+    thread_pool_job_fn fn;
+    void *arg;
+};
+
+struct thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs;
+    pthread_cond_t has_room;
+    pthread_cond_t idle;
+
+    struct thread_pool_job *head;
+    struct thread_pool_job *tail;
+    size_t queued;
+    size_t max_queued;
+
+    unsigned int running;
+    int stopping;
+
+    unsigned int active;    // workers not asked to retire
+    unsigned int retiring;  // workers yet to exit after a resize
+
+    unsigned int thread_count;  // every worker started, retired ones are joined on free
+    pthread_t *threads;
+};
+
+static void *__worker(void *data)
+{
+    struct thread_pool *pool = data;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->stopping && pool->retiring == 0)
+            pthread_cond_wait(&pool->has_jobs, &pool->lock);
+
+        if (pool->retiring > 0) {
+            pool->retiring--;
+            break;
+        }
+        if (pool->head == NULL)
+            break; // stopping and drained
+
+        struct thread_pool_job *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pool->queued--;
+        pool->running++;
+        pthread_cond_signal(&pool->has_room);
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (pool->head == NULL && pool->running == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct thread_pool *thread_pool_new(unsigned int threads, size_t max_queued)
+{
+    struct thread_pool *pool = calloc(1, sizeof(struct thread_pool));
+    if (pool == NULL)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_jobs, NULL);
+    pthread_cond_init(&pool->has_room, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->max_queued = max_queued;
+
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, __worker, pool) != 0) {
+            error_print("cannot create worker thread %u\n", i);
+            break;
+        }
+        pool->thread_count++;
+    }
+    pool->active = pool->thread_count;
+
+    if (pool->thread_count == 0) {
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int thread_pool_submit(struct thread_pool *pool, thread_pool_job_fn fn, void *arg, int block)
+{
+    struct thread_pool_job *job = malloc(sizeof(struct thread_pool_job));
+    if (job == NULL)
+        return -ENOMEM;
+
+    job->next = NULL;
+    job->fn = fn;
+    job->arg = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->max_queued > 0 && pool->queued >= pool->max_queued) {
+        if (!block) {
+            pthread_mutex_unlock(&pool->lock);
+            free(job);
+            return -EAGAIN;
+        }
+        pthread_cond_wait(&pool->has_room, &pool->lock);
+    }
+
+    if (pool->tail == NULL)
+        pool->head = job;
+    else
+        pool->tail->next = job;
+    pool->tail = job;
+    pool->queued++;
+    pthread_cond_signal(&pool->has_jobs);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+int thread_pool_resize(struct thread_pool *pool, unsigned int threads)
+{
+    if (threads == 0)
+        return -EINVAL;
+
+    int res = 0;
+    pthread_mutex_lock(&pool->lock);
+    if (threads < pool->active) {
+        pool->retiring += pool->active - threads;
+        pool->active = threads;
+        pthread_cond_broadcast(&pool->has_jobs);
+    }
+
+    // take back retirements not done yet before starting new workers
+    while (pool->active < threads && pool->retiring > 0) {
+        pool->retiring--;
+        pool->active++;
+    }
+    while (pool->active < threads) {
+        pthread_t *grown = realloc(pool->threads, (pool->thread_count + 1) * sizeof(pthread_t));
+        if (grown == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        pool->threads = grown;
+        if (pthread_create(&pool->threads[pool->thread_count], NULL, __worker, pool) != 0) {
+            error_print("cannot create worker thread %u\n", pool->thread_count);
+            res = -EAGAIN;
+            break;
+        }
+        pool->thread_count++;
+        pool->active++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return res;
+}
+
+void thread_pool_wait(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head != NULL || pool->running > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(struct thread_pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->has_jobs);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_jobs);
+    pthread_cond_destroy(&pool->has_room);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool);
+}
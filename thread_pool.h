@@ -0,0 +1,45 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_THREAD_POOL_H
+#define FUSE_XATTRS_THREAD_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Pool of worker threads consuming a bounded FIFO of jobs.
+ */
+struct thread_pool;
+
+typedef void (*thread_pool_job_fn)(void *arg);
+
+struct thread_pool *thread_pool_new(unsigned int threads, size_t max_queued);
+
+/**
+ * Queue fn(arg) to be run by a worker.
+ * @param block - wait for room when the queue is full instead of failing.
+ * @return 0 on success, -EAGAIN if the queue is full and block is 0,
+ *         -ENOMEM if the job cannot be allocated.
+ */
+int thread_pool_submit(struct thread_pool *pool, thread_pool_job_fn fn, void *arg, int block);
+
+/**
+ * Start or retire workers until threads of them are left. Retiring ones
+ * finish their current job first.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int thread_pool_resize(struct thread_pool *pool, unsigned int threads);
+
+/* Wait until the queue is empty and every worker is idle. */
+void thread_pool_wait(struct thread_pool *pool);
+
+/* Run the queued jobs, then stop and join the workers. */
+void thread_pool_free(struct thread_pool *pool);
+
+#endif //FUSE_XATTRS_THREAD_POOL_H
@@ -0,0 +1,403 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include <fuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "hash_table.h"
+#include "utils.h"
+
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+
+static FILE *trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int recording = 0;
+static uint64_t trace_start = 0;     // CLOCK_MONOTONIC, ns
+
+static uint32_t last_thread = 0;
+static __thread uint32_t thread_number = 0;
+
+static struct fuse_operations next;
+static struct fuse_operations traced;
+
+static uint64_t __now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+int trace_open(const char *trace_path)
+{
+    FILE *file = fopen(trace_path, "w");
+    if (file == NULL)
+        return -errno;
+    setvbuf(file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    struct trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(struct trace_record);
+    header.start_time = __now(CLOCK_REALTIME);
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0) {
+        int res = -errno;
+        fclose(file);
+        return res;
+    }
+
+    trace_start = __now(CLOCK_MONOTONIC);
+    trace_file = file;
+    recording = 1;
+    return 0;
+}
+
+int trace_set_enabled(int enabled)
+{
+    int res = 0;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file == NULL) {
+        res = -EBADF;
+    } else {
+        __atomic_store_n(&recording, enabled != 0, __ATOMIC_RELAXED);
+        if (!enabled && fflush(trace_file) != 0)
+            res = -errno;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return res;
+}
+
+static void __record(uint64_t begin, enum trace_op op, const char *path, const char *other, const char *name,
+                     uint64_t size, uint64_t offset, uint32_t flags, int result)
+{
+    if (!__atomic_load_n(&recording, __ATOMIC_RELAXED))
+        return;
+
+    const uint64_t duration = __now(CLOCK_MONOTONIC) - begin;
+    if (thread_number == 0)
+        thread_number = __atomic_add_fetch(&last_thread, 1, __ATOMIC_RELAXED);
+
+    struct trace_record record;
+    memset(&record, 0, sizeof(record));
+    record.start = begin - trace_start;
+    record.path_hash = hash_string(path);
+    record.other_hash = other != NULL ? hash_string(other) : 0;
+    record.size = size;
+    record.offset = offset;
+    record.duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t) duration;
+    record.result = result;
+    record.thread = thread_number;
+    record.flags = flags;
+    record.op = (uint8_t) op;
+    const size_t name_size = name != NULL ? strnlen(name, UINT8_MAX) : 0;
+    record.name_size = (uint8_t) name_size;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL && recording) {
+        if (fwrite(&record, sizeof(record), 1, trace_file) != 1
+            || (name_size > 0 && fwrite(name, name_size, 1, trace_file) != 1)) {
+            error_print("cannot write the trace: %s, recording stopped\n", strerror(errno));
+            recording = 0;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static int trace_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.getattr(path, stbuf, fi);
+    __record(begin, TRACE_GETATTR, path, NULL, NULL, 0, 0, 0, res);
+    return res;
+}
+
+static int trace_access(const char *path, int mask)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.access(path, mask);
+    __record(begin, TRACE_ACCESS, path, NULL, NULL, 0, 0, (uint32_t) mask, res);
+    return res;
+}
+
+static int trace_readlink(const char *path, char *buf, size_t size)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.readlink(path, buf, size);
+    __record(begin, TRACE_READLINK, path, NULL, NULL, size, 0, 0, res);
+    return res;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                         struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.readdir(path, buf, filler, offset, fi, flags);
+    __record(begin, TRACE_READDIR, path, NULL, NULL, 0, (uint64_t) offset, flags, res);
+    return res;
+}
+
+static int trace_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.mknod(path, mode, rdev);
+    __record(begin, TRACE_MKNOD, path, NULL, NULL, 0, 0, mode, res);
+    return res;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.mkdir(path, mode);
+    __record(begin, TRACE_MKDIR, path, NULL, NULL, 0, 0, mode, res);
+    return res;
+}
+
+static int trace_symlink(const char *from, const char *to)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.symlink(from, to);
+    __record(begin, TRACE_SYMLINK, to, from, NULL, 0, 0, 0, res);
+    return res;
+}
+
+static int trace_unlink(const char *path)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.unlink(path);
+    __record(begin, TRACE_UNLINK, path, NULL, NULL, 0, 0, 0, res);
+    return res;
+}
+
+static int trace_rmdir(const char *path)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.rmdir(path);
+    __record(begin, TRACE_RMDIR, path, NULL, NULL, 0, 0, 0, res);
+    return res;
+}
+
+static int trace_rename(const char *from, const char *to, unsigned int flags)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.rename(from, to, flags);
+    __record(begin, TRACE_RENAME, from, to, NULL, 0, 0, flags, res);
+    return res;
+}
+
+static int trace_link(const char *from, const char *to)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.link(from, to);
+    __record(begin, TRACE_LINK, from, to, NULL, 0, 0, 0, res);
+    return res;
+}
+
+static int trace_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.chmod(path, mode, fi);
+    __record(begin, TRACE_CHMOD, path, NULL, NULL, 0, 0, mode, res);
+    return res;
+}
+
+static int trace_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.chown(path, uid, gid, fi);
+    __record(begin, TRACE_CHOWN, path, NULL, NULL, 0, 0, 0, res);
+    return res;
+}
+
+static int trace_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.truncate(path, size, fi);
+    __record(begin, TRACE_TRUNCATE, path, NULL, NULL, (uint64_t) size, 0, 0, res);
+    return res;
+}
+
+#ifdef HAS_UTIMENSAT
+static int trace_utimens(const char *path, const struct timespec ts[2], struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.utimens(path, ts, fi);
+    __record(begin, TRACE_UTIMENS, path, NULL, NULL, 0, 0, 0, res);
+    return res;
+}
+#endif
+
+static int trace_open_file(const char *path, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.open(path, fi);
+    __record(begin, TRACE_OPEN, path, NULL, NULL, 0, 0, (uint32_t) fi->flags, res);
+    return res;
+}
+
+static int trace_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.create(path, mode, fi);
+    __record(begin, TRACE_CREATE, path, NULL, NULL, 0, 0, (uint32_t) fi->flags, res);
+    return res;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.read(path, buf, size, offset, fi);
+    __record(begin, TRACE_READ, path, NULL, NULL, size, (uint64_t) offset, 0, res);
+    return res;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.write(path, buf, size, offset, fi);
+    __record(begin, TRACE_WRITE, path, NULL, NULL, size, (uint64_t) offset, 0, res);
+    return res;
+}
+
+static int trace_statfs(const char *path, struct statvfs *stbuf)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.statfs(path, stbuf);
+    __record(begin, TRACE_STATFS, path, NULL, NULL, 0, 0, 0, res);
+    return res;
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.release(path, fi);
+    __record(begin, TRACE_RELEASE, path, NULL, NULL, 0, 0, (uint32_t) fi->flags, res);
+    return res;
+}
+
+static int trace_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.fsync(path, isdatasync, fi);
+    __record(begin, TRACE_FSYNC, path, NULL, NULL, 0, 0, (uint32_t) isdatasync, res);
+    return res;
+}
+
+static int trace_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.fsyncdir(path, isdatasync, fi);
+    __record(begin, TRACE_FSYNCDIR, path, NULL, NULL, 0, 0, (uint32_t) isdatasync, res);
+    return res;
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static int trace_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.fallocate(path, mode, offset, length, fi);
+    __record(begin, TRACE_FALLOCATE, path, NULL, NULL, (uint64_t) length, (uint64_t) offset, (uint32_t) mode, res);
+    return res;
+}
+#endif
+
+static int trace_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.setxattr(path, name, value, size, flags);
+    __record(begin, TRACE_SETXATTR, path, NULL, name, size, 0, (uint32_t) flags, res);
+    return res;
+}
+
+static int trace_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.getxattr(path, name, value, size);
+    __record(begin, TRACE_GETXATTR, path, NULL, name, size, 0, 0, res);
+    return res;
+}
+
+static int trace_listxattr(const char *path, char *list, size_t size)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.listxattr(path, list, size);
+    __record(begin, TRACE_LISTXATTR, path, NULL, NULL, size, 0, 0, res);
+    return res;
+}
+
+static int trace_removexattr(const char *path, const char *name)
+{
+    const uint64_t begin = __now(CLOCK_MONOTONIC);
+    int res = next.removexattr(path, name);
+    __record(begin, TRACE_REMOVEXATTR, path, NULL, name, 0, 0, 0, res);
+    return res;
+}
+
+static void trace_destroy(void *private_data)
+{
+    if (next.destroy)
+        next.destroy(private_data);
+
+    pthread_mutex_lock(&trace_lock);
+    recording = 0;
+    if (fclose(trace_file) != 0)
+        error_print("cannot write the trace: %s\n", strerror(errno));
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* operations ops doesn't implement stay unimplemented */
+#define TRACE_OP(op, wrapper) traced.op = next.op ? wrapper : NULL
+
+const struct fuse_operations *trace_operations(const struct fuse_operations *ops)
+{
+    next = *ops;
+    traced = *ops;
+    traced.destroy = trace_destroy;
+
+    TRACE_OP(getattr, trace_getattr);
+    TRACE_OP(access, trace_access);
+    TRACE_OP(readlink, trace_readlink);
+    TRACE_OP(readdir, trace_readdir);
+    TRACE_OP(mknod, trace_mknod);
+    TRACE_OP(mkdir, trace_mkdir);
+    TRACE_OP(symlink, trace_symlink);
+    TRACE_OP(unlink, trace_unlink);
+    TRACE_OP(rmdir, trace_rmdir);
+    TRACE_OP(rename, trace_rename);
+    TRACE_OP(link, trace_link);
+    TRACE_OP(chmod, trace_chmod);
+    TRACE_OP(chown, trace_chown);
+    TRACE_OP(truncate, trace_truncate);
+#ifdef HAS_UTIMENSAT
+    TRACE_OP(utimens, trace_utimens);
+#endif
+    TRACE_OP(open, trace_open_file);
+    TRACE_OP(create, trace_create);
+    TRACE_OP(read, trace_read);
+    TRACE_OP(write, trace_write);
+    TRACE_OP(statfs, trace_statfs);
+    TRACE_OP(release, trace_release);
+    TRACE_OP(fsync, trace_fsync);
+    TRACE_OP(fsyncdir, trace_fsyncdir);
+#ifdef HAVE_POSIX_FALLOCATE
+    TRACE_OP(fallocate, trace_fallocate);
+#endif
+    TRACE_OP(setxattr, trace_setxattr);
+    TRACE_OP(getxattr, trace_getxattr);
+    TRACE_OP(listxattr, trace_listxattr);
+    TRACE_OP(removexattr, trace_removexattr);
+
+    return &traced;
+}
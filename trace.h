@@ -0,0 +1,101 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_TRACE_H
+#define FUSE_XATTRS_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Workload trace (-o trace=FILE): every operation the daemon serves, as
+ * a fixed size record followed by the attribute name, if any. Paths are
+ * only kept as 64 bits hashes and values not at all, so a trace shows
+ * the shape of a workload without its data. `fuse_xattrs_tool replay'
+ * runs it again, see replay.h.
+ *
+ * Layout, in host byte order:
+ *     header
+ *     (record, name_size bytes of attribute name)*
+ */
+#define TRACE_MAGIC "FXTRACE"
+#define TRACE_VERSION 1
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       // sizeof(struct trace_record), newer records may grow
+    uint64_t start_time;        // ns since the epoch when recording started
+};
+
+enum trace_op {
+    TRACE_GETATTR = 1,
+    TRACE_ACCESS,
+    TRACE_READLINK,
+    TRACE_READDIR,
+    TRACE_MKNOD,
+    TRACE_MKDIR,
+    TRACE_SYMLINK,
+    TRACE_UNLINK,
+    TRACE_RMDIR,
+    TRACE_RENAME,
+    TRACE_LINK,
+    TRACE_CHMOD,
+    TRACE_CHOWN,
+    TRACE_TRUNCATE,
+    TRACE_UTIMENS,
+    TRACE_OPEN,
+    TRACE_CREATE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_STATFS,
+    TRACE_RELEASE,
+    TRACE_FSYNC,
+    TRACE_FSYNCDIR,
+    TRACE_FALLOCATE,
+    TRACE_SETXATTR,
+    TRACE_GETXATTR,
+    TRACE_LISTXATTR,
+    TRACE_REMOVEXATTR,
+    TRACE_OP_COUNT
+};
+
+struct trace_record {
+    uint64_t start;         // ns since start_time
+    uint64_t path_hash;     // hash_string() of the mount relative path (symlink: link)
+    uint64_t other_hash;    // rename, link: of the new path, symlink: of the target
+    uint64_t size;          // value, buffer, read/write or truncate size
+    uint64_t offset;        // read, write, fallocate
+    uint32_t duration;      // ns, saturated
+    int32_t result;
+    uint32_t thread;        // daemon thread, numbered from 1 in order of appearance
+    uint32_t flags;         // xattr, open, readdir or rename flags, access mask, mode
+    uint8_t op;             // enum trace_op
+    uint8_t name_size;      // bytes of attribute name following, no '\0'
+    uint8_t reserved[6];
+};
+
+struct fuse_operations;
+
+/**
+ * Start recording to trace_path, before fuse_main() (it may leave the
+ * working directory).
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int trace_open(const char *trace_path);
+
+/* @return ops recording every call before handing it to ops. */
+const struct fuse_operations *trace_operations(const struct fuse_operations *ops);
+
+/**
+ * Pause (0) or resume recording, the trace is flushed when paused.
+ * @return On success, zero is returned. -EBADF when not recording.
+ */
+int trace_set_enabled(int enabled);
+
+#endif //FUSE_XATTRS_TRACE_H
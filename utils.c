@@ -7,28 +7,85 @@
   See the file COPYING.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "utils.h"
+#include "arena.h"
 #include "fuse_xattrs_config.h"
 #include "xattrs_config.h"
 
 const size_t BINARY_SIDECAR_EXT_SIZE;
 
-/* TODO: re-use memory to avoid calling malloc every time */
+int debug_output = 1;
+
+static char *__prepend_source_directory(char *dst, const char *b, size_t b_size)
+{
+    if (dst == NULL)
+        return NULL;
+
+    memcpy(dst, xattrs_config.source_dir, xattrs_config.source_dir_size);
+    memcpy(dst+xattrs_config.source_dir_size, b, b_size + 1); // include '\0'
+    return dst;
+}
+
 char *prepend_source_directory(const char *b) {
     const size_t b_size = strlen(b);
     const size_t dst_len = xattrs_config.source_dir_size + b_size + 1;
-    char *dst = (char*) malloc(sizeof(char) * dst_len);
+    return __prepend_source_directory(malloc(sizeof(char) * dst_len), b, b_size);
+}
 
-    memcpy(dst, xattrs_config.source_dir, xattrs_config.source_dir_size);
-    memcpy(dst+xattrs_config.source_dir_size, b, b_size + 1); // include '\0'
-    //sprintf(dst, "%s%s", a, b);
+char *arena_prepend_source_directory(const char *b) {
+    const size_t b_size = strlen(b);
+    const size_t dst_len = xattrs_config.source_dir_size + b_size + 1;
+    return __prepend_source_directory(arena_alloc(dst_len), b, b_size);
+}
 
-    return dst;
+/**
+ * Check if the path is valid. If it's a relative path,
+ * prepend the working path.
+ * @param path relative or absolute path to eval.
+ * @return new string with absolute path
+ */
+const char *sanitized_source_directory(const char *path) {
+    char *absolute_path;
+    if (strlen(path) == 0) {
+        return NULL;
+    }
+
+    /* absolute path, we don't do anything */
+    if (path[0] == '/') {
+        if (is_directory(path) == -1) {
+            return NULL;
+        }
+        absolute_path = strdup(path);
+        return absolute_path;
+    }
+
+    char *pwd = get_current_dir_name();
+    size_t len = strlen(pwd) + 1 + strlen(path) + 1;
+    int has_trailing_backslash = (path[strlen(path)-1] == '/');
+    if (!has_trailing_backslash)
+        len++;
+
+    absolute_path = (char*) malloc(sizeof(char) * len);
+    memset(absolute_path, '\0', len);
+    sprintf(absolute_path, "%s/%s", pwd, path);
+
+    if(!has_trailing_backslash)
+        absolute_path[len-2] = '/';
+
+    if (is_directory(absolute_path) == -1) {
+        free(absolute_path);
+        return NULL;
+    }
+
+    return absolute_path;
 }
 
 int is_directory(const char *path) {
@@ -59,28 +116,48 @@ int is_regular_file(const char *path) {
     return 1;
 }
 
+static char *__get_sidecar_path(char *sidecar_path, const char *path, size_t path_len)
+{
+    if (sidecar_path == NULL)
+        return NULL;
+
+    memcpy(sidecar_path, path, path_len);
+    memcpy(sidecar_path + path_len, BINARY_SIDECAR_EXT, BINARY_SIDECAR_EXT_SIZE + 1); // include '\0'
+    return sidecar_path;
+}
+
 char *get_sidecar_path(const char *path)
 {
     const size_t path_len = strlen(path);
-    const size_t sidecar_ext_len = strlen(BINARY_SIDECAR_EXT); // this can be optimized
-    const size_t sidecar_path_len = path_len + sidecar_ext_len + 1;
-    char *sidecar_path = (char *) malloc(sidecar_path_len);
-    memset(sidecar_path, '\0', sidecar_path_len);
-    memcpy(sidecar_path, path, path_len);
-    memcpy(sidecar_path + path_len, BINARY_SIDECAR_EXT, sidecar_ext_len);
+    return __get_sidecar_path(malloc(path_len + BINARY_SIDECAR_EXT_SIZE + 1), path, path_len);
+}
 
-    return sidecar_path;
+char *arena_get_sidecar_path(const char *path)
+{
+    const size_t path_len = strlen(path);
+    return __get_sidecar_path(arena_alloc(path_len + BINARY_SIDECAR_EXT_SIZE + 1), path, path_len);
 }
 
-// TODO: make it work for binary data
-char *sanitize_value(const char *value, size_t value_size)
+static char *__sanitize_value(char *sanitized, const char *value, size_t value_size)
 {
-    char *sanitized = malloc(value_size + 1);
+    if (sanitized == NULL)
+        return NULL;
+
     memcpy(sanitized, value, value_size);
     sanitized[value_size] = '\0';
     return sanitized;
 }
 
+// TODO: make it work for binary data
+char *sanitize_value(const char *value, size_t value_size)
+{
+    return __sanitize_value(malloc(value_size + 1), value, value_size);
+}
+
+char *arena_sanitize_value(const char *value, size_t value_size)
+{
+    return __sanitize_value(arena_alloc(value_size + 1), value, value_size);
+}
 
 const size_t BINARY_SIDECAR_EXT_SIZE = strlen(BINARY_SIDECAR_EXT);
 
@@ -99,35 +176,46 @@ const int filename_is_sidecar(const char *string) {
     return 0;
 }
 
-#define USER_NAMESPACE "user."
-#define SYSTEM_NAMESPACE "system."
-#define SECURITY_NAMESPACE "security."
-#define TRUSTED_NAMESPACE "trusted."
+struct namespace_prefix {
+    const char *prefix;
+    size_t size;
+    enum namespace namespace;
+};
 
-const size_t USER_NAMESPACE_SIZE     = strlen(USER_NAMESPACE);
-const size_t SYSTEM_NAMESPACE_SIZE   = strlen(SYSTEM_NAMESPACE);
-const size_t SECURITY_NAMESPACE_SIZE = strlen(SECURITY_NAMESPACE);
-const size_t THRUSTED_NAMESPACE_SIZE = strlen(TRUSTED_NAMESPACE);
+/*
+ * Indexed by the first character of the attribute name. This is hit for
+ * every kernel generated security.capability probe (one per write), so it
+ * must stay cheap: no strlen and no logging.
+ */
+static const struct namespace_prefix NAMESPACE_PREFIXES[][2] = {
+        ['s'] = {
+                { "security.", sizeof("security.") - 1, SECURITY },
+                { "system.",   sizeof("system.") - 1,   SYSTEM   },
+        },
+        ['t'] = {
+                { "trusted.",  sizeof("trusted.") - 1,  TRUSTED  },
+        },
+        ['u'] = {
+                { "user.",     sizeof("user.") - 1,     USER     },
+        },
+};
+
+#define NAMESPACE_PREFIXES_SIZE (sizeof(NAMESPACE_PREFIXES) / sizeof(NAMESPACE_PREFIXES[0]))
 
 enum namespace get_namespace(const char *name) {
-    size_t name_size = strlen(name);
-
-    if (name_size > USER_NAMESPACE_SIZE && memcmp(name, USER_NAMESPACE, USER_NAMESPACE_SIZE) == 0) {
-        return USER;
-    }
-
-    if (name_size > SYSTEM_NAMESPACE_SIZE && memcmp(name, SYSTEM_NAMESPACE, SYSTEM_NAMESPACE_SIZE) == 0) {
-        return SYSTEM;
-    }
-
-    if (name_size > SECURITY_NAMESPACE_SIZE && memcmp(name, SECURITY_NAMESPACE, SECURITY_NAMESPACE_SIZE) == 0) {
-        return SECURITY;
+    const unsigned char first = (unsigned char) name[0];
+    if (first >= NAMESPACE_PREFIXES_SIZE) {
+        return ERROR;
     }
 
-    if (name_size > THRUSTED_NAMESPACE_SIZE && memcmp(name, TRUSTED_NAMESPACE, THRUSTED_NAMESPACE_SIZE) == 0) {
-        return TRUSTED;
+    const struct namespace_prefix *candidates = NAMESPACE_PREFIXES[first];
+    for (int i = 0; i < 2 && candidates[i].prefix != NULL; i++) {
+        const size_t size = candidates[i].size;
+        // the name must be longer than the prefix
+        if (strncmp(name, candidates[i].prefix, size) == 0 && name[size] != '\0') {
+            return candidates[i].namespace;
+        }
     }
 
-    error_print("invalid namespace for key: %s\n", name);
     return ERROR;
 }
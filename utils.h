@@ -11,7 +11,14 @@
 #ifndef FUSE_XATTRS_UTILS_H
 #define FUSE_XATTRS_UTILS_H
 
-#define DEBUG 1
+/*
+ * Switched at runtime through the control socket. The client library
+ * builds with -DDEBUG=0: it must not write to its host's stderr.
+ */
+#ifndef DEBUG
+extern int debug_output;
+#define DEBUG __atomic_load_n(&debug_output, __ATOMIC_RELAXED)
+#endif
 
 #include <string.h>
 #include <stdio.h>
@@ -39,6 +46,12 @@ enum namespace get_namespace(const char *name);
 char *get_sidecar_path(const char *path);
 char *sanitize_value(const char *value, size_t value_size);
 char *prepend_source_directory(const char *b);
+const char *sanitized_source_directory(const char *path);
+
+/* Same as above, allocated from the request arena (see arena.h). */
+char *arena_get_sidecar_path(const char *path);
+char *arena_sanitize_value(const char *value, size_t value_size);
+char *arena_prepend_source_directory(const char *b);
 
 extern const size_t BINARY_SIDECAR_EXT_SIZE;
 const int filename_is_sidecar(const char *string);
@@ -0,0 +1,370 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* For pipe2 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "watcher.h"
+#include "hash_table.h"
+#include "sidecar_cache.h"
+#include "stat_cache.h"
+#include "query_index.h"
+#include "dir_store.h"
+#include "blob_store.h"
+#include "binary_storage.h"
+#include "own_changes.h"
+#include "utils.h"
+#include "xattrs_config.h"
+#include "fuse_xattrs_config.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+#define WATCHER_BUFFER_SIZE (64 * 1024)
+#define WD_KEY_SIZE 12
+
+static int inotify_fd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static pthread_t thread;
+static int running = 0;
+static watcher_notify_fn notify = NULL;
+
+/* watch descriptor -> mount relative path of the directory, watcher thread only */
+static struct hash_table *dirs = NULL;
+
+static char *__join(const char *dir, const char *name)
+{
+    const size_t dir_size = strlen(dir);
+    const int needs_slash = dir[dir_size - 1] != '/';
+    char *path = malloc(dir_size + needs_slash + strlen(name) + 1);
+    if (path == NULL)
+        return NULL;
+
+    memcpy(path, dir, dir_size);
+    if (needs_slash)
+        path[dir_size] = '/';
+    strcpy(path + dir_size + needs_slash, name);
+
+    return path;
+}
+
+/* @param path - mount relative path of a directory, adopted by the table. */
+static void __watch(char *path)
+{
+    char *abs_path = prepend_source_directory(path);
+    int wd = inotify_add_watch(inotify_fd, abs_path, WATCH_MASK);
+    if (wd == -1) {
+        // ENOSPC: raise fs.inotify.max_user_watches
+        error_print("cannot watch %s errno=%d\n", abs_path, errno);
+        free(abs_path);
+        free(path);
+        return;
+    }
+
+    DIR *dir = opendir(abs_path);
+    free(abs_path);
+
+    // a moved directory keeps its watch descriptor, only the path changes
+    char key[WD_KEY_SIZE];
+    sprintf(key, "%d", wd);
+    free(hash_table_remove(dirs, key));
+    if (hash_table_put(dirs, key, path) != 0) {
+        inotify_rm_watch(inotify_fd, wd);
+        free(path);
+        path = NULL;
+    }
+
+    if (dir == NULL)
+        return;
+
+    const int is_root = path != NULL && strcmp(path, "/") == 0;
+    struct dirent *de;
+    while (path != NULL && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (is_root && strcmp(de->d_name, BLOB_STORE_NAME) == 0)
+            continue;
+
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+
+        if (is_dir) {
+            char *child = __join(path, de->d_name);
+            if (child != NULL)
+                __watch(child);
+        }
+    }
+    closedir(dir);
+}
+
+struct unwatch_args {
+    const char *path;
+    size_t size;
+};
+
+static void __unwatch_below(const char *key, void *value, void *data)
+{
+    const struct unwatch_args *args = data;
+    const char *path = value;
+    if (strncmp(path, args->path, args->size) != 0 || (path[args->size] != '\0' && path[args->size] != '/'))
+        return;
+
+    inotify_rm_watch(inotify_fd, atoi(key));
+    free(hash_table_remove(dirs, key));
+}
+
+/*
+ * Stop watching the directory at path and the ones below it: moved out of
+ * the tree they would keep reporting under their old paths. A move within
+ * the tree watches them again, from IN_MOVED_TO.
+ */
+static void __unwatch(const char *path)
+{
+    struct unwatch_args args = { path, strlen(path) };
+    hash_table_foreach(dirs, __unwatch_below, &args);
+}
+
+/* @return 1 if path is a file whose changes come from handles of ours. */
+static int __written_by_us(const char *path)
+{
+    char *abs_path = prepend_source_directory(path);
+    struct stat st;
+    const int res = lstat(abs_path, &st) == 0 && S_ISREG(st.st_mode) && own_changes_is_open(&st);
+    free(abs_path);
+    return res;
+}
+
+static void __reload_entry(const char *path, void *data)
+{
+    (void) data;
+    query_index_reload(path);
+}
+
+static void __sidecar_changed(const char *path, uint32_t mask)
+{
+    char *abs_path = prepend_source_directory(path);
+    char *sidecar_path = get_sidecar_path(abs_path);
+    const int ours = sidecar_path != NULL && own_changes_match(sidecar_path);
+    free(sidecar_path);
+    if (ours) {
+        free(abs_path);
+        return;
+    }
+
+    sidecar_cache_invalidate(abs_path);
+    // a sidecar rewritten in place is caught by the fstat() of its open fd
+    if (mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+        binary_storage_forget(abs_path);
+    query_index_reload(abs_path);
+    free(abs_path);
+}
+
+static void __store_changed(const char *dir_path)
+{
+    char *store_path = __join(dir_path, DIR_STORE_NAME);
+    if (store_path == NULL)
+        return;
+
+    char *abs_path = prepend_source_directory(store_path);
+    if (!own_changes_match(abs_path)) {
+        sidecar_cache_invalidate(abs_path);
+        if (query_index_enabled())
+            dir_store_foreach_entry(abs_path, __reload_entry, NULL);
+    }
+    free(abs_path);
+    free(store_path);
+}
+
+static void __handle(const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW) {
+        error_print("inotify queue overflow, dropping every cache\n");
+        sidecar_cache_clear();
+        stat_cache_clear();
+        return;
+    }
+
+    char key[WD_KEY_SIZE];
+    sprintf(key, "%d", event->wd);
+    if (event->mask & IN_IGNORED) {
+        free(hash_table_remove(dirs, key));
+        return;
+    }
+
+    const char *dir_path = hash_table_get(dirs, key);
+    if (dir_path == NULL || event->len == 0)
+        return;
+
+    const char *name = event->name;
+    const int is_root = strcmp(dir_path, "/") == 0;
+
+    if (is_root && strcmp(name, BLOB_STORE_NAME) == 0)
+        return; // blobs are immutable
+
+    if (is_root && strcmp(name, BINARY_SIDECAR_EXT) == 0) {
+        __sidecar_changed("/", event->mask);
+        return;
+    }
+
+    if (dir_store_enabled() && strcmp(name, DIR_STORE_NAME) == 0) {
+        __store_changed(dir_path);
+        return;
+    }
+    if (dir_store_is_store_name(name))
+        return;
+
+    char *path = __join(dir_path, name);
+    if (path == NULL)
+        return;
+
+    if (filename_is_sidecar(name) == 1) {
+        path[strlen(path) - BINARY_SIDECAR_EXT_SIZE] = '\0';
+        __sidecar_changed(path, event->mask);
+        free(path);
+        return;
+    }
+
+    if (event->mask & IN_ISDIR) {
+        // cached paths below it are stale: cheaper to start over
+        if (event->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)) {
+            sidecar_cache_clear();
+            stat_cache_clear();
+        }
+        if (event->mask & IN_MOVED_FROM)
+            __unwatch(path);
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            char *dir_copy = strdup(path);
+            if (dir_copy != NULL)
+                __watch(dir_copy);
+        }
+    } else if (!(event->mask & ~(IN_MODIFY | IN_CLOSE_WRITE)) && __written_by_us(path)) {
+        // writes through our handles update the stat cache themselves
+        free(path);
+        return;
+    }
+
+    stat_cache_invalidate_name(path);
+    if (notify != NULL)
+        notify(path);
+    free(path);
+}
+
+static void *__run(void *data)
+{
+    (void) data;
+
+    char buffer[WATCHER_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+            { .fd = inotify_fd, .events = POLLIN },
+            { .fd = stop_pipe[0], .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            error_print("poll failed errno=%d\n", errno);
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            error_print("cannot read inotify events errno=%d\n", errno);
+            break;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *) ptr;
+            __handle(event);
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return NULL;
+}
+
+static void __free_path(void *path)
+{
+    free(path);
+}
+
+int watcher_init(watcher_notify_fn _notify)
+{
+    notify = _notify;
+    own_changes_enable();
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        int res = -errno;
+        error_print("inotify_init1 failed errno=%d\n", errno);
+        return res;
+    }
+
+    dirs = hash_table_new();
+    if (dirs == NULL || pipe2(stop_pipe, O_CLOEXEC) != 0) {
+        watcher_destroy();
+        return -ENOMEM;
+    }
+
+    char *root = strdup("/");
+    if (root != NULL)
+        __watch(root);
+    debug_print("watching %zu directories\n", hash_table_size(dirs));
+
+    int res = pthread_create(&thread, NULL, __run, NULL);
+    if (res != 0) {
+        error_print("cannot start the watcher thread\n");
+        watcher_destroy();
+        return -res;
+    }
+    running = 1;
+
+    return 0;
+}
+
+void watcher_destroy(void)
+{
+    if (running) {
+        char byte = 0;
+        if (write(stop_pipe[1], &byte, 1) == 1)
+            pthread_join(thread, NULL);
+        running = 0;
+    }
+
+    if (stop_pipe[0] != -1) {
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        stop_pipe[0] = stop_pipe[1] = -1;
+    }
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    hash_table_free(dirs, __free_path);
+    dirs = NULL;
+}
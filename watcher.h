@@ -0,0 +1,46 @@
+/*
+  fuse_xattrs - Add xattrs support using sidecar files
+
+  Copyright (C) 2017  Felipe Barriga Richards <felipe {at} felipebarriga.cl>
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifndef FUSE_XATTRS_WATCHER_H
+#define FUSE_XATTRS_WATCHER_H
+
+/*
+ * Detects changes made to the source directory outside the mount (rsync
+ * jobs, cleanup scripts) with inotify on every directory of the tree.
+ *
+ * A changed sidecar or directory store is dropped from the sidecar cache
+ * and reloaded into the query index. Any other change is dropped from the
+ * stat cache and reported to notify with the mount relative path, so the
+ * kernel can be told.
+ *
+ * The events of our own writes are skipped (see own_changes.h): a sidecar
+ * or store still as we left it, or a file written while it has handles
+ * open through the mount. Skipped as well: a change another process makes
+ * to a sidecar just before one of ours rewrites it (the sidecar cache is
+ * right, the query index may miss its other attributes until the next
+ * change), and writes of other processes to a file while it is open
+ * through the mount (cache_ttl bounds how long its cached stat lives).
+ * Directories moved out of the tree stop being watched.
+ *
+ * inotify only reports changes made through this host's kernel: what
+ * other NFS clients write goes unnoticed, so keep cache_ttl short on
+ * such mounts.
+ */
+
+/* @param path - mount relative path of what changed. */
+typedef void (*watcher_notify_fn)(const char *path);
+
+/**
+ * Watch the tree and start the thread reading events.
+ * @return On success, zero is returned. On failure, -errno is returned.
+ */
+int watcher_init(watcher_notify_fn notify);
+void watcher_destroy(void);
+
+#endif //FUSE_XATTRS_WATCHER_H
@@ -12,8 +12,43 @@
 
 extern struct xattrs_config {
     const int show_sidecar;
+    const int multithread;
+    const int no_security_xattrs;
+    const int cache;
+    const unsigned int cache_ttl;   // seconds, 0: DEFAULT_CACHE_TTL
+    const unsigned int cache_size;  // MiB, 0: DEFAULT_CACHE_SIZE
+    const char *cache_snapshot;
+    const unsigned int cache_snapshot_interval; // seconds, 0: DEFAULT_SNAPSHOT_INTERVAL
+    const int prefetch;
+    const unsigned int prefetch_threads;
+    const int query_index;
+    const int native_xattrs;
+    const int dir_store;
+    const int dedup;
+    const unsigned int dedup_min;   // bytes, 0: DEFAULT_DEDUP_MIN
+    const int watch;
+    const int stat_cache;
+    const unsigned int stat_cache_ttl;   // seconds, 0: DEFAULT_STAT_CACHE_TTL
+    const unsigned int stat_cache_size;  // MiB, 0: DEFAULT_STAT_CACHE_SIZE
+    const char *ro_index;
+    const char *control;
+    const char *trace;
+    const int no_open;
+    const int no_parallel_dirops;
+    const int single_writer;
+    const char *journal;
+    const unsigned int journal_size;    // MiB, 0: DEFAULT_JOURNAL_SIZE
+    const int generation;
+    const int symlinks;
+    const int passthrough;
     const char *source_dir;
     size_t source_dir_size;
+
+    /* negotiated at init */
+    int handle_killpriv;    // clearing suid/sgid on write is up to us
+    int writeback_cache;    // the kernel caches writes, it may read write-only files
+    int skip_open;          // opens aren't sent: read and write by path
+    int backing_files;      // opens register their source file for kernel passthrough
 } xattrs_config;
 
 